@@ -0,0 +1,205 @@
+#include "batch.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define BATCH_MAX_THREADS 256
+#define BATCH_SLICE TICK_CYCLES // Cycles run between I/O and budget checks.
+
+// Range of job indices [head, tail) still to run. The owner takes from the
+// head, thieves take from the tail. Padded to a cache line so that workers
+// polling each other's ranges do not share lines.
+typedef struct {
+    pthread_mutex_t lock;
+    size_t head;
+    size_t tail;
+} __attribute__((aligned(64))) range_t;
+
+typedef struct {
+    batch_job_t* jobs;
+    range_t* ranges;
+    unsigned workers;
+    atomic_size_t left; // Jobs not finished yet.
+} pool_t;
+
+typedef struct {
+    pool_t* pool;
+    unsigned id;
+} worker_t;
+
+static void run_job(batch_job_t* job)
+{
+    cpu_t* cpu = job->cpu;
+    uint64_t cycles = 0;
+    stop_t stop = cpu->halted ? STOP_HALT : STOP_BUDGET;
+
+    while (stop != STOP_HALT && (job->budget == 0 || cycles < job->budget)) {
+        uint64_t left = job->budget == 0 ? BATCH_SLICE : job->budget - cycles;
+        uint32_t start = cpu->tick_cycles;
+
+        stop = run_cycles(cpu, left < BATCH_SLICE ? left : BATCH_SLICE);
+        cycles += (uint32_t)(cpu->tick_cycles - start);
+
+        if (stop == STOP_IO && !cpu->io_out) {
+            cpu->reg->a = 0xff;
+        }
+    }
+
+    flags_materialize(cpu->reg);
+
+    job->stop = stop == STOP_HALT ? STOP_HALT : STOP_BUDGET;
+    job->cycles = cycles;
+    job->reg = *cpu->reg;
+    job->digest = mem_digest(cpu->mem);
+}
+
+static bool take(range_t* range, size_t* index)
+{
+    bool ok = false;
+
+    pthread_mutex_lock(&range->lock);
+    if (range->head < range->tail) {
+        *index = range->head++;
+        ok = true;
+    }
+    pthread_mutex_unlock(&range->lock);
+
+    return ok;
+}
+
+// Moves the back half of some other worker's range into `self`'s.
+static bool steal(pool_t* pool, unsigned self)
+{
+    for (unsigned i = 1; i < pool->workers; i++) {
+        range_t* victim = &pool->ranges[(self + i) % pool->workers];
+        size_t head = 0;
+        size_t tail = 0;
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            tail = victim->tail;
+            head = tail - (tail - victim->head + 1) / 2;
+            victim->tail = head;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (head < tail) {
+            range_t* own = &pool->ranges[self];
+
+            pthread_mutex_lock(&own->lock);
+            own->head = head;
+            own->tail = tail;
+            pthread_mutex_unlock(&own->lock);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void* work(void* arg)
+{
+    worker_t* worker = arg;
+    pool_t* pool = worker->pool;
+    range_t* own = &pool->ranges[worker->id];
+    size_t index;
+
+    // A worker that finds nothing to steal keeps looking until every job is
+    // done: a range may be in flight between a victim and its thief.
+    while (atomic_load_explicit(&pool->left, memory_order_acquire) > 0) {
+        if (take(own, &index)) {
+            run_job(&pool->jobs[index]);
+            atomic_fetch_sub_explicit(&pool->left, 1, memory_order_release);
+        } else if (!steal(pool, worker->id)) {
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+unsigned batch_run(batch_job_t* jobs, size_t count, unsigned threads)
+{
+    if (jobs == NULL || count == 0) {
+        return 0;
+    }
+
+    if (threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? (unsigned)cores : 1;
+    }
+
+    if (threads > BATCH_MAX_THREADS) {
+        threads = BATCH_MAX_THREADS;
+    }
+
+    if (threads > count) {
+        threads = count;
+    }
+
+    pool_t pool;
+    range_t* ranges = aligned_alloc(64, threads * sizeof(range_t));
+    worker_t* workers = malloc(threads * sizeof(worker_t));
+    pthread_t* ids = malloc(threads * sizeof(pthread_t));
+
+    if (ranges == NULL || workers == NULL || ids == NULL) {
+        threads = 1;
+    }
+
+    pool.jobs = jobs;
+    pool.ranges = ranges;
+    pool.workers = threads;
+    atomic_init(&pool.left, count);
+
+    if (threads == 1) {
+        for (size_t i = 0; i < count; i++) {
+            run_job(&jobs[i]);
+        }
+
+        free(ids);
+        free(workers);
+        free(ranges);
+        return 1;
+    }
+
+    for (unsigned i = 0; i < threads; i++) {
+        pthread_mutex_init(&ranges[i].lock, NULL);
+        ranges[i].head = count * i / threads;
+        ranges[i].tail = count * (i + 1) / threads;
+        workers[i].pool = &pool;
+        workers[i].id = i;
+    }
+
+    // The calling thread is worker 0. Workers that fail to start leave their
+    // range to be stolen by the others.
+    unsigned started = 1;
+
+    ids[0] = pthread_self();
+
+    for (unsigned i = 1; i < threads; i++) {
+        if (pthread_create(&ids[i], NULL, work, &workers[i]) == 0) {
+            started++;
+        } else {
+            ids[i] = ids[0];
+        }
+    }
+
+    work(&workers[0]);
+
+    for (unsigned i = 1; i < threads; i++) {
+        if (!pthread_equal(ids[i], ids[0])) {
+            pthread_join(ids[i], NULL);
+        }
+    }
+
+    for (unsigned i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&ranges[i].lock);
+    }
+
+    free(ids);
+    free(workers);
+    free(ranges);
+    return started;
+}
@@ -0,0 +1,30 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include "common.h"
+
+#include "cpu.h"
+
+// Runs many independent machines on a pool of host threads.
+//
+// Every job owns its cpu_t, reg_t and mem_t (and bcache/jit, if any), so the
+// machines share nothing and each one is only ever touched by one thread.
+// Jobs are handed out in contiguous ranges, one per worker, and a worker that
+// runs out steals the back half of another worker's range.
+typedef struct {
+    cpu_t* cpu; // Set up with init_cpu(); runs from its current state.
+    uint64_t budget; // Cycle limit, 0 to run until HLT.
+
+    // Filled in by batch_run().
+    stop_t stop; // STOP_HALT or STOP_BUDGET.
+    uint64_t cycles;
+    reg_t reg; // Final register state.
+    uint64_t digest; // mem_digest() of the final memory.
+} batch_job_t;
+
+// Runs every job to HLT or to its budget on `threads` workers, 0 for one per
+// online host core. There are no devices: IN reads an open bus and OUT is
+// dropped. Returns the number of workers that ran.
+unsigned batch_run(batch_job_t* jobs, size_t count, unsigned threads);
+
+#endif
@@ -0,0 +1,168 @@
+#include "bcache.h"
+
+#include <stdlib.h>
+
+#include "cpu.h"
+#include "fuse.h"
+
+bool bcache_ends_block(uint8_t opcode)
+{
+    switch (opcode) {
+    case 0x76: // HLT
+    case 0xd3: // OUT
+    case 0xdb: // IN
+    case 0xe9: // PCHL
+    case 0xf3: // DI
+    case 0xfb: // EI
+        return true;
+    default:
+        break;
+    }
+
+    if (opcode < 0xc0) {
+        return false;
+    }
+
+    // Jumps, calls, returns and restarts in the 0xc0-0xff block.
+    switch (opcode & 0x07) {
+    case 0x00: // Rcc
+    case 0x02: // Jcc
+    case 0x04: // Ccc
+    case 0x07: // RST
+        return true;
+    case 0x03: // JMP (0xc3, 0xcb)
+        return opcode == 0xc3 || opcode == 0xcb;
+    case 0x01: // RET (0xc9, 0xd9)
+        return opcode == 0xc9 || opcode == 0xd9;
+    case 0x05: // CALL (0xcd, 0xdd, 0xed, 0xfd)
+        return (opcode & 0x0f) == 0x0d;
+    default:
+        return false;
+    }
+}
+
+bcache_t* bcache_create(void)
+{
+    bcache_t* cache = malloc(sizeof(bcache_t));
+
+    bcache_flush(cache);
+
+    return cache;
+}
+
+void bcache_destroy(bcache_t* cache)
+{
+    free(cache);
+}
+
+void bcache_flush(bcache_t* cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < BCACHE_BLOCKS; i++) {
+        cache->blocks[i].valid = false;
+    }
+}
+
+// Index of the pair in FUSE_PAIRS, -1 if it is not fused.
+static int fuse_find(uint8_t first, uint8_t second)
+{
+    for (int i = 0; i < FUSE_COUNT; i++) {
+        if (FUSE_PAIRS[i][0] == first && FUSE_PAIRS[i][1] == second) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static bool decode(block_t* block, mem_t* mem, uint16_t pc, const void* const* handlers)
+{
+    uint8_t page = pc >> MEM_PAGE_SHIFT;
+    uint32_t limit = (page + 1) << MEM_PAGE_SHIFT;
+
+    block->pc = pc;
+    block->count = 0;
+    block->cycles = 0;
+
+    while (block->count < BLOCK_INSNS) {
+        uint8_t opcode = mem_peek(mem, pc);
+        uint8_t size = OPCODES_SIZE[opcode];
+
+        if (pc + size > limit) {
+            break;
+        }
+
+        insn_t* insn = &block->insns[block->count++];
+        insn->opcode = opcode;
+        insn->handler = handlers != NULL ? handlers[opcode] : NULL;
+        insn->imm = 0;
+        insn->next = pc + size;
+
+        if (size == 2) {
+            insn->imm = mem_peek(mem, pc + 1);
+        } else if (size == 3) {
+            insn->imm = mem_peek(mem, pc + 1) | (mem_peek(mem, pc + 2) << 8);
+        }
+
+        block->cycles += OPCODES_CYCLES[opcode];
+        pc += size;
+
+        if (bcache_ends_block(opcode) || pc == limit) {
+            break;
+        }
+    }
+
+    if (block->count == 0) {
+        return false;
+    }
+
+    // The first instruction of a fused pair runs both, and the second one's
+    // handler is never reached.
+    for (int i = 0; handlers != NULL && i + 1 < block->count; i++) {
+        int fused = fuse_find(block->insns[i].opcode, block->insns[i + 1].opcode);
+
+        if (fused >= 0) {
+            block->insns[i++].handler = handlers[256 + fused];
+        }
+    }
+
+    // Only a block that jumps back to its start or stops at an IN can be
+    // the head of a loop spin_detect() knows, which saves looking at every
+    // block that is decoded again after a write to its page.
+    const insn_t* last = &block->insns[block->count - 1];
+
+    block->spin.kind = SPIN_NONE;
+
+    if (last->opcode == 0xdb || (last->imm == block->pc && OPCODES_SIZE[last->opcode] == 3)) {
+        spin_detect(&block->spin, mem, block->pc);
+    }
+
+    mem_mark_code(mem, page);
+    block->gen = mem->code_gen[page];
+    block->valid = true;
+
+    return true;
+}
+
+block_t* bcache_get(bcache_t* cache, mem_t* mem, uint16_t pc, const void* const* handlers)
+{
+    if (cache == NULL || mem == NULL) {
+        return NULL;
+    }
+
+    block_t* block = &cache->blocks[pc & (BCACHE_BLOCKS - 1)];
+
+    if (block->valid && block->pc == pc && block->gen == mem->code_gen[pc >> MEM_PAGE_SHIFT]) {
+        return block;
+    }
+
+    if (!decode(block, mem, pc, handlers)) {
+        block->valid = false;
+        return NULL;
+    }
+
+    return block;
+}
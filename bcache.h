@@ -0,0 +1,52 @@
+#ifndef __BCACHE_H__
+#define __BCACHE_H__
+
+#include "common.h"
+
+#include "mem.h"
+#include "spin.h"
+
+#define BCACHE_BLOCKS 2048 // Direct-mapped, indexed by guest PC.
+#define BLOCK_INSNS 16 // Longest straight-line run decoded into one block.
+
+typedef struct {
+    const void* handler; // Dispatch target (label address with THREADED_DISPATCH), of a fused pair if one starts here.
+    uint16_t imm; // Immediate operand, if any.
+    uint16_t next; // Address of the following instruction.
+    uint8_t opcode;
+} insn_t;
+
+// A basic block: straight-line code from `pc` up to and including the first
+// instruction that may change the PC, halt, touch I/O or the interrupt flag.
+// Blocks never cross a memory page, so a single generation number is enough
+// to tell whether the code they were decoded from has been overwritten.
+typedef struct {
+    bool valid;
+    uint16_t pc;
+    uint8_t count;
+    uint32_t gen;
+    uint32_t cycles; // Sum of OPCODES_CYCLES over the block.
+    spin_t spin; // Loop starting at `pc`, if any.
+    insn_t insns[BLOCK_INSNS];
+} block_t;
+
+typedef struct {
+    block_t blocks[BCACHE_BLOCKS];
+} bcache_t;
+
+bcache_t* bcache_create(void);
+void bcache_destroy(bcache_t* cache);
+void bcache_flush(bcache_t* cache);
+
+// Returns the block starting at `pc`, decoding it on a miss. `handlers` maps
+// opcodes to dispatch targets, followed by the targets of the pairs of
+// FUSE_PAIRS (see fuse.h), and may be NULL when dispatch goes by opcode.
+// Returns NULL when no block can be formed at `pc` (the first instruction
+// crosses a page boundary).
+block_t* bcache_get(bcache_t* cache, mem_t* mem, uint16_t pc, const void* const* handlers);
+
+// Instructions after which the next PC is not simply the following address,
+// or whose effects must be observed by the run loop before going on.
+bool bcache_ends_block(uint8_t opcode);
+
+#endif
@@ -0,0 +1,456 @@
+#include "bdos.h"
+
+#include <ctype.h>
+#include <string.h>
+
+#define BDOS_ENTRY 0x0005
+#define BDOS_RECORD 128 // Bytes per record.
+#define BDOS_EXTENT 128 // Records per extent.
+
+// Fields of a file control block.
+#define FCB_NAME 1 // 8 characters, then 3 of type, padded with spaces.
+#define FCB_EX 12 // Extent, the record number over 128.
+#define FCB_S2 14 // Module, the extent over 32.
+#define FCB_RC 15 // Records in the extent.
+#define FCB_MAP 16 // Allocation map. Its first byte holds the index of the host file plus one.
+#define FCB_CR 32 // Record in the extent.
+#define FCB_R0 33 // Random record, 3 bytes.
+
+void init_bdos(bdos_t* bdos, FILE* in, FILE* out, const char* dir)
+{
+    if (bdos == NULL) {
+        return;
+    }
+
+    memset(bdos, 0, sizeof(bdos_t));
+    bdos->in = in;
+    bdos->out = out;
+    bdos->dir = dir;
+    bdos->dma = BDOS_DMA;
+}
+
+void bdos_close(bdos_t* bdos)
+{
+    if (bdos == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < BDOS_FILES; i++) {
+        if (bdos->files[i] != NULL) {
+            fclose(bdos->files[i]);
+            bdos->files[i] = NULL;
+        }
+    }
+}
+
+// Next character typed, with the Return key as CR, or EOF.
+static int console_read(bdos_t* bdos)
+{
+    if (bdos->in == NULL) {
+        return EOF;
+    }
+
+    if (bdos->out != NULL) {
+        fflush(bdos->out);
+    }
+
+    int c = fgetc(bdos->in);
+
+    return c == '\n' ? '\r' : c;
+}
+
+static void console_write(bdos_t* bdos, uint8_t c)
+{
+    if (bdos->out != NULL) {
+        fputc(c, bdos->out);
+    }
+}
+
+// Function 10: a line into the buffer at `buf`, which starts with its size
+// and gets the length of the line, without the Return.
+static void console_line(bdos_t* bdos, mem_t* mem, uint16_t buf)
+{
+    uint8_t max = mem_read(mem, buf);
+    uint8_t len = 0;
+    int c;
+
+    while (len < max && (c = console_read(bdos)) != EOF && c != '\r') {
+        mem_write(mem, buf + 2 + len++, c);
+    }
+
+    mem_write(mem, buf + 1, len);
+}
+
+// Characters a CP/M file name can hold: printable, and none of those the
+// CCP reads as separators or wildcards, which would also be path
+// separators, globs or devices on the host.
+static bool fcb_char(char c)
+{
+    return c > ' ' && c < 0x7f && strchr("/\\.*?:<>,;=[]|\"", c) == NULL;
+}
+
+// Host path of the file the FCB at `fcb` names. False if the name is
+// empty, has a space before its last character or a character a CP/M name
+// cannot have, so that nothing outside `dir` can be reached.
+static bool fcb_path(const bdos_t* bdos, mem_t* mem, uint16_t fcb, char* path, size_t size)
+{
+    char name[13];
+    size_t len = 0;
+    bool padding = false;
+
+    for (int i = 0; i < 11; i++) {
+        char c = mem_read(mem, fcb + FCB_NAME + i) & 0x7f; // The top bits are attributes.
+
+        if (i == 8) {
+            padding = false;
+
+            if ((mem_read(mem, fcb + FCB_NAME + 8) & 0x7f) != ' ') {
+                name[len++] = '.';
+            }
+        }
+
+        if (c == ' ') {
+            padding = true;
+        } else if (padding || !fcb_char(c)) {
+            return false;
+        } else {
+            name[len++] = tolower((unsigned char)c);
+        }
+    }
+
+    if (len == 0 || name[0] == '.') {
+        return false;
+    }
+
+    name[len] = '\0';
+    snprintf(path, size, "%s/%s", bdos->dir != NULL ? bdos->dir : ".", name);
+    return true;
+}
+
+// Index of the host file the FCB was opened as, -1 if it is not open or
+// the slot in its map belongs to another FCB.
+static int fcb_slot(const bdos_t* bdos, mem_t* mem, uint16_t fcb)
+{
+    uint8_t slot = mem_read(mem, fcb + FCB_MAP);
+
+    if (slot == 0 || slot > BDOS_FILES || bdos->files[slot - 1] == NULL || bdos->owners[slot - 1] != fcb) {
+        return -1;
+    }
+
+    return slot - 1;
+}
+
+// The host file the FCB was opened as, NULL if it is not open.
+static FILE* fcb_file(const bdos_t* bdos, mem_t* mem, uint16_t fcb)
+{
+    int slot = fcb_slot(bdos, mem, fcb);
+
+    return slot >= 0 ? bdos->files[slot] : NULL;
+}
+
+// Closes the host file the FCB was opened as, if any.
+static void fcb_close(bdos_t* bdos, mem_t* mem, uint16_t fcb)
+{
+    int slot = fcb_slot(bdos, mem, fcb);
+
+    if (slot >= 0) {
+        fclose(bdos->files[slot]);
+        bdos->files[slot] = NULL;
+        mem_write(mem, fcb + FCB_MAP, 0);
+    }
+}
+
+// Opens the file the FCB names with `mode` for fopen() and remembers it in
+// the FCB, closing the one it had open first. False if the name is not
+// valid, the file cannot be opened or BDOS_FILES files are open.
+static bool fcb_open(bdos_t* bdos, mem_t* mem, uint16_t fcb, const char* mode)
+{
+    char path[FILENAME_MAX];
+    int slot = 0;
+
+    if (!fcb_path(bdos, mem, fcb, path, sizeof(path))) {
+        return false;
+    }
+
+    fcb_close(bdos, mem, fcb);
+
+    while (slot < BDOS_FILES && bdos->files[slot] != NULL) {
+        slot++;
+    }
+
+    if (slot == BDOS_FILES) {
+        return false;
+    }
+
+    bdos->files[slot] = fopen(path, mode);
+
+    if (bdos->files[slot] == NULL) {
+        return false;
+    }
+
+    bdos->owners[slot] = fcb;
+    mem_write(mem, fcb + FCB_MAP, slot + 1);
+    return true;
+}
+
+// Records in the file.
+static uint32_t file_records(FILE* file)
+{
+    if (fseek(file, 0, SEEK_END) != 0) {
+        return 0;
+    }
+
+    long size = ftell(file);
+
+    return size > 0 ? (size + BDOS_RECORD - 1) / BDOS_RECORD : 0;
+}
+
+// Record the FCB is at for sequential access.
+static uint32_t fcb_record(mem_t* mem, uint16_t fcb)
+{
+    uint32_t extent = (mem_read(mem, fcb + FCB_S2) & 0x3f) * 32 + (mem_read(mem, fcb + FCB_EX) & 0x1f);
+
+    return extent * BDOS_EXTENT + (mem_read(mem, fcb + FCB_CR) & 0x7f);
+}
+
+static void fcb_seek(mem_t* mem, uint16_t fcb, uint32_t record)
+{
+    mem_write(mem, fcb + FCB_CR, record % BDOS_EXTENT);
+    mem_write(mem, fcb + FCB_EX, (record / BDOS_EXTENT) % 32);
+    mem_write(mem, fcb + FCB_S2, record / BDOS_EXTENT / 32);
+}
+
+static uint32_t fcb_random(mem_t* mem, uint16_t fcb)
+{
+    return mem_read(mem, fcb + FCB_R0) | (mem_read(mem, fcb + FCB_R0 + 1) << 8) | (mem_read(mem, fcb + FCB_R0 + 2) << 16);
+}
+
+static void fcb_set_random(mem_t* mem, uint16_t fcb, uint32_t record)
+{
+    mem_write(mem, fcb + FCB_R0, record);
+    mem_write(mem, fcb + FCB_R0 + 1, record >> 8);
+    mem_write(mem, fcb + FCB_R0 + 2, record >> 16);
+}
+
+// Reads `record` into the DMA buffer, padded with ^Z at the end of the
+// file. Returns the BDOS result: 0, or 1 past the end of the file.
+static uint8_t read_record(const bdos_t* bdos, mem_t* mem, FILE* file, uint32_t record)
+{
+    uint8_t buf[BDOS_RECORD];
+    size_t count;
+
+    if (fseek(file, (long)record * BDOS_RECORD, SEEK_SET) != 0 || (count = fread(buf, 1, BDOS_RECORD, file)) == 0) {
+        return 1;
+    }
+
+    memset(buf + count, 0x1a, BDOS_RECORD - count);
+
+    for (int i = 0; i < BDOS_RECORD; i++) {
+        mem_write(mem, bdos->dma + i, buf[i]);
+    }
+
+    return 0;
+}
+
+// Writes the DMA buffer to `record`. Returns the BDOS result: 0, or 2 if
+// the host disk is full.
+static uint8_t write_record(const bdos_t* bdos, mem_t* mem, FILE* file, uint32_t record)
+{
+    uint8_t buf[BDOS_RECORD];
+
+    for (int i = 0; i < BDOS_RECORD; i++) {
+        buf[i] = mem_read(mem, bdos->dma + i);
+    }
+
+    if (fseek(file, (long)record * BDOS_RECORD, SEEK_SET) != 0 || fwrite(buf, 1, BDOS_RECORD, file) != BDOS_RECORD) {
+        return 2;
+    }
+
+    return 0;
+}
+
+// Functions 15-36 on the FCB at `fcb`, with the BDOS result.
+static uint16_t file_call(bdos_t* bdos, mem_t* mem, uint8_t func, uint16_t fcb)
+{
+    char path[FILENAME_MAX];
+    char to[FILENAME_MAX];
+    FILE* file = fcb_file(bdos, mem, fcb);
+    uint32_t record;
+    uint32_t records;
+    uint8_t ret;
+
+    switch (func) {
+    case 15: // Open file
+        if (!fcb_open(bdos, mem, fcb, "r+b") && !fcb_open(bdos, mem, fcb, "rb")) {
+            return 0xff;
+        }
+
+        // Records from the start of the extent the FCB asks for on.
+        record = fcb_record(mem, fcb) / BDOS_EXTENT * BDOS_EXTENT;
+        records = file_records(fcb_file(bdos, mem, fcb));
+        records = records > record ? records - record : 0;
+        mem_write(mem, fcb + FCB_RC, records > BDOS_EXTENT ? BDOS_EXTENT : records);
+        return 0;
+    case 16: // Close file
+        fcb_close(bdos, mem, fcb);
+        return 0;
+    case 19: // Delete file
+        return fcb_path(bdos, mem, fcb, path, sizeof(path)) && remove(path) == 0 ? 0 : 0xff;
+    case 20: // Read sequential
+    case 21: // Write sequential
+        if (file == NULL) {
+            return 0xff;
+        }
+
+        record = fcb_record(mem, fcb);
+        ret = func == 20 ? read_record(bdos, mem, file, record) : write_record(bdos, mem, file, record);
+
+        if (ret == 0) {
+            fcb_seek(mem, fcb, record + 1);
+        }
+        return ret;
+    case 22: // Make file
+        if (!fcb_open(bdos, mem, fcb, "w+b")) {
+            return 0xff;
+        }
+
+        mem_write(mem, fcb + FCB_RC, 0);
+        return 0;
+    case 23: // Rename file, to the name in the second half of the FCB
+        if (!fcb_path(bdos, mem, fcb, path, sizeof(path)) || !fcb_path(bdos, mem, fcb + 16, to, sizeof(to))) {
+            return 0xff;
+        }
+
+        return rename(path, to) == 0 ? 0 : 0xff;
+    case 33: // Read random
+    case 34: // Write random
+    case 40: // Write random with zero fill
+        if (file == NULL) {
+            return 0xff;
+        }
+
+        record = fcb_random(mem, fcb);
+        fcb_seek(mem, fcb, record);
+        return func == 33 ? read_record(bdos, mem, file, record) : write_record(bdos, mem, file, record);
+    case 35: // Compute file size
+        if (file != NULL) {
+            fcb_set_random(mem, fcb, file_records(file));
+            return 0;
+        }
+
+        if (!fcb_path(bdos, mem, fcb, path, sizeof(path)) || (file = fopen(path, "rb")) == NULL) {
+            return 0xff;
+        }
+
+        fcb_set_random(mem, fcb, file_records(file));
+        fclose(file);
+        return 0;
+    case 36: // Set random record
+        fcb_set_random(mem, fcb, fcb_record(mem, fcb));
+        return 0;
+    default: // Directory searches and the like, which nothing answers.
+        return 0xff;
+    }
+}
+
+// A jump to 0000 or a RET to the CCP: the program is done.
+static bool warm_boot(void* ctx, reg_t* reg, mem_t* mem)
+{
+    (void)ctx;
+    (void)reg;
+    (void)mem;
+    return false;
+}
+
+// CALL 0005, with the function in C.
+static bool bdos_call(void* ctx, reg_t* reg, mem_t* mem)
+{
+    bdos_t* bdos = ctx;
+    uint16_t ret = 0;
+    int c;
+
+    switch (reg->c) {
+    case 0: // System reset
+        return false;
+    case 1: // Console input
+        c = console_read(bdos);
+        ret = c == EOF ? 0x1a : c;
+        break;
+    case 2: // Console output
+        console_write(bdos, reg->e);
+        break;
+    case 6: // Direct console I/O: input for FF, status for FE, else output
+        if (reg->e == 0xff) {
+            c = console_read(bdos);
+            ret = c == EOF ? 0 : c;
+        } else if (reg->e != 0xfe) {
+            console_write(bdos, reg->e);
+        }
+        break;
+    case 9: // Print string, up to a '$'
+        for (uint32_t i = 0; i < MEM_SIZE && (c = mem_read(mem, reg->de + i)) != '$'; i++) {
+            console_write(bdos, c);
+        }
+        break;
+    case 10: // Read console buffer
+        console_line(bdos, mem, reg->de);
+        break;
+    case 11: // Console status: nothing typed ahead
+        break;
+    case 12: // Version: CP/M 2.2
+        ret = 0x0022;
+        break;
+    case 13: // Reset disk system
+        bdos->dma = BDOS_DMA;
+        break;
+    case 14: // Select disk
+        ret = reg->e == 0 ? 0 : 0xff;
+        break;
+    case 24: // Login vector: A:
+        ret = 0x0001;
+        break;
+    case 25: // Current disk: A:
+    case 32: // User code: 0
+        break;
+    case 26: // Set DMA address
+        bdos->dma = reg->de;
+        break;
+    default:
+        ret = file_call(bdos, mem, reg->c, reg->de);
+        break;
+    }
+
+    // Results come back in A and L, and in B and H for the high byte.
+    reg->a = reg->l = ret & 0xff;
+    reg->b = reg->h = ret >> 8;
+    return true;
+}
+
+bool bdos_install(bdos_t* bdos, traps_t* traps, reg_t* reg, mem_t* mem)
+{
+    if (bdos == NULL || traps == NULL || reg == NULL || mem == NULL) {
+        return false;
+    }
+
+    if (!traps_add(traps, 0x0000, warm_boot, bdos) || !traps_add(traps, BDOS_ENTRY, bdos_call, bdos)
+        || !traps_add(traps, BDOS_BASE + 6, bdos_call, bdos)) {
+        return false;
+    }
+
+    // JMP to the warm boot of the BIOS above the BDOS, and JMP to the BDOS,
+    // whose address programs take as the top of their memory.
+    mem_write(mem, 0x0000, 0xc3);
+    mem_write_word(mem, 0x0001, BDOS_BASE + 0x103);
+    mem_write(mem, BDOS_ENTRY, 0xc3);
+    mem_write_word(mem, BDOS_ENTRY + 1, BDOS_BASE + 6);
+
+    // Default FCBs with no file names, and an empty command tail.
+    for (uint16_t addr = 0x005c; addr < 0x0100; addr++) {
+        mem_write(mem, addr, (addr >= 0x005d && addr < 0x0068) || (addr >= 0x006d && addr < 0x0078) ? ' ' : 0);
+    }
+
+    reg->sp = BDOS_BASE - 2;
+    mem_write_word(mem, reg->sp, 0x0000);
+    bdos->dma = BDOS_DMA;
+    return true;
+}
@@ -0,0 +1,55 @@
+#ifndef __BDOS_H__
+#define __BDOS_H__
+
+#include "common.h"
+
+#include <stdio.h>
+
+#include "mem.h"
+#include "regs.h"
+#include "trap.h"
+
+#define BDOS_FILES 16 // Host files open at once.
+#define BDOS_BASE 0xfe00 // Where the BDOS would be; the program gets the memory below it.
+#define BDOS_DMA 0x0080 // Default record buffer, which also holds the command tail.
+
+// The CP/M 2.2 BDOS done by the host, for .COM programs loaded at 0100.
+//
+// Calls to 0005 trap to a native handler that takes the function in C and
+// its argument in DE and E, and returns in A and L (HL and BA for 16-bit
+// results) as the real one does. The console functions read and write
+// `in` and `out` directly, without echo: the host terminal already shows
+// what is typed. The files of the only drive, A:, are the files in `dir`,
+// named as in the FCB but in lower case. A name with characters CP/M names
+// cannot have, such as '/' or '.', or with a space inside it, is turned
+// down with FF without looking at the host. A file open on the host is
+// remembered in the first byte of the FCB's allocation map, and only
+// reached through the FCB at the address it was opened at: a copied or
+// made-up map byte reads as a file that is not open. Opening an FCB again
+// closes the file it had open. There are no wildcards, user areas or
+// directory searches.
+//
+// A jump to 0000, BDOS function 0 and the RET of a program that returns to
+// the CCP halt the CPU.
+typedef struct {
+    FILE* in; // Console input, NULL to read end of file (^Z).
+    FILE* out; // Console output, NULL to drop it.
+    const char* dir;
+    uint16_t dma;
+    FILE* files[BDOS_FILES];
+    uint16_t owners[BDOS_FILES]; // Address of the FCB each file was opened with.
+} bdos_t;
+
+void init_bdos(bdos_t* bdos, FILE* in, FILE* out, const char* dir);
+
+// Sets up page zero with the warm boot and BDOS entry points and an empty
+// command line, and points SP below the BDOS with 0000 pushed for the RET
+// back to the CCP. The entry points are traps in `traps`, which must be
+// attached to the CPU that runs the program. False if there is no room for
+// them.
+bool bdos_install(bdos_t* bdos, traps_t* traps, reg_t* reg, mem_t* mem);
+
+// Closes the files the program left open.
+void bdos_close(bdos_t* bdos);
+
+#endif
@@ -1,5 +1,9 @@
 #include "cpu.h"
 
+#include <stdlib.h>
+
+#include "fuse.h"
+
 void init_cpu(cpu_t* cpu, reg_t* reg, mem_t* mem)
 {
     if (cpu == NULL || reg == NULL || mem == NULL) {
@@ -11,337 +15,625 @@ void init_cpu(cpu_t* cpu, reg_t* reg, mem_t* mem)
     cpu->halted = false;
     cpu->interrupt = false;
     cpu->tick_cycles = 0;
+    cpu->cycles = 0;
+    cpu->next_event = UINT64_MAX;
+    cpu->events = NULL;
+    cpu->traps = NULL;
+    cpu->bcache = NULL;
+    cpu->jit = NULL;
+    cpu->stop = STOP_BUDGET;
+    cpu->io = NULL;
+    cpu->trace = NULL;
+    cpu->profile = NULL;
+    cpu->io_port = 0;
+    cpu->io_out = false;
+
+    init_flags();
 }
 
-uint8_t imm_ds(cpu_t* cpu)
+machine_t* machine_create(void)
 {
-    if (cpu == NULL) {
+    machine_t* machine = aligned_alloc(64, sizeof(machine_t));
+
+    if (machine == NULL) {
+        return NULL;
+    }
+
+    if (!init_mem(&machine->mem)) {
+        free(machine);
+        return NULL;
+    }
+
+    init_reg(&machine->reg);
+    init_cpu(&machine->cpu, &machine->reg, &machine->mem);
+    return machine;
+}
+
+void machine_destroy(machine_t* machine)
+{
+    if (machine == NULL) {
+        return;
+    }
+
+    free_mem(&machine->mem);
+    free(machine);
+}
+
+bool cpu_clone(cpu_t* cpu, reg_t* reg, mem_t* mem, cpu_t* src)
+{
+    if (cpu == NULL || reg == NULL || mem == NULL || src == NULL) {
+        return false;
+    }
+
+    if (!mem_clone(mem, src->mem)) {
+        return false;
+    }
+
+    *reg = *src->reg;
+    *cpu = *src;
+    cpu->reg = reg;
+    cpu->mem = mem;
+
+    // Code caches tell code apart by page generation only, which the two
+    // machines now advance independently.
+    cpu->bcache = NULL;
+    cpu->jit = NULL;
+    cpu->trace = NULL;
+    cpu->profile = NULL;
+
+    // The events' callbacks act on the source machine.
+    if (cpu->events != NULL) {
+        cpu->events = NULL;
+        cpu->next_event = UINT64_MAX;
+    }
+
+    return true;
+}
+
+uint8_t imm_ds(reg_t* reg, mem_t* mem)
+{
+    if (reg == NULL || mem == NULL) {
         return 0;
     }
 
-    uint8_t val = get_mem(cpu->mem, cpu->reg->pc);
+    uint8_t val = mem_read(mem, reg->pc);
 
-    cpu->reg->pc += 1;
+    reg->pc += 1;
 
     return val;
 }
 
-uint16_t imm_dw(cpu_t* cpu)
+uint16_t imm_dw(reg_t* reg, mem_t* mem)
 {
-    if (cpu == NULL) {
+    if (reg == NULL || mem == NULL) {
         return 0;
     }
 
-    uint8_t val = get_mem(cpu->mem, cpu->reg->pc++);
+    uint16_t val = mem_read_word(mem, reg->pc);
 
-    cpu->reg->pc += 2;
+    reg->pc += 2;
 
     return val;
 }
 
-uint8_t get_m(cpu_t* cpu)
+uint8_t get_m(reg_t* reg, mem_t* mem)
 {
-    if (cpu == NULL) {
+    if (reg == NULL || mem == NULL) {
         return 0;
     }
 
-    return get_mem(cpu->mem, get_reg_hl(cpu->reg));
+    return mem_read(mem, reg->hl);
 }
 
-void set_m(cpu_t* cpu, uint8_t val)
+void set_m(reg_t* reg, mem_t* mem, uint8_t val)
 {
-    if (cpu == NULL) {
+    if (reg == NULL || mem == NULL) {
         return;
     }
 
-    set_mem(cpu->mem, get_reg_hl(cpu->reg), val);
+    mem_write(mem, reg->hl, val);
 }
 
-void stack_add(cpu_t* cpu, uint16_t val)
+void stack_add(reg_t* reg, mem_t* mem, uint16_t val)
 {
-    if (cpu == NULL) {
+    if (reg == NULL || mem == NULL) {
         return;
     }
 
-    cpu->reg->sp -= 2;
-    set_mem_word(cpu->mem, cpu->reg->sp, val);
+    reg->sp -= 2;
+    mem_write_word(mem, reg->sp, val);
 }
 
-uint16_t stack_pop(cpu_t* cpu)
+uint16_t stack_pop(reg_t* reg, mem_t* mem)
 {
-    if (cpu == NULL) {
+    if (reg == NULL || mem == NULL) {
         return 0;
     }
 
-    uint16_t val = get_mem_word(cpu->mem, cpu->reg->sp);
+    uint16_t val = mem_read_word(mem, reg->sp);
 
-    cpu->reg->sp += 2;
+    reg->sp += 2;
 
     return val;
 }
 
-uint8_t alu_inr(cpu_t* cpu, uint8_t val)
+uint8_t alu_inr(reg_t* reg, uint8_t val)
 {
-    if (cpu == NULL) {
+    if (reg == NULL) {
         return 0;
     }
 
     uint8_t res = val + 1;
 
-    ZSP_UPDATE(cpu, val, res);
+    flags_inr_op(reg, res);
 
     return res;
 }
 
-uint8_t alu_dcr(cpu_t* cpu, uint8_t val)
+uint8_t alu_dcr(reg_t* reg, uint8_t val)
 {
-    if (cpu == NULL) {
+    if (reg == NULL) {
         return 0;
     }
 
     uint8_t res = val - 1;
 
-    ZSP_UPDATE(cpu, val, res);
+    flags_dcr_op(reg, res);
 
     return res;
 }
 
-void alu_daa(cpu_t* cpu)
+void alu_daa(reg_t* reg)
 {
-    if (cpu == NULL) {
+    if (reg == NULL) {
         return;
     }
 
-    uint8_t correction = 0;
-    bool c = get_reg_flag(cpu->reg, C);
-
-    uint8_t lsb = cpu->reg->a & 0x0f;
-    uint8_t msb = cpu->reg->a >> 4;
+    uint8_t f = flags_get(reg);
+    uint16_t val = flags_daa[((f & FLAG_A) ? 2 : 0) | (f & FLAG_C)][reg->a];
 
-    if (lsb > 9 || get_reg_flag(cpu->reg, A)) {
-        correction += 0x06;
-    }
+    reg->a = val & 0xff;
+    flags_set(reg, val >> 8);
+}
 
-    if (msb > 9 || get_reg_flag(cpu->reg, C) || (msb >= 9 && lsb > 9)) {
-        correction += 0x06;
-        c = true;
+void alu_add(reg_t* reg, uint8_t val)
+{
+    if (reg == NULL) {
+        return;
     }
 
-    alu_add(cpu, correction);
+    uint8_t a = reg->a;
 
-    set_reg_flag(cpu->reg, C, c);
+    flags_add_op(reg, a, val, 0);
+    reg->a = a + val;
 }
 
-void alu_add(cpu_t* cpu, uint8_t val)
+void alu_adc(reg_t* reg, uint8_t val)
 {
-    if (cpu == NULL) {
+    if (reg == NULL) {
         return;
     }
 
-    uint8_t a = cpu->reg->a;
-    uint8_t res = a + val;
-
-    ZSP_UPDATE(cpu, val, res);
-
-    set_reg_flag(cpu->reg, C, a + res > 0xff);
+    uint8_t a = reg->a;
+    uint8_t c = flags_carry(reg);
 
-    cpu->reg->a = res;
+    flags_add_op(reg, a, val, c);
+    reg->a = a + val + c;
 }
 
-void alu_adc(cpu_t* cpu, uint8_t val)
+void alu_sub(reg_t* reg, uint8_t val)
 {
-    if (cpu == NULL) {
+    if (reg == NULL) {
         return;
     }
 
-    uint8_t a = cpu->reg->a;
-    uint8_t c = get_reg_flag(cpu->reg, C);
-
-    uint8_t res = a + val + c;
-
-    ZSP_UPDATE(cpu, val, res);
+    uint8_t a = reg->a;
 
-    set_reg_flag(cpu->reg, C, a + val + res > 0xff);
-
-    cpu->reg->a = res;
+    flags_sub_op(reg, a, val, 0);
+    reg->a = a - val;
 }
 
-void alu_sub(cpu_t* cpu, uint8_t val)
+void alu_sbb(reg_t* reg, uint8_t val)
 {
-    if (cpu == NULL) {
+    if (reg == NULL) {
         return;
     }
 
-    uint8_t a = cpu->reg->a;
-    uint8_t res = a - val;
-
-    ZSP_UPDATE(cpu, val, res);
+    uint8_t a = reg->a;
+    uint8_t c = flags_carry(reg);
 
-    set_reg_flag(cpu->reg, A, (a & 0x0f) - (val & 0x0f) >= 0x00);
-    set_reg_flag(cpu->reg, C, a < val);
-
-    cpu->reg->a = res;
+    flags_sub_op(reg, a, val, c);
+    reg->a = a - val - c;
 }
 
-void alu_sbb(cpu_t* cpu, uint8_t val)
+void alu_ana(reg_t* reg, uint8_t val)
 {
-    if (cpu == NULL) {
+    if (reg == NULL) {
         return;
     }
 
-    uint8_t a = cpu->reg->a;
-    uint8_t c = get_reg_flag(cpu->reg, C);
+    uint8_t a = reg->a;
+    uint8_t res = a & val;
 
-    uint8_t res = a - val - c;
+    // AND sets the auxiliary carry from bit 3 of either operand.
+    flags_logic_op(reg, res, ((a | val) & 0x08) << 1);
+    reg->a = res;
+}
 
-    ZSP_UPDATE(cpu, val, res);
+void alu_xra(reg_t* reg, uint8_t val)
+{
+    if (reg == NULL) {
+        return;
+    }
 
-    set_reg_flag(cpu->reg, A, (a & 0x0f) - (val & 0x0f) - (c & 0x0f) >= 0x00);
-    set_reg_flag(cpu->reg, C, a + val + res > 0xff);
+    uint8_t res = reg->a ^ val;
 
-    cpu->reg->a = res;
+    flags_logic_op(reg, res, 0);
+    reg->a = res;
 }
 
-void alu_ana(cpu_t* cpu, uint8_t val)
+void alu_ora(reg_t* reg, uint8_t val)
 {
-    if (cpu == NULL) {
+    if (reg == NULL) {
         return;
     }
 
-    uint8_t a = cpu->reg->a;
-    uint8_t res = a & val;
-
-    ZSP_UPDATE(cpu, val, res);
+    uint8_t res = reg->a | val;
 
-    set_reg_flag(cpu->reg, C, false);
-
-    cpu->reg->a = res;
+    flags_logic_op(reg, res, 0);
+    reg->a = res;
 }
 
-void alu_xra(cpu_t* cpu, uint8_t val)
+void alu_cmp(reg_t* reg, uint8_t val)
 {
-    if (cpu == NULL) {
+    if (reg == NULL) {
         return;
     }
 
-    uint8_t a = cpu->reg->a;
-    uint8_t res = a ^ val;
+    flags_sub_op(reg, reg->a, val, 0);
+}
 
-    ZSP_UPDATE(cpu, val, res);
+void alu_rlc(reg_t* reg)
+{
+    if (reg == NULL) {
+        return;
+    }
 
-    set_reg_flag(cpu->reg, C, false);
+    uint8_t a = reg->a;
+    uint8_t c = a >> 7;
 
-    cpu->reg->a = res;
+    flags_set(reg, (flags_get(reg) & ~FLAG_C) | c);
+    reg->a = (a << 1) | c;
 }
 
-void alu_ora(cpu_t* cpu, uint8_t val)
+void alu_rrc(reg_t* reg)
 {
-    if (cpu == NULL) {
+    if (reg == NULL) {
         return;
     }
 
-    uint8_t a = cpu->reg->a;
-    uint8_t res = a | val;
+    uint8_t a = reg->a;
+    uint8_t c = a & 0x01;
 
-    ZSP_UPDATE(cpu, val, res);
-
-    set_reg_flag(cpu->reg, C, false);
-
-    cpu->reg->a = res;
+    flags_set(reg, (flags_get(reg) & ~FLAG_C) | c);
+    reg->a = (a >> 1) | (c << 7);
 }
 
-void alu_cmp(cpu_t* cpu, uint8_t val)
+void alu_ral(reg_t* reg)
 {
-    if (cpu == NULL) {
+    if (reg == NULL) {
         return;
     }
 
-    uint8_t res = cpu->reg->a;
-
-    alu_sub(cpu, val);
+    uint8_t a = reg->a;
+    uint8_t f = flags_get(reg);
 
-    cpu->reg->a = res;
+    flags_set(reg, (f & ~FLAG_C) | (a >> 7));
+    reg->a = (a << 1) | (f & FLAG_C);
 }
 
-void alu_rlc(cpu_t* cpu)
+void alu_rar(reg_t* reg)
 {
-    if (cpu == NULL) {
+    if (reg == NULL) {
         return;
     }
 
-    uint8_t c = GET_BIT(cpu->reg->a, 7);
-    uint8_t res = (cpu->reg->a << 1) | c;
-
-    set_reg_flag(cpu->reg, C, c);
+    uint8_t a = reg->a;
+    uint8_t f = flags_get(reg);
 
-    cpu->reg->a = res;
+    flags_set(reg, (f & ~FLAG_C) | (a & 0x01));
+    reg->a = (a >> 1) | ((f & FLAG_C) << 7);
 }
 
-void alu_rrc(cpu_t* cpu)
+void alu_dad(reg_t* reg, uint16_t val)
 {
-    if (cpu == NULL) {
+    if (reg == NULL) {
         return;
     }
 
-    uint8_t c = GET_BIT(cpu->reg->a, 0);
-    uint8_t res = 0;
+    uint32_t res = reg->hl + val;
 
-    if (c) {
-        res = 0x80 | (cpu->reg->a << 1);
-    } else {
-        res = cpu->reg->a >> 1;
-    }
+    flags_set(reg, (flags_get(reg) & ~FLAG_C) | (res >> 16));
+    reg->hl = res;
+}
+
+// Evaluates the condition encoded in bits 3-5 of a conditional jump, call or
+// return: NZ, Z, NC, C, PO, PE, P, M.
+static inline bool cond(reg_t* reg, uint8_t opcode)
+{
+    static const uint8_t flags[4] = { FLAG_Z, FLAG_C, FLAG_P, FLAG_S };
 
-    set_reg_flag(cpu->reg, C, c);
+    bool set = flags_test(reg, flags[(opcode >> 4) & 0x03]);
 
-    cpu->reg->a = res;
+    return (opcode & 0x08) ? set : !set;
 }
 
-void alu_ral(cpu_t* cpu)
-{
-    if (cpu == NULL) {
-        return;
-    }
+#ifdef THREADED_DISPATCH
+// Label table of a threaded dispatch loop, without the braces. Undocumented
+// opcodes point at the handler of the documented instruction they behave
+// like.
+// clang-format off
+#define HANDLERS                                                                                   \
+    &&op_0x00, &&op_0x01, &&op_0x02, &&op_0x03, &&op_0x04, &&op_0x05, &&op_0x06, &&op_0x07, \
+    &&op_0x00, &&op_0x09, &&op_0x0a, &&op_0x0b, &&op_0x0c, &&op_0x0d, &&op_0x0e, &&op_0x0f, \
+    &&op_0x00, &&op_0x11, &&op_0x12, &&op_0x13, &&op_0x14, &&op_0x15, &&op_0x16, &&op_0x17, \
+    &&op_0x00, &&op_0x19, &&op_0x1a, &&op_0x1b, &&op_0x1c, &&op_0x1d, &&op_0x1e, &&op_0x1f, \
+    &&op_0x00, &&op_0x21, &&op_0x22, &&op_0x23, &&op_0x24, &&op_0x25, &&op_0x26, &&op_0x27, \
+    &&op_0x00, &&op_0x29, &&op_0x2a, &&op_0x2b, &&op_0x2c, &&op_0x2d, &&op_0x2e, &&op_0x2f, \
+    &&op_0x00, &&op_0x31, &&op_0x32, &&op_0x33, &&op_0x34, &&op_0x35, &&op_0x36, &&op_0x37, \
+    &&op_0x00, &&op_0x39, &&op_0x3a, &&op_0x3b, &&op_0x3c, &&op_0x3d, &&op_0x3e, &&op_0x3f, \
+    &&op_0x40, &&op_0x41, &&op_0x42, &&op_0x43, &&op_0x44, &&op_0x45, &&op_0x46, &&op_0x47, \
+    &&op_0x48, &&op_0x49, &&op_0x4a, &&op_0x4b, &&op_0x4c, &&op_0x4d, &&op_0x4e, &&op_0x4f, \
+    &&op_0x50, &&op_0x51, &&op_0x52, &&op_0x53, &&op_0x54, &&op_0x55, &&op_0x56, &&op_0x57, \
+    &&op_0x58, &&op_0x59, &&op_0x5a, &&op_0x5b, &&op_0x5c, &&op_0x5d, &&op_0x5e, &&op_0x5f, \
+    &&op_0x60, &&op_0x61, &&op_0x62, &&op_0x63, &&op_0x64, &&op_0x65, &&op_0x66, &&op_0x67, \
+    &&op_0x68, &&op_0x69, &&op_0x6a, &&op_0x6b, &&op_0x6c, &&op_0x6d, &&op_0x6e, &&op_0x6f, \
+    &&op_0x70, &&op_0x71, &&op_0x72, &&op_0x73, &&op_0x74, &&op_0x75, &&op_0x76, &&op_0x77, \
+    &&op_0x78, &&op_0x79, &&op_0x7a, &&op_0x7b, &&op_0x7c, &&op_0x7d, &&op_0x7e, &&op_0x7f, \
+    &&op_0x80, &&op_0x81, &&op_0x82, &&op_0x83, &&op_0x84, &&op_0x85, &&op_0x86, &&op_0x87, \
+    &&op_0x88, &&op_0x89, &&op_0x8a, &&op_0x8b, &&op_0x8c, &&op_0x8d, &&op_0x8e, &&op_0x8f, \
+    &&op_0x90, &&op_0x91, &&op_0x92, &&op_0x93, &&op_0x94, &&op_0x95, &&op_0x96, &&op_0x97, \
+    &&op_0x98, &&op_0x99, &&op_0x9a, &&op_0x9b, &&op_0x9c, &&op_0x9d, &&op_0x9e, &&op_0x9f, \
+    &&op_0xa0, &&op_0xa1, &&op_0xa2, &&op_0xa3, &&op_0xa4, &&op_0xa5, &&op_0xa6, &&op_0xa7, \
+    &&op_0xa8, &&op_0xa9, &&op_0xaa, &&op_0xab, &&op_0xac, &&op_0xad, &&op_0xae, &&op_0xaf, \
+    &&op_0xb0, &&op_0xb1, &&op_0xb2, &&op_0xb3, &&op_0xb4, &&op_0xb5, &&op_0xb6, &&op_0xb7, \
+    &&op_0xb8, &&op_0xb9, &&op_0xba, &&op_0xbb, &&op_0xbc, &&op_0xbd, &&op_0xbe, &&op_0xbf, \
+    &&op_0xc0, &&op_0xc1, &&op_0xc2, &&op_0xc3, &&op_0xc4, &&op_0xc5, &&op_0xc6, &&op_0xc7, \
+    &&op_0xc8, &&op_0xc9, &&op_0xca, &&op_0xc3, &&op_0xcc, &&op_0xcd, &&op_0xce, &&op_0xcf, \
+    &&op_0xd0, &&op_0xd1, &&op_0xd2, &&op_0xd3, &&op_0xd4, &&op_0xd5, &&op_0xd6, &&op_0xd7, \
+    &&op_0xd8, &&op_0xc9, &&op_0xda, &&op_0xdb, &&op_0xdc, &&op_0xcd, &&op_0xde, &&op_0xdf, \
+    &&op_0xe0, &&op_0xe1, &&op_0xe2, &&op_0xe3, &&op_0xe4, &&op_0xe5, &&op_0xe6, &&op_0xe7, \
+    &&op_0xe8, &&op_0xe9, &&op_0xea, &&op_0xeb, &&op_0xec, &&op_0xcd, &&op_0xee, &&op_0xef, \
+    &&op_0xf0, &&op_0xf1, &&op_0xf2, &&op_0xf3, &&op_0xf4, &&op_0xf5, &&op_0xf6, &&op_0xf7, \
+    &&op_0xf8, &&op_0xf9, &&op_0xfa, &&op_0xfb, &&op_0xfc, &&op_0xcd, &&op_0xfe, &&op_0xff
+// clang-format on
+#endif
 
-    uint8_t c = GET_BIT(cpu->reg->a, 7);
-    uint8_t res = (cpu->reg->a << 1) | get_reg_flag(cpu->reg, C);
+// GCC splits a local reg_t into one scalar per register and pair, and has to
+// put the pairs back together wherever the handlers meet again, which ends up
+// costing more than the loads it saves on branchy guest code. Kept whole, the
+// copy stays on the stack, where it is as quick to reach as cpu->reg and
+// cannot alias guest memory. emubench with GCC 12 on x86-64, ns per
+// instruction, best of twelve runs with and without it:
+//             interp          bcache
+//            with  without   with  without
+//   alu      2.9   3.3       3.0   3.7
+//   bcd      3.4   3.4       3.3   3.9
+//   branch   5.0   5.0       4.1   4.6
+//   calls    5.2   4.5       3.2   3.4
+//   memcpy   4.0   4.1       2.0   2.4
+// Runs differ by about 10%, so only the block cache gains for sure. It
+// finishes each batch in dispatch(), and taking the attribute off dispatch()
+// alone loses most of the gain, so both have it.
+#if defined(__GNUC__) && !defined(__clang__)
+#define CACHED_ATTR __attribute__((optimize("no-tree-sra")))
+#else
+#define CACHED_ATTR
+#endif
 
-    set_reg_flag(cpu->reg, C, c);
+// Runs instructions until at least `budget` cycles have been spent or the CPU
+// halts, fetching and decoding every instruction from memory.
+//
+// With THREADED_DISPATCH every handler ends in its own fetch and indirect
+// jump through a 256-entry label table (computed goto); otherwise the
+// portable switch is used.
+#define DISPATCH dispatch
+#define DISPATCH_ATTR CACHED_ATTR
+#define TRACE()
+#define CACHED 1
+#include "dispatch.h"
+#undef DISPATCH
+#undef DISPATCH_ATTR
+#undef TRACE
+#undef CACHED
+
+// Same as dispatch(), but straight on cpu->reg, for exec(). On a single
+// instruction the copy costs more than it saves, all the more since the JIT
+// has just written the registers one at a time, which the copy then reads
+// whole.
+#define DISPATCH dispatch_one
+#define DISPATCH_ATTR
+#define TRACE()
+#define CACHED 0
+#include "dispatch.h"
+#undef DISPATCH
+#undef DISPATCH_ATTR
+#undef TRACE
+#undef CACHED
+
+// Hands the instruction just fetched to the trace and the profiler.
+static inline void observe(cpu_t* cpu, uint8_t opcode, uint64_t cycle)
+{
+    if (cpu->trace != NULL) {
+        trace_record(cpu->trace, cpu->reg, cpu->reg->pc - 1, opcode, cycle);
+    }
 
-    cpu->reg->a = res;
+    if (cpu->profile != NULL) {
+        profile_record(cpu->profile, cpu->reg->pc - 1, cpu->reg->sp, opcode, cycle);
+    }
 }
 
-void alu_rar(cpu_t* cpu)
+// Same as dispatch(), but records every instruction in cpu->trace and/or
+// cpu->profile, one of which must be set. A variant of its own keeps the
+// checks out of the plain loop; it is cold so that it does not eat into the
+// inlining done for that loop.
+#define DISPATCH dispatch_traced
+#define DISPATCH_ATTR __attribute__((cold))
+#define TRACE() observe(cpu, opcode, cpu->cycles + cycles)
+#define CACHED 0
+#include "dispatch.h"
+#undef DISPATCH
+#undef DISPATCH_ATTR
+#undef TRACE
+#undef CACHED
+
+// Same contract as dispatch(), but runs predecoded blocks from the block
+// cache. The cycles of a whole block are accounted up front, so the budget is
+// only checked between blocks; a block that does not fit in what is left of
+// the budget is handed to dispatch() instead. Like dispatch(), it runs on a
+// copy of the registers, see dispatch.h.
+static CACHED_ATTR uint32_t dispatch_blocks(cpu_t* cpu, uint32_t budget)
 {
-    if (cpu == NULL) {
-        return;
-    }
+    uint32_t cycles = 0;
+    uint8_t opcode;
+    const insn_t* insn;
+    const insn_t* end;
+    uint32_t code_writes;
+    reg_t reg = *cpu->reg;
+    mem_t* const mem = cpu->mem;
+
+#ifdef THREADED_DISPATCH
+    static const void* const handlers[256 + FUSE_COUNT] = { HANDLERS, FUSE_HANDLERS };
+#else
+    const void* const* handlers = NULL;
+#endif
 
-    uint8_t c = GET_BIT(cpu->reg->a, 0);
-    uint8_t res = 0;
+#define IMM8() ((uint8_t)insn->imm)
+#define IMM16() (insn->imm)
+#define EXIT goto out
+#define JUMP NEXT // Checked for traps as the next block starts.
+#define REG (&reg)
+#define MEM mem
+#define SAVE() (*cpu->reg = reg)
+#define LOAD() (reg = *cpu->reg)
+
+    while (cycles < budget && cpu->stop == STOP_BUDGET) {
+        if (cpu->traps != NULL && traps_at(cpu->traps, reg.pc)) {
+            SAVE();
+            cycles += run_traps(cpu, budget - cycles);
+            LOAD();
+            continue;
+        }
 
-    if (get_reg_flag(cpu->reg, C)) {
-        res = 0x80 | (cpu->reg->a >> 1);
-    } else {
-        res = cpu->reg->a >> 1;
-    }
+        block_t* block = bcache_get(cpu->bcache, mem, reg.pc, handlers);
 
-    set_reg_flag(cpu->reg, C, c);
+        if (block == NULL) {
+            SAVE();
+            cycles += dispatch_one(cpu, 1);
+            LOAD();
+            continue;
+        }
 
-    cpu->reg->a = res;
-}
+        if (block->spin.kind != SPIN_NONE) {
+            uint32_t skipped;
 
-void alu_dad(cpu_t* cpu, uint16_t val)
-{
-    if (cpu == NULL) {
-        return;
-    }
+            SAVE();
+            skipped = spin_skip(cpu, &block->spin, budget - cycles);
+            LOAD();
 
-    uint16_t a = get_reg_hl(cpu->reg);
-    uint16_t res = a + val;
+            if (skipped > 0) {
+                cycles += skipped;
+                continue;
+            }
+        }
 
-    set_reg_flag(cpu->reg, C, a > 0xffff - val);
-    set_reg_hl(cpu->reg, res);
+        if (budget - cycles < block->cycles) {
+            SAVE();
+            cycles += dispatch(cpu, budget - cycles);
+            LOAD();
+            break;
+        }
+
+        insn = block->insns;
+        end = insn + block->count;
+        code_writes = mem->code_writes;
+        cycles += block->cycles;
+
+#ifdef THREADED_DISPATCH
+#define OP(n) op_##n:
+#define ALIAS(n)
+#define NEXT_INSN                              \
+    {                                          \
+        if (mem->code_writes != code_writes) { \
+            goto stale;                        \
+        }                                      \
+        if (++insn == end) {                   \
+            continue;                          \
+        }                                      \
+        reg.pc = insn->next;                   \
+        opcode = insn->opcode;                 \
+        goto* insn->handler;                   \
+    }
+#define NEXT NEXT_INSN
+
+        reg.pc = insn->next;
+        opcode = insn->opcode;
+        goto* insn->handler;
+#else
+#define OP(n) case n:
+#define ALIAS(n) case n:
+#define NEXT                                   \
+    {                                          \
+        if (mem->code_writes != code_writes) { \
+            goto stale;                        \
+        }                                      \
+        continue;                              \
+    }
+
+        for (; insn < end; insn++) {
+            reg.pc = insn->next;
+            opcode = insn->opcode;
+
+            switch (opcode) {
+#endif
+
+#include "opcodes.h"
+
+#ifdef THREADED_DISPATCH
+#define FUSE_INSTANCES
+#include "fuse.h"
+#undef FUSE_INSTANCES
+#undef NEXT_INSN
+#else
+            }
+        }
+
+        continue;
+#endif
+
+    stale:
+        // The block overwrote its own code: give back the cycles of the
+        // instructions that will not run and decode again from the new PC.
+        while (++insn < end) {
+            cycles -= OPCODES_CYCLES[insn->opcode];
+        }
+    }
+
+#undef IMM8
+#undef IMM16
+#undef OP
+#undef ALIAS
+#undef NEXT
+#undef EXIT
+#undef JUMP
+#undef REG
+#undef MEM
+#undef SAVE
+#undef LOAD
+
+out:
+    *cpu->reg = reg;
+    return cycles;
 }
 
 uint32_t exec(cpu_t* cpu)
@@ -350,1012 +642,199 @@ uint32_t exec(cpu_t* cpu)
         return 0;
     }
 
-    uint8_t opcode = imm_ds(cpu);
-    switch (opcode) {
-    case 0x08:
-    case 0x10:
-    case 0x18:
-    case 0x20:
-    case 0x28:
-    case 0x30:
-    case 0x38:
-        opcode = 0x00;
-        break;
-
-    case 0xcb:
-        opcode = 0xc3;
-        break;
-
-    case 0xd9:
-        opcode = 0xc9;
-        break;
-
-    case 0xdd:
-    case 0xed:
-    case 0xfd:
-        opcode = 0xcd;
-        break;
-
-    default:
-        break;
+    cpu->stop = STOP_BUDGET;
+
+    if (cpu->traps != NULL && traps_at(cpu->traps, cpu->reg->pc)) {
+        return run_traps(cpu, 1);
     }
 
-#ifdef DEBUG
-#include <stdio.h>
-
-    fprintf(stderr, "%04X PC=%04X SP=%04X A=%02X F=%02X B=%02X C=%02X D=%02X E=%02X H=%02X L=%02X\n",
-        opcode,
-        cpu->reg->pc - 1,
-        cpu->reg->sp,
-        cpu->reg->a,
-        cpu->reg->f,
-        cpu->reg->b,
-        cpu->reg->c,
-        cpu->reg->d,
-        cpu->reg->e,
-        cpu->reg->h,
-        cpu->reg->l);
-#endif
+    return cpu->trace != NULL || cpu->profile != NULL ? dispatch_traced(cpu, 1) : dispatch_one(cpu, 1);
+}
 
-    uint32_t cycle = 0;
-    switch (opcode) {
-    // Carry bit instructions
-    case 0x3f:
-        set_reg_flag(cpu->reg, C, !get_reg_flag(cpu->reg, C));
-        break;
-    case 0x37:
-        set_reg_flag(cpu->reg, C, true);
-        break;
-
-    // INR
-    case 0x04:
-        cpu->reg->b = alu_inr(cpu, cpu->reg->b);
-        break;
-    case 0x0c:
-        cpu->reg->c = alu_inr(cpu, cpu->reg->c);
-        break;
-    case 0x14:
-        cpu->reg->d = alu_inr(cpu, cpu->reg->d);
-        break;
-    case 0x1c:
-        cpu->reg->e = alu_inr(cpu, cpu->reg->e);
-        break;
-    case 0x24:
-        cpu->reg->h = alu_inr(cpu, cpu->reg->h);
-        break;
-    case 0x2c:
-        cpu->reg->l = alu_inr(cpu, cpu->reg->l);
-        break;
-
-    case 0x34: {
-        uint8_t m = get_m(cpu);
-        uint8_t r = alu_inr(cpu, m);
-        set_m(cpu, r);
-        break;
-    }
-    case 0x3c:
-        cpu->reg->a = alu_inr(cpu, cpu->reg->a);
-        break;
-
-    // DCR
-    case 0x05:
-        cpu->reg->b = alu_dcr(cpu, cpu->reg->b);
-        break;
-    case 0x0d:
-        cpu->reg->c = alu_dcr(cpu, cpu->reg->c);
-        break;
-    case 0x15:
-        cpu->reg->d = alu_dcr(cpu, cpu->reg->d);
-        break;
-    case 0x1d:
-        cpu->reg->e = alu_dcr(cpu, cpu->reg->e);
-        break;
-    case 0x25:
-        cpu->reg->h = alu_dcr(cpu, cpu->reg->h);
-        break;
-    case 0x2d:
-        cpu->reg->l = alu_dcr(cpu, cpu->reg->l);
-        break;
-    case 0x35: {
-        uint8_t m = get_m(cpu);
-        uint8_t r = alu_dcr(cpu, m);
-        set_m(cpu, r);
-        break;
+uint32_t exec_batch(cpu_t* cpu, uint32_t budget)
+{
+    if (cpu == NULL || cpu->halted) {
+        return 0;
     }
 
-    case 0x3d:
-        cpu->reg->a = alu_dcr(cpu, cpu->reg->a);
-        break;
-
-    // CMA
-    case 0x2f:
-        cpu->reg->a = !cpu->reg->a;
-        break;
-
-    // DAA
-    case 0x27:
-        alu_daa(cpu);
-        break;
-
-    // NOP: undocumented NOPs from 0x08 to 0x38
-    case 0x08:
-    case 0x10:
-    case 0x18:
-    case 0x20:
-    case 0x28:
-    case 0x30:
-    case 0x38:
-    case 0x00:
-        break;
-
-    // MOV
-    case 0x40:
-        break;
-    case 0x41:
-        cpu->reg->b = cpu->reg->c;
-        break;
-    case 0x42:
-        cpu->reg->b = cpu->reg->d;
-        break;
-    case 0x43:
-        cpu->reg->b = cpu->reg->e;
-        break;
-    case 0x44:
-        cpu->reg->b = cpu->reg->h;
-        break;
-    case 0x45:
-        cpu->reg->b = cpu->reg->l;
-        break;
-    case 0x46:
-        cpu->reg->b = get_m(cpu);
-        break;
-    case 0x47:
-        cpu->reg->b = cpu->reg->a;
-        break;
-    case 0x48:
-        cpu->reg->c = cpu->reg->b;
-        break;
-    case 0x49:
-        break;
-    case 0x4a:
-        cpu->reg->c = cpu->reg->d;
-        break;
-    case 0x4b:
-        cpu->reg->c = cpu->reg->e;
-        break;
-    case 0x4c:
-        cpu->reg->c = cpu->reg->h;
-        break;
-    case 0x4d:
-        cpu->reg->c = cpu->reg->l;
-        break;
-    case 0x4e:
-        cpu->reg->c = get_m(cpu);
-        break;
-    case 0x4f:
-        cpu->reg->c = cpu->reg->a;
-        break;
-    case 0x50:
-        cpu->reg->d = cpu->reg->b;
-        break;
-    case 0x51:
-        cpu->reg->d = cpu->reg->c;
-        break;
-    case 0x52:
-        break;
-    case 0x53:
-        cpu->reg->d = cpu->reg->e;
-        break;
-    case 0x54:
-        cpu->reg->d = cpu->reg->h;
-        break;
-    case 0x55:
-        cpu->reg->d = cpu->reg->l;
-        break;
-    case 0x56:
-        cpu->reg->d = get_m(cpu);
-        break;
-    case 0x57:
-        cpu->reg->d = cpu->reg->a;
-        break;
-    case 0x58:
-        cpu->reg->e = cpu->reg->b;
-        break;
-    case 0x59:
-        cpu->reg->e = cpu->reg->c;
-        break;
-    case 0x5a:
-        cpu->reg->e = cpu->reg->d;
-        break;
-    case 0x5b:
-        break;
-    case 0x5c:
-        cpu->reg->e = cpu->reg->h;
-        break;
-    case 0x5d:
-        cpu->reg->e = cpu->reg->l;
-        break;
-    case 0x5e:
-        cpu->reg->e = get_m(cpu);
-        break;
-    case 0x5f:
-        cpu->reg->e = cpu->reg->a;
-        break;
-    case 0x60:
-        cpu->reg->h = cpu->reg->b;
-        break;
-    case 0x61:
-        cpu->reg->h = cpu->reg->c;
-        break;
-    case 0x62:
-        cpu->reg->h = cpu->reg->d;
-        break;
-    case 0x63:
-        cpu->reg->h = cpu->reg->e;
-        break;
-    case 0x64:
-        break;
-    case 0x65:
-        cpu->reg->h = cpu->reg->l;
-        break;
-    case 0x66:
-        cpu->reg->h = get_m(cpu);
-        break;
-    case 0x67:
-        cpu->reg->h = cpu->reg->a;
-        break;
-    case 0x68:
-        cpu->reg->l = cpu->reg->b;
-        break;
-    case 0x69:
-        cpu->reg->l = cpu->reg->c;
-        break;
-    case 0x6a:
-        cpu->reg->l = cpu->reg->d;
-        break;
-    case 0x6b:
-        cpu->reg->l = cpu->reg->e;
-        break;
-    case 0x6c:
-        cpu->reg->l = cpu->reg->h;
-        break;
-    case 0x6d:
-        break;
-    case 0x6e:
-        cpu->reg->l = get_m(cpu);
-        break;
-    case 0x6f:
-        cpu->reg->l = cpu->reg->a;
-        break;
-    case 0x70:
-        set_m(cpu, cpu->reg->b);
-        break;
-    case 0x71:
-        set_m(cpu, cpu->reg->c);
-        break;
-    case 0x72:
-        set_m(cpu, cpu->reg->d);
-        break;
-    case 0x73:
-        set_m(cpu, cpu->reg->e);
-        break;
-    case 0x74:
-        set_m(cpu, cpu->reg->h);
-        break;
-    case 0x75:
-        set_m(cpu, cpu->reg->l);
-        break;
-    case 0x77:
-        set_m(cpu, cpu->reg->a);
-        break;
-    case 0x78:
-        cpu->reg->a = cpu->reg->b;
-        break;
-    case 0x79:
-        cpu->reg->a = cpu->reg->c;
-        break;
-    case 0x7a:
-        cpu->reg->a = cpu->reg->d;
-        break;
-    case 0x7b:
-        cpu->reg->a = cpu->reg->e;
-        break;
-    case 0x7c:
-        cpu->reg->a = cpu->reg->h;
-        break;
-    case 0x7d:
-        cpu->reg->a = cpu->reg->l;
-        break;
-    case 0x7e:
-        cpu->reg->a = get_m(cpu);
-        break;
-    case 0x7f:
-        break;
-
-    // STAX
-    case 0x02:
-        set_mem(cpu->mem, get_reg_bc(cpu->reg), cpu->reg->a);
-        break;
-    case 0x12:
-        set_mem(cpu->mem, get_reg_de(cpu->reg), cpu->reg->a);
-        break;
-
-    // LDAX
-    case 0x0a:
-        cpu->reg->a = get_mem(cpu->mem, get_reg_bc(cpu->reg));
-        break;
-    case 0x1a:
-        cpu->reg->a = get_mem(cpu->mem, get_reg_de(cpu->reg));
-        break;
-
-    // ADD
-    case 0x80:
-        alu_add(cpu, cpu->reg->b);
-        break;
-    case 0x81:
-        alu_add(cpu, cpu->reg->c);
-        break;
-    case 0x82:
-        alu_add(cpu, cpu->reg->d);
-        break;
-    case 0x83:
-        alu_add(cpu, cpu->reg->e);
-        break;
-    case 0x84:
-        alu_add(cpu, cpu->reg->h);
-        break;
-    case 0x85:
-        alu_add(cpu, cpu->reg->l);
-        break;
-    case 0x86:
-        alu_add(cpu, get_m(cpu));
-        break;
-    case 0x87:
-        alu_add(cpu, cpu->reg->a);
-        break;
-
-    // ADC
-    case 0x88:
-        alu_adc(cpu, cpu->reg->b);
-        break;
-    case 0x89:
-        alu_adc(cpu, cpu->reg->c);
-        break;
-    case 0x8a:
-        alu_adc(cpu, cpu->reg->d);
-        break;
-    case 0x8b:
-        alu_adc(cpu, cpu->reg->e);
-        break;
-    case 0x8c:
-        alu_adc(cpu, cpu->reg->h);
-        break;
-    case 0x8d:
-        alu_adc(cpu, cpu->reg->l);
-        break;
-    case 0x8e:
-        alu_adc(cpu, get_m(cpu));
-        break;
-    case 0x8f:
-        alu_adc(cpu, cpu->reg->a);
-        break;
-
-    // SUB
-    case 0x90:
-        alu_sub(cpu, cpu->reg->b);
-        break;
-    case 0x91:
-        alu_sub(cpu, cpu->reg->c);
-        break;
-    case 0x92:
-        alu_sub(cpu, cpu->reg->d);
-        break;
-    case 0x93:
-        alu_sub(cpu, cpu->reg->e);
-        break;
-    case 0x94:
-        alu_sub(cpu, cpu->reg->h);
-        break;
-    case 0x95:
-        alu_sub(cpu, cpu->reg->l);
-        break;
-    case 0x96:
-        alu_sub(cpu, get_m(cpu));
-        break;
-    case 0x97:
-        alu_sub(cpu, cpu->reg->a);
-        break;
-
-    // SBB
-    case 0x98:
-        alu_sbb(cpu, cpu->reg->b);
-        break;
-    case 0x99:
-        alu_sbb(cpu, cpu->reg->c);
-        break;
-    case 0x9a:
-        alu_sbb(cpu, cpu->reg->d);
-        break;
-    case 0x9b:
-        alu_sbb(cpu, cpu->reg->e);
-        break;
-    case 0x9c:
-        alu_sbb(cpu, cpu->reg->h);
-        break;
-    case 0x9d:
-        alu_sbb(cpu, cpu->reg->l);
-        break;
-    case 0x9e:
-        alu_sbb(cpu, get_m(cpu));
-        break;
-    case 0x9f:
-        alu_sbb(cpu, cpu->reg->a);
-        break;
-
-    // ANA
-    case 0xa0:
-        alu_ana(cpu, cpu->reg->b);
-        break;
-    case 0xa1:
-        alu_ana(cpu, cpu->reg->c);
-        break;
-    case 0xa2:
-        alu_ana(cpu, cpu->reg->d);
-        break;
-    case 0xa3:
-        alu_ana(cpu, cpu->reg->e);
-        break;
-    case 0xa4:
-        alu_ana(cpu, cpu->reg->h);
-        break;
-    case 0xa5:
-        alu_ana(cpu, cpu->reg->l);
-        break;
-    case 0xa6:
-        alu_ana(cpu, get_m(cpu));
-        break;
-    case 0xa7:
-        alu_ana(cpu, cpu->reg->a);
-        break;
-
-    // XRA
-    case 0xa8:
-        alu_xra(cpu, cpu->reg->b);
-        break;
-    case 0xa9:
-        alu_xra(cpu, cpu->reg->c);
-        break;
-    case 0xaa:
-        alu_xra(cpu, cpu->reg->d);
-        break;
-    case 0xab:
-        alu_xra(cpu, cpu->reg->e);
-        break;
-    case 0xac:
-        alu_xra(cpu, cpu->reg->h);
-        break;
-    case 0xad:
-        alu_xra(cpu, cpu->reg->l);
-        break;
-    case 0xae:
-        alu_xra(cpu, get_m(cpu));
-        break;
-    case 0xaf:
-        alu_xra(cpu, cpu->reg->a);
-        break;
-
-    // ORA
-    case 0xb0:
-        alu_ora(cpu, cpu->reg->b);
-        break;
-    case 0xb1:
-        alu_ora(cpu, cpu->reg->c);
-        break;
-    case 0xb2:
-        alu_ora(cpu, cpu->reg->d);
-        break;
-    case 0xb3:
-        alu_ora(cpu, cpu->reg->e);
-        break;
-    case 0xb4:
-        alu_ora(cpu, cpu->reg->h);
-        break;
-    case 0xb5:
-        alu_ora(cpu, cpu->reg->l);
-        break;
-    case 0xb6:
-        alu_ora(cpu, get_m(cpu));
-        break;
-    case 0xb7:
-        alu_ora(cpu, cpu->reg->a);
-        break;
-
-    // CMP
-    case 0xb8:
-        alu_cmp(cpu, cpu->reg->b);
-        break;
-    case 0xb9:
-        alu_cmp(cpu, cpu->reg->c);
-        break;
-    case 0xba:
-        alu_cmp(cpu, cpu->reg->d);
-        break;
-    case 0xbb:
-        alu_cmp(cpu, cpu->reg->e);
-        break;
-    case 0xbc:
-        alu_cmp(cpu, cpu->reg->h);
-        break;
-    case 0xbd:
-        alu_cmp(cpu, cpu->reg->l);
-        break;
-    case 0xbe:
-        alu_cmp(cpu, get_m(cpu));
-        break;
-    case 0xbf:
-        alu_cmp(cpu, cpu->reg->a);
-        break;
-
-    // RLC
-    case 0x07:
-        alu_rlc(cpu);
-        break;
-
-    // RRC
-    case 0x0f:
-        alu_rrc(cpu);
-        break;
-
-    // RAL
-    case 0x17:
-        alu_ral(cpu);
-        break;
-
-    // RAR
-    case 0x1f:
-        alu_rar(cpu);
-        break;
-
-    // PUSH
-    case 0xc5:
-        stack_add(cpu, get_reg_bc(cpu->reg));
-        break;
-    case 0xd5:
-        stack_add(cpu, get_reg_de(cpu->reg));
-        break;
-    case 0xe5:
-        stack_add(cpu, get_reg_hl(cpu->reg));
-        break;
-    case 0xf5:
-        stack_add(cpu, get_reg_af(cpu->reg));
-        break;
-
-    // POP Pop Data Off Stack
-    case 0xc1: {
-        uint16_t val = stack_pop(cpu);
-        set_reg_bc(cpu->reg, val);
-        break;
-    }
-    case 0xd1: {
-        uint16_t val = stack_pop(cpu);
-        set_reg_de(cpu->reg, val);
-        break;
-    }
-    case 0xe1: {
-        uint16_t val = stack_pop(cpu);
-        set_reg_hl(cpu->reg, val);
-        break;
+    cpu->stop = STOP_BUDGET;
+
+    // The last batch may have stopped at a trap, or the host pointed PC at
+    // one.
+    uint32_t cycles = run_traps(cpu, budget);
+
+    if (cpu->stop != STOP_BUDGET || cycles >= budget) {
+        return cycles;
     }
-    case 0xf1: {
-        uint16_t val = stack_pop(cpu);
-        set_reg_af(cpu->reg, val);
-        break;
+
+    // Only the interpreter records a trace or a profile.
+    if (cpu->trace != NULL || cpu->profile != NULL) {
+        return cycles + dispatch_traced(cpu, budget - cycles);
     }
 
-    // DAD
-    case 0x09:
-        alu_dad(cpu, get_reg_bc(cpu->reg));
-        break;
-    case 0x19:
-        alu_dad(cpu, get_reg_de(cpu->reg));
-        break;
-    case 0x29:
-        alu_dad(cpu, get_reg_hl(cpu->reg));
-        break;
-    case 0x39:
-        alu_dad(cpu, cpu->reg->sp);
-        break;
-
-    // INX
-    case 0x03:
-        set_reg_bc(cpu->reg, get_reg_bc(cpu->reg) + 1);
-        break;
-    case 0x13:
-        set_reg_de(cpu->reg, get_reg_de(cpu->reg) + 1);
-        break;
-    case 0x23:
-        set_reg_hl(cpu->reg, get_reg_hl(cpu->reg) + 1);
-        break;
-    case 0x33:
-        cpu->reg->sp = cpu->reg->sp + 1;
-        break;
-
-    // DCX
-    case 0x0b:
-        set_reg_bc(cpu->reg, get_reg_bc(cpu->reg) - 1);
-        break;
-    case 0x1b:
-        set_reg_de(cpu->reg, get_reg_de(cpu->reg) - 1);
-        break;
-    case 0x2b:
-        set_reg_hl(cpu->reg, get_reg_hl(cpu->reg) - 1);
-        break;
-    case 0x3b:
-        cpu->reg->sp = cpu->reg->sp - 1;
-        break;
-
-    // XCHG
-    case 0xeb: {
-        swap_mem(&cpu->reg->h, &cpu->reg->d);
-        swap_mem(&cpu->reg->l, &cpu->reg->e);
-        break;
+    if (cpu->jit != NULL) {
+        return cycles + jit_exec(cpu, budget - cycles);
     }
 
-    // XTHL
-    case 0xe3: {
-        uint16_t val = get_mem_word(cpu->mem, cpu->reg->sp);
-        uint16_t b = get_reg_hl(cpu->reg);
-        set_reg_hl(cpu->reg, val);
-        set_mem_word(cpu->mem, cpu->reg->sp, b);
-        break;
+    if (cpu->bcache != NULL) {
+        return cycles + dispatch_blocks(cpu, budget - cycles);
     }
 
-    // SPHL
-    case 0xf9:
-        cpu->reg->sp = get_reg_hl(cpu->reg);
-        break;
+    return cycles + dispatch(cpu, budget - cycles);
+}
 
-    // LXI
-    case 0x01: {
-        uint16_t val = imm_dw(cpu);
-        set_reg_bc(cpu->reg, val);
-        break;
-    }
-    case 0x11: {
-        uint16_t val = imm_dw(cpu);
-        set_reg_de(cpu->reg, val);
-        break;
-    }
-    case 0x21: {
-        uint16_t val = imm_dw(cpu);
-        set_reg_hl(cpu->reg, val);
-        break;
-    }
-    case 0x31: {
-        uint16_t val = imm_dw(cpu);
-        cpu->reg->sp = val;
-        break;
+uint32_t run_traps(cpu_t* cpu, uint32_t budget)
+{
+    if (cpu == NULL || cpu->traps == NULL) {
+        return 0;
     }
 
-    // MVI
-    case 0x06:
-        cpu->reg->b = imm_ds(cpu);
-        break;
-    case 0x0e:
-        cpu->reg->c = imm_ds(cpu);
-        break;
-    case 0x16:
-        cpu->reg->d = imm_ds(cpu);
-        break;
-    case 0x1e:
-        cpu->reg->e = imm_ds(cpu);
-        break;
-    case 0x26:
-        cpu->reg->h = imm_ds(cpu);
-        break;
-    case 0x2e:
-        cpu->reg->l = imm_ds(cpu);
-        break;
-    case 0x36: {
-        uint8_t val = imm_ds(cpu);
-        set_m(cpu, val);
-        break;
-    }
-    case 0x3e:
-        cpu->reg->a = imm_ds(cpu);
-        break;
-
-    // ADI
-    case 0xc6: {
-        uint8_t val = imm_ds(cpu);
-        alu_add(cpu, val);
-        break;
-    }
+    uint32_t cycles = 0;
+    const trap_t* trap;
 
-    // ACI
-    case 0xce: {
-        uint8_t val = imm_ds(cpu);
-        alu_adc(cpu, val);
-        break;
-    }
+    while (cycles < budget && (trap = traps_find(cpu->traps, cpu->reg->pc)) != NULL) {
+        if (!trap->fire(trap->ctx, cpu->reg, cpu->mem)) {
+            cpu->halted = true;
+            cpu->stop = STOP_HALT;
+            break;
+        }
 
-    // SUI
-    case 0xd6: {
-        uint8_t val = imm_ds(cpu);
-        alu_sub(cpu, val);
-        break;
+        // The RET of the routine the trap stands in for.
+        cpu->reg->pc = stack_pop(cpu->reg, cpu->mem);
+        cycles += OPCODES_CYCLES[0xc9];
     }
 
-    // SBI
-    case 0xde: {
-        uint8_t val = imm_ds(cpu);
-        alu_sbb(cpu, val);
-        break;
-    }
+    return cycles;
+}
 
-    // ANI
-    case 0xe6: {
-        uint8_t val = imm_ds(cpu);
-        alu_ana(cpu, val);
-        break;
+uint32_t step(cpu_t* cpu)
+{
+    if (cpu == NULL) {
+        return 0;
     }
 
-    // XRI
-    case 0xee: {
-        uint8_t val = imm_ds(cpu);
-        alu_xra(cpu, val);
-        break;
-    }
+    uint32_t cycles = exec(cpu);
+    cpu->tick_cycles += cycles;
+    cpu->cycles += cycles;
+    return cycles;
+}
 
-    // ORI
-    case 0xf6: {
-        uint8_t val = imm_ds(cpu);
-        alu_ora(cpu, val);
-        break;
+// Lets the time a halted CPU waits for an interrupt pass, up to the next
+// event and at most `budget` cycles. Returns the cycles that passed.
+static uint32_t idle(cpu_t* cpu, uint32_t budget)
+{
+    if (!cpu->interrupt || cpu->next_event == UINT64_MAX) {
+        return 0;
     }
 
-    // CPI
-    case 0xfe: {
-        uint8_t val = imm_ds(cpu);
-        alu_cmp(cpu, val);
-        break;
-    }
+    uint64_t due = cpu->next_event > cpu->cycles ? cpu->next_event - cpu->cycles : 0;
+    uint32_t cycles = due < budget ? due : budget;
 
-    // STA
-    case 0x32: {
-        uint16_t addr = imm_dw(cpu);
-        set_mem(cpu->mem, addr, cpu->reg->a);
-        break;
-    }
+    cpu->tick_cycles += cycles;
+    cpu->cycles += cycles;
+    return cycles;
+}
 
-    // LDA
-    case 0x3a: {
-        uint16_t addr = imm_dw(cpu);
-        uint8_t val = get_mem(cpu->mem, addr);
-        cpu->reg->a = val;
-        break;
+// Fires the events that are due and returns how many of the `left` cycles
+// can run before the next one.
+static uint32_t run_events(cpu_t* cpu, uint32_t left)
+{
+    if (cpu->events == NULL) {
+        return left;
     }
 
-    // SHLD
-    case 0x22: {
-        uint16_t addr = imm_dw(cpu);
-        set_mem_word(cpu->mem, addr, get_reg_hl(cpu->reg));
-        break;
-    }
+    events_run(cpu->events, cpu->cycles);
+    cpu->next_event = events_next(cpu->events);
+
+    uint64_t due = cpu->next_event - cpu->cycles;
+    return due < left ? due : left;
+}
+
+// Halted, but an event may still interrupt it.
+static bool waiting(const cpu_t* cpu)
+{
+    return cpu->halted && cpu->interrupt && cpu->events != NULL && cpu->next_event != UINT64_MAX;
+}
 
-    // LHLD
-    case 0x2a: {
-        uint16_t addr = imm_dw(cpu);
-        uint8_t val = get_mem_word(cpu->mem, addr);
-        set_reg_hl(cpu->reg, val);
-        break;
+stop_t run_cycles(cpu_t* cpu, uint32_t budget)
+{
+    if (cpu == NULL) {
+        return STOP_BUDGET;
     }
 
-    // PCHL
-    case 0xe9:
-        cpu->reg->pc = get_reg_hl(cpu->reg);
-        break;
-
-    // JUMP
-    case 0xc3:
-    case 0xda:
-    case 0xd2:
-    case 0xca:
-    case 0xc2:
-    case 0xfa:
-    case 0xf2:
-    case 0xea:
-    case 0xe2: {
-        uint8_t addr = imm_dw(cpu);
-        bool condition = false;
-        switch (opcode) {
-        case 0xc3: // JMP
-            condition = true;
-            break;
-        case 0xda: // JC
-            condition = get_reg_flag(cpu->reg, C);
-            break;
-        case 0xd2: // JNC
-            condition = !get_reg_flag(cpu->reg, C);
-            break;
-        case 0xca: // JZ
-            condition = get_reg_flag(cpu->reg, Z);
-            break;
-        case 0xc2: // JNZ
-            condition = !get_reg_flag(cpu->reg, Z);
-            break;
-        case 0xfa: // JM
-            condition = get_reg_flag(cpu->reg, S);
-            break;
-        case 0xf2: // JP
-            condition = !get_reg_flag(cpu->reg, S);
-            break;
-        case 0xea: // JPE
-            condition = get_reg_flag(cpu->reg, P);
-            break;
-        case 0xe2: // JPO
-            condition = !get_reg_flag(cpu->reg, P);
-            break;
-        }
+    uint32_t spent = 0;
 
-        if (condition) {
-            cpu->reg->pc = addr;
-        }
+    do {
+        uint32_t slice = run_events(cpu, budget - spent);
+        uint32_t cycles = cpu->halted ? 0 : exec_batch(cpu, slice);
 
-        break;
-    }
+        cpu->tick_cycles += cycles;
+        cpu->cycles += cycles;
+        spent += cycles;
 
-    // CALL
-    case 0xcd:
-    case 0xdc:
-    case 0xd4:
-    case 0xcc:
-    case 0xc4:
-    case 0xfc:
-    case 0xf4:
-    case 0xec:
-    case 0xe4: {
-        uint16_t val = imm_dw(cpu);
-        bool condition = false;
-        switch (opcode) {
-        case 0xcd: // CALL
-            condition = true;
-            break;
-        case 0xdc: // CC
-            condition = get_reg_flag(cpu->reg, C);
-            break;
-        case 0xd4: // CNC
-            condition = !get_reg_flag(cpu->reg, C);
-            break;
-        case 0xcc: // CZ
-            condition = get_reg_flag(cpu->reg, Z);
-            break;
-        case 0xc4: // CNZ
-            condition = !get_reg_flag(cpu->reg, Z);
-            break;
-        case 0xfc: // CM
-            condition = get_reg_flag(cpu->reg, S);
-            break;
-        case 0xf4: // CP
-            condition = !get_reg_flag(cpu->reg, S);
-            break;
-        case 0xec: // CPE
-            condition = get_reg_flag(cpu->reg, P);
-            break;
-        case 0xe4: // CPO
-            condition = !get_reg_flag(cpu->reg, P);
-            break;
+        if (cpu->halted) {
+            cpu->stop = STOP_HALT;
+            spent += cycles < slice ? idle(cpu, slice - cycles) : 0;
         }
+    } while (spent < budget && (cpu->stop == STOP_BUDGET || waiting(cpu)));
 
-        if (condition) {
-            cycle = 6;
-            stack_add(cpu, cpu->reg->pc);
-            cpu->reg->pc = val;
-        }
+    return cpu->stop;
+}
 
-        break;
+stop_t run_until(cpu_t* cpu, uint32_t budget, bool (*until)(cpu_t* cpu, void* arg), void* arg)
+{
+    if (cpu == NULL || until == NULL) {
+        return STOP_BUDGET;
     }
 
-    // RET
-    case 0xc9:
-    case 0xd8:
-    case 0xd0:
-    case 0xc8:
-    case 0xc0:
-    case 0xf8:
-    case 0xf0:
-    case 0xe8:
-    case 0xe0: {
-        bool condition = false;
-        switch (opcode) {
-        case 0xc9: // RET
-            condition = true;
-            break;
-        case 0xd8: // RC
-            condition = get_reg_flag(cpu->reg, C);
-            break;
-        case 0xd0: // RNC
-            condition = !get_reg_flag(cpu->reg, C);
-            break;
-        case 0xc8: // RZ
-            condition = get_reg_flag(cpu->reg, Z);
-            break;
-        case 0xc0: // RNZ
-            condition = !get_reg_flag(cpu->reg, Z);
-            break;
-        case 0xf8: // RM
-            condition = get_reg_flag(cpu->reg, S);
-            break;
-        case 0xf0: // RP
-            condition = !get_reg_flag(cpu->reg, S);
-            break;
-        case 0xe8: // RPE
-            condition = get_reg_flag(cpu->reg, P);
-            break;
-        case 0xe0: // RPO
-            condition = !get_reg_flag(cpu->reg, P);
-            break;
-        }
+    uint32_t cycles = 0;
+
+    do {
+        uint32_t end = cycles + run_events(cpu, budget - cycles);
+
+        cpu->stop = cpu->halted ? STOP_HALT : STOP_BUDGET;
+
+        // One instruction at a time, as `until` checks after each; the
+        // events are only looked at again once the slice is used up.
+        while (cycles < end && cpu->stop == STOP_BUDGET) {
+            uint32_t spent = exec(cpu);
+
+            // Kept up to date for the trace of the next instruction.
+            cycles += spent;
+            cpu->tick_cycles += spent;
+            cpu->cycles += spent;
 
-        if (condition) {
-            cycle = 6;
-            cpu->reg->pc = stack_pop(cpu);
+            if (cpu->stop == STOP_BUDGET && until(cpu, arg)) {
+                cpu->stop = STOP_BREAK;
+            }
         }
 
-        break;
-    }
+        if (cpu->stop == STOP_HALT && cycles < end) {
+            cycles += idle(cpu, end - cycles);
+        }
+    } while (cycles < budget && (cpu->stop == STOP_BUDGET || waiting(cpu)));
 
-    // RST
-    case 0xc7:
-    case 0xcf:
-    case 0xd7:
-    case 0xdf:
-    case 0xe7:
-    case 0xef:
-    case 0xf7:
-    case 0xff: {
-        stack_add(cpu, cpu->reg->pc);
-        cpu->reg->pc = (uint16_t)(opcode & 0x38);
-		break;
-    }
+    return cpu->stop;
+}
 
-    // Interrupts
-    case 0xfb:
-        cpu->interrupt = true;
-        break;
-    case 0xf3:
-        cpu->interrupt = false;
-        break;
-
-    // I/O - TBD
-    case 0xdb:
-        // port_in()
-        break;
-    case 0xd3:
-        // port_out()
-        break;
-
-    // HLT
-    case 0x76:
-        cpu->halted = true;
-        break;
-
-    default:
-        break;
+bool schedule_event(cpu_t* cpu, uint64_t cycle, void (*fire)(void* ctx, uint64_t cycle), void* ctx)
+{
+    if (cpu == NULL || !events_add(cpu->events, cycle, fire, ctx)) {
+        return false;
     }
 
-    return OPCODES_CYCLES[opcode] + cycle;
+    cpu->next_event = cycle < cpu->next_event ? cycle : cpu->next_event;
+    return true;
 }
 
-uint32_t step(cpu_t* cpu)
+void cancel_event(cpu_t* cpu, void (*fire)(void* ctx, uint64_t cycle), void* ctx)
 {
-    if (cpu == NULL) {
-        return 0;
+    if (cpu == NULL || cpu->events == NULL) {
+        return;
     }
 
-    uint32_t cycles = exec(cpu);
-    cpu->tick_cycles += cycles;
-    return cycles;
+    events_cancel(cpu->events, fire, ctx);
+    cpu->next_event = events_next(cpu->events);
 }
 
 void handle_interrupt(cpu_t* cpu, uint16_t addr)
@@ -1366,8 +845,12 @@ void handle_interrupt(cpu_t* cpu, uint16_t addr)
 
     if (cpu->interrupt) {
         cpu->interrupt = false;
-        stack_add(cpu, cpu->reg->pc);
+        cpu->halted = false;
+        profile_settle(cpu->profile, cpu->reg->pc, cpu->reg->sp, cpu->cycles);
+        stack_add(cpu->reg, cpu->mem, cpu->reg->pc);
         cpu->reg->pc = addr;
+        profile_interrupt(cpu->profile, addr, cpu->reg->sp, cpu->cycles, OPCODES_CYCLES[0xcd]);
         cpu->tick_cycles += OPCODES_CYCLES[0xcd];
+        cpu->cycles += OPCODES_CYCLES[0xcd];
     }
 }
@@ -3,8 +3,16 @@
 
 #include "common.h"
 
+#include "bcache.h"
+#include "event.h"
+#include "flags.h"
+#include "io.h"
+#include "jit.h"
 #include "mem.h"
+#include "profile.h"
 #include "regs.h"
+#include "trace.h"
+#include "trap.h"
 
 static const uint32_t CLOCK_FREQUENCY = 2000000;
 static const uint32_t TICK_TIME = 16;
@@ -30,48 +38,158 @@ static const uint8_t OPCODES_CYCLES[256] = {
     5, 10, 10, 18, 11, 11, 7,  11, 5, 5,  10, 4,  11, 17, 7, 11, // E
     5, 10, 10, 4,  11, 11, 7,  11, 5, 5,  10, 4,  11, 17, 7, 11  // F
 };
+
+static const uint8_t OPCODES_SIZE[256] = {
+	//  0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 0
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 1
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1, // 2
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1, // 3
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 4
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 5
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 6
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 7
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 8
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 9
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // A
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // B
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 3, 3, 3, 2, 1, // C
+    1, 1, 3, 2, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1, // D
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1, // E
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1  // F
+};
 // clang-format on
 
+// Why a batch of instructions stopped.
+typedef enum {
+    STOP_BUDGET = 0, // The cycle budget was used up (also: still running).
+    STOP_HALT, // HLT was executed.
+    STOP_IO, // IN or OUT needs the host, see io_port/io_out.
+    STOP_BREAK, // The run_until() predicate returned true.
+} stop_t;
+
+// The fields the dispatch loops use come first and fit in one cache line;
+// the rest is looked at once per batch at most.
 typedef struct {
     reg_t* reg;
     mem_t* mem;
+    io_t* io; // Port handlers, NULL to trap every IN/OUT to the host.
+    events_t* events; // Event scheduler, NULL if the host keeps next_event itself.
+    traps_t* traps; // Native handlers at guest addresses, NULL if there are none.
+    uint64_t cycles; // Total run through step(), run_cycles() and run_until().
+    uint64_t next_event; // `cycles` at which the next event is due, UINT64_MAX if none.
+    stop_t stop; // Set by the instruction that ended the batch.
     bool halted;
     bool interrupt;
+    uint8_t io_port; // Port of the trapped IN/OUT.
+    bool io_out; // OUT: the value is in A. IN: the host stores the value in A.
+
     uint32_t tick_cycles;
+    bcache_t* bcache; // Predecoded block cache, NULL to decode every instruction.
+    jit_t* jit; // Native code translator, takes precedence over bcache.
+    trace_t* trace; // Execution trace, NULL when not tracing.
+    profile_t* profile; // Guest profiler, NULL when not profiling.
 } cpu_t;
 
+// A machine in one allocation. The hot fields of the CPU take the first
+// cache line, the rest of it and the registers the second, and the page
+// table of the memory starts on the third.
+typedef struct {
+    cpu_t cpu;
+    reg_t reg;
+    mem_t mem __attribute__((aligned(64)));
+} __attribute__((aligned(64))) machine_t;
+
 void init_cpu(cpu_t* cpu, reg_t* reg, mem_t* mem);
 
+// Allocates and initializes a machine; NULL when out of host memory.
+machine_t* machine_create(void);
+void machine_destroy(machine_t* machine);
+
+// Branches a machine: `cpu`, `reg` and `mem` (not initialized, or freed with
+// free_mem()) become a copy of `src` that shares its memory pages until
+// either side writes to one, see mem_clone(). The clone gets no bcache or
+// jit, no events and is neither traced nor profiled; attach new ones if it
+// needs them. It shares the port handlers and the traps.
+bool cpu_clone(cpu_t* cpu, reg_t* reg, mem_t* mem, cpu_t* src);
+
 uint32_t exec(cpu_t* cpu);
+uint32_t exec_batch(cpu_t* cpu, uint32_t budget);
+uint32_t jit_exec(cpu_t* cpu, uint32_t budget);
+
+// Skips the iterations of the loop `spin` that fit in `budget` cycles, with
+// PC at its head, and returns their cycles; 0 if it is not skipped. The
+// block cache and the JIT try it whenever they enter a loop head.
+uint32_t spin_skip(cpu_t* cpu, spin_t* spin, uint32_t budget);
+
+// Runs the trap at PC and any that it returns to, each followed by a RET,
+// until PC is back in guest code, a trap halts the CPU or `budget` cycles
+// have passed. Returns the cycles of the RETs.
+uint32_t run_traps(cpu_t* cpu, uint32_t budget);
 uint32_t step(cpu_t* cpu);
+
+// Batched execution for the host loop. Both count the spent cycles into
+// tick_cycles and return why they stopped; the trapping instruction has
+// already completed, so the host services it and calls them again.
+//
+// run_cycles() runs until `budget` cycles (usually TICK_CYCLES) are used up.
+// run_until() also stops as soon as `until` returns true, which it checks
+// after every instruction, so it is meant for debuggers rather than frames.
+//
+// With cpu->events set, both fire every event as the cycle count reaches
+// it. run_cycles() runs in slices that end at the next event, so the
+// engines need no check of their own beyond the budget they already test;
+// an event scheduled by a port handler ends the batch after the IN/OUT if
+// it is due before the end of it, one scheduled from anywhere else within a
+// batch fires at the end of it.
+//
+// A CPU halted with interrupts enabled is idle until interrupted: both let
+// the cycles up to next_event pass at once, within the budget. With events
+// attached they go on through the events up to the budget, so that one
+// of them can interrupt and wake it; otherwise they return STOP_HALT and
+// leave the interrupt to the host. With nothing scheduled, or halted with
+// interrupts disabled, no cycles pass.
+stop_t run_cycles(cpu_t* cpu, uint32_t budget);
+stop_t run_until(cpu_t* cpu, uint32_t budget, bool (*until)(cpu_t* cpu, void* arg), void* arg);
+
+// Schedules `fire` on cpu->events at cycle count `cycle`, for instance
+// cpu->cycles + 868 for a UART byte; false if there is no room. Callbacks
+// run between instructions and may call handle_interrupt() and schedule
+// again.
+bool schedule_event(cpu_t* cpu, uint64_t cycle, void (*fire)(void* ctx, uint64_t cycle), void* ctx);
+void cancel_event(cpu_t* cpu, void (*fire)(void* ctx, uint64_t cycle), void* ctx);
+
+// Jumps to `addr` if interrupts are enabled, waking the CPU from HLT.
 void handle_interrupt(cpu_t* cpu, uint16_t addr);
 
-uint8_t imm_ds(cpu_t* cpu);
-uint16_t imm_dw(cpu_t* cpu);
-
-uint8_t get_m(cpu_t* cpu);
-void set_m(cpu_t* cpu, uint8_t val);
-
-void stack_add(cpu_t* cpu, uint16_t val);
-uint16_t stack_pop(cpu_t* cpu);
-
-uint8_t alu_inr(cpu_t* cpu, uint8_t val);
-uint8_t alu_dcr(cpu_t* cpu, uint8_t val);
-
-void alu_daa(cpu_t* cpu);
-void alu_add(cpu_t* cpu, uint8_t val);
-void alu_adc(cpu_t* cpu, uint8_t val);
-void alu_sub(cpu_t* cpu, uint8_t val);
-void alu_sbb(cpu_t* cpu, uint8_t val);
-void alu_ana(cpu_t* cpu, uint8_t val);
-void alu_xra(cpu_t* cpu, uint8_t val);
-void alu_ora(cpu_t* cpu, uint8_t val);
-void alu_cmp(cpu_t* cpu, uint8_t val);
-
-void alu_rlc(cpu_t* cpu);
-void alu_rrc(cpu_t* cpu);
-void alu_ral(cpu_t* cpu);
-void alu_rar(cpu_t* cpu);
-void alu_dad(cpu_t* cpu, uint16_t val);
+// Helpers of the opcode handlers, which run on the registers and memory of
+// a machine rather than the machine itself, see dispatch.h.
+uint8_t imm_ds(reg_t* reg, mem_t* mem);
+uint16_t imm_dw(reg_t* reg, mem_t* mem);
+
+uint8_t get_m(reg_t* reg, mem_t* mem);
+void set_m(reg_t* reg, mem_t* mem, uint8_t val);
+
+void stack_add(reg_t* reg, mem_t* mem, uint16_t val);
+uint16_t stack_pop(reg_t* reg, mem_t* mem);
+
+uint8_t alu_inr(reg_t* reg, uint8_t val);
+uint8_t alu_dcr(reg_t* reg, uint8_t val);
+
+void alu_daa(reg_t* reg);
+void alu_add(reg_t* reg, uint8_t val);
+void alu_adc(reg_t* reg, uint8_t val);
+void alu_sub(reg_t* reg, uint8_t val);
+void alu_sbb(reg_t* reg, uint8_t val);
+void alu_ana(reg_t* reg, uint8_t val);
+void alu_xra(reg_t* reg, uint8_t val);
+void alu_ora(reg_t* reg, uint8_t val);
+void alu_cmp(reg_t* reg, uint8_t val);
+
+void alu_rlc(reg_t* reg);
+void alu_rrc(reg_t* reg);
+void alu_ral(reg_t* reg);
+void alu_rar(reg_t* reg);
+void alu_dad(reg_t* reg, uint16_t val);
 
 #endif
@@ -0,0 +1,123 @@
+// Interpreter loop shared by dispatch() and dispatch_traced().
+//
+// This file is included by cpu.c once per variant, with:
+//   DISPATCH the name of the function to define
+//   TRACE()  run after every fetch, with `opcode` and `cycles` up to date
+//   DISPATCH_ATTR attributes of the function
+//   CACHED   1 to run on a copy of the registers, 0 to run on cpu->reg
+//
+// The copy lives in a local that nothing outside the function can reach, so
+// the compiler knows that guest stores leave it alone. Through cpu->reg, it
+// has to load the pointer and the registers again after every store, since a
+// store through a byte pointer might change them. The copy still lives on
+// the stack (CACHED_ATTR keeps GCC from splitting it into scalars, see
+// cpu.c): what it saves is those reloads, not memory accesses as such. It
+// is written back when the batch ends and around port handlers, which may
+// look at the machine; MMIO handlers see the registers as the batch found
+// them.
+
+static DISPATCH_ATTR uint32_t DISPATCH(cpu_t* cpu, uint32_t budget)
+{
+    uint32_t cycles = 0;
+    uint8_t opcode;
+
+#if CACHED
+    reg_t reg = *cpu->reg;
+    mem_t* const mem = cpu->mem;
+
+#define REG (&reg)
+#define MEM mem
+#define SAVE() (*cpu->reg = reg)
+#define LOAD() (reg = *cpu->reg)
+#else
+#define REG cpu->reg
+#define MEM cpu->mem
+#define SAVE()
+#define LOAD()
+#endif
+
+#define IMM8() imm_ds(REG, MEM)
+#define IMM16() imm_dw(REG, MEM)
+#define EXIT                              \
+    {                                     \
+        cycles += OPCODES_CYCLES[opcode]; \
+        goto out;                         \
+    }
+
+// The batch ends if a trap halts the CPU or uses up the budget before it
+// gets back to guest code, which the next batch then starts with.
+#define JUMP                                                                 \
+    {                                                                        \
+        if (cpu->traps != NULL && traps_at(cpu->traps, REG->pc)) {           \
+            SAVE();                                                          \
+            cycles += run_traps(cpu, budget - cycles);                       \
+            LOAD();                                                          \
+            if (cpu->stop != STOP_BUDGET || traps_at(cpu->traps, REG->pc)) { \
+                EXIT;                                                        \
+            }                                                                \
+        }                                                                    \
+        NEXT;                                                                \
+    }
+
+#ifdef THREADED_DISPATCH
+    static const void* const handlers[256] = { HANDLERS };
+
+#define OP(n) op_##n:
+#define ALIAS(n)
+#define NEXT                              \
+    {                                     \
+        cycles += OPCODES_CYCLES[opcode]; \
+        if (cycles >= budget) {           \
+            goto out;                     \
+        }                                 \
+        opcode = IMM8();                  \
+        TRACE();                          \
+        goto* handlers[opcode];           \
+    }
+
+    opcode = IMM8();
+    TRACE();
+    goto* handlers[opcode];
+#else
+#define OP(n) case n:
+#define ALIAS(n) case n:
+#define NEXT                              \
+    {                                     \
+        cycles += OPCODES_CYCLES[opcode]; \
+        if (cycles >= budget) {           \
+            goto out;                     \
+        }                                 \
+        continue;                         \
+    }
+
+    for (;;) {
+        opcode = IMM8();
+        TRACE();
+
+        switch (opcode) {
+#endif
+
+#include "opcodes.h"
+
+#ifndef THREADED_DISPATCH
+        }
+    }
+#endif
+
+#undef IMM8
+#undef IMM16
+#undef OP
+#undef ALIAS
+#undef NEXT
+#undef JUMP
+#undef EXIT
+
+out:
+    SAVE();
+    return cycles;
+}
+
+#undef REG
+#undef MEM
+#undef SAVE
+#undef LOAD
@@ -0,0 +1,122 @@
+#include "event.h"
+
+#include <string.h>
+
+static bool before(const event_t* a, const event_t* b)
+{
+    return a->cycle < b->cycle || (a->cycle == b->cycle && a->seq < b->seq);
+}
+
+static void sift_up(events_t* events, uint32_t i)
+{
+    event_t ev = events->heap[i];
+
+    while (i > 0 && before(&ev, &events->heap[(i - 1) / 2])) {
+        events->heap[i] = events->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+
+    events->heap[i] = ev;
+}
+
+static void sift_down(events_t* events, uint32_t i)
+{
+    event_t ev = events->heap[i];
+
+    for (;;) {
+        uint32_t child = 2 * i + 1;
+
+        if (child >= events->count) {
+            break;
+        }
+
+        if (child + 1 < events->count && before(&events->heap[child + 1], &events->heap[child])) {
+            child++;
+        }
+
+        if (!before(&events->heap[child], &ev)) {
+            break;
+        }
+
+        events->heap[i] = events->heap[child];
+        i = child;
+    }
+
+    events->heap[i] = ev;
+}
+
+void init_events(events_t* events)
+{
+    if (events == NULL) {
+        return;
+    }
+
+    memset(events, 0, sizeof(events_t));
+}
+
+bool events_add(events_t* events, uint64_t cycle, void (*fire)(void* ctx, uint64_t cycle), void* ctx)
+{
+    if (events == NULL || fire == NULL || events->count == EVENTS_MAX) {
+        return false;
+    }
+
+    event_t* ev = &events->heap[events->count];
+
+    ev->cycle = cycle;
+    ev->seq = events->seq++;
+    ev->fire = fire;
+    ev->ctx = ctx;
+    sift_up(events, events->count++);
+    return true;
+}
+
+void events_cancel(events_t* events, void (*fire)(void* ctx, uint64_t cycle), void* ctx)
+{
+    if (events == NULL) {
+        return;
+    }
+
+    uint32_t kept = 0;
+
+    for (uint32_t i = 0; i < events->count; i++) {
+        if (events->heap[i].fire != fire || events->heap[i].ctx != ctx) {
+            events->heap[kept++] = events->heap[i];
+        }
+    }
+
+    if (kept == events->count) {
+        return;
+    }
+
+    // Rebuild the heap from what is left.
+    events->count = kept;
+
+    for (uint32_t i = kept / 2; i-- > 0;) {
+        sift_down(events, i);
+    }
+}
+
+uint64_t events_next(const events_t* events)
+{
+    if (events == NULL || events->count == 0) {
+        return UINT64_MAX;
+    }
+
+    return events->heap[0].cycle;
+}
+
+void events_run(events_t* events, uint64_t now)
+{
+    if (events == NULL) {
+        return;
+    }
+
+    while (events->count > 0 && events->heap[0].cycle <= now) {
+        event_t ev = events->heap[0];
+
+        // Off the heap before it fires, so that the callback can re-arm it.
+        events->heap[0] = events->heap[--events->count];
+        sift_down(events, 0);
+        ev.fire(ev.ctx, ev.cycle);
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include "common.h"
+
+#define EVENTS_MAX 64 // Events pending at once per scheduler.
+
+// Something due at an absolute cycle count, such as an interrupt at
+// mid-frame or a UART byte arriving. `fire` is passed the cycle the event
+// was scheduled for, which may be a little earlier than the CPU's count
+// since batches only stop between instructions; periodic events re-arm
+// from it so that they do not drift.
+typedef struct {
+    uint64_t cycle;
+    uint64_t seq; // Order of scheduling, fires events due at the same cycle first come first served.
+    void (*fire)(void* ctx, uint64_t cycle);
+    void* ctx;
+} event_t;
+
+// Min-heap of pending events, ordered by cycle. Attach one to cpu->events
+// and schedule through schedule_event(), which keeps cpu->next_event up to
+// date; the run loop then fires each event as the cycle count reaches it.
+typedef struct {
+    event_t heap[EVENTS_MAX];
+    uint32_t count;
+    uint64_t seq;
+} events_t;
+
+void init_events(events_t* events);
+
+// False if EVENTS_MAX events are already pending.
+bool events_add(events_t* events, uint64_t cycle, void (*fire)(void* ctx, uint64_t cycle), void* ctx);
+
+// Drops every pending event with this callback and context.
+void events_cancel(events_t* events, void (*fire)(void* ctx, uint64_t cycle), void* ctx);
+
+// Cycle of the earliest pending event, UINT64_MAX if there is none.
+uint64_t events_next(const events_t* events);
+
+// Fires every event due by `now`, earliest first, including those the
+// callbacks schedule for no later than `now`.
+void events_run(events_t* events, uint64_t now);
+
+#endif
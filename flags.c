@@ -0,0 +1,136 @@
+#include "flags.h"
+
+uint8_t flags_szp[256];
+uint8_t flags_add[2][256][256];
+uint8_t flags_sub[2][256][256];
+uint8_t flags_inr[256];
+uint8_t flags_dcr[256];
+uint16_t flags_daa[4][256];
+
+static bool parity(uint8_t val)
+{
+    val ^= val >> 4;
+    val ^= val >> 2;
+    val ^= val >> 1;
+
+    return (val & 1) == 0;
+}
+
+static uint8_t add_flags(uint8_t a, uint8_t val, uint8_t carry)
+{
+    uint16_t sum = a + val + carry;
+    uint8_t res = sum & 0xff;
+
+    return flags_szp[res] | ((a ^ val ^ res) & FLAG_A) | (sum >> 8);
+}
+
+void init_flags(void)
+{
+    static bool ready = false;
+
+    if (ready) {
+        return;
+    }
+
+    for (int i = 0; i < 256; i++) {
+        uint8_t f = FLAG_ALWAYS;
+
+        if (i & 0x80) {
+            f |= FLAG_S;
+        }
+        if (i == 0) {
+            f |= FLAG_Z;
+        }
+        if (parity(i)) {
+            f |= FLAG_P;
+        }
+
+        flags_szp[i] = f;
+    }
+
+    for (int c = 0; c < 2; c++) {
+        for (int a = 0; a < 256; a++) {
+            for (int v = 0; v < 256; v++) {
+                flags_add[c][a][v] = add_flags(a, v, c);
+
+                // The 8080 subtracts by adding the complement, so the
+                // auxiliary carry comes out of that addition while the
+                // carry flag holds the inverted carry (borrow).
+                flags_sub[c][a][v] = add_flags(a, ~v, !c) ^ FLAG_C;
+            }
+        }
+    }
+
+    for (int i = 0; i < 256; i++) {
+        flags_inr[i] = flags_szp[i] | ((i & 0x0f) == 0x00 ? FLAG_A : 0);
+        flags_dcr[i] = flags_szp[i] | ((i & 0x0f) != 0x0f ? FLAG_A : 0);
+    }
+
+    for (int i = 0; i < 4; i++) {
+        bool ac = i & 2;
+        bool cy = i & 1;
+
+        for (int a = 0; a < 256; a++) {
+            uint8_t correction = 0;
+
+            if ((a & 0x0f) > 9 || ac) {
+                correction |= 0x06;
+            }
+
+            if (a > 0x99 || cy) {
+                correction |= 0x60;
+                cy = true;
+            }
+
+            uint8_t res = a + correction;
+            uint8_t f = flags_szp[res] | ((a ^ correction ^ res) & FLAG_A) | (cy ? FLAG_C : 0);
+
+            flags_daa[i][a] = res | (f << 8);
+            cy = i & 1;
+        }
+    }
+
+    ready = true;
+}
+
+#ifdef LAZY_FLAGS
+
+void flags_materialize(reg_t* reg)
+{
+    if (reg == NULL) {
+        return;
+    }
+
+    uint8_t a = reg->lazy_a;
+    uint8_t b = reg->lazy_b;
+
+    switch (reg->lazy) {
+    case LAZY_ADD:
+        reg->f = flags_add[0][a][b];
+        break;
+    case LAZY_ADC:
+        reg->f = flags_add[1][a][b];
+        break;
+    case LAZY_SUB:
+        reg->f = flags_sub[0][a][b];
+        break;
+    case LAZY_SBB:
+        reg->f = flags_sub[1][a][b];
+        break;
+    case LAZY_LOGIC:
+        reg->f = flags_szp[a] | b;
+        break;
+    case LAZY_INR:
+        reg->f = flags_inr[a] | b;
+        break;
+    case LAZY_DCR:
+        reg->f = flags_dcr[a] | b;
+        break;
+    default:
+        break;
+    }
+
+    reg->lazy = LAZY_NONE;
+}
+
+#endif
@@ -0,0 +1,216 @@
+#ifndef __FLAGS_H__
+#define __FLAGS_H__
+
+#include "common.h"
+
+#include "regs.h"
+
+// Flag register layout: S Z 0 A 0 P 1 C
+#define FLAG_S (1 << S)
+#define FLAG_Z (1 << Z)
+#define FLAG_A (1 << A)
+#define FLAG_P (1 << P)
+#define FLAG_C (1 << C)
+#define FLAG_ALWAYS 0x02 // Bit 1 always reads back as 1.
+
+// Precomputed flag bytes. Every table entry is a complete F value, so the ALU
+// only has to look it up and store it.
+extern uint8_t flags_szp[256]; // [result] -> S, Z, P (plus bit 1)
+extern uint8_t flags_add[2][256][256]; // [carry][a][val] -> flags of a + val + carry
+extern uint8_t flags_sub[2][256][256]; // [borrow][a][val] -> flags of a - val - borrow
+extern uint8_t flags_inr[256]; // [result] -> S, Z, A, P (carry untouched)
+extern uint8_t flags_dcr[256]; // [result] -> S, Z, A, P (carry untouched)
+extern uint16_t flags_daa[4][256]; // [ac << 1 | cy][a] -> result | flags << 8
+
+void init_flags(void);
+
+// Flag producers and consumers used by the ALU.
+//
+// By default every producer stores the complete F byte. With LAZY_FLAGS a
+// producer only records the kind of operation and its operands in reg_t,
+// and F is computed from them by the first consumer that needs it; most
+// flags are overwritten before anything reads them. reg->f is only up to
+// date after flags_get() (or get_reg_af()/get_reg_flag()), which keeps the
+// eager representation available for debugging. flags_materialize() brings
+// it up to date before reg_t is copied out; it does nothing without
+// LAZY_FLAGS.
+
+#ifdef LAZY_FLAGS
+
+typedef enum {
+    LAZY_NONE = 0, // reg->f is up to date.
+    LAZY_ADD, // lazy_a + lazy_b
+    LAZY_ADC, // lazy_a + lazy_b + 1
+    LAZY_SUB, // lazy_a - lazy_b
+    LAZY_SBB, // lazy_a - lazy_b - 1
+    LAZY_LOGIC, // result lazy_a, auxiliary carry lazy_b
+    LAZY_INR, // result lazy_a, carry lazy_b
+    LAZY_DCR, // result lazy_a, carry lazy_b
+} lazy_t;
+
+void flags_materialize(reg_t* reg);
+
+static inline uint8_t flags_get(reg_t* reg)
+{
+    if (reg->lazy != LAZY_NONE) {
+        flags_materialize(reg);
+    }
+
+    return reg->f;
+}
+
+static inline uint8_t flags_carry(reg_t* reg)
+{
+    switch (reg->lazy) {
+    case LAZY_NONE:
+        return reg->f & FLAG_C;
+    case LAZY_ADD:
+        return (reg->lazy_a + reg->lazy_b) >> 8;
+    case LAZY_ADC:
+        return (reg->lazy_a + reg->lazy_b + 1) >> 8;
+    case LAZY_SUB:
+        return reg->lazy_a < reg->lazy_b;
+    case LAZY_SBB:
+        return reg->lazy_a <= reg->lazy_b;
+    case LAZY_LOGIC:
+        return 0;
+    default:
+        return reg->lazy_b;
+    }
+}
+
+// Tests the flags in `mask`. S, Z and P only depend on the result, so they
+// are answered without materializing F.
+static inline bool flags_test(reg_t* reg, uint8_t mask)
+{
+    uint8_t res;
+
+    if (reg->lazy == LAZY_NONE) {
+        return (reg->f & mask) != 0;
+    }
+
+    if (mask == FLAG_C) {
+        return flags_carry(reg);
+    }
+
+    if ((mask & (FLAG_A | FLAG_C)) != 0) {
+        return (flags_get(reg) & mask) != 0;
+    }
+
+    switch (reg->lazy) {
+    case LAZY_ADD:
+    case LAZY_ADC:
+        res = reg->lazy_a + reg->lazy_b + (reg->lazy == LAZY_ADC);
+        break;
+    case LAZY_SUB:
+    case LAZY_SBB:
+        res = reg->lazy_a - reg->lazy_b - (reg->lazy == LAZY_SBB);
+        break;
+    default:
+        res = reg->lazy_a;
+        break;
+    }
+
+    return (flags_szp[res] & mask) != 0;
+}
+
+static inline void flags_set(reg_t* reg, uint8_t f)
+{
+    reg->f = f;
+    reg->lazy = LAZY_NONE;
+}
+
+static inline void flags_add_op(reg_t* reg, uint8_t a, uint8_t val, uint8_t carry)
+{
+    reg->lazy = carry ? LAZY_ADC : LAZY_ADD;
+    reg->lazy_a = a;
+    reg->lazy_b = val;
+}
+
+static inline void flags_sub_op(reg_t* reg, uint8_t a, uint8_t val, uint8_t borrow)
+{
+    reg->lazy = borrow ? LAZY_SBB : LAZY_SUB;
+    reg->lazy_a = a;
+    reg->lazy_b = val;
+}
+
+static inline void flags_logic_op(reg_t* reg, uint8_t res, uint8_t ac)
+{
+    reg->lazy = LAZY_LOGIC;
+    reg->lazy_a = res;
+    reg->lazy_b = ac;
+}
+
+static inline void flags_inr_op(reg_t* reg, uint8_t res)
+{
+    uint8_t carry = flags_carry(reg);
+
+    reg->lazy = LAZY_INR;
+    reg->lazy_a = res;
+    reg->lazy_b = carry;
+}
+
+static inline void flags_dcr_op(reg_t* reg, uint8_t res)
+{
+    uint8_t carry = flags_carry(reg);
+
+    reg->lazy = LAZY_DCR;
+    reg->lazy_a = res;
+    reg->lazy_b = carry;
+}
+
+#else
+
+static inline void flags_materialize(reg_t* reg)
+{
+    (void)reg;
+}
+
+static inline uint8_t flags_get(reg_t* reg)
+{
+    return reg->f;
+}
+
+static inline uint8_t flags_carry(reg_t* reg)
+{
+    return reg->f & FLAG_C;
+}
+
+static inline bool flags_test(reg_t* reg, uint8_t mask)
+{
+    return (reg->f & mask) != 0;
+}
+
+static inline void flags_set(reg_t* reg, uint8_t f)
+{
+    reg->f = f;
+}
+
+static inline void flags_add_op(reg_t* reg, uint8_t a, uint8_t val, uint8_t carry)
+{
+    reg->f = flags_add[carry][a][val];
+}
+
+static inline void flags_sub_op(reg_t* reg, uint8_t a, uint8_t val, uint8_t borrow)
+{
+    reg->f = flags_sub[borrow][a][val];
+}
+
+static inline void flags_logic_op(reg_t* reg, uint8_t res, uint8_t ac)
+{
+    reg->f = flags_szp[res] | ac;
+}
+
+static inline void flags_inr_op(reg_t* reg, uint8_t res)
+{
+    reg->f = (reg->f & FLAG_C) | flags_inr[res];
+}
+
+static inline void flags_dcr_op(reg_t* reg, uint8_t res)
+{
+    reg->f = (reg->f & FLAG_C) | flags_dcr[res];
+}
+
+#endif
+
+#endif
@@ -0,0 +1,127 @@
+// Opcode pairs that the block cache runs as one handler (see fused.h):
+// those of the seed list, then the most frequent in the profiles. Generated
+// by fusegen from the seed list and profiles written with emu -p; do not
+// edit.
+
+#ifndef __FUSE_H__
+#define __FUSE_H__
+
+#include "common.h"
+
+#define FUSE_COUNT 32
+
+// clang-format off
+// [pair] -> first and second opcode, with what a seed pair is or the
+// average share of the instructions run that start the pair.
+static const uint8_t FUSE_PAIRS[FUSE_COUNT][2] = {
+    { 0x7e, 0x23 }, // MOV A,M / INX H
+    { 0x23, 0x7e }, // INX H / MOV A,M
+    { 0x7e, 0xb7 }, // MOV A,M / ORA A
+    { 0x77, 0x23 }, // MOV M,A / INX H
+    { 0x7e, 0x12 }, // MOV A,M / STAX D
+    { 0x1a, 0x77 }, // LDAX D / MOV M,A
+    { 0x12, 0x13 }, // STAX D / INX D
+    { 0x23, 0x13 }, // INX H / INX D
+    { 0x5e, 0x23 }, // MOV E,M / INX H
+    { 0x23, 0x56 }, // INX H / MOV D,M
+    { 0xfe, 0xca }, // CPI / JZ
+    { 0xfe, 0xc2 }, // CPI / JNZ
+    { 0xe6, 0xca }, // ANI / JZ
+    { 0xb7, 0xca }, // ORA A / JZ
+    { 0xb7, 0xc2 }, // ORA A / JNZ
+    { 0x3a, 0xb7 }, // LDA / ORA A
+    { 0x0b, 0x78 }, // DCX B / MOV A,B
+    { 0x78, 0xb1 }, // MOV A,B / ORA C
+    { 0xb1, 0xc2 }, // ORA C / JNZ
+    { 0x7a, 0xb3 }, // MOV A,D / ORA E
+    { 0x7c, 0xb5 }, // MOV A,H / ORA L
+    { 0x05, 0xc2 }, // DCR B / JNZ
+    { 0x0d, 0xc2 }, // DCR C / JNZ
+    { 0x21, 0x39 }, // LXI H / DAD SP
+    { 0x39, 0x5e }, // DAD SP / MOV E,M
+    { 0xc5, 0xd5 }, // PUSH B / PUSH D
+    { 0xd5, 0xe5 }, // PUSH D / PUSH H
+    { 0xf5, 0xc5 }, // PUSH PSW / PUSH B
+    { 0xe1, 0xd1 }, // POP H / POP D
+    { 0xd1, 0xc1 }, // POP D / POP B
+    { 0xc1, 0xf1 }, // POP B / POP PSW
+    { 0xe1, 0xc9 }, // POP H / RET
+};
+
+// Entry points of the handlers, in the same order.
+#define FUSE_HANDLERS \
+    &&fused_0, &&fused_1, &&fused_2, &&fused_3, &&fused_4, &&fused_5, &&fused_6, &&fused_7, \
+    &&fused_8, &&fused_9, &&fused_10, &&fused_11, &&fused_12, &&fused_13, &&fused_14, &&fused_15, \
+    &&fused_16, &&fused_17, &&fused_18, &&fused_19, &&fused_20, &&fused_21, &&fused_22, &&fused_23, \
+    &&fused_24, &&fused_25, &&fused_26, &&fused_27, &&fused_28, &&fused_29, &&fused_30, &&fused_31
+// clang-format on
+
+#endif
+
+// The handlers, in dispatch_blocks().
+#ifdef FUSE_INSTANCES
+#define FUSE_INDEX 0
+#include "fused.h"
+#define FUSE_INDEX 1
+#include "fused.h"
+#define FUSE_INDEX 2
+#include "fused.h"
+#define FUSE_INDEX 3
+#include "fused.h"
+#define FUSE_INDEX 4
+#include "fused.h"
+#define FUSE_INDEX 5
+#include "fused.h"
+#define FUSE_INDEX 6
+#include "fused.h"
+#define FUSE_INDEX 7
+#include "fused.h"
+#define FUSE_INDEX 8
+#include "fused.h"
+#define FUSE_INDEX 9
+#include "fused.h"
+#define FUSE_INDEX 10
+#include "fused.h"
+#define FUSE_INDEX 11
+#include "fused.h"
+#define FUSE_INDEX 12
+#include "fused.h"
+#define FUSE_INDEX 13
+#include "fused.h"
+#define FUSE_INDEX 14
+#include "fused.h"
+#define FUSE_INDEX 15
+#include "fused.h"
+#define FUSE_INDEX 16
+#include "fused.h"
+#define FUSE_INDEX 17
+#include "fused.h"
+#define FUSE_INDEX 18
+#include "fused.h"
+#define FUSE_INDEX 19
+#include "fused.h"
+#define FUSE_INDEX 20
+#include "fused.h"
+#define FUSE_INDEX 21
+#include "fused.h"
+#define FUSE_INDEX 22
+#include "fused.h"
+#define FUSE_INDEX 23
+#include "fused.h"
+#define FUSE_INDEX 24
+#include "fused.h"
+#define FUSE_INDEX 25
+#include "fused.h"
+#define FUSE_INDEX 26
+#include "fused.h"
+#define FUSE_INDEX 27
+#include "fused.h"
+#define FUSE_INDEX 28
+#include "fused.h"
+#define FUSE_INDEX 29
+#include "fused.h"
+#define FUSE_INDEX 30
+#include "fused.h"
+#define FUSE_INDEX 31
+#include "fused.h"
+#endif
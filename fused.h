@@ -0,0 +1,49 @@
+// Handler of one fused pair, FUSE_PAIRS[FUSE_INDEX] (see fuse.h), which
+// runs both instructions with no dispatch in between.
+//
+// This file is included by dispatch_blocks() once for each pair, after the
+// handlers of opcodes.h and with NEXT_INSN the NEXT of the loop. Both halves
+// are the handlers of opcodes.h behind a switch on a constant, which the
+// compiler resolves, so the pair is one stretch of straight-line code: what
+// the first instruction computes and the second overwrites unread, such as
+// the flags of `DCR C / DCR D`, is left out as dead code.
+
+#define FUSED_CAT_(a, b) a##b
+#define FUSED_CAT(a, b) FUSED_CAT_(a, b)
+
+#undef OP
+#undef ALIAS
+#undef NEXT
+#define OP(n) case n:
+#define ALIAS(n) case n:
+
+// The first instruction may have overwritten the second.
+#define NEXT                                       \
+    {                                              \
+        if (mem->code_writes != code_writes) {     \
+            goto stale;                            \
+        }                                          \
+        goto FUSED_CAT(fused_second_, FUSE_INDEX); \
+    }
+
+FUSED_CAT(fused_, FUSE_INDEX):
+    opcode = FUSE_PAIRS[FUSE_INDEX][0];
+
+    switch (opcode) {
+#include "opcodes.h"
+    }
+
+FUSED_CAT(fused_second_, FUSE_INDEX):
+#undef NEXT
+#define NEXT NEXT_INSN
+    insn++;
+    reg.pc = insn->next;
+    opcode = FUSE_PAIRS[FUSE_INDEX][1];
+
+    switch (opcode) {
+#include "opcodes.h"
+    }
+
+#undef FUSED_CAT_
+#undef FUSED_CAT
+#undef FUSE_INDEX
@@ -0,0 +1,173 @@
+#include "io.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define IO_RING_IDLE_NS 100000 // Drain thread nap while the ring is empty.
+
+// head and tail count pushed and drained OUTs and only ever grow; each side
+// keeps its counter on a cache line of its own.
+struct io_ring {
+    // Producer.
+    atomic_uint head __attribute__((aligned(64)));
+    unsigned tail_seen; // Last tail read, refreshed only when the ring looks full.
+    atomic_uint_fast64_t dropped;
+
+    // Consumer.
+    atomic_uint tail __attribute__((aligned(64)));
+    atomic_bool stop;
+    void (*drain)(void* ctx, uint8_t port, uint8_t val);
+    void* ctx;
+    pthread_t thread;
+
+    uint16_t slots[IO_RING_SIZE] __attribute__((aligned(64))); // port << 8 | val
+};
+
+void init_io(io_t* io)
+{
+    if (io == NULL) {
+        return;
+    }
+
+    memset(io, 0, sizeof(io_t));
+}
+
+void io_map(io_t* io, uint8_t port, uint8_t (*in)(void* ctx, uint8_t port), void (*out)(void* ctx, uint8_t port, uint8_t val), void* ctx)
+{
+    if (io == NULL) {
+        return;
+    }
+
+    io->port[port].in = in;
+    io->port[port].out = out;
+    io->port[port].ctx = ctx;
+    io->port[port].stable = false;
+}
+
+void io_stable(io_t* io, uint8_t port, bool stable)
+{
+    if (io == NULL) {
+        return;
+    }
+
+    io->port[port].stable = stable;
+}
+
+static void* drain_ring(void* arg)
+{
+    io_ring_t* ring = arg;
+    const struct timespec idle = { 0, IO_RING_IDLE_NS };
+
+    for (;;) {
+        // Read before head, so that whatever was pushed before the stop
+        // request is drained before leaving.
+        bool stop = atomic_load_explicit(&ring->stop, memory_order_acquire);
+        unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+        if (head == tail) {
+            if (stop) {
+                return NULL;
+            }
+
+            nanosleep(&idle, NULL);
+            continue;
+        }
+
+        for (; tail != head; tail++) {
+            uint16_t slot = ring->slots[tail & (IO_RING_SIZE - 1)];
+
+            ring->drain(ring->ctx, slot >> 8, slot & 0xff);
+            atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+        }
+    }
+}
+
+io_ring_t* io_ring_create(void (*drain)(void* ctx, uint8_t port, uint8_t val), void* ctx)
+{
+    if (drain == NULL) {
+        return NULL;
+    }
+
+    io_ring_t* ring = aligned_alloc(64, sizeof(io_ring_t));
+
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->stop, false);
+    ring->tail_seen = 0;
+    ring->drain = drain;
+    ring->ctx = ctx;
+
+    if (pthread_create(&ring->thread, NULL, drain_ring, ring) != 0) {
+        free(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+void io_ring_destroy(io_ring_t* ring)
+{
+    if (ring == NULL) {
+        return;
+    }
+
+    atomic_store_explicit(&ring->stop, true, memory_order_release);
+    pthread_join(ring->thread, NULL);
+    free(ring);
+}
+
+bool io_ring_push(io_ring_t* ring, uint8_t port, uint8_t val)
+{
+    if (ring == NULL) {
+        return false;
+    }
+
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head - ring->tail_seen == IO_RING_SIZE) {
+        ring->tail_seen = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+        if (head - ring->tail_seen == IO_RING_SIZE) {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return false;
+        }
+    }
+
+    ring->slots[head & (IO_RING_SIZE - 1)] = (port << 8) | val;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+uint64_t io_ring_dropped(io_ring_t* ring)
+{
+    if (ring == NULL) {
+        return 0;
+    }
+
+    return atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+}
+
+static void queue_out(void* ctx, uint8_t port, uint8_t val)
+{
+    io_ring_push(ctx, port, val);
+}
+
+void io_queue(io_t* io, uint8_t port, io_ring_t* ring)
+{
+    if (io == NULL || ring == NULL) {
+        return;
+    }
+
+    io->port[port].in = NULL;
+    io->port[port].out = queue_out;
+    io->port[port].ctx = ring;
+}
@@ -0,0 +1,52 @@
+#ifndef __IO_H__
+#define __IO_H__
+
+#include "common.h"
+
+#define IO_PORTS 256
+#define IO_RING_SIZE 4096 // Queued OUTs per ring, a power of two.
+
+// Handlers of one port. IN and OUT on a port without the matching handler
+// stop the batch with STOP_IO for the host loop to service.
+typedef struct {
+    uint8_t (*in)(void* ctx, uint8_t port);
+    void (*out)(void* ctx, uint8_t port, uint8_t val);
+    void* ctx;
+    bool stable; // See io_stable().
+} io_port_t;
+
+// Port handler table. Handlers run on the emulation thread, in the middle
+// of a batch, so they should be quick; slow consumers belong behind a ring.
+// The registers are up to date in cpu->reg while they run.
+typedef struct {
+    io_port_t port[IO_PORTS];
+} io_t;
+
+void init_io(io_t* io);
+void io_map(io_t* io, uint8_t port, uint8_t (*in)(void* ctx, uint8_t port), void (*out)(void* ctx, uint8_t port, uint8_t val), void* ctx);
+
+// Marks the IN handler of `port` as free of side effects, with a value that
+// only changes when an event fires or on an OUT, such as a status port.
+// Loops polling it can then be skipped, see spin.h. io_map() clears it.
+void io_stable(io_t* io, uint8_t port, bool stable);
+
+// Lock-free single-producer/single-consumer queue of OUTs, drained by a host
+// thread of its own that hands them to `drain` in order. The emulation
+// thread never waits on it: an OUT that finds the ring full is dropped and
+// counted.
+typedef struct io_ring io_ring_t;
+
+io_ring_t* io_ring_create(void (*drain)(void* ctx, uint8_t port, uint8_t val), void* ctx);
+
+// Stops the host thread once it has drained everything queued so far.
+void io_ring_destroy(io_ring_t* ring);
+
+// Producer side; false if the ring was full.
+bool io_ring_push(io_ring_t* ring, uint8_t port, uint8_t val);
+uint64_t io_ring_dropped(io_ring_t* ring);
+
+// Makes `port` an output-only port whose OUTs go into `ring`; IN from it
+// traps. Only one thread may run the machines that feed a ring.
+void io_queue(io_t* io, uint8_t port, io_ring_t* ring);
+
+#endif
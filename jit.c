@@ -0,0 +1,1386 @@
+#include "jit.h"
+
+#include <stdlib.h>
+
+#include "cpu.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <string.h>
+#include <sys/mman.h>
+
+#define JIT_ARENA_SIZE (4 << 20)
+#define JIT_BLOCKS 4096 // Direct-mapped, indexed by guest PC.
+#define JIT_BLOCK_INSNS 64
+#define JIT_BLOCK_CODE 8192 // Upper bound of the native size of one block.
+
+#define FLAGS_ALL (FLAG_S | FLAG_Z | FLAG_A | FLAG_P | FLAG_C)
+
+// Why native code returned to jit_exec().
+enum {
+    JIT_EXIT_JUMP, // Left the block for ctx->pc; ctx->patch may be chained to it.
+    JIT_EXIT_INTERP, // The instruction at ctx->pc must be run by the interpreter.
+    JIT_EXIT_BUDGET, // The block at ctx->pc does not fit in the remaining cycles.
+    JIT_EXIT_STALE, // The block at ctx->pc was translated from overwritten code.
+};
+
+// Guest state as seen by native code. Registers are widened to 32 bits so
+// they can be loaded straight into host registers.
+typedef struct {
+    uint32_t a, f, b, c, d, e, h, l;
+    uint32_t sp;
+    uint32_t pc;
+    int32_t remain; // Cycles left in the budget.
+    uint32_t exit;
+    uint8_t* patch; // Site to redirect to the translation of ctx->pc, or NULL.
+    uint8_t** read; // mem->read
+    uint8_t** write; // mem->write
+} jit_ctx_t;
+
+typedef struct {
+    bool valid;
+    uint16_t pc;
+    uint32_t gen;
+    uint8_t* code; // NULL when the first instruction is not translated.
+    spin_t spin; // Loop starting at `pc`, if any; never chained to, so that it can be skipped.
+} jit_block_t;
+
+struct jit {
+    uint8_t* arena; // Executable, and only writable while code is written into it.
+    bool broken; // The arena could not be made executable again; nothing runs natively.
+    size_t used;
+    size_t reset; // Arena offset of the first block, after the trampolines.
+    uint32_t flushes;
+    void (*enter)(jit_ctx_t* ctx, uint8_t* code);
+    uint8_t* leave;
+    mem_t* mem; // Memory the translations were made from.
+    jit_ctx_t ctx;
+    jit_block_t blocks[JIT_BLOCKS];
+};
+
+// -----------------------------------------------------------------------------
+// x86-64 encoder
+// -----------------------------------------------------------------------------
+
+enum {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSP = 4,
+    RBP = 5,
+    RSI = 6,
+    RDI = 7,
+    R8 = 8,
+    R9 = 9,
+    R10 = 10,
+    R11 = 11,
+    R12 = 12,
+    R13 = 13,
+    R14 = 14,
+    R15 = 15,
+};
+
+// Register assignment inside translated code:
+//   r8-r15  guest A, F, B, C, D, E, H, L (zero-extended bytes)
+//   rbx     guest SP
+//   rdi     jit_ctx_t
+//   rsi     mem->read
+//   rdx     mem->write
+//   rax, rcx, rbp scratch; guest memory is addressed as [rcx + rax], with
+//   rcx the page and rax the offset, see page_addr()
+#define H_A R8
+#define H_F R9
+#define H_SP RBX
+#define CTX RDI
+#define READ RSI
+#define WRITE RDX
+
+// 8080 register field (B, C, D, E, H, L, M, A) to host register.
+static const int HOST_REG[8] = { R10, R11, R12, R13, R14, R15, -1, R8 };
+
+// 8080 register pair field (BC, DE, HL, SP) to the host registers of its
+// high and low halves; SP is a single host register.
+static const int HOST_PAIR[4][2] = { { R10, R11 }, { R12, R13 }, { R14, R15 }, { H_SP, -1 } };
+
+// Group 1 ALU operations, in both 8080 (bits 3-5 of 0x80-0xbf) and x86
+// (/digit of 0x80/0x81) order.
+enum {
+    ALU_ADD,
+    ALU_ADC,
+    ALU_SUB,
+    ALU_SBB,
+    ALU_AND,
+    ALU_XOR,
+    ALU_OR,
+    ALU_CMP,
+};
+
+static const uint8_t X86_ALU[8] = { 0, 2, 5, 3, 4, 6, 1, 7 };
+
+typedef struct {
+    uint8_t* p;
+} asm_t;
+
+static void emit8(asm_t* as, uint8_t val)
+{
+    *as->p++ = val;
+}
+
+static void emit32(asm_t* as, uint32_t val)
+{
+    memcpy(as->p, &val, 4);
+    as->p += 4;
+}
+
+static void rex(asm_t* as, bool w, int reg, int index, int rm, bool force)
+{
+    uint8_t val = 0x40 | (w << 3) | ((reg >> 3) & 1) << 2 | ((index >> 3) & 1) << 1 | ((rm >> 3) & 1);
+
+    if (val != 0x40 || force) {
+        emit8(as, val);
+    }
+}
+
+static void modrm(asm_t* as, int mod, int reg, int rm)
+{
+    emit8(as, (mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+// Memory operand [base + disp32]; base must not be rsp/r12.
+static void mem_disp(asm_t* as, int reg, int base, int32_t disp)
+{
+    modrm(as, 2, reg, base);
+    emit32(as, disp);
+}
+
+// Memory operand [base + index]; base must not be rbp/r13.
+static void mem_index(asm_t* as, int reg, int base, int index)
+{
+    modrm(as, 0, reg, 4);
+    emit8(as, ((index & 7) << 3) | (base & 7));
+}
+
+static void mov_rr(asm_t* as, int dst, int src)
+{
+    rex(as, false, src, 0, dst, false);
+    emit8(as, 0x89);
+    modrm(as, 3, src, dst);
+}
+
+static void mov_rr64(asm_t* as, int dst, int src)
+{
+    rex(as, true, src, 0, dst, false);
+    emit8(as, 0x89);
+    modrm(as, 3, src, dst);
+}
+
+static void mov_ri(asm_t* as, int dst, uint32_t imm)
+{
+    rex(as, false, 0, 0, dst, false);
+    emit8(as, 0xb8 + (dst & 7));
+    emit32(as, imm);
+}
+
+// 32-bit register operation with an immediate (x86 group 1 /digit).
+static void alu_ri(asm_t* as, int digit, int dst, uint32_t imm)
+{
+    rex(as, false, 0, 0, dst, false);
+    emit8(as, 0x81);
+    modrm(as, 3, digit, dst);
+    emit32(as, imm);
+}
+
+static void add_rr(asm_t* as, int dst, int src)
+{
+    rex(as, false, src, 0, dst, false);
+    emit8(as, 0x01);
+    modrm(as, 3, src, dst);
+}
+
+static void or_rr(asm_t* as, int dst, int src)
+{
+    rex(as, false, src, 0, dst, false);
+    emit8(as, 0x09);
+    modrm(as, 3, src, dst);
+}
+
+// 8-bit register operation (x86 group 1 /digit). A REX prefix is always
+// emitted so that encodings 4-7 select spl/bpl/sil/dil, never ah-bh.
+static void alu8_rr(asm_t* as, int digit, int dst, int src)
+{
+    rex(as, false, src, 0, dst, true);
+    emit8(as, digit << 3);
+    modrm(as, 3, src, dst);
+}
+
+static void alu8_ri(asm_t* as, int digit, int dst, uint8_t imm)
+{
+    rex(as, false, 0, 0, dst, true);
+    emit8(as, 0x80);
+    modrm(as, 3, digit, dst);
+    emit8(as, imm);
+}
+
+static void incdec8(asm_t* as, int dst, bool dec)
+{
+    rex(as, false, 0, 0, dst, true);
+    emit8(as, 0xfe);
+    modrm(as, 3, dec ? 1 : 0, dst);
+}
+
+static void shl_ri(asm_t* as, int dst, uint8_t n)
+{
+    rex(as, false, 0, 0, dst, false);
+    emit8(as, 0xc1);
+    modrm(as, 3, 4, dst);
+    emit8(as, n);
+}
+
+static void shr_ri(asm_t* as, int dst, uint8_t n)
+{
+    rex(as, false, 0, 0, dst, false);
+    emit8(as, 0xc1);
+    modrm(as, 3, 5, dst);
+    emit8(as, n);
+}
+
+static void bt_ri(asm_t* as, int reg, uint8_t bit)
+{
+    rex(as, false, 0, 0, reg, false);
+    emit8(as, 0x0f);
+    emit8(as, 0xba);
+    modrm(as, 3, 4, reg);
+    emit8(as, bit);
+}
+
+static void test_ri(asm_t* as, int reg, uint32_t imm)
+{
+    rex(as, false, 0, 0, reg, false);
+    emit8(as, 0xf7);
+    modrm(as, 3, 0, reg);
+    emit32(as, imm);
+}
+
+// movzx dst, byte [base + index]
+static void load8(asm_t* as, int dst, int base, int index)
+{
+    rex(as, false, dst, index, base, false);
+    emit8(as, 0x0f);
+    emit8(as, 0xb6);
+    mem_index(as, dst, base, index);
+}
+
+// mov byte [base + index], src
+static void store8(asm_t* as, int base, int index, int src)
+{
+    rex(as, false, src, index, base, true);
+    emit8(as, 0x88);
+    mem_index(as, src, base, index);
+}
+
+static void load32(asm_t* as, int dst, int base, int32_t disp)
+{
+    rex(as, false, dst, 0, base, false);
+    emit8(as, 0x8b);
+    mem_disp(as, dst, base, disp);
+}
+
+static void store32(asm_t* as, int base, int32_t disp, int src)
+{
+    rex(as, false, src, 0, base, false);
+    emit8(as, 0x89);
+    mem_disp(as, src, base, disp);
+}
+
+static void load64(asm_t* as, int dst, int base, int32_t disp)
+{
+    rex(as, true, dst, 0, base, false);
+    emit8(as, 0x8b);
+    mem_disp(as, dst, base, disp);
+}
+
+// mov dst, [base + index * 8]; base must not be rbp/r13.
+static void load64_index(asm_t* as, int dst, int base, int index)
+{
+    rex(as, true, dst, index, base, false);
+    emit8(as, 0x8b);
+    modrm(as, 0, dst, 4);
+    emit8(as, (3 << 6) | ((index & 7) << 3) | (base & 7));
+}
+
+static void test_rr64(asm_t* as, int a, int b)
+{
+    rex(as, true, b, 0, a, false);
+    emit8(as, 0x85);
+    modrm(as, 3, b, a);
+}
+
+static void store64(asm_t* as, int base, int32_t disp, int src)
+{
+    rex(as, true, src, 0, base, false);
+    emit8(as, 0x89);
+    mem_disp(as, src, base, disp);
+}
+
+// Group 1 operation on dword [base + disp32] with an immediate.
+static void alu_mi(asm_t* as, int digit, int base, int32_t disp, uint32_t imm)
+{
+    rex(as, false, 0, 0, base, false);
+    emit8(as, 0x81);
+    mem_disp(as, digit, base, disp);
+    emit32(as, imm);
+}
+
+static void mov_mi(asm_t* as, int base, int32_t disp, uint32_t imm)
+{
+    rex(as, false, 0, 0, base, false);
+    emit8(as, 0xc7);
+    mem_disp(as, 0, base, disp);
+    emit32(as, imm);
+}
+
+// lea dst, [rip + target]
+static void lea_rip(asm_t* as, int dst, uint8_t* target)
+{
+    rex(as, true, dst, 0, 0, false);
+    emit8(as, 0x8d);
+    modrm(as, 0, dst, 5);
+    emit32(as, (uint32_t)(target - (as->p + 4)));
+}
+
+// Condition codes for jcc.
+enum {
+    CC_L = 0x0c,
+    CC_NE = 0x05,
+    CC_E = 0x04,
+};
+
+// Emits a jcc with an unresolved target and returns the rel32 to patch.
+static uint8_t* jcc(asm_t* as, int cc)
+{
+    emit8(as, 0x0f);
+    emit8(as, 0x80 | cc);
+    emit32(as, 0);
+
+    return as->p - 4;
+}
+
+static void jmp(asm_t* as, uint8_t* target)
+{
+    emit8(as, 0xe9);
+    emit32(as, (uint32_t)(target - (as->p + 4)));
+}
+
+static void resolve(uint8_t* rel, uint8_t* target)
+{
+    uint32_t val = (uint32_t)(target - (rel + 4));
+    memcpy(rel, &val, 4);
+}
+
+static void push(asm_t* as, int reg)
+{
+    rex(as, false, 0, 0, reg, false);
+    emit8(as, 0x50 + (reg & 7));
+}
+
+static void pop(asm_t* as, int reg)
+{
+    rex(as, false, 0, 0, reg, false);
+    emit8(as, 0x58 + (reg & 7));
+}
+
+// lahf; movzx eax, ah
+static void flags_to_eax(asm_t* as)
+{
+    emit8(as, 0x9f);
+    emit8(as, 0x0f);
+    emit8(as, 0xb6);
+    emit8(as, 0xc4);
+}
+
+// -----------------------------------------------------------------------------
+// Trampolines
+// -----------------------------------------------------------------------------
+
+#define CTX_OFF(field) ((int32_t)offsetof(jit_ctx_t, field))
+
+static const struct {
+    int host;
+    int32_t off;
+} GUEST_REGS[] = {
+    { H_A, CTX_OFF(a) },
+    { H_F, CTX_OFF(f) },
+    { R10, CTX_OFF(b) },
+    { R11, CTX_OFF(c) },
+    { R12, CTX_OFF(d) },
+    { R13, CTX_OFF(e) },
+    { R14, CTX_OFF(h) },
+    { R15, CTX_OFF(l) },
+    { H_SP, CTX_OFF(sp) },
+};
+
+static const int SAVED_REGS[] = { RBX, RBP, R12, R13, R14, R15 };
+
+#define COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
+// W^X: the arena is mapped writable or executable, never both at once.
+// Every write into it, a translation or a chained exit, is bracketed by
+// these. The whole arena is flipped, so that it stays a single mapping.
+static bool arena_writable(jit_t* jit)
+{
+    return !jit->broken && mprotect(jit->arena, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE) == 0;
+}
+
+static void arena_executable(jit_t* jit)
+{
+    if (mprotect(jit->arena, JIT_ARENA_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        jit->broken = true;
+        jit_flush(jit);
+    }
+}
+
+static void emit_trampolines(jit_t* jit)
+{
+    asm_t as = { jit->arena };
+
+    // enter(ctx, code): save callee-saved registers, load the guest state
+    // and jump to the block.
+    jit->enter = (void (*)(jit_ctx_t*, uint8_t*))(void*)as.p;
+    for (size_t i = 0; i < COUNT(SAVED_REGS); i++) {
+        push(&as, SAVED_REGS[i]);
+    }
+    mov_rr64(&as, RAX, RSI);
+    for (size_t i = 0; i < COUNT(GUEST_REGS); i++) {
+        load32(&as, GUEST_REGS[i].host, CTX, GUEST_REGS[i].off);
+    }
+    load64(&as, READ, CTX, CTX_OFF(read));
+    load64(&as, WRITE, CTX, CTX_OFF(write));
+    emit8(&as, 0xff); // jmp rax
+    emit8(&as, 0xe0);
+
+    // leave: store the guest state and return to jit_exec().
+    jit->leave = as.p;
+    for (size_t i = 0; i < COUNT(GUEST_REGS); i++) {
+        store32(&as, CTX, GUEST_REGS[i].off, GUEST_REGS[i].host);
+    }
+    for (size_t i = COUNT(SAVED_REGS); i > 0; i--) {
+        pop(&as, SAVED_REGS[i - 1]);
+    }
+    emit8(&as, 0xc3);
+
+    jit->reset = as.p - jit->arena;
+    jit->used = jit->reset;
+}
+
+// -----------------------------------------------------------------------------
+// Translator
+// -----------------------------------------------------------------------------
+
+typedef struct {
+    uint8_t opcode;
+    uint16_t imm;
+    uint16_t pc;
+    uint16_t next;
+    bool flags; // Materialize the flags this instruction produces.
+} jit_insn_t;
+
+// Exit stubs are emitted after the block body. `rel` is the jcc to resolve
+// (NULL for a fall-through exit emitted in place).
+typedef struct {
+    uint8_t* rel;
+    uint16_t pc;
+    uint32_t reason;
+    int32_t refund;
+} jit_exit_t;
+
+typedef struct {
+    asm_t as;
+    jit_t* jit;
+    uint8_t* entry;
+    jit_exit_t exits[2 * JIT_BLOCK_INSNS + 4];
+    int nexits;
+} jit_block_asm_t;
+
+static bool is_store(uint8_t op)
+{
+    return (op >= 0x70 && op <= 0x77 && op != 0x76) || op == 0x36 || op == 0x34 || op == 0x35
+        || op == 0x02 || op == 0x12 || op == 0x32;
+}
+
+// Whether the translator handles the opcode; anything else ends the block
+// and runs in the interpreter (stack operations, LHLD/SHLD, I/O, EI/DI,
+// HLT, DAA, calls and returns).
+static bool translatable(uint8_t op)
+{
+    if (op == 0x76) {
+        return false;
+    }
+
+    if ((op >= 0x40 && op <= 0xbf) || (op & 0xc7) == 0x06 || (op & 0xc7) == 0xc6) {
+        return true; // MOV, ALU r/M, MVI, ALU immediate
+    }
+
+    if ((op & 0xc7) == 0x04 || (op & 0xc7) == 0x05) {
+        return true; // INR, DCR
+    }
+
+    if ((op & 0xc7) == 0x00 && op < 0x40) {
+        return true; // NOP and its aliases
+    }
+
+    if (op < 0x40 && ((op & 0x07) == 0x03 || (op & 0x0f) == 0x01 || (op & 0x0f) == 0x09)) {
+        return true; // INX, DCX, LXI, DAD
+    }
+
+    switch (op) {
+    case 0x02: // STAX B
+    case 0x12: // STAX D
+    case 0x0a: // LDAX B
+    case 0x1a: // LDAX D
+    case 0x32: // STA
+    case 0x3a: // LDA
+    case 0x07: // RLC
+    case 0x0f: // RRC
+    case 0x17: // RAL
+    case 0x1f: // RAR
+    case 0x2f: // CMA
+    case 0x37: // STC
+    case 0x3f: // CMC
+    case 0xeb: // XCHG
+    case 0xf9: // SPHL
+    case 0xc3: // JMP
+    case 0xcb:
+        return true;
+    default:
+        return (op & 0xc7) == 0xc2; // Jcc
+    }
+}
+
+static bool is_branch(uint8_t op)
+{
+    return op == 0xc3 || op == 0xcb || (op & 0xc7) == 0xc2;
+}
+
+static uint8_t cond_flag(uint8_t op)
+{
+    static const uint8_t flags[4] = { FLAG_Z, FLAG_C, FLAG_P, FLAG_S };
+
+    return flags[(op >> 4) & 0x03];
+}
+
+// Flags written by an instruction, and flags it reads given whether its own
+// flags are materialized.
+static uint8_t flags_written(uint8_t op)
+{
+    if (op >= 0x80 && op <= 0xbf) {
+        return FLAGS_ALL;
+    }
+
+    if ((op & 0xc7) == 0xc6) {
+        return FLAGS_ALL;
+    }
+
+    if ((op & 0xc7) == 0x04 || (op & 0xc7) == 0x05) {
+        return FLAGS_ALL & ~FLAG_C;
+    }
+
+    if (op < 0x40 && (op & 0x0f) == 0x09) {
+        return FLAG_C; // DAD
+    }
+
+    switch (op) {
+    case 0x07:
+    case 0x0f:
+    case 0x17:
+    case 0x1f:
+    case 0x37:
+    case 0x3f:
+        return FLAG_C;
+    default:
+        return 0;
+    }
+}
+
+static uint8_t flags_read(uint8_t op, bool materialized)
+{
+    if (is_store(op)) {
+        return FLAGS_ALL; // May leave the block before the store.
+    }
+
+    if ((op & 0xc7) == 0xc2) {
+        return cond_flag(op);
+    }
+
+    uint8_t alu = (op >= 0x80 && op <= 0xbf) || (op & 0xc7) == 0xc6 ? (op >> 3) & 0x07 : 0xff;
+    if (alu == ALU_ADC || alu == ALU_SBB) {
+        return FLAG_C;
+    }
+
+    uint8_t partial = flags_written(op);
+    if (partial != 0 && partial != FLAGS_ALL && materialized) {
+        // Only part of F is rewritten, so the rest must be up to date.
+        bool reads_c = op == 0x17 || op == 0x1f || op == 0x3f;
+        return (FLAGS_ALL & ~partial) | (reads_c ? FLAG_C : 0);
+    }
+
+    if (op == 0x17 || op == 0x1f || op == 0x3f) {
+        return FLAG_C;
+    }
+
+    return 0;
+}
+
+static void add_exit(jit_block_asm_t* ba, uint8_t* rel, uint16_t pc, uint32_t reason, int32_t refund)
+{
+    jit_exit_t* ex = &ba->exits[ba->nexits++];
+
+    ex->rel = rel;
+    ex->pc = pc;
+    ex->reason = reason;
+    ex->refund = refund;
+}
+
+// Exit stub. The first instruction is at least five bytes long so that a
+// chainable exit can be overwritten with a direct jump to the next block.
+static void emit_exit(jit_block_asm_t* ba, const jit_exit_t* ex)
+{
+    asm_t* as = &ba->as;
+
+    if (ex->refund != 0) {
+        alu_mi(as, 0, CTX, CTX_OFF(remain), ex->refund);
+    }
+
+    uint8_t* site = as->p;
+    mov_mi(as, CTX, CTX_OFF(pc), ex->pc);
+    mov_mi(as, CTX, CTX_OFF(exit), ex->reason);
+
+    if (ex->reason == JIT_EXIT_JUMP) {
+        lea_rip(as, RAX, site);
+    } else if (ex->reason == JIT_EXIT_STALE) {
+        lea_rip(as, RAX, ba->entry);
+    } else {
+        mov_ri(as, RAX, 0);
+    }
+    store64(as, CTX, CTX_OFF(patch), RAX);
+
+    jmp(as, ba->jit->leave);
+}
+
+// Loads the address held in a register pair into eax.
+static void pair_addr(asm_t* as, int hi, int lo)
+{
+    mov_rr(as, RAX, hi);
+    shl_ri(as, RAX, 8);
+    or_rr(as, RAX, lo);
+}
+
+// Stores the 16-bit value in eax into a register pair.
+static void split_pair(asm_t* as, int hi, int lo)
+{
+    mov_rr(as, lo, RAX);
+    alu_ri(as, 4, lo, 0xff);
+    mov_rr(as, hi, RAX);
+    shr_ri(as, hi, 8);
+    alu_ri(as, 4, hi, 0xff);
+}
+
+// Splits the guest address in eax into rcx = table[eax >> 8], the host
+// pointer of its page, and eax, the offset into it.
+static void page_addr(asm_t* as, int table)
+{
+    mov_rr(as, RCX, RAX);
+    shr_ri(as, RCX, 8);
+    load64_index(as, RCX, table, RCX);
+    alu_ri(as, 4, RAX, MEM_PAGE_SIZE - 1);
+}
+
+// Looks up the guest address in eax for a store, leaving the block if the
+// page has no write pointer: the interpreter then stores through set_mem(),
+// which takes care of copy-on-write, ROM, MMIO and code on the page.
+static void store_guard(jit_block_asm_t* ba, const jit_insn_t* insn, int32_t refund)
+{
+    asm_t* as = &ba->as;
+
+    page_addr(as, WRITE);
+    test_rr64(as, RCX, RCX);
+    add_exit(ba, jcc(as, CC_E), insn->pc, JIT_EXIT_INTERP, refund);
+}
+
+// Looks up the guest address in eax for a load, leaving the block for MMIO
+// pages, which have no read pointer.
+static void load_guard(jit_block_asm_t* ba, const jit_insn_t* insn, int32_t refund)
+{
+    asm_t* as = &ba->as;
+
+    page_addr(as, READ);
+    test_rr64(as, RCX, RCX);
+    add_exit(ba, jcc(as, CC_E), insn->pc, JIT_EXIT_INTERP, refund);
+}
+
+static void emit_alu(jit_block_asm_t* ba, const jit_insn_t* insn, int src, uint8_t imm, bool is_imm)
+{
+    asm_t* as = &ba->as;
+    uint8_t alu = (insn->opcode >> 3) & 0x07;
+
+    if (alu == ALU_AND && insn->flags) {
+        // AND sets the auxiliary carry from bit 3 of either operand.
+        mov_rr(as, RBP, H_A);
+        if (is_imm) {
+            alu_ri(as, 1, RBP, imm);
+        } else {
+            or_rr(as, RBP, src);
+        }
+        alu_ri(as, 4, RBP, 0x08);
+        shl_ri(as, RBP, 1);
+    }
+
+    if (alu == ALU_ADC || alu == ALU_SBB) {
+        bt_ri(as, H_F, 0);
+    }
+
+    if (is_imm) {
+        alu8_ri(as, X86_ALU[alu], H_A, imm);
+    } else {
+        alu8_rr(as, X86_ALU[alu], H_A, src);
+    }
+
+    if (!insn->flags) {
+        return;
+    }
+
+    // lahf leaves S Z 0 A 0 P 1 C in ah, which is exactly the 8080 layout.
+    flags_to_eax(as);
+
+    switch (alu) {
+    case ALU_SUB:
+    case ALU_SBB:
+    case ALU_CMP:
+        // x86 reports a borrow out of bit 3, the 8080 a carry.
+        alu_ri(as, 6, RAX, FLAG_A);
+        break;
+    case ALU_AND:
+        alu_ri(as, 4, RAX, (uint8_t)~FLAG_A);
+        or_rr(as, RAX, RBP);
+        break;
+    case ALU_XOR:
+    case ALU_OR:
+        alu_ri(as, 4, RAX, (uint8_t)~FLAG_A);
+        break;
+    default:
+        break;
+    }
+
+    mov_rr(as, H_F, RAX);
+}
+
+static void emit_incdec_flags(asm_t* as, bool dec)
+{
+    flags_to_eax(as);
+    alu_ri(as, 4, RAX, (uint8_t)~FLAG_C);
+    if (dec) {
+        alu_ri(as, 6, RAX, FLAG_A);
+    }
+    alu_ri(as, 4, H_F, FLAG_C);
+    or_rr(as, H_F, RAX);
+}
+
+static void emit_insn(jit_block_asm_t* ba, const jit_insn_t* insn, int32_t refund)
+{
+    asm_t* as = &ba->as;
+    uint8_t op = insn->opcode;
+
+    if (op >= 0x40 && op <= 0x7f) { // MOV
+        int dst = HOST_REG[(op >> 3) & 0x07];
+        int src = HOST_REG[op & 0x07];
+
+        if (dst < 0) {
+            pair_addr(as, R14, R15);
+            store_guard(ba, insn, refund);
+            store8(as, RCX, RAX, src);
+        } else if (src < 0) {
+            pair_addr(as, R14, R15);
+            load_guard(ba, insn, refund);
+            load8(as, dst, RCX, RAX);
+        } else if (dst != src) {
+            mov_rr(as, dst, src);
+        }
+        return;
+    }
+
+    if (op >= 0x80 && op <= 0xbf) { // ALU r/M
+        int src = HOST_REG[op & 0x07];
+
+        if (src < 0) {
+            pair_addr(as, R14, R15);
+            load_guard(ba, insn, refund);
+            load8(as, RCX, RCX, RAX);
+            src = RCX;
+        }
+
+        emit_alu(ba, insn, src, 0, false);
+        return;
+    }
+
+    if ((op & 0xc7) == 0xc6) { // ALU immediate
+        emit_alu(ba, insn, -1, insn->imm, true);
+        return;
+    }
+
+    if ((op & 0xc7) == 0x06) { // MVI
+        int dst = HOST_REG[(op >> 3) & 0x07];
+
+        if (dst < 0) {
+            pair_addr(as, R14, R15);
+            store_guard(ba, insn, refund);
+            mov_ri(as, RBP, insn->imm & 0xff);
+            store8(as, RCX, RAX, RBP);
+        } else {
+            mov_ri(as, dst, insn->imm & 0xff);
+        }
+        return;
+    }
+
+    if ((op & 0xc7) == 0x04 || (op & 0xc7) == 0x05) { // INR, DCR
+        bool dec = op & 0x01;
+        int dst = HOST_REG[(op >> 3) & 0x07];
+
+        if (dst < 0) {
+            pair_addr(as, R14, R15);
+            store_guard(ba, insn, refund);
+            load8(as, RBP, RCX, RAX);
+            incdec8(as, RBP, dec);
+            store8(as, RCX, RAX, RBP);
+        } else {
+            incdec8(as, dst, dec);
+        }
+
+        if (insn->flags) {
+            emit_incdec_flags(as, dec);
+        }
+        return;
+    }
+
+    if (op < 0x40 && ((op & 0x07) == 0x03 || (op & 0x0f) == 0x01 || (op & 0x0f) == 0x09)) {
+        const int* pair = HOST_PAIR[(op >> 4) & 0x03];
+
+        if ((op & 0x0f) == 0x01) { // LXI
+            if (pair[1] < 0) {
+                mov_ri(as, pair[0], insn->imm);
+            } else {
+                mov_ri(as, pair[0], insn->imm >> 8);
+                mov_ri(as, pair[1], insn->imm & 0xff);
+            }
+        } else if ((op & 0x0f) == 0x09) { // DAD
+            if (pair[1] < 0) {
+                mov_rr(as, RCX, pair[0]);
+            } else {
+                mov_rr(as, RCX, pair[0]);
+                shl_ri(as, RCX, 8);
+                or_rr(as, RCX, pair[1]);
+            }
+            pair_addr(as, R14, R15);
+            add_rr(as, RAX, RCX);
+            if (insn->flags) {
+                mov_rr(as, RCX, RAX);
+                shr_ri(as, RCX, 16);
+                alu_ri(as, 4, H_F, (uint8_t)~FLAG_C);
+                or_rr(as, H_F, RCX);
+            }
+            split_pair(as, R14, R15);
+        } else { // INX, DCX
+            uint32_t step = op & 0x08 ? 0xffff : 1;
+
+            if (pair[1] < 0) {
+                alu_ri(as, 0, pair[0], step);
+                alu_ri(as, 4, pair[0], 0xffff);
+            } else {
+                pair_addr(as, pair[0], pair[1]);
+                alu_ri(as, 0, RAX, step);
+                split_pair(as, pair[0], pair[1]);
+            }
+        }
+        return;
+    }
+
+    switch (op) {
+    case 0x02: // STAX B
+    case 0x12: // STAX D
+        pair_addr(as, op == 0x02 ? R10 : R12, op == 0x02 ? R11 : R13);
+        store_guard(ba, insn, refund);
+        store8(as, RCX, RAX, H_A);
+        break;
+
+    case 0x0a: // LDAX B
+    case 0x1a: // LDAX D
+        pair_addr(as, op == 0x0a ? R10 : R12, op == 0x0a ? R11 : R13);
+        load_guard(ba, insn, refund);
+        load8(as, H_A, RCX, RAX);
+        break;
+
+    case 0x32: // STA
+        load64(as, RCX, WRITE, (insn->imm >> MEM_PAGE_SHIFT) * sizeof(uint8_t*));
+        test_rr64(as, RCX, RCX);
+        add_exit(ba, jcc(as, CC_E), insn->pc, JIT_EXIT_INTERP, refund);
+        mov_ri(as, RAX, insn->imm & (MEM_PAGE_SIZE - 1));
+        store8(as, RCX, RAX, H_A);
+        break;
+
+    case 0x3a: // LDA
+        load64(as, RCX, READ, (insn->imm >> MEM_PAGE_SHIFT) * sizeof(uint8_t*));
+        test_rr64(as, RCX, RCX);
+        add_exit(ba, jcc(as, CC_E), insn->pc, JIT_EXIT_INTERP, refund);
+        mov_ri(as, RAX, insn->imm & (MEM_PAGE_SIZE - 1));
+        load8(as, H_A, RCX, RAX);
+        break;
+
+    case 0x07: // RLC
+        mov_rr(as, RAX, H_A);
+        shr_ri(as, RAX, 7);
+        shl_ri(as, H_A, 1);
+        or_rr(as, H_A, RAX);
+        alu_ri(as, 4, H_A, 0xff);
+        if (insn->flags) {
+            alu_ri(as, 4, H_F, (uint8_t)~FLAG_C);
+            or_rr(as, H_F, RAX);
+        }
+        break;
+
+    case 0x0f: // RRC
+        mov_rr(as, RAX, H_A);
+        alu_ri(as, 4, RAX, 0x01);
+        shr_ri(as, H_A, 1);
+        if (insn->flags) {
+            alu_ri(as, 4, H_F, (uint8_t)~FLAG_C);
+            or_rr(as, H_F, RAX);
+        }
+        shl_ri(as, RAX, 7);
+        or_rr(as, H_A, RAX);
+        break;
+
+    case 0x17: // RAL
+        mov_rr(as, RAX, H_A);
+        shr_ri(as, RAX, 7);
+        mov_rr(as, RCX, H_F);
+        alu_ri(as, 4, RCX, FLAG_C);
+        shl_ri(as, H_A, 1);
+        or_rr(as, H_A, RCX);
+        alu_ri(as, 4, H_A, 0xff);
+        if (insn->flags) {
+            alu_ri(as, 4, H_F, (uint8_t)~FLAG_C);
+            or_rr(as, H_F, RAX);
+        }
+        break;
+
+    case 0x1f: // RAR
+        mov_rr(as, RAX, H_A);
+        alu_ri(as, 4, RAX, 0x01);
+        mov_rr(as, RCX, H_F);
+        alu_ri(as, 4, RCX, FLAG_C);
+        shl_ri(as, RCX, 7);
+        shr_ri(as, H_A, 1);
+        or_rr(as, H_A, RCX);
+        if (insn->flags) {
+            alu_ri(as, 4, H_F, (uint8_t)~FLAG_C);
+            or_rr(as, H_F, RAX);
+        }
+        break;
+
+    case 0x2f: // CMA
+        alu_ri(as, 6, H_A, 0xff);
+        break;
+
+    case 0x37: // STC
+        if (insn->flags) {
+            alu_ri(as, 1, H_F, FLAG_C);
+        }
+        break;
+
+    case 0x3f: // CMC
+        if (insn->flags) {
+            alu_ri(as, 6, H_F, FLAG_C);
+        }
+        break;
+
+    case 0xf9: // SPHL
+        pair_addr(as, R14, R15);
+        mov_rr(as, H_SP, RAX);
+        break;
+
+    case 0xeb: // XCHG
+        mov_rr(as, RAX, R14);
+        mov_rr(as, R14, R12);
+        mov_rr(as, R12, RAX);
+        mov_rr(as, RAX, R15);
+        mov_rr(as, R15, R13);
+        mov_rr(as, R13, RAX);
+        break;
+
+    default: // NOP
+        break;
+    }
+}
+
+static uint8_t* translate(jit_t* jit, mem_t* mem, uint16_t pc)
+{
+    jit_insn_t insns[JIT_BLOCK_INSNS];
+    int count = 0;
+    uint8_t page = pc >> MEM_PAGE_SHIFT;
+    uint32_t limit = (page + 1) << MEM_PAGE_SHIFT;
+    uint32_t cycles = 0;
+    bool branch = false;
+
+    // Decode up to the first branch, untranslated instruction or page end.
+    uint32_t addr = pc;
+    while (count < JIT_BLOCK_INSNS && addr < limit) {
+        uint8_t op = mem_peek(mem, addr);
+        uint8_t size = OPCODES_SIZE[op];
+
+        if (!translatable(op) || addr + size > limit) {
+            break;
+        }
+
+        jit_insn_t* insn = &insns[count++];
+        insn->opcode = op;
+        insn->pc = addr;
+        insn->next = addr + size;
+        insn->imm = 0;
+        if (size == 2) {
+            insn->imm = mem_peek(mem, addr + 1);
+        } else if (size == 3) {
+            insn->imm = mem_peek(mem, addr + 1) | (mem_peek(mem, addr + 2) << 8);
+        }
+
+        cycles += OPCODES_CYCLES[op];
+        addr += size;
+
+        if (is_branch(op)) {
+            branch = true;
+            break;
+        }
+    }
+
+    if (count == 0) {
+        return NULL;
+    }
+
+    // Flag liveness: everything is live when the block is left, and a flag
+    // producer only materializes F if one of its flags is read before being
+    // overwritten.
+    uint8_t live = FLAGS_ALL;
+    for (int i = count - 1; i >= 0; i--) {
+        uint8_t written = flags_written(insns[i].opcode);
+
+        insns[i].flags = (live & written) != 0;
+        live &= ~written;
+        live |= flags_read(insns[i].opcode, insns[i].flags);
+    }
+
+    if (jit->used + JIT_BLOCK_CODE > JIT_ARENA_SIZE) {
+        jit_flush(jit);
+    }
+
+    if (!arena_writable(jit)) {
+        return NULL;
+    }
+
+    jit_block_asm_t ba;
+    ba.jit = jit;
+    ba.as.p = jit->arena + jit->used;
+    ba.entry = ba.as.p;
+    ba.nexits = 0;
+
+    asm_t* as = &ba.as;
+
+    // Entry: leave if the code was overwritten since translation or if the
+    // whole block does not fit in the budget, then charge its cycles.
+    int32_t gen_off = offsetof(mem_t, code_gen) - offsetof(mem_t, write) + page * sizeof(uint32_t);
+    alu_mi(as, 7, WRITE, gen_off, mem->code_gen[page]);
+    add_exit(&ba, jcc(as, CC_NE), pc, JIT_EXIT_STALE, 0);
+    alu_mi(as, 7, CTX, CTX_OFF(remain), cycles);
+    add_exit(&ba, jcc(as, CC_L), pc, JIT_EXIT_BUDGET, 0);
+    alu_mi(as, 5, CTX, CTX_OFF(remain), cycles);
+
+    int32_t refund = cycles;
+    for (int i = 0; i < count; i++) {
+        const jit_insn_t* insn = &insns[i];
+
+        if (is_branch(insn->opcode)) {
+            if (insn->opcode != 0xc3 && insn->opcode != 0xcb) {
+                bool when_set = insn->opcode & 0x08;
+
+                test_ri(as, H_F, cond_flag(insn->opcode));
+                add_exit(&ba, jcc(as, when_set ? CC_NE : CC_E), insn->imm, JIT_EXIT_JUMP, 0);
+                add_exit(&ba, NULL, insn->next, JIT_EXIT_JUMP, 0);
+            } else {
+                add_exit(&ba, NULL, insn->imm, JIT_EXIT_JUMP, 0);
+            }
+            break;
+        }
+
+        emit_insn(&ba, insn, refund);
+        refund -= OPCODES_CYCLES[insn->opcode];
+    }
+
+    if (!branch) {
+        uint16_t next = insns[count - 1].next;
+        bool interp = next < limit; // Stopped at an untranslated instruction.
+
+        add_exit(&ba, NULL, next, interp ? JIT_EXIT_INTERP : JIT_EXIT_JUMP, 0);
+    }
+
+    // The fall-through exit goes first so that it directly follows the body.
+    for (int i = ba.nexits - 1; i >= 0; i--) {
+        if (ba.exits[i].rel == NULL) {
+            emit_exit(&ba, &ba.exits[i]);
+            break;
+        }
+    }
+
+    for (int i = 0; i < ba.nexits; i++) {
+        if (ba.exits[i].rel != NULL) {
+            resolve(ba.exits[i].rel, as->p);
+            emit_exit(&ba, &ba.exits[i]);
+        }
+    }
+
+    jit->used = as->p - jit->arena;
+    arena_executable(jit);
+
+    return jit->broken ? NULL : ba.entry;
+}
+
+static jit_block_t* lookup(jit_t* jit, mem_t* mem, uint16_t pc)
+{
+    if (jit->mem != mem) {
+        jit_flush(jit);
+        jit->mem = mem;
+    }
+
+    jit_block_t* block = &jit->blocks[pc & (JIT_BLOCKS - 1)];
+    uint8_t page = pc >> MEM_PAGE_SHIFT;
+
+    if (block->valid && block->pc == pc && block->gen == mem->code_gen[page]) {
+        return block;
+    }
+
+    block->code = translate(jit, mem, pc);
+    spin_detect(&block->spin, mem, pc);
+    block->valid = true;
+    block->pc = pc;
+    block->gen = mem->code_gen[page];
+    mem_mark_code(mem, page);
+
+    return block;
+}
+
+// Redirects a chainable exit (or the entry of a stale block) to `target`.
+static void chain(jit_t* jit, uint8_t* site, uint8_t* target)
+{
+    asm_t as = { site };
+
+    if (arena_writable(jit)) {
+        jmp(&as, target);
+        arena_executable(jit);
+    }
+}
+
+jit_t* jit_create(void)
+{
+    jit_t* jit = malloc(sizeof(jit_t));
+
+    if (jit == NULL) {
+        return NULL;
+    }
+
+    jit->arena = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->arena == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+
+    jit->broken = false;
+    jit->flushes = 0;
+    jit->mem = NULL;
+    emit_trampolines(jit);
+    jit_flush(jit);
+
+    // Hosts that refuse executable memory written at run time (SELinux
+    // execmem) fail here.
+    if (mprotect(jit->arena, JIT_ARENA_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        munmap(jit->arena, JIT_ARENA_SIZE);
+        free(jit);
+        return NULL;
+    }
+
+    return jit;
+}
+
+void jit_destroy(jit_t* jit)
+{
+    if (jit == NULL) {
+        return;
+    }
+
+    munmap(jit->arena, JIT_ARENA_SIZE);
+    free(jit);
+}
+
+void jit_flush(jit_t* jit)
+{
+    if (jit == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < JIT_BLOCKS; i++) {
+        jit->blocks[i].valid = false;
+    }
+
+    jit->used = jit->reset;
+    jit->flushes++;
+}
+
+// Whether the instruction the interpreter just ran had a port handler
+// schedule an event that is due within the batch, which then ends so that
+// run_cycles() can fire it. Only untranslated instructions do IN and OUT.
+static bool scheduled(const cpu_t* cpu, uint32_t budget)
+{
+    return cpu->events != NULL && cpu->cycles + budget > cpu->next_event;
+}
+
+uint32_t jit_exec(cpu_t* cpu, uint32_t budget)
+{
+    if (cpu == NULL || cpu->jit == NULL) {
+        return 0;
+    }
+
+    jit_t* jit = cpu->jit;
+    jit_ctx_t* ctx = &jit->ctx;
+    reg_t* reg = cpu->reg;
+    uint32_t cycles = 0;
+
+    while (cycles < budget && cpu->stop == STOP_BUDGET) {
+        if (cpu->traps != NULL && traps_at(cpu->traps, reg->pc)) {
+            cycles += run_traps(cpu, budget - cycles);
+            continue;
+        }
+
+        jit_block_t* block = lookup(jit, cpu->mem, reg->pc);
+
+        if (block->spin.kind != SPIN_NONE) {
+            uint32_t skipped = spin_skip(cpu, &block->spin, budget - cycles);
+
+            if (skipped > 0) {
+                cycles += skipped;
+                continue;
+            }
+        }
+
+        if (block->code == NULL) {
+            cycles += exec(cpu);
+
+            if (scheduled(cpu, budget)) {
+                break;
+            }
+            continue;
+        }
+
+        uint32_t left = budget - cycles;
+        int32_t remain = left > INT32_MAX ? INT32_MAX : (int32_t)left;
+
+        ctx->a = reg->a;
+        ctx->f = flags_get(reg);
+        ctx->b = reg->b;
+        ctx->c = reg->c;
+        ctx->d = reg->d;
+        ctx->e = reg->e;
+        ctx->h = reg->h;
+        ctx->l = reg->l;
+        ctx->sp = reg->sp;
+        ctx->remain = remain;
+        ctx->read = cpu->mem->read;
+        ctx->write = cpu->mem->write;
+
+        jit->enter(ctx, block->code);
+
+        reg->a = ctx->a;
+        flags_set(reg, ctx->f);
+        reg->b = ctx->b;
+        reg->c = ctx->c;
+        reg->d = ctx->d;
+        reg->e = ctx->e;
+        reg->h = ctx->h;
+        reg->l = ctx->l;
+        reg->sp = ctx->sp;
+        reg->pc = ctx->pc;
+        cycles += remain - ctx->remain;
+
+        switch (ctx->exit) {
+        case JIT_EXIT_JUMP:
+        case JIT_EXIT_STALE:
+            // A trap has to be seen by the loop above every time.
+            if (ctx->patch != NULL && (cpu->traps == NULL || !traps_at(cpu->traps, reg->pc))) {
+                uint8_t* site = ctx->patch;
+                uint32_t flushes = jit->flushes;
+                jit_block_t* next = lookup(jit, cpu->mem, reg->pc);
+
+                if (next->code != NULL && next->spin.kind == SPIN_NONE && jit->flushes == flushes) {
+                    chain(jit, site, next->code);
+                }
+            }
+            break;
+
+        case JIT_EXIT_INTERP:
+            if (cycles < budget) {
+                cycles += exec(cpu);
+            }
+
+            if (scheduled(cpu, budget)) {
+                return cycles;
+            }
+            break;
+
+        case JIT_EXIT_BUDGET:
+            while (cycles < budget && cpu->stop == STOP_BUDGET) {
+                cycles += exec(cpu);
+            }
+            break;
+        }
+    }
+
+    return cycles;
+}
+
+#else
+
+jit_t* jit_create(void)
+{
+    return NULL;
+}
+
+void jit_destroy(jit_t* jit)
+{
+    (void)jit;
+}
+
+void jit_flush(jit_t* jit)
+{
+    (void)jit;
+}
+
+uint32_t jit_exec(cpu_t* cpu, uint32_t budget)
+{
+    if (cpu == NULL) {
+        return 0;
+    }
+
+    uint32_t cycles = 0;
+
+    while (cycles < budget && cpu->stop == STOP_BUDGET) {
+        cycles += exec(cpu);
+    }
+
+    return cycles;
+}
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include "common.h"
+
+// Dynamic binary translator from 8080 basic blocks to x86-64 code.
+//
+// Only available on x86-64 Linux; elsewhere jit_create() returns NULL and
+// the interpreter is used. The same happens on hosts that refuse to make
+// memory executable once it has been written (SELinux execmem, PaX
+// MPROTECT): the code arena is only ever writable or executable, and is
+// flipped from one to the other around each translation and each chained
+// exit. The translator itself lives behind jit_exec() in cpu.h.
+typedef struct jit jit_t;
+
+jit_t* jit_create(void);
+void jit_destroy(jit_t* jit);
+
+// Drops every translation. Needed after memory is modified behind the
+// back of set_mem() (e.g. loading a new image into mem->data).
+void jit_flush(jit_t* jit);
+
+#endif
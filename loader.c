@@ -0,0 +1,262 @@
+#include "loader.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Longest Intel HEX record: ':', 255 data bytes and 5 bytes of header and
+// checksum, two digits each, plus the line ending.
+#define HEX_LINE (1 + (255 + 5) * 2 + 3)
+
+static bool load_raw(mem_t* mem, const segment_t* seg)
+{
+    int fd = open(seg->path, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0) {
+        return false;
+    }
+
+    // Whatever does not fit below the top of memory is left out.
+    bool ok = fstat(fd, &st) == 0 && st.st_size > 0 && mem_map_file(mem, seg->addr, fd, st.st_size);
+
+    close(fd);
+
+    if (ok && seg->rom) {
+        size_t size = st.st_size;
+        mem_protect(mem, seg->addr, size < MEM_SIZE ? size : MEM_SIZE);
+    }
+
+    return ok;
+}
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+
+    return -1;
+}
+
+// Decodes the hex digits after the ':' of a record into bytes. Returns the
+// number of bytes, or -1 if a character is not a hex digit.
+static int hex_bytes(const char* line, uint8_t* out)
+{
+    int count = 0;
+
+    for (const char* p = line + 1; *p != '\0' && *p != '\r' && *p != '\n'; p += 2) {
+        int hi = hex_digit(p[0]);
+        int lo = hi < 0 ? -1 : hex_digit(p[1]);
+
+        if (lo < 0) {
+            return -1;
+        }
+
+        out[count++] = (hi << 4) | lo;
+    }
+
+    return count;
+}
+
+// Loads an Intel HEX file. `first` receives the address of its first data
+// record and `start` that of its start address record, if it has one.
+static bool load_hex(mem_t* mem, const segment_t* seg, uint16_t* first, bool* has_start, uint16_t* start)
+{
+    FILE* file = fopen(seg->path, "r");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    char line[HEX_LINE + 1];
+    uint8_t rec[(HEX_LINE - 1) / 2];
+    bool touched[MEM_PAGES] = { false };
+    bool have_data = false;
+    bool ok = false;
+    uint32_t base = 0;
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (line[0] == '\r' || line[0] == '\n') {
+            continue;
+        }
+
+        int count = line[0] == ':' ? hex_bytes(line, rec) : -1;
+        if (count < 5 || count != rec[0] + 5) {
+            break;
+        }
+
+        uint8_t sum = 0;
+        for (int i = 0; i < count; i++) {
+            sum += rec[i];
+        }
+
+        if (sum != 0) {
+            break;
+        }
+
+        uint8_t len = rec[0];
+        uint32_t addr = base + ((rec[1] << 8) | rec[2]);
+        uint8_t type = rec[3];
+        const uint8_t* data = &rec[4];
+        uint32_t val = 0;
+
+        for (int i = 0; i < len && i < 4; i++) {
+            val = (val << 8) | data[i];
+        }
+
+        if (type == 0x00) {
+            if (addr + len > MEM_SIZE) {
+                break;
+            }
+
+            if (!mem_load(mem, addr, data, len)) {
+                break;
+            }
+
+            for (uint32_t i = addr; i < addr + len; i++) {
+                touched[i >> MEM_PAGE_SHIFT] = true;
+            }
+
+            if (!have_data) {
+                *first = addr;
+                have_data = true;
+            }
+        } else if (type == 0x01) {
+            ok = true;
+            break;
+        } else if (type == 0x02 && len == 2) {
+            base = val << 4;
+        } else if (type == 0x04 && len == 2) {
+            base = val << 16;
+        } else if (type == 0x03 && len == 4) {
+            val = ((val >> 16) << 4) + (val & 0xffff);
+            if (val >= MEM_SIZE) {
+                break;
+            }
+
+            *start = val;
+            *has_start = true;
+        } else if (type == 0x05 && len == 4) {
+            if (val >= MEM_SIZE) {
+                break;
+            }
+
+            *start = val;
+            *has_start = true;
+        } else {
+            break;
+        }
+    }
+
+    fclose(file);
+
+    for (uint32_t page = 0; page < MEM_PAGES && seg->rom; page++) {
+        if (touched[page]) {
+            mem_protect(mem, page << MEM_PAGE_SHIFT, MEM_PAGE_SIZE);
+        }
+    }
+
+    return ok;
+}
+
+bool load_segments(mem_t* mem, const segment_t* segs, unsigned count, uint16_t* entry)
+{
+    if (mem == NULL || segs == NULL || count == 0) {
+        return false;
+    }
+
+    bool has_start = false;
+    uint16_t start = 0;
+
+    for (unsigned i = 0; i < count; i++) {
+        uint16_t addr = segs[i].addr;
+        bool ok = segs[i].format == IMAGE_HEX ? load_hex(mem, &segs[i], &addr, &has_start, &start) : load_raw(mem, &segs[i]);
+
+        if (!ok) {
+            return false;
+        }
+
+        if (i == 0 && !has_start) {
+            start = addr;
+        }
+    }
+
+    if (entry != NULL) {
+        *entry = start;
+    }
+
+    return true;
+}
+
+unsigned parse_segments(char* spec, segment_t* segs, unsigned max)
+{
+    if (spec == NULL || segs == NULL) {
+        return 0;
+    }
+
+    unsigned count = 0;
+    char* save = NULL;
+
+    for (char* part = strtok_r(spec, "+", &save); part != NULL; part = strtok_r(NULL, "+", &save)) {
+        if (count == max) {
+            return 0;
+        }
+
+        segment_t* seg = &segs[count++];
+        char* opt = strrchr(part, ',');
+        char* at = strrchr(part, '@');
+
+        seg->rom = false;
+        if (opt != NULL) {
+            if (strcmp(opt, ",ro") != 0) {
+                return 0;
+            }
+
+            seg->rom = true;
+            *opt = '\0';
+        }
+
+        if (at != NULL) {
+            char* end = NULL;
+            unsigned long addr = strtoul(at + 1, &end, 16);
+
+            if (end == at + 1 || *end != '\0' || addr >= MEM_SIZE) {
+                return 0;
+            }
+
+            seg->addr = addr;
+            *at = '\0';
+        }
+
+        if (part[0] == '\0') {
+            return 0;
+        }
+
+        const char* ext = strrchr(part, '.');
+
+        seg->path = part;
+        seg->format = IMAGE_RAW;
+        if (ext != NULL && (strcasecmp(ext, ".hex") == 0 || strcasecmp(ext, ".ihx") == 0)) {
+            seg->format = IMAGE_HEX;
+        }
+
+        if (at == NULL) {
+            seg->addr = ext != NULL && strcasecmp(ext, ".com") == 0 ? 0x100 : 0x0000;
+        }
+    }
+
+    return count;
+}
@@ -0,0 +1,36 @@
+#ifndef __LOADER_H__
+#define __LOADER_H__
+
+#include "common.h"
+
+#include "mem.h"
+
+#define LOADER_MAX_SEGMENTS 16
+
+typedef enum {
+    IMAGE_RAW, // Bytes as they are in the file.
+    IMAGE_HEX, // Intel HEX; the records carry their own addresses.
+} image_format_t;
+
+typedef struct {
+    const char* path;
+    image_format_t format;
+    uint16_t addr; // Load address of a raw image.
+    bool rom; // Make the pages the segment covers ROM.
+} segment_t;
+
+// Loads segments in order, later ones overwriting earlier ones where they
+// overlap. Raw images are mapped with mem_map_file(), so that their pages are
+// shared with the page cache and every process running them.
+//
+// `entry` receives the start address: the load address of the first
+// segment, unless a HEX start address record says otherwise.
+bool load_segments(mem_t* mem, const segment_t* segs, unsigned count, uint16_t* entry);
+
+// Parses an image spec of the form SEGMENT[+SEGMENT...], where a SEGMENT is
+// PATH[@ADDR][,ro] with ADDR in hex. .hex and .ihx files are Intel HEX, .com
+// files default to 0100 and anything else to 0000. Paths point into `spec`,
+// which is modified. Returns the number of segments, 0 if the spec is bad.
+unsigned parse_segments(char* spec, segment_t* segs, unsigned max);
+
+#endif
@@ -0,0 +1,856 @@
+#include "lockstep.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// The step function is compiled for AVX-512 (x86-64-v4), AVX2 and the
+// baseline ISA, and the loader picks the best one the host supports.
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__)
+#define LOCKSTEP_TARGETS __attribute__((target_clones("arch=x86-64-v4", "avx2", "default")))
+#else
+#define LOCKSTEP_TARGETS
+#endif
+
+// Kernels are inlined into every clone of step_lanes() so that their loops
+// are vectorized for its ISA too.
+#define KERNEL static inline __attribute__((always_inline))
+
+// Masks hold 0xff for the lanes an instruction runs on and 0x00 for the
+// others. Kernels compute every lane and keep the old value where the mask
+// is clear, which the compiler turns into blends rather than branches.
+#define EACH_LANE(i) for (unsigned i = 0; i < LOCKSTEP_LANES; i++)
+
+lockstep_t* lockstep_create(void)
+{
+    lockstep_t* ls = aligned_alloc(64, sizeof(lockstep_t));
+    mem_t* mem = calloc(LOCKSTEP_LANES, sizeof(mem_t));
+
+    if (ls == NULL || mem == NULL) {
+        free(mem);
+        free(ls);
+        return NULL;
+    }
+
+    ls->mem = mem;
+    memset(ls->cycles, 0, sizeof(ls->cycles));
+    memset(ls->halted, 0, sizeof(ls->halted));
+    memset(ls->shared, 0, sizeof(ls->shared));
+
+    for (unsigned i = 0; i < LOCKSTEP_LANES; i++) {
+        if (!init_mem(&ls->mem[i])) {
+            lockstep_destroy(ls);
+            return NULL;
+        }
+
+        init_reg(&ls->regs[i]);
+        init_cpu(&ls->cpu[i], &ls->regs[i], &ls->mem[i]);
+        lockstep_set_reg(ls, i, &ls->regs[i]);
+    }
+
+    return ls;
+}
+
+void lockstep_destroy(lockstep_t* ls)
+{
+    if (ls == NULL) {
+        return;
+    }
+
+    for (unsigned i = 0; i < LOCKSTEP_LANES; i++) {
+        free_mem(&ls->mem[i]);
+    }
+
+    free(ls->mem);
+    free(ls);
+}
+
+void lockstep_reset(lockstep_t* ls)
+{
+    if (ls == NULL) {
+        return;
+    }
+
+    memset(ls->cycles, 0, sizeof(ls->cycles));
+    memset(ls->halted, 0, sizeof(ls->halted));
+
+    for (unsigned i = 0; i < LOCKSTEP_LANES; i++) {
+        ls->cpu[i].halted = false;
+        ls->cpu[i].interrupt = false;
+    }
+}
+
+void lockstep_set_reg(lockstep_t* ls, unsigned lane, reg_t* reg)
+{
+    if (ls == NULL || reg == NULL || lane >= LOCKSTEP_LANES) {
+        return;
+    }
+
+    lanes_reg_t* r = &ls->reg;
+
+    r->a[lane] = reg->a;
+    r->f[lane] = flags_get(reg);
+    r->b[lane] = reg->b;
+    r->c[lane] = reg->c;
+    r->d[lane] = reg->d;
+    r->e[lane] = reg->e;
+    r->h[lane] = reg->h;
+    r->l[lane] = reg->l;
+    r->sp[lane] = reg->sp;
+    r->pc[lane] = reg->pc;
+}
+
+void lockstep_get_reg(lockstep_t* ls, unsigned lane, reg_t* reg)
+{
+    if (ls == NULL || reg == NULL || lane >= LOCKSTEP_LANES) {
+        return;
+    }
+
+    lanes_reg_t* r = &ls->reg;
+
+    reg->a = r->a[lane];
+    flags_set(reg, r->f[lane]);
+    reg->b = r->b[lane];
+    reg->c = r->c[lane];
+    reg->d = r->d[lane];
+    reg->e = r->e[lane];
+    reg->h = r->h[lane];
+    reg->l = r->l[lane];
+    reg->sp = r->sp[lane];
+    reg->pc = r->pc[lane];
+}
+
+// Finds the pages whose contents are the same in every lane. They are also
+// flagged as code pages, so that set_mem() reports writes to them.
+static void share_pages(lockstep_t* ls)
+{
+    for (unsigned page = 0; page < MEM_PAGES; page++) {
+        const uint8_t* first = ls->mem[0].read[page];
+        bool same = first != NULL;
+
+        // Lanes cloned from one machine still point at the same page.
+        for (unsigned i = 1; i < LOCKSTEP_LANES && same; i++) {
+            const uint8_t* data = ls->mem[i].read[page];
+
+            same = data == first || (data != NULL && memcmp(first, data, MEM_PAGE_SIZE) == 0);
+        }
+
+        ls->shared[page] = same;
+
+        for (unsigned i = 0; i < LOCKSTEP_LANES && same; i++) {
+            mem_mark_code(&ls->mem[i], page);
+        }
+    }
+}
+
+// Runs one instruction of one lane through the scalar interpreter.
+static void run_scalar(lockstep_t* ls, unsigned lane)
+{
+    cpu_t* cpu = &ls->cpu[lane];
+    uint32_t code_writes = cpu->mem->code_writes;
+
+    lockstep_get_reg(ls, lane, cpu->reg);
+    ls->cycles[lane] += exec(cpu);
+
+    // set_mem() clears the code flag of a page it writes to.
+    if (cpu->mem->code_writes != code_writes) {
+        for (unsigned page = 0; page < MEM_PAGES; page++) {
+            ls->shared[page] &= cpu->mem->code_page[page];
+        }
+    }
+
+    if (cpu->stop == STOP_IO && !cpu->io_out) {
+        cpu->reg->a = 0xff;
+    }
+
+    if (cpu->halted) {
+        ls->halted[lane] = 0xff;
+    }
+
+    lockstep_set_reg(ls, lane, cpu->reg);
+}
+
+// Blends written with masks rather than `?:`, which would make the
+// compiler guard the loads of the lanes not taken.
+KERNEL uint8_t pick8(uint8_t m, uint8_t val, uint8_t old)
+{
+    return (val & m) | (old & ~m);
+}
+
+KERNEL uint16_t pick16(uint8_t m, uint16_t val, uint16_t old)
+{
+    uint16_t wide = (int8_t)m;
+
+    return (val & wide) | (old & ~wide);
+}
+
+KERNEL uint8_t szp(uint8_t res)
+{
+    uint8_t p = res ^ (res >> 4);
+
+    p ^= p >> 2;
+    p ^= p >> 1;
+
+    return (res & FLAG_S) | (res == 0 ? FLAG_Z : 0) | ((~p & 1) << P) | FLAG_ALWAYS;
+}
+
+// ADD, ADC, SUB, SBB or CMP (`keep` leaves A alone), with the flags laid out
+// like flags_add[] and flags_sub[]. Subtraction adds the complement and
+// inverts the carry, like the 8080 does.
+KERNEL void arith(lanes_reg_t* r, const uint8_t* m, const uint8_t* val, bool carry, bool sub, bool keep)
+{
+    EACH_LANE(i)
+    {
+        uint8_t a = r->a[i];
+        uint8_t v = sub ? ~val[i] : val[i];
+        uint8_t c = (carry ? r->f[i] & FLAG_C : 0) ^ (sub ? 1 : 0);
+        uint16_t sum = a + v + c;
+        uint8_t res = sum;
+        uint8_t f = szp(res) | ((a ^ v ^ res) & FLAG_A) | ((sum >> 8) ^ (sub ? FLAG_C : 0));
+
+        r->f[i] = pick8(m[i], f, r->f[i]);
+        if (!keep) {
+            r->a[i] = pick8(m[i], res, r->a[i]);
+        }
+    }
+}
+
+// ANA (4), XRA (5) or ORA (6).
+KERNEL void logic(lanes_reg_t* r, const uint8_t* m, const uint8_t* val, uint8_t kind)
+{
+    EACH_LANE(i)
+    {
+        uint8_t a = r->a[i];
+        uint8_t res = kind == 4 ? a & val[i] : kind == 5 ? a ^ val[i] : a | val[i];
+        uint8_t f = szp(res);
+
+        // AND sets the auxiliary carry from bit 3 of either operand.
+        if (kind == 4) {
+            f |= ((a | val[i]) & 0x08) << 1;
+        }
+
+        r->f[i] = pick8(m[i], f, r->f[i]);
+        r->a[i] = pick8(m[i], res, r->a[i]);
+    }
+}
+
+// ALU operation in bits 3-5 of the opcode.
+KERNEL void alu(lanes_reg_t* r, const uint8_t* m, uint8_t op, const uint8_t* val)
+{
+    switch ((op >> 3) & 0x07) {
+    case 0:
+        arith(r, m, val, false, false, false);
+        break;
+    case 1:
+        arith(r, m, val, true, false, false);
+        break;
+    case 2:
+        arith(r, m, val, false, true, false);
+        break;
+    case 3:
+        arith(r, m, val, true, true, false);
+        break;
+    case 4:
+        logic(r, m, val, 4);
+        break;
+    case 5:
+        logic(r, m, val, 5);
+        break;
+    case 6:
+        logic(r, m, val, 6);
+        break;
+    default:
+        arith(r, m, val, false, true, true);
+        break;
+    }
+}
+
+// INR or DCR of `val`; the carry is left alone.
+KERNEL void inc(lanes_reg_t* r, const uint8_t* m, uint8_t* val, bool dec)
+{
+    EACH_LANE(i)
+    {
+        uint8_t res = dec ? val[i] - 1 : val[i] + 1;
+        uint8_t half = dec ? (res & 0x0f) != 0x0f : (res & 0x0f) == 0x00;
+        uint8_t f = szp(res) | (r->f[i] & FLAG_C) | (half ? FLAG_A : 0);
+
+        r->f[i] = pick8(m[i], f, r->f[i]);
+        val[i] = pick8(m[i], res, val[i]);
+    }
+}
+
+// RLC, RRC, RAL or RAR.
+KERNEL void rotate(lanes_reg_t* r, const uint8_t* m, uint8_t op)
+{
+    EACH_LANE(i)
+    {
+        uint8_t a = r->a[i];
+        uint8_t carry = r->f[i] & FLAG_C;
+        uint8_t out = op == 0x07 || op == 0x17 ? a >> 7 : a & 0x01;
+        uint8_t res;
+
+        if (op == 0x07) {
+            res = (a << 1) | out;
+        } else if (op == 0x0f) {
+            res = (a >> 1) | (out << 7);
+        } else if (op == 0x17) {
+            res = (a << 1) | carry;
+        } else {
+            res = (a >> 1) | (carry << 7);
+        }
+
+        r->f[i] = pick8(m[i], (r->f[i] & ~FLAG_C) | out, r->f[i]);
+        r->a[i] = pick8(m[i], res, r->a[i]);
+    }
+}
+
+// Lanes of `m` where the condition of a conditional jump, call or return
+// holds, as cond() in cpu.c evaluates it.
+KERNEL void taken(uint8_t* t, const lanes_reg_t* r, const uint8_t* m, uint8_t op)
+{
+    static const uint8_t flags[4] = { FLAG_Z, FLAG_C, FLAG_P, FLAG_S };
+
+    uint8_t flag = flags[(op >> 4) & 0x03];
+    uint8_t want = (op & 0x08) ? flag : 0;
+
+    EACH_LANE(i)
+    {
+        t[i] = m[i] & -((r->f[i] & flag) == want);
+    }
+}
+
+// Register operand of an opcode field (B C D E H L - A); M has no register.
+KERNEL uint8_t* operand(lanes_reg_t* r, uint8_t field)
+{
+    uint8_t* regs[8] = { r->b, r->c, r->d, r->e, r->h, r->l, NULL, r->a };
+
+    return regs[field & 0x07];
+}
+
+KERNEL void pair(uint16_t* val, const uint8_t* hi, const uint8_t* lo)
+{
+    EACH_LANE(i)
+    {
+        val[i] = (hi[i] << 8) | lo[i];
+    }
+}
+
+// Writes `val` into the pair `hi` and `lo` on the lanes of `m`.
+KERNEL void split(uint8_t* hi, uint8_t* lo, const uint8_t* m, const uint16_t* val)
+{
+    EACH_LANE(i)
+    {
+        hi[i] = pick8(m[i], val[i] >> 8, hi[i]);
+        lo[i] = pick8(m[i], val[i] & 0xff, lo[i]);
+    }
+}
+
+KERNEL void set8(uint8_t* dst, const uint8_t* m, const uint8_t* val)
+{
+    EACH_LANE(i)
+    {
+        dst[i] = pick8(m[i], val[i], dst[i]);
+    }
+}
+
+KERNEL void set16(uint16_t* dst, const uint8_t* m, const uint16_t* val)
+{
+    EACH_LANE(i)
+    {
+        dst[i] = pick16(m[i], val[i], dst[i]);
+    }
+}
+
+KERNEL void load(lockstep_t* ls, uint8_t* val, const uint16_t* addr)
+{
+    EACH_LANE(i)
+    {
+        val[i] = mem_peek(&ls->mem[i], addr[i]);
+    }
+}
+
+// Stores go through set_mem() so that code tracking stays right.
+KERNEL void store(lockstep_t* ls, const uint8_t* m, const uint16_t* addr, const uint8_t* val)
+{
+    EACH_LANE(i)
+    {
+        if (m[i]) {
+            set_mem(&ls->mem[i], addr[i], val[i]);
+            ls->shared[addr[i] >> MEM_PAGE_SHIFT] = false;
+        }
+    }
+}
+
+// PUSH on the lanes of `m`, storing the low byte first like set_mem_word().
+KERNEL void push(lockstep_t* ls, const uint8_t* m, const uint16_t* val)
+{
+    uint16_t* sp = ls->reg.sp;
+
+    EACH_LANE(i)
+    {
+        if (m[i]) {
+            sp[i] -= 2;
+            set_mem(&ls->mem[i], sp[i], val[i] & 0xff);
+            set_mem(&ls->mem[i], (uint16_t)(sp[i] + 1), val[i] >> 8);
+            ls->shared[sp[i] >> MEM_PAGE_SHIFT] = false;
+            ls->shared[(uint16_t)(sp[i] + 1) >> MEM_PAGE_SHIFT] = false;
+        }
+    }
+}
+
+// POP on the lanes of `m`; `val` is only meaningful in those lanes.
+KERNEL void pop(lockstep_t* ls, const uint8_t* m, uint16_t* val)
+{
+    uint16_t* sp = ls->reg.sp;
+
+    EACH_LANE(i)
+    {
+        val[i] = mem_peek(&ls->mem[i], sp[i]) | (mem_peek(&ls->mem[i], sp[i] + 1) << 8);
+        sp[i] += m[i] & 2;
+    }
+}
+
+KERNEL bool vectorized(uint8_t op)
+{
+#ifdef LOCKSTEP_SCALAR
+    (void)op;
+    return false;
+#else
+    if (op >= 0x40 && op < 0xc0) {
+        return op != 0x76; // MOV and ALU, but not HLT
+    }
+
+    if (op >= 0xc0) {
+        switch (op & 0x07) {
+        case 0x00: // Rcc
+        case 0x02: // Jcc
+        case 0x04: // Ccc
+        case 0x06: // ALU immediate
+        case 0x07: // RST
+            return true;
+        case 0x01: // POP, RET, PCHL, SPHL
+            return true;
+        case 0x03: // JMP, XCHG
+            return op == 0xc3 || op == 0xcb || op == 0xeb;
+        default: // PUSH and CALL
+            return (op & 0x0f) == 0x05 || (op & 0x0f) == 0x0d;
+        }
+    }
+
+    switch (op & 0x07) {
+    case 0x00: // NOP and its aliases
+    case 0x01: // LXI, DAD
+    case 0x02: // STAX, SHLD, STA, LDAX, LHLD, LDA
+    case 0x03: // INX, DCX
+        return true;
+    case 0x07: // Rotates, CMA, STC, CMC; DAA stays scalar
+        return op != 0x27;
+    default: // INR, DCR, MVI
+        return true;
+    }
+#endif
+}
+
+// Runs one instruction on the lanes of `m` with the vector kernels and
+// accounts its cycles. `code` is the memory to fetch the operands at `pc`
+// from when the instruction is on a shared page, NULL to fetch them lane by
+// lane.
+KERNEL void run_vector(lockstep_t* ls, const uint8_t* m, uint8_t op, const mem_t* code, uint16_t pc)
+{
+    lanes_reg_t* r = &ls->reg;
+    uint16_t next[LOCKSTEP_LANES];
+    uint16_t addr[LOCKSTEP_LANES];
+    uint16_t word[LOCKSTEP_LANES];
+    uint8_t val[LOCKSTEP_LANES];
+    uint8_t hi[LOCKSTEP_LANES];
+    uint8_t t[LOCKSTEP_LANES]; // Lanes that took a conditional call or return.
+
+    EACH_LANE(i)
+    {
+        next[i] = r->pc[i] + OPCODES_SIZE[op];
+        t[i] = 0;
+    }
+
+    if (code != NULL) {
+        uint8_t lo = mem_peek(code, pc + 1);
+        uint16_t imm = lo | (mem_peek(code, pc + 2) << 8);
+
+        EACH_LANE(i)
+        {
+            val[i] = lo;
+            addr[i] = imm;
+        }
+    } else if (OPCODES_SIZE[op] > 1) {
+        EACH_LANE(i)
+        {
+            addr[i] = r->pc[i] + 1;
+        }
+        load(ls, val, addr);
+
+        if (OPCODES_SIZE[op] > 2) {
+            EACH_LANE(i)
+            {
+                addr[i] = r->pc[i] + 2;
+            }
+            load(ls, hi, addr);
+            pair(addr, hi, val);
+        }
+    }
+
+    switch (op) {
+    // LDAX, STAX, LDA, STA, SHLD
+    case 0x02:
+        pair(word, r->b, r->c);
+        store(ls, m, word, r->a);
+        break;
+    case 0x12:
+        pair(word, r->d, r->e);
+        store(ls, m, word, r->a);
+        break;
+    case 0x0a:
+        pair(word, r->b, r->c);
+        load(ls, val, word);
+        set8(r->a, m, val);
+        break;
+    case 0x1a:
+        pair(word, r->d, r->e);
+        load(ls, val, word);
+        set8(r->a, m, val);
+        break;
+    case 0x32:
+        store(ls, m, addr, r->a);
+        break;
+    case 0x3a:
+        load(ls, val, addr);
+        set8(r->a, m, val);
+        break;
+    case 0x22:
+        store(ls, m, addr, r->l);
+        EACH_LANE(i)
+        {
+            addr[i] += 1;
+        }
+        store(ls, m, addr, r->h);
+        break;
+    case 0x2a:
+        load(ls, val, addr);
+        set8(r->l, m, val);
+        EACH_LANE(i)
+        {
+            addr[i] += 1;
+        }
+        load(ls, val, addr);
+        set8(r->h, m, val);
+        break;
+
+    // Stack pointer
+    case 0x31:
+        set16(r->sp, m, addr);
+        break;
+    case 0x33:
+    case 0x3b:
+        EACH_LANE(i)
+        {
+            r->sp[i] += pick16(m[i], op == 0x33 ? 1 : -1, 0);
+        }
+        break;
+    case 0xf9:
+        pair(word, r->h, r->l);
+        set16(r->sp, m, word);
+        break;
+
+    case 0xeb:
+        EACH_LANE(i)
+        {
+            uint8_t h = r->h[i];
+            uint8_t l = r->l[i];
+
+            r->h[i] = pick8(m[i], r->d[i], h);
+            r->l[i] = pick8(m[i], r->e[i], l);
+            r->d[i] = pick8(m[i], h, r->d[i]);
+            r->e[i] = pick8(m[i], l, r->e[i]);
+        }
+        break;
+
+    case 0x07:
+    case 0x0f:
+    case 0x17:
+    case 0x1f:
+        rotate(r, m, op);
+        break;
+    case 0x2f:
+        EACH_LANE(i)
+        {
+            r->a[i] ^= m[i];
+        }
+        break;
+    case 0x37:
+        EACH_LANE(i)
+        {
+            r->f[i] |= m[i] & FLAG_C;
+        }
+        break;
+    case 0x3f:
+        EACH_LANE(i)
+        {
+            r->f[i] ^= m[i] & FLAG_C;
+        }
+        break;
+
+    // Jumps, calls and returns
+    case 0xe9:
+        pair(next, r->h, r->l);
+        break;
+    case 0xc3:
+    case 0xcb:
+        memcpy(next, addr, sizeof(next));
+        break;
+    case 0xc9:
+    case 0xd9:
+        pop(ls, m, next);
+        break;
+    case 0xcd:
+    case 0xdd:
+    case 0xed:
+    case 0xfd:
+        push(ls, m, next);
+        memcpy(next, addr, sizeof(next));
+        break;
+
+    default:
+        if (op >= 0x40 && op < 0x80) {
+            uint8_t* dst = operand(r, op >> 3);
+            uint8_t* src = operand(r, op);
+
+            if (src == NULL) {
+                pair(word, r->h, r->l);
+                load(ls, val, word);
+                src = val;
+            }
+
+            if (dst == NULL) {
+                pair(word, r->h, r->l);
+                store(ls, m, word, src);
+            } else {
+                set8(dst, m, src);
+            }
+        } else if (op >= 0x80 && op < 0xc0) {
+            uint8_t* src = operand(r, op);
+
+            if (src == NULL) {
+                pair(word, r->h, r->l);
+                load(ls, val, word);
+                src = val;
+            }
+
+            alu(r, m, op, src);
+        } else if (op < 0x40 && (op & 0x07) == 0x06) {
+            uint8_t* dst = operand(r, op >> 3);
+
+            if (dst == NULL) {
+                pair(word, r->h, r->l);
+                store(ls, m, word, val);
+            } else {
+                set8(dst, m, val);
+            }
+        } else if (op < 0x40 && (op & 0x06) == 0x04) {
+            uint8_t* dst = operand(r, op >> 3);
+
+            if (dst == NULL) {
+                pair(word, r->h, r->l);
+                load(ls, val, word);
+                inc(r, m, val, op & 0x01);
+                store(ls, m, word, val);
+            } else {
+                inc(r, m, dst, op & 0x01);
+            }
+        } else if (op < 0x40 && (op & 0x07) != 0x00) { // LXI, INX and DCX of BC, DE and HL; DAD
+            uint8_t* h = operand(r, (op >> 3) & 0x06);
+            uint8_t* l = operand(r, ((op >> 3) & 0x06) | 1);
+
+            if ((op & 0x0f) == 0x09) {
+                if ((op & 0x30) == 0x30) {
+                    memcpy(word, r->sp, sizeof(word));
+                } else {
+                    pair(word, h, l);
+                }
+
+                pair(addr, r->h, r->l);
+                EACH_LANE(i)
+                {
+                    uint32_t sum = addr[i] + word[i];
+
+                    r->f[i] = pick8(m[i], (r->f[i] & ~FLAG_C) | (sum >> 16), r->f[i]);
+                    addr[i] = sum;
+                }
+                split(r->h, r->l, m, addr);
+            } else if ((op & 0x0f) == 0x01) {
+                split(h, l, m, addr);
+            } else {
+                pair(word, h, l);
+                EACH_LANE(i)
+                {
+                    word[i] += op & 0x08 ? -1 : 1;
+                }
+                split(h, l, m, word);
+            }
+        } else if (op >= 0xc0) {
+            switch (op & 0x07) {
+            case 0x00: // Rcc
+                taken(t, r, m, op);
+                pop(ls, t, word);
+                set16(next, t, word);
+                break;
+            case 0x02: // Jcc
+                taken(hi, r, m, op);
+                set16(next, hi, addr);
+                break;
+            case 0x04: // Ccc
+                taken(t, r, m, op);
+                push(ls, t, next);
+                set16(next, t, addr);
+                break;
+            case 0x05: // PUSH
+                switch (op & 0x30) {
+                case 0x00:
+                    pair(word, r->b, r->c);
+                    break;
+                case 0x10:
+                    pair(word, r->d, r->e);
+                    break;
+                case 0x20:
+                    pair(word, r->h, r->l);
+                    break;
+                default:
+                    pair(word, r->a, r->f);
+                    break;
+                }
+                push(ls, m, word);
+                break;
+            case 0x01: // POP
+                pop(ls, m, word);
+
+                if (op == 0xf1) {
+                    EACH_LANE(i)
+                    {
+                        word[i] = (word[i] & 0xffd5) | FLAG_ALWAYS;
+                    }
+                    split(r->a, r->f, m, word);
+                } else {
+                    split(operand(r, (op >> 3) & 0x06), operand(r, ((op >> 3) & 0x06) | 1), m, word);
+                }
+                break;
+            case 0x06: // ALU immediate
+                alu(r, m, op, val);
+                break;
+            default: // RST
+                push(ls, m, next);
+                EACH_LANE(i)
+                {
+                    next[i] = op & 0x38;
+                }
+                break;
+            }
+        }
+        break;
+    }
+
+    // A taken conditional call or return costs 6 cycles more than the table.
+    EACH_LANE(i)
+    {
+        r->pc[i] = pick16(m[i], next[i], r->pc[i]);
+        ls->cycles[i] += (m[i] & OPCODES_CYCLES[op]) + (t[i] & 6);
+    }
+}
+
+// Runs the next instruction on the lanes that are in step with the leader.
+// Returns the number of lanes that ran it, 0 once every lane has stopped.
+LOCKSTEP_TARGETS static uint32_t step_lanes(lockstep_t* ls, const uint32_t* start, uint32_t budget)
+{
+    lanes_reg_t* r = &ls->reg;
+    uint8_t running[LOCKSTEP_LANES];
+    uint8_t m[LOCKSTEP_LANES];
+    uint16_t lowest = 0xffff;
+
+    EACH_LANE(i)
+    {
+        running[i] = ~ls->halted[i] & -(ls->cycles[i] - start[i] < budget);
+    }
+
+    // Lowest PC first, so that lanes which fell behind catch up with the
+    // others instead of running ahead on their own.
+    EACH_LANE(i)
+    {
+        uint16_t pc = pick16(running[i], r->pc[i], 0xffff);
+
+        lowest = pc < lowest ? pc : lowest;
+    }
+
+    EACH_LANE(i)
+    {
+        m[i] = running[i] & -(r->pc[i] == lowest);
+    }
+
+    const uint8_t* first = memchr(m, 0xff, sizeof(m));
+
+    if (first == NULL) {
+        return 0;
+    }
+
+    // On a shared page every lane at the leader's PC sees the same
+    // instruction; elsewhere each lane's opcode has to be checked.
+    const mem_t* code = &ls->mem[first - m];
+    uint8_t opcode = mem_peek(code, lowest);
+    uint8_t page = lowest >> MEM_PAGE_SHIFT;
+
+    if (!ls->shared[page] || ((lowest & (MEM_PAGE_SIZE - 1)) > MEM_PAGE_SIZE - 3 && !ls->shared[(uint8_t)(page + 1)])) {
+        uint8_t op[LOCKSTEP_LANES];
+
+        load(ls, op, r->pc);
+        EACH_LANE(i)
+        {
+            m[i] &= -(op[i] == opcode);
+        }
+        code = NULL;
+    }
+
+    uint32_t count = 0;
+
+    EACH_LANE(i)
+    {
+        count += m[i] & 1;
+    }
+
+    if (vectorized(opcode)) {
+        run_vector(ls, m, opcode, code, lowest);
+        return count;
+    }
+
+    EACH_LANE(i)
+    {
+        if (m[i]) {
+            run_scalar(ls, i);
+        }
+    }
+
+    return count;
+}
+
+uint64_t lockstep_run(lockstep_t* ls, uint32_t budget)
+{
+    if (ls == NULL) {
+        return 0;
+    }
+
+    uint32_t start[LOCKSTEP_LANES];
+    uint64_t insns = 0;
+    uint32_t count;
+
+    memcpy(start, ls->cycles, sizeof(start));
+    share_pages(ls);
+
+    while ((count = step_lanes(ls, start, budget)) > 0) {
+        insns += count;
+    }
+
+    return insns;
+}
@@ -0,0 +1,73 @@
+#ifndef __LOCKSTEP_H__
+#define __LOCKSTEP_H__
+
+#include "common.h"
+
+#include "cpu.h"
+#include "mem.h"
+#include "regs.h"
+
+// Lockstep interpreter for many instances of the same program.
+//
+// The registers of all lanes are kept as a structure of arrays, so one
+// instruction runs across every lane as a handful of loops that the compiler
+// turns into SIMD code (AVX-512 or AVX2 where the host has them, picked at
+// run time). Each step runs the instruction at the lowest PC among the
+// running lanes, for all lanes that are at that PC and see the same opcode
+// there; the others are masked out until they get back in step. Instructions
+// without a vector kernel run lane by lane through the scalar interpreter,
+// so their ALU work is done by the alu_* functions. Building with
+// LOCKSTEP_SCALAR sends every instruction that way.
+#define LOCKSTEP_LANES 64
+
+// reg_t with one array element per lane.
+typedef struct {
+    uint8_t a[LOCKSTEP_LANES];
+    uint8_t f[LOCKSTEP_LANES]; // Always up to date, whatever FLAG_EVAL says.
+    uint8_t b[LOCKSTEP_LANES];
+    uint8_t c[LOCKSTEP_LANES];
+    uint8_t d[LOCKSTEP_LANES];
+    uint8_t e[LOCKSTEP_LANES];
+    uint8_t h[LOCKSTEP_LANES];
+    uint8_t l[LOCKSTEP_LANES];
+    uint16_t sp[LOCKSTEP_LANES];
+    uint16_t pc[LOCKSTEP_LANES];
+} __attribute__((aligned(64))) lanes_reg_t;
+
+typedef struct {
+    lanes_reg_t reg;
+    uint32_t cycles[LOCKSTEP_LANES]; // Per-lane cycle counters; they wrap around.
+    uint8_t halted[LOCKSTEP_LANES]; // 0xff for lanes that executed HLT.
+
+    // Pages that hold the same bytes in every lane. Instructions fetched
+    // from them are read once instead of once per lane; a write to one of
+    // them drops it from the set until the next lockstep_run().
+    bool shared[MEM_PAGES];
+
+    // One machine per lane for the scalar path. Their registers only hold
+    // the lane state while a scalar instruction runs; mem[] is the memory of
+    // the lanes and is what the host loads programs into.
+    mem_t* mem;
+    reg_t regs[LOCKSTEP_LANES];
+    cpu_t cpu[LOCKSTEP_LANES];
+} lockstep_t;
+
+// Creates LOCKSTEP_LANES lanes with zeroed memory and registers.
+lockstep_t* lockstep_create(void);
+void lockstep_destroy(lockstep_t* ls);
+
+// Makes every lane runnable again: clears the halted flags, here and in the
+// scalar machines, the interrupt enables and the cycle counters. Registers and memory are left as
+// they are, for the host to set before the next lockstep_run(); clearing
+// halted[] alone would leave a lane halted on the scalar path.
+void lockstep_reset(lockstep_t* ls);
+
+void lockstep_set_reg(lockstep_t* ls, unsigned lane, reg_t* reg);
+void lockstep_get_reg(lockstep_t* ls, unsigned lane, reg_t* reg);
+
+// Runs every lane until it halts or has used `budget` more cycles. Returns
+// the number of instructions executed over all lanes. IN reads an open bus
+// and OUT is dropped.
+uint64_t lockstep_run(lockstep_t* ls, uint32_t budget);
+
+#endif
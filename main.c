@@ -1,22 +1,336 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#define DEBUG 1
-
+#include "batch.h"
+#include "bdos.h"
 #include "cpu.h"
+#include "loader.h"
 #include "mem.h"
+#include "pace.h"
 #include "regs.h"
 
-int main()
+// Emulated time each image gets in batch mode before it is given up on.
+#define BATCH_SECONDS 60
+
+// Records handed to the trace writer at a time with -T.
+#define TRACE_CHUNK 65536
+
+// Maps an image spec (see parse_segments()) into memory and points PC at
+// its entry.
+static bool load_image(cpu_t* cpu, char* spec)
+{
+    segment_t segs[LOADER_MAX_SEGMENTS];
+    unsigned count = parse_segments(spec, segs, LOADER_MAX_SEGMENTS);
+    uint16_t entry = 0;
+
+    if (count == 0 || !load_segments(cpu->mem, segs, count, &entry)) {
+        return false;
+    }
+
+    cpu->reg->pc = entry;
+    return true;
+}
+
+// Services the IN/OUT that stopped the last batch. There are no devices yet:
+// OUT is dropped and IN reads an open bus.
+static void service_io(cpu_t* cpu)
+{
+    if (!cpu->io_out) {
+        cpu->reg->a = 0xff;
+    }
+}
+
+// Interrupts every `period` cycles, alternating RST 1 and RST 2 like the
+// mid-frame and end-of-frame interrupts of the Taito 8080 arcade boards.
+typedef struct {
+    cpu_t* cpu;
+    uint32_t period;
+    uint8_t rst;
+} interrupter_t;
+
+static void raise_interrupt(void* ctx, uint64_t cycle)
+{
+    interrupter_t* irq = ctx;
+
+    handle_interrupt(irq->cpu, irq->rst * 8);
+    irq->rst ^= 3;
+    schedule_event(irq->cpu, cycle + irq->period, raise_interrupt, irq);
+}
+
+// Prints the last `count` records of the trace, oldest first. The ring can
+// hold more: it is rounded up to a power of two, and to TRACE_CHUNK with -T.
+static void dump_trace(trace_t* trace, uint32_t count)
+{
+    uint64_t first = trace->count > count ? trace->count - count : 0;
+
+    if (trace->count - first > trace->size) {
+        first = trace->count - trace->size;
+    }
+
+    for (uint64_t i = first; i < trace->count; i++) {
+        trace_format(&trace->recs[i & (trace->size - 1)], stderr);
+    }
+}
+
+// Writes the profile to `path`, as folded stacks if it ends in .folded.
+static bool write_profile(cpu_t* cpu, const char* path)
+{
+    FILE* file = fopen(path, "w");
+    size_t len = strlen(path);
+    bool folded = len >= 7 && strcmp(path + len - 7, ".folded") == 0;
+
+    if (file == NULL) {
+        return false;
+    }
+
+    profile_settle(cpu->profile, cpu->reg->pc, cpu->reg->sp, cpu->cycles);
+
+    bool ok = folded ? profile_dump_folded(cpu->profile, file) : profile_dump(cpu->profile, file);
+
+    return fclose(file) == 0 && ok;
+}
+
+// Runs every image on its own machine across all host cores and prints the
+// final state of each, for regression runs over many programs.
+static int run_batch(int count, char** paths)
+{
+    batch_job_t* jobs = calloc(count, sizeof(batch_job_t));
+    machine_t** machines = calloc(count, sizeof(machine_t*));
+
+    if (jobs == NULL || machines == NULL) {
+        fprintf(stderr, "[ERROR:%s:%d] Could not allocate enough space for %d machines.", __FILE__, __LINE__, count);
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        machines[i] = machine_create();
+
+        if (machines[i] == NULL) {
+            fprintf(stderr, "[ERROR:%s:%d] Could not allocate enough space for %d machines.\n", __FILE__, __LINE__, count);
+            return 1;
+        }
+
+        if (!load_image(&machines[i]->cpu, paths[i])) {
+            fprintf(stderr, "[ERROR:%s:%d] Could not load %s.\n", __FILE__, __LINE__, paths[i]);
+            return 1;
+        }
+
+        jobs[i].cpu = &machines[i]->cpu;
+        jobs[i].budget = (uint64_t)CLOCK_FREQUENCY * BATCH_SECONDS;
+    }
+
+    batch_run(jobs, count, 0);
+
+    for (int i = 0; i < count; i++) {
+        batch_job_t* job = &jobs[i];
+
+        printf("%s: %s after %llu cycles, PC=%04X AF=%04X BC=%04X DE=%04X HL=%04X SP=%04X mem=%016llx\n",
+            paths[i],
+            job->stop == STOP_HALT ? "halted" : "timed out",
+            (unsigned long long)job->cycles,
+            job->reg.pc,
+            get_reg_af(&job->reg),
+            get_reg_bc(&job->reg),
+            get_reg_de(&job->reg),
+            get_reg_hl(&job->reg),
+            job->reg.sp,
+            (unsigned long long)job->digest);
+    }
+
+    for (int i = 0; i < count; i++) {
+        machine_destroy(machines[i]);
+    }
+
+    free(machines);
+    free(jobs);
+    return 0;
+}
+
+int main(int argc, char** argv)
 {
-    cpu_t* cpu = malloc(sizeof(cpu_t));
-    mem_t* mem = malloc(sizeof(mem_t));
-    reg_t* reg = malloc(sizeof(reg_t));
+    // -t N: keep a trace of the last N instructions and dump it on exit.
+    // -T FILE: write a trace of every instruction to FILE, see tracecat.
+    // -p FILE: write a profile to FILE on exit, as folded stacks if it ends
+    // in .folded. -s N: sample the profile every N cycles.
+    // -r N: pace to real time, waiting every N ticks.
+    // -i N: interrupt every N cycles, see interrupter_t.
+    // -c DIR: run a CP/M program with its files in DIR, see bdos.h.
+    const char* name = argv[0];
+    uint32_t trace_size = 0;
+    const char* trace_path = NULL;
+    const char* profile_path = NULL;
+    uint32_t sample_period = 0;
+    uint32_t pace_skip = 0;
+    uint32_t irq_period = 0;
+    const char* cpm_dir = NULL;
+
+    while (argc > 2 && argv[1][0] == '-' && strchr("tTpsric", argv[1][1]) != NULL && argv[1][2] == '\0') {
+        switch (argv[1][1]) {
+        case 't':
+            trace_size = strtoul(argv[2], NULL, 0);
+            break;
+        case 'T':
+            trace_path = argv[2];
+            break;
+        case 'p':
+            profile_path = argv[2];
+            break;
+        case 's':
+            sample_period = strtoul(argv[2], NULL, 0);
+            break;
+        case 'r':
+            pace_skip = strtoul(argv[2], NULL, 0);
+            break;
+        case 'i':
+            irq_period = strtoul(argv[2], NULL, 0);
+            break;
+        case 'c':
+            cpm_dir = argv[2];
+            break;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s [-t N] [-T FILE] [-p FILE [-s N]] [-r N] [-i N] [-c DIR] IMAGE...\n", name);
+        fprintf(stderr, "  IMAGE is PATH[@ADDR][,ro][+PATH[@ADDR][,ro]...]; .hex/.ihx are Intel HEX\n");
+        fprintf(stderr, "  -t N dumps the last N instructions of a single image to stderr\n");
+        fprintf(stderr, "  -T FILE streams a trace of every instruction of a single image to FILE\n");
+        fprintf(stderr, "  -p FILE writes a profile of a single image to FILE, folded stacks for *.folded\n");
+        fprintf(stderr, "  -s N samples the profile every N cycles instead of counting every instruction\n");
+        fprintf(stderr, "  -r N runs a single image in real time, waiting for the clock every N ticks\n");
+        fprintf(stderr, "  -i N interrupts a single image every N cycles, with RST 1 and RST 2 in turn\n");
+        fprintf(stderr, "  -c DIR runs a single image as a CP/M program on the console, with its files in DIR\n");
+        return 1;
+    }
 
-    if (cpu == NULL || mem == NULL || reg == NULL) {
+    if (argc > 2) {
+        return run_batch(argc - 1, argv + 1);
+    }
+
+    machine_t* machine = machine_create();
+
+    if (machine == NULL) {
         fprintf(stderr, "[ERROR:%s:%d] Could not allocate enough space for CPU + RAM + REGISTERS.", __FILE__, __LINE__);
+        return 1;
+    }
+
+    cpu_t* cpu = &machine->cpu;
+
+    if (!load_image(cpu, argv[1])) {
+        fprintf(stderr, "[ERROR:%s:%d] Could not load %s.\n", __FILE__, __LINE__, argv[1]);
+        return 1;
+    }
+
+    if (trace_size > 0 || trace_path != NULL) {
+        uint32_t size = trace_path != NULL && trace_size < TRACE_CHUNK ? TRACE_CHUNK : trace_size;
+
+        cpu->trace = trace_create(size);
+
+        if (cpu->trace == NULL) {
+            fprintf(stderr, "[ERROR:%s:%d] Could not allocate a trace of %u instructions.\n", __FILE__, __LINE__, size);
+            return 1;
+        }
+    }
+
+    if (trace_path != NULL && !trace_stream_open(cpu->trace, trace_path)) {
+        fprintf(stderr, "[ERROR:%s:%d] Could not write a trace to %s.\n", __FILE__, __LINE__, trace_path);
+        return 1;
+    }
+
+    if (profile_path != NULL) {
+        cpu->profile = profile_create(sample_period > 0 ? PROFILE_SAMPLE : PROFILE_EXACT, sample_period);
+
+        if (cpu->profile == NULL) {
+            fprintf(stderr, "[ERROR:%s:%d] Could not allocate a profile.\n", __FILE__, __LINE__);
+            return 1;
+        }
+    }
+
+    traps_t traps;
+    bdos_t bdos;
+
+    if (cpm_dir != NULL) {
+        init_traps(&traps);
+        init_bdos(&bdos, stdin, stdout, cpm_dir);
+
+        if (!bdos_install(&bdos, &traps, cpu->reg, cpu->mem)) {
+            fprintf(stderr, "[ERROR:%s:%d] Could not set up CP/M.\n", __FILE__, __LINE__);
+            return 1;
+        }
+
+        cpu->traps = &traps;
+    }
+
+    events_t events;
+    interrupter_t irq = { cpu, irq_period, 1 };
+
+    if (irq_period > 0) {
+        init_events(&events);
+        cpu->events = &events;
+        schedule_event(cpu, irq_period, raise_interrupt, &irq);
+    }
+
+    // One iteration per frame of TICK_CYCLES cycles. The core only comes back
+    // early for I/O; the cycles a frame overshoots are taken from the next one.
+    // Without -r frames run unthrottled. A CPU halted with interrupts enabled
+    // waits for the next one, if there is one coming.
+    uint64_t frames = 0;
+    pace_t pace;
+
+    init_pace(&pace, (uint64_t)TICK_CYCLES * 1000000000 / CLOCK_FREQUENCY, pace_skip);
+    pace_turbo(&pace, pace_skip == 0);
+
+    while (!cpu->halted || (cpu->interrupt && cpu->next_event != UINT64_MAX)) {
+        while (cpu->tick_cycles < TICK_CYCLES) {
+            stop_t stop = run_cycles(cpu, TICK_CYCLES - cpu->tick_cycles);
+
+            if (stop == STOP_IO) {
+                service_io(cpu);
+            } else if (stop == STOP_HALT) {
+                break;
+            }
+        }
+
+        cpu->tick_cycles = cpu->tick_cycles > TICK_CYCLES ? cpu->tick_cycles - TICK_CYCLES : 0;
+        frames++;
+        pace_tick(&pace);
+    }
+
+    printf("halted at %04X after %llu frames\n", cpu->reg->pc, (unsigned long long)frames);
+
+    if (pace.waits > 0) {
+        fprintf(stderr, "paced %llu waits, jitter %.1f us average, %.1f us max, %.1f ms dropped\n",
+            (unsigned long long)pace.waits,
+            pace.jitter_sum_ns / 1e3 / pace.waits,
+            pace.jitter_max_ns / 1e3,
+            pace.dropped_ns / 1e6);
+    }
+
+    if (trace_path != NULL && !trace_stream_close(cpu->trace)) {
+        fprintf(stderr, "[ERROR:%s:%d] Could not write a trace to %s.\n", __FILE__, __LINE__, trace_path);
+    }
+
+    // After the stream is closed, so that the ring holds the last records
+    // again rather than only those since the last chunk.
+    if (trace_size > 0) {
+        dump_trace(cpu->trace, trace_size);
+    }
+
+    trace_destroy(cpu->trace);
+
+    if (profile_path != NULL && !write_profile(cpu, profile_path)) {
+        fprintf(stderr, "[ERROR:%s:%d] Could not write a profile to %s.\n", __FILE__, __LINE__, profile_path);
+    }
+
+    profile_destroy(cpu->profile);
+
+    if (cpm_dir != NULL) {
+        bdos_close(&bdos);
     }
 
-    init_reg(reg);
-    init_cpu(cpu, reg, mem);
+    machine_destroy(machine);
+    return 0;
 }
@@ -1,21 +1,201 @@
 #include "mem.h"
 
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Backs every page that has never been written. Only ever read: pages that
+// point here have no write pointer.
+static const uint8_t zero_page[MEM_PAGE_SIZE];
+
+static void release_page(mem_page_t* page)
+{
+    if (page != NULL && atomic_fetch_sub_explicit(&page->refs, 1, memory_order_acq_rel) == 1) {
+        free(page);
+    }
+}
+
+static void release_map(mem_map_t* map)
+{
+    if (map != NULL && atomic_fetch_sub_explicit(&map->refs, 1, memory_order_acq_rel) == 1) {
+        munmap(map->addr, map->size);
+        free(map);
+    }
+}
+
+// Called on every change to a page behind its write pointer, for the page
+// and its mirrors.
+static void invalidate(mem_t* mem, uint8_t page)
+{
+    uint8_t at = page;
+
+    do {
+        mem->dirty[at / 64] |= (uint64_t)1 << (at % 64);
+
+        if (mem->code_page[at]) {
+            mem->code_page[at] = false;
+            mem->code_gen[at]++;
+            mem->code_writes++;
+        }
+
+        at = mem->mirror[at];
+    } while (at != page);
+}
+
+// Takes a page out of its mirror ring, ahead of giving it other bytes.
+static void detach(mem_t* mem, uint8_t page)
+{
+    uint8_t prev = page;
+
+    while (mem->mirror[prev] != page) {
+        prev = mem->mirror[prev];
+    }
+
+    mem->mirror[prev] = mem->mirror[page];
+    mem->mirror[page] = page;
+}
+
+// Points a page at bytes it does not own.
+static void set_page(mem_t* mem, uint8_t page, const uint8_t* data)
+{
+    detach(mem, page);
+    invalidate(mem, page);
+    release_page(mem->page[page]);
+
+    mem->page[page] = NULL;
+    mem->read[page] = (uint8_t*)data;
+    mem->write[page] = NULL;
+    mem->io[page] = NULL;
+}
+
+bool init_mem(mem_t* mem)
+{
+    if (mem == NULL) {
+        return false;
+    }
+
+    memset(mem, 0, sizeof(mem_t));
+
+    for (uint32_t page = 0; page < MEM_PAGES; page++) {
+        mem->read[page] = (uint8_t*)zero_page;
+        mem->mirror[page] = page;
+    }
+
+    return true;
+}
+
+void free_mem(mem_t* mem)
+{
+    if (mem == NULL) {
+        return;
+    }
+
+    for (uint32_t page = 0; page < MEM_PAGES; page++) {
+        release_page(mem->page[page]);
+        mem->page[page] = NULL;
+        mem->read[page] = (uint8_t*)zero_page;
+        mem->write[page] = NULL;
+        mem->io[page] = NULL;
+        mem->mirror[page] = page;
+    }
+
+    for (uint32_t i = 0; i < MEM_MAPS; i++) {
+        release_map(mem->maps[i]);
+        mem->maps[i] = NULL;
+    }
+}
+
+bool mem_clone(mem_t* dst, mem_t* src)
+{
+    if (dst == NULL || src == NULL) {
+        return false;
+    }
+
+    memcpy(dst, src, sizeof(mem_t));
+
+    for (uint32_t page = 0; page < MEM_PAGES; page++) {
+        if (src->page[page] != NULL) {
+            atomic_fetch_add_explicit(&src->page[page]->refs, 1, memory_order_relaxed);
+        }
+
+        // Both sides now go through mem_unshare() on their next write.
+        src->write[page] = NULL;
+        dst->write[page] = NULL;
+    }
+
+    for (uint32_t i = 0; i < MEM_MAPS; i++) {
+        if (src->maps[i] != NULL) {
+            atomic_fetch_add_explicit(&src->maps[i]->refs, 1, memory_order_relaxed);
+        }
+    }
+
+    return true;
+}
+
+uint8_t mem_read_slow(mem_t* mem, uint16_t addr)
+{
+    if (mem == NULL) {
+        return 0;
+    }
+
+    const uint8_t* data = mem->read[addr >> MEM_PAGE_SHIFT];
+    const mem_io_t* io = mem->io[addr >> MEM_PAGE_SHIFT];
+
+    if (data != NULL) {
+        return data[addr & (MEM_PAGE_SIZE - 1)];
+    }
+
+    return io != NULL && io->read != NULL ? io->read(io->ctx, addr) : 0xff;
+}
+
+void mem_write_slow(mem_t* mem, uint16_t addr, uint8_t val)
+{
+    if (mem == NULL) {
+        return;
+    }
+
+    uint8_t page = addr >> MEM_PAGE_SHIFT;
+    const mem_io_t* io = mem->io[page];
+
+    if (io != NULL) {
+        if (io->write != NULL) {
+            io->write(io->ctx, addr, val);
+        }
+        return;
+    }
+
+    if (mem->rom_page[page]) {
+        return;
+    }
+
+    uint8_t* data = mem->write[page];
+
+    if (data == NULL) {
+        data = mem_unshare(mem, page);
+        if (data == NULL) {
+            return;
+        }
+    }
+
+    data[addr & (MEM_PAGE_SIZE - 1)] = val;
+}
+
 uint8_t get_mem(mem_t* mem, uint16_t addr)
 {
     if (mem == NULL) {
         return 0;
     }
 
-    return mem->data[addr];
+    return mem_read(mem, addr);
 }
 
-uint8_t get_mem_word(mem_t* mem, uint16_t addr)
+uint16_t get_mem_word(mem_t* mem, uint16_t addr)
 {
     if (mem == NULL) {
         return 0;
     }
 
-    return get_mem(mem, addr) | (get_mem(mem, addr + 1) << 8);
+    return mem_read_word(mem, addr);
 }
 
 void set_mem(mem_t* mem, uint16_t addr, uint8_t val)
@@ -24,15 +204,248 @@ void set_mem(mem_t* mem, uint16_t addr, uint8_t val)
         return;
     }
 
-    mem->data[addr] = val;
+    mem_write(mem, addr, val);
 }
 
-void set_mem_word(mem_t* mem, uint16_t addr, uint8_t val)
+void set_mem_word(mem_t* mem, uint16_t addr, uint16_t val)
 {
     if (mem == NULL) {
         return;
     }
 
-    set_mem(mem, addr, (val & 0xFF));
-    set_mem(mem, addr + 1, (val >> 8));
+    mem_write_word(mem, addr, val);
+}
+
+uint8_t* mem_unshare(mem_t* mem, uint8_t page)
+{
+    if (mem == NULL || mem->io[page] != NULL) {
+        return NULL;
+    }
+
+    invalidate(mem, page);
+
+    mem_page_t* own = mem->page[page];
+    uint32_t mirrors = 1;
+
+    for (uint8_t at = mem->mirror[page]; at != page; at = mem->mirror[at]) {
+        mirrors++;
+    }
+
+    // The last reference can only be dropped by this machine, so a count no
+    // higher than the number of mirrors means nobody else can see the page.
+    if (own == NULL || atomic_load_explicit(&own->refs, memory_order_acquire) > mirrors) {
+        mem_page_t* copy = malloc(sizeof(mem_page_t));
+
+        if (copy == NULL) {
+            return NULL;
+        }
+
+        atomic_init(&copy->refs, mirrors);
+        memcpy(copy->data, mem->read[page], MEM_PAGE_SIZE);
+
+        uint8_t at = page;
+        do {
+            release_page(own);
+            mem->page[at] = copy;
+            mem->read[at] = copy->data;
+            at = mem->mirror[at];
+        } while (at != page);
+    }
+
+    uint8_t at = page;
+    do {
+        if (!mem->rom_page[at]) {
+            mem->write[at] = mem->read[at];
+        }
+        at = mem->mirror[at];
+    } while (at != page);
+
+    return mem->read[page];
+}
+
+void mem_checkpoint(mem_t* mem)
+{
+    if (mem == NULL) {
+        return;
+    }
+
+    memset(mem->dirty, 0, sizeof(mem->dirty));
+
+    for (uint32_t page = 0; page < MEM_PAGES; page++) {
+        mem->write[page] = NULL;
+    }
+}
+
+void mem_mark_code(mem_t* mem, uint8_t page)
+{
+    if (mem == NULL) {
+        return;
+    }
+
+    mem->code_page[page] = true;
+
+    // A mirror could otherwise write to the code without set_mem() noticing.
+    uint8_t at = page;
+    do {
+        mem->write[at] = NULL;
+        at = mem->mirror[at];
+    } while (at != page);
+}
+
+bool mem_load(mem_t* mem, uint16_t addr, const uint8_t* src, size_t size)
+{
+    if (mem == NULL || src == NULL) {
+        return false;
+    }
+
+    uint32_t at = addr;
+
+    while (size > 0 && at < MEM_SIZE) {
+        uint32_t offset = at & (MEM_PAGE_SIZE - 1);
+        uint32_t len = MEM_PAGE_SIZE - offset;
+        uint8_t page = at >> MEM_PAGE_SHIFT;
+        uint8_t* data = mem->io[page] != NULL ? NULL : mem_unshare(mem, page);
+
+        if (data == NULL && mem->io[page] == NULL) {
+            return false;
+        }
+
+        if (len > size) {
+            len = size;
+        }
+
+        if (data != NULL) {
+            memcpy(data + offset, src, len);
+        }
+        src += len;
+        size -= len;
+        at += len;
+    }
+
+    return true;
+}
+
+bool mem_map_file(mem_t* mem, uint16_t addr, int fd, size_t size)
+{
+    if (mem == NULL || size == 0) {
+        return false;
+    }
+
+    if (size > (size_t)(MEM_SIZE - addr)) {
+        size = MEM_SIZE - addr;
+    }
+
+    uint8_t* base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+
+    // Pages that lie wholly inside the file point into the mapping, if there
+    // is a slot left to keep it in; the rest is copied.
+    uint32_t first = (addr + MEM_PAGE_SIZE - 1) >> MEM_PAGE_SHIFT;
+    uint32_t end = (addr + size) >> MEM_PAGE_SHIFT;
+    mem_map_t* map = NULL;
+
+    for (uint32_t i = 0; i < MEM_MAPS && first < end; i++) {
+        if (mem->maps[i] == NULL) {
+            map = malloc(sizeof(mem_map_t));
+            mem->maps[i] = map;
+            break;
+        }
+    }
+
+    if (map == NULL) {
+        bool ok = mem_load(mem, addr, base, size);
+
+        munmap(base, size);
+        return ok;
+    }
+
+    atomic_init(&map->refs, 1);
+    map->addr = base;
+    map->size = size;
+
+    for (uint32_t page = first; page < end; page++) {
+        set_page(mem, page, base + (page << MEM_PAGE_SHIFT) - addr);
+    }
+
+    uint32_t head = (first << MEM_PAGE_SHIFT) - addr;
+    uint32_t tail = (end << MEM_PAGE_SHIFT) - addr;
+
+    return mem_load(mem, addr, base, head) && mem_load(mem, addr + tail, base + tail, size - tail);
+}
+
+void mem_protect(mem_t* mem, uint16_t addr, uint32_t size)
+{
+    if (mem == NULL || size == 0) {
+        return;
+    }
+
+    uint32_t last = (addr + size - 1) >> MEM_PAGE_SHIFT;
+
+    for (uint32_t page = addr >> MEM_PAGE_SHIFT; page <= last && page < MEM_PAGES; page++) {
+        mem->rom_page[page] = true;
+        mem->write[page] = NULL;
+    }
+}
+
+void mem_map_io(mem_t* mem, uint16_t addr, uint32_t size, const mem_io_t* io)
+{
+    if (mem == NULL || size == 0) {
+        return;
+    }
+
+    uint32_t last = (addr + size - 1) >> MEM_PAGE_SHIFT;
+
+    for (uint32_t page = addr >> MEM_PAGE_SHIFT; page <= last && page < MEM_PAGES; page++) {
+        set_page(mem, page, io != NULL ? NULL : zero_page);
+        mem->io[page] = io;
+    }
+}
+
+void mem_mirror(mem_t* mem, uint16_t addr, uint32_t size, uint16_t src)
+{
+    if (mem == NULL || size == 0) {
+        return;
+    }
+
+    uint32_t first = addr >> MEM_PAGE_SHIFT;
+    uint32_t last = (addr + size - 1) >> MEM_PAGE_SHIFT;
+
+    for (uint32_t page = first; page <= last && page < MEM_PAGES; page++) {
+        uint8_t from = (src >> MEM_PAGE_SHIFT) + (page - first);
+
+        if (from == page) {
+            continue;
+        }
+
+        set_page(mem, page, mem->read[from]);
+        mem->io[page] = mem->io[from];
+        mem->page[page] = mem->page[from];
+
+        if (mem->page[page] != NULL) {
+            atomic_fetch_add_explicit(&mem->page[page]->refs, 1, memory_order_relaxed);
+        }
+
+        // The first write to either side goes through mem_unshare(), which
+        // points every page of the ring at the same writable bytes.
+        mem->write[from] = NULL;
+        mem->mirror[page] = mem->mirror[from];
+        mem->mirror[from] = page;
+    }
+}
+
+uint64_t mem_digest(mem_t* mem)
+{
+    if (mem == NULL) {
+        return 0;
+    }
+
+    uint64_t hash = 0xcbf29ce484222325;
+
+    for (uint32_t i = 0; i < MEM_SIZE; i++) {
+        hash = (hash ^ mem_peek(mem, i)) * 0x100000001b3;
+    }
+
+    return hash;
 }
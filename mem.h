@@ -3,15 +3,182 @@
 
 #include "common.h"
 
+#include <stdatomic.h>
+
 #define MEM_SIZE 65536 // 64K of memory
 
+#define MEM_PAGE_SHIFT 8
+#define MEM_PAGE_SIZE (1 << MEM_PAGE_SHIFT)
+#define MEM_PAGES (MEM_SIZE >> MEM_PAGE_SHIFT)
+
+#define MEM_MAPS 16 // Files mapped into one address space at most.
+
+// A page of memory, shared by a machine and its clones until one of them
+// writes to it.
+typedef struct {
+    atomic_uint refs;
+    uint8_t data[MEM_PAGE_SIZE];
+} mem_page_t;
+
+// A file mapped read-only by mem_map_file(). It stays mapped while any
+// machine or clone still has it in its page table.
+typedef struct {
+    atomic_uint refs;
+    void* addr;
+    size_t size;
+} mem_map_t;
+
+// A memory-mapped device, see mem_map_io(). Either handler may be NULL: reads
+// then see an open bus (0xff) and writes are dropped. The interpreter runs on
+// a copy of the CPU registers during a batch, so the handlers must not rely
+// on cpu->reg.
+typedef struct {
+    uint8_t (*read)(void* ctx, uint16_t addr);
+    void (*write)(void* ctx, uint16_t addr, uint8_t val);
+    void* ctx;
+} mem_io_t;
+
 typedef struct {
-    uint8_t data[MEM_SIZE];
+    // Page table. read[] points at the bytes of every page, or is NULL for
+    // MMIO pages, whose reads take the slow path. write[] holds the same
+    // pointer for pages that can be written in place, and NULL for pages
+    // whose writes take the slow path: pages shared with clones or backed by
+    // a file, ROM, MMIO and pages holding decoded code.
+    uint8_t* read[MEM_PAGES];
+    uint8_t* write[MEM_PAGES];
+    mem_page_t* page[MEM_PAGES]; // Owner of read[], NULL for the zero page and files.
+    mem_map_t* maps[MEM_MAPS];
+    const mem_io_t* io[MEM_PAGES]; // Device behind an MMIO page.
+
+    // Pages that show the same bytes form a ring through mirror[], so that
+    // a write through one of them reaches the others; a page that is not
+    // mirrored points at itself. Every page in a ring holds a reference to
+    // the shared mem_page_t.
+    uint8_t mirror[MEM_PAGES];
+
+    // Self-modifying code tracking for the block cache: a write into a page
+    // flagged in code_page bumps its code_gen, which invalidates every block
+    // decoded from that page, and code_writes, which tells a running block
+    // to stop.
+    bool code_page[MEM_PAGES];
+    uint32_t code_gen[MEM_PAGES];
+    uint32_t code_writes;
+
+    // ROM pages: set_mem() drops writes to them.
+    bool rom_page[MEM_PAGES];
+
+    // Pages written since the last mem_checkpoint(), one bit per page. A
+    // checkpoint also drops every write pointer, so the first store to each
+    // page sets its bit on the slow path and later ones cost nothing.
+    uint64_t dirty[MEM_PAGES / 64];
 } mem_t;
 
+// Every page starts out as a shared page of zeros, so this cannot fail for
+// a valid `mem`.
+bool init_mem(mem_t* mem);
+void free_mem(mem_t* mem);
+
+// Makes `dst` (not initialized, or freed) a copy of `src` that shares all of
+// its pages until either of them writes to one. Costs a page table copy;
+// neither machine may be running on another thread meanwhile.
+bool mem_clone(mem_t* dst, mem_t* src);
+
+// Byte at `addr` without side effects, for decoders that already know `mem`
+// is valid. MMIO pages read as an open bus.
+static inline uint8_t mem_peek(const mem_t* mem, uint16_t addr)
+{
+    const uint8_t* data = mem->read[addr >> MEM_PAGE_SHIFT];
+
+    return data != NULL ? data[addr & (MEM_PAGE_SIZE - 1)] : 0xff;
+}
+
+// Devices, ROM and everything else behind a NULL page pointer.
+uint8_t mem_read_slow(mem_t* mem, uint16_t addr);
+void mem_write_slow(mem_t* mem, uint16_t addr, uint8_t val);
+
+// Guest accesses for the interpreter: the page pointer on the common path,
+// with no call, and the slow path above otherwise. `mem` must be valid.
+static inline uint8_t mem_read(mem_t* mem, uint16_t addr)
+{
+    const uint8_t* data = mem->read[addr >> MEM_PAGE_SHIFT];
+
+    if (__builtin_expect(data != NULL, 1)) {
+        return data[addr & (MEM_PAGE_SIZE - 1)];
+    }
+
+    return mem_read_slow(mem, addr);
+}
+
+static inline void mem_write(mem_t* mem, uint16_t addr, uint8_t val)
+{
+    uint8_t* data = mem->write[addr >> MEM_PAGE_SHIFT];
+
+    if (__builtin_expect(data != NULL, 1)) {
+        data[addr & (MEM_PAGE_SIZE - 1)] = val;
+        return;
+    }
+
+    mem_write_slow(mem, addr, val);
+}
+
+static inline uint16_t mem_read_word(mem_t* mem, uint16_t addr)
+{
+    return mem_read(mem, addr) | (mem_read(mem, addr + 1) << 8);
+}
+
+static inline void mem_write_word(mem_t* mem, uint16_t addr, uint16_t val)
+{
+    mem_write(mem, addr, val & 0xff);
+    mem_write(mem, addr + 1, val >> 8);
+}
+
+// Checked versions of the above.
 uint8_t get_mem(mem_t* mem, uint16_t addr);
-uint8_t get_mem_word(mem_t* mem, uint16_t addr);
+uint16_t get_mem_word(mem_t* mem, uint16_t addr);
 
 void set_mem(mem_t* mem, uint16_t addr, uint8_t val);
-void set_mem_word(mem_t* mem, uint16_t addr, uint8_t val);
+void set_mem_word(mem_t* mem, uint16_t addr, uint16_t val);
+
+// Slow path of a RAM write: invalidates code decoded from the page and its
+// mirrors, marks them dirty and gives the machine its own copy of their
+// bytes if they are shared. Returns the writable page, NULL for MMIO pages
+// or when out of host memory.
+uint8_t* mem_unshare(mem_t* mem, uint8_t page);
+
+// Clears the dirty bitmap.
+void mem_checkpoint(mem_t* mem);
+
+static inline bool mem_dirty(const mem_t* mem, uint8_t page)
+{
+    return (mem->dirty[page / 64] >> (page % 64)) & 1;
+}
+
+// Flags a page as holding decoded code, so that the next write to it goes
+// through set_mem() and invalidates that code.
+void mem_mark_code(mem_t* mem, uint8_t page);
+
+// Host-side writes that ignore ROM, for loaders. MMIO pages are skipped.
+bool mem_load(mem_t* mem, uint16_t addr, const uint8_t* src, size_t size);
+
+// Maps `size` bytes of file `fd` read-only at `addr`. Whole pages point into
+// the mapping, shared with every process that maps the file until written;
+// partial pages at either end are copied.
+bool mem_map_file(mem_t* mem, uint16_t addr, int fd, size_t size);
+
+// Makes the pages covering [addr, addr + size) ROM.
+void mem_protect(mem_t* mem, uint16_t addr, uint32_t size);
+
+// Puts device `io` behind the pages covering [addr, addr + size); its
+// handlers get the full guest address. `io` must outlive the mapping, also
+// in clones, which share it. A NULL `io` turns the pages back into RAM of
+// zeros.
+void mem_map_io(mem_t* mem, uint16_t addr, uint32_t size, const mem_io_t* io);
+
+// Makes the pages covering [addr, addr + size) mirrors of those from `src`
+// on: both then show, and write to, the same bytes (or device). `addr` and
+// `src` are rounded down to a page.
+void mem_mirror(mem_t* mem, uint16_t addr, uint32_t size, uint16_t src);
+
+// 64-bit FNV-1a hash of the whole address space.
+uint64_t mem_digest(mem_t* mem);
 #endif
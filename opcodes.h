@@ -0,0 +1,925 @@
+// Opcode handlers shared by every dispatch core.
+//
+// This file is included in the middle of a dispatch loop that provides:
+//   cpu      the cpu_t being executed
+//   REG      its registers
+//   MEM      its memory
+//   opcode   the opcode that was just fetched
+//   cycles   the cycle counter of the current batch
+//   budget   the cycles the current batch may run
+// and the following macros:
+//   IMM8()   the 8-bit immediate operand of the instruction
+//   IMM16()  the 16-bit immediate operand of the instruction
+//   OP(n)    entry point of the handler for opcode n
+//   ALIAS(n) undocumented opcode n that shares the handler above it
+//   NEXT     account the opcode cycles and dispatch the next instruction
+//   JUMP     NEXT for an instruction that may have moved PC elsewhere, where
+//            a trap may be waiting (see trap.h)
+//   EXIT     account the opcode cycles and leave the dispatch loop
+//   SAVE()   hand the registers over to a callback such as a port handler
+//   LOAD()   take them back once it returns
+
+// Carry bit instructions
+OP(0x3f)
+    flags_set(REG, flags_get(REG) ^ FLAG_C);
+    NEXT;
+OP(0x37)
+    flags_set(REG, flags_get(REG) | FLAG_C);
+    NEXT;
+
+// INR
+OP(0x04)
+    REG->b = alu_inr(REG, REG->b);
+    NEXT;
+OP(0x0c)
+    REG->c = alu_inr(REG, REG->c);
+    NEXT;
+OP(0x14)
+    REG->d = alu_inr(REG, REG->d);
+    NEXT;
+OP(0x1c)
+    REG->e = alu_inr(REG, REG->e);
+    NEXT;
+OP(0x24)
+    REG->h = alu_inr(REG, REG->h);
+    NEXT;
+OP(0x2c)
+    REG->l = alu_inr(REG, REG->l);
+    NEXT;
+
+OP(0x34) {
+    uint8_t m = get_m(REG, MEM);
+    uint8_t r = alu_inr(REG, m);
+    set_m(REG, MEM, r);
+    NEXT;
+}
+OP(0x3c)
+    REG->a = alu_inr(REG, REG->a);
+    NEXT;
+
+// DCR
+OP(0x05)
+    REG->b = alu_dcr(REG, REG->b);
+    NEXT;
+OP(0x0d)
+    REG->c = alu_dcr(REG, REG->c);
+    NEXT;
+OP(0x15)
+    REG->d = alu_dcr(REG, REG->d);
+    NEXT;
+OP(0x1d)
+    REG->e = alu_dcr(REG, REG->e);
+    NEXT;
+OP(0x25)
+    REG->h = alu_dcr(REG, REG->h);
+    NEXT;
+OP(0x2d)
+    REG->l = alu_dcr(REG, REG->l);
+    NEXT;
+OP(0x35) {
+    uint8_t m = get_m(REG, MEM);
+    uint8_t r = alu_dcr(REG, m);
+    set_m(REG, MEM, r);
+    NEXT;
+}
+
+OP(0x3d)
+    REG->a = alu_dcr(REG, REG->a);
+    NEXT;
+
+
+// CMA
+OP(0x2f)
+    REG->a = ~REG->a;
+    NEXT;
+
+// DAA
+OP(0x27)
+    alu_daa(REG);
+    NEXT;
+
+// NOP: undocumented NOPs from 0x08 to 0x38
+OP(0x00)
+ALIAS(0x08)
+ALIAS(0x10)
+ALIAS(0x18)
+ALIAS(0x20)
+ALIAS(0x28)
+ALIAS(0x30)
+ALIAS(0x38)
+    NEXT;
+
+// MOV
+OP(0x40)
+    NEXT;
+OP(0x41)
+    REG->b = REG->c;
+    NEXT;
+OP(0x42)
+    REG->b = REG->d;
+    NEXT;
+OP(0x43)
+    REG->b = REG->e;
+    NEXT;
+OP(0x44)
+    REG->b = REG->h;
+    NEXT;
+OP(0x45)
+    REG->b = REG->l;
+    NEXT;
+OP(0x46)
+    REG->b = get_m(REG, MEM);
+    NEXT;
+OP(0x47)
+    REG->b = REG->a;
+    NEXT;
+OP(0x48)
+    REG->c = REG->b;
+    NEXT;
+OP(0x49)
+    NEXT;
+OP(0x4a)
+    REG->c = REG->d;
+    NEXT;
+OP(0x4b)
+    REG->c = REG->e;
+    NEXT;
+OP(0x4c)
+    REG->c = REG->h;
+    NEXT;
+OP(0x4d)
+    REG->c = REG->l;
+    NEXT;
+OP(0x4e)
+    REG->c = get_m(REG, MEM);
+    NEXT;
+OP(0x4f)
+    REG->c = REG->a;
+    NEXT;
+OP(0x50)
+    REG->d = REG->b;
+    NEXT;
+OP(0x51)
+    REG->d = REG->c;
+    NEXT;
+OP(0x52)
+    NEXT;
+OP(0x53)
+    REG->d = REG->e;
+    NEXT;
+OP(0x54)
+    REG->d = REG->h;
+    NEXT;
+OP(0x55)
+    REG->d = REG->l;
+    NEXT;
+OP(0x56)
+    REG->d = get_m(REG, MEM);
+    NEXT;
+OP(0x57)
+    REG->d = REG->a;
+    NEXT;
+OP(0x58)
+    REG->e = REG->b;
+    NEXT;
+OP(0x59)
+    REG->e = REG->c;
+    NEXT;
+OP(0x5a)
+    REG->e = REG->d;
+    NEXT;
+OP(0x5b)
+    NEXT;
+OP(0x5c)
+    REG->e = REG->h;
+    NEXT;
+OP(0x5d)
+    REG->e = REG->l;
+    NEXT;
+OP(0x5e)
+    REG->e = get_m(REG, MEM);
+    NEXT;
+OP(0x5f)
+    REG->e = REG->a;
+    NEXT;
+OP(0x60)
+    REG->h = REG->b;
+    NEXT;
+OP(0x61)
+    REG->h = REG->c;
+    NEXT;
+OP(0x62)
+    REG->h = REG->d;
+    NEXT;
+OP(0x63)
+    REG->h = REG->e;
+    NEXT;
+OP(0x64)
+    NEXT;
+OP(0x65)
+    REG->h = REG->l;
+    NEXT;
+OP(0x66)
+    REG->h = get_m(REG, MEM);
+    NEXT;
+OP(0x67)
+    REG->h = REG->a;
+    NEXT;
+OP(0x68)
+    REG->l = REG->b;
+    NEXT;
+OP(0x69)
+    REG->l = REG->c;
+    NEXT;
+OP(0x6a)
+    REG->l = REG->d;
+    NEXT;
+OP(0x6b)
+    REG->l = REG->e;
+    NEXT;
+OP(0x6c)
+    REG->l = REG->h;
+    NEXT;
+OP(0x6d)
+    NEXT;
+OP(0x6e)
+    REG->l = get_m(REG, MEM);
+    NEXT;
+OP(0x6f)
+    REG->l = REG->a;
+    NEXT;
+OP(0x70)
+    set_m(REG, MEM, REG->b);
+    NEXT;
+OP(0x71)
+    set_m(REG, MEM, REG->c);
+    NEXT;
+OP(0x72)
+    set_m(REG, MEM, REG->d);
+    NEXT;
+OP(0x73)
+    set_m(REG, MEM, REG->e);
+    NEXT;
+OP(0x74)
+    set_m(REG, MEM, REG->h);
+    NEXT;
+OP(0x75)
+    set_m(REG, MEM, REG->l);
+    NEXT;
+OP(0x77)
+    set_m(REG, MEM, REG->a);
+    NEXT;
+OP(0x78)
+    REG->a = REG->b;
+    NEXT;
+OP(0x79)
+    REG->a = REG->c;
+    NEXT;
+OP(0x7a)
+    REG->a = REG->d;
+    NEXT;
+OP(0x7b)
+    REG->a = REG->e;
+    NEXT;
+OP(0x7c)
+    REG->a = REG->h;
+    NEXT;
+OP(0x7d)
+    REG->a = REG->l;
+    NEXT;
+OP(0x7e)
+    REG->a = get_m(REG, MEM);
+    NEXT;
+OP(0x7f)
+    NEXT;
+
+// STAX
+OP(0x02)
+    mem_write(MEM, REG->bc, REG->a);
+    NEXT;
+OP(0x12)
+    mem_write(MEM, REG->de, REG->a);
+    NEXT;
+
+// LDAX
+OP(0x0a)
+    REG->a = mem_read(MEM, REG->bc);
+    NEXT;
+OP(0x1a)
+    REG->a = mem_read(MEM, REG->de);
+    NEXT;
+
+// ADD
+OP(0x80)
+    alu_add(REG, REG->b);
+    NEXT;
+OP(0x81)
+    alu_add(REG, REG->c);
+    NEXT;
+OP(0x82)
+    alu_add(REG, REG->d);
+    NEXT;
+OP(0x83)
+    alu_add(REG, REG->e);
+    NEXT;
+OP(0x84)
+    alu_add(REG, REG->h);
+    NEXT;
+OP(0x85)
+    alu_add(REG, REG->l);
+    NEXT;
+OP(0x86)
+    alu_add(REG, get_m(REG, MEM));
+    NEXT;
+OP(0x87)
+    alu_add(REG, REG->a);
+    NEXT;
+
+// ADC
+OP(0x88)
+    alu_adc(REG, REG->b);
+    NEXT;
+OP(0x89)
+    alu_adc(REG, REG->c);
+    NEXT;
+OP(0x8a)
+    alu_adc(REG, REG->d);
+    NEXT;
+OP(0x8b)
+    alu_adc(REG, REG->e);
+    NEXT;
+OP(0x8c)
+    alu_adc(REG, REG->h);
+    NEXT;
+OP(0x8d)
+    alu_adc(REG, REG->l);
+    NEXT;
+OP(0x8e)
+    alu_adc(REG, get_m(REG, MEM));
+    NEXT;
+OP(0x8f)
+    alu_adc(REG, REG->a);
+    NEXT;
+
+// SUB
+OP(0x90)
+    alu_sub(REG, REG->b);
+    NEXT;
+OP(0x91)
+    alu_sub(REG, REG->c);
+    NEXT;
+OP(0x92)
+    alu_sub(REG, REG->d);
+    NEXT;
+OP(0x93)
+    alu_sub(REG, REG->e);
+    NEXT;
+OP(0x94)
+    alu_sub(REG, REG->h);
+    NEXT;
+OP(0x95)
+    alu_sub(REG, REG->l);
+    NEXT;
+OP(0x96)
+    alu_sub(REG, get_m(REG, MEM));
+    NEXT;
+OP(0x97)
+    alu_sub(REG, REG->a);
+    NEXT;
+
+// SBB
+OP(0x98)
+    alu_sbb(REG, REG->b);
+    NEXT;
+OP(0x99)
+    alu_sbb(REG, REG->c);
+    NEXT;
+OP(0x9a)
+    alu_sbb(REG, REG->d);
+    NEXT;
+OP(0x9b)
+    alu_sbb(REG, REG->e);
+    NEXT;
+OP(0x9c)
+    alu_sbb(REG, REG->h);
+    NEXT;
+OP(0x9d)
+    alu_sbb(REG, REG->l);
+    NEXT;
+OP(0x9e)
+    alu_sbb(REG, get_m(REG, MEM));
+    NEXT;
+OP(0x9f)
+    alu_sbb(REG, REG->a);
+    NEXT;
+
+// ANA
+OP(0xa0)
+    alu_ana(REG, REG->b);
+    NEXT;
+OP(0xa1)
+    alu_ana(REG, REG->c);
+    NEXT;
+OP(0xa2)
+    alu_ana(REG, REG->d);
+    NEXT;
+OP(0xa3)
+    alu_ana(REG, REG->e);
+    NEXT;
+OP(0xa4)
+    alu_ana(REG, REG->h);
+    NEXT;
+OP(0xa5)
+    alu_ana(REG, REG->l);
+    NEXT;
+OP(0xa6)
+    alu_ana(REG, get_m(REG, MEM));
+    NEXT;
+OP(0xa7)
+    alu_ana(REG, REG->a);
+    NEXT;
+
+// XRA
+OP(0xa8)
+    alu_xra(REG, REG->b);
+    NEXT;
+OP(0xa9)
+    alu_xra(REG, REG->c);
+    NEXT;
+OP(0xaa)
+    alu_xra(REG, REG->d);
+    NEXT;
+OP(0xab)
+    alu_xra(REG, REG->e);
+    NEXT;
+OP(0xac)
+    alu_xra(REG, REG->h);
+    NEXT;
+OP(0xad)
+    alu_xra(REG, REG->l);
+    NEXT;
+OP(0xae)
+    alu_xra(REG, get_m(REG, MEM));
+    NEXT;
+OP(0xaf)
+    alu_xra(REG, REG->a);
+    NEXT;
+
+// ORA
+OP(0xb0)
+    alu_ora(REG, REG->b);
+    NEXT;
+OP(0xb1)
+    alu_ora(REG, REG->c);
+    NEXT;
+OP(0xb2)
+    alu_ora(REG, REG->d);
+    NEXT;
+OP(0xb3)
+    alu_ora(REG, REG->e);
+    NEXT;
+OP(0xb4)
+    alu_ora(REG, REG->h);
+    NEXT;
+OP(0xb5)
+    alu_ora(REG, REG->l);
+    NEXT;
+OP(0xb6)
+    alu_ora(REG, get_m(REG, MEM));
+    NEXT;
+OP(0xb7)
+    alu_ora(REG, REG->a);
+    NEXT;
+
+// CMP
+OP(0xb8)
+    alu_cmp(REG, REG->b);
+    NEXT;
+OP(0xb9)
+    alu_cmp(REG, REG->c);
+    NEXT;
+OP(0xba)
+    alu_cmp(REG, REG->d);
+    NEXT;
+OP(0xbb)
+    alu_cmp(REG, REG->e);
+    NEXT;
+OP(0xbc)
+    alu_cmp(REG, REG->h);
+    NEXT;
+OP(0xbd)
+    alu_cmp(REG, REG->l);
+    NEXT;
+OP(0xbe)
+    alu_cmp(REG, get_m(REG, MEM));
+    NEXT;
+OP(0xbf)
+    alu_cmp(REG, REG->a);
+    NEXT;
+
+// RLC
+OP(0x07)
+    alu_rlc(REG);
+    NEXT;
+
+// RRC
+OP(0x0f)
+    alu_rrc(REG);
+    NEXT;
+
+// RAL
+OP(0x17)
+    alu_ral(REG);
+    NEXT;
+
+// RAR
+OP(0x1f)
+    alu_rar(REG);
+    NEXT;
+
+// PUSH
+OP(0xc5)
+    stack_add(REG, MEM, REG->bc);
+    NEXT;
+OP(0xd5)
+    stack_add(REG, MEM, REG->de);
+    NEXT;
+OP(0xe5)
+    stack_add(REG, MEM, REG->hl);
+    NEXT;
+OP(0xf5)
+    stack_add(REG, MEM, (REG->a << 8) | flags_get(REG));
+    NEXT;
+
+// POP Pop Data Off Stack
+OP(0xc1) {
+    uint16_t val = stack_pop(REG, MEM);
+    REG->bc = val;
+    NEXT;
+}
+OP(0xd1) {
+    uint16_t val = stack_pop(REG, MEM);
+    REG->de = val;
+    NEXT;
+}
+OP(0xe1) {
+    uint16_t val = stack_pop(REG, MEM);
+    REG->hl = val;
+    NEXT;
+}
+OP(0xf1) {
+    uint16_t val = stack_pop(REG, MEM);
+    REG->a = val >> 8;
+    flags_set(REG, (val & 0xd5) | FLAG_ALWAYS);
+    NEXT;
+}
+
+// DAD
+OP(0x09)
+    alu_dad(REG, REG->bc);
+    NEXT;
+OP(0x19)
+    alu_dad(REG, REG->de);
+    NEXT;
+OP(0x29)
+    alu_dad(REG, REG->hl);
+    NEXT;
+OP(0x39)
+    alu_dad(REG, REG->sp);
+    NEXT;
+
+// INX
+OP(0x03)
+    REG->bc++;
+    NEXT;
+OP(0x13)
+    REG->de++;
+    NEXT;
+OP(0x23)
+    REG->hl++;
+    NEXT;
+OP(0x33)
+    REG->sp++;
+    NEXT;
+
+// DCX
+OP(0x0b)
+    REG->bc--;
+    NEXT;
+OP(0x1b)
+    REG->de--;
+    NEXT;
+OP(0x2b)
+    REG->hl--;
+    NEXT;
+OP(0x3b)
+    REG->sp--;
+    NEXT;
+
+// XCHG
+OP(0xeb) {
+    uint16_t val = REG->hl;
+    REG->hl = REG->de;
+    REG->de = val;
+    NEXT;
+}
+
+// XTHL
+OP(0xe3) {
+    uint16_t val = mem_read_word(MEM, REG->sp);
+    uint16_t b = REG->hl;
+    REG->hl = val;
+    mem_write_word(MEM, REG->sp, b);
+    NEXT;
+}
+
+// SPHL
+OP(0xf9)
+    REG->sp = REG->hl;
+    NEXT;
+
+// LXI
+OP(0x01) {
+    uint16_t val = IMM16();
+    REG->bc = val;
+    NEXT;
+}
+OP(0x11) {
+    uint16_t val = IMM16();
+    REG->de = val;
+    NEXT;
+}
+OP(0x21) {
+    uint16_t val = IMM16();
+    REG->hl = val;
+    NEXT;
+}
+OP(0x31) {
+    uint16_t val = IMM16();
+    REG->sp = val;
+    NEXT;
+}
+
+// MVI
+OP(0x06)
+    REG->b = IMM8();
+    NEXT;
+OP(0x0e)
+    REG->c = IMM8();
+    NEXT;
+OP(0x16)
+    REG->d = IMM8();
+    NEXT;
+OP(0x1e)
+    REG->e = IMM8();
+    NEXT;
+OP(0x26)
+    REG->h = IMM8();
+    NEXT;
+OP(0x2e)
+    REG->l = IMM8();
+    NEXT;
+OP(0x36) {
+    uint8_t val = IMM8();
+    set_m(REG, MEM, val);
+    NEXT;
+}
+OP(0x3e)
+    REG->a = IMM8();
+    NEXT;
+
+// ADI
+OP(0xc6) {
+    uint8_t val = IMM8();
+    alu_add(REG, val);
+    NEXT;
+}
+
+// ACI
+OP(0xce) {
+    uint8_t val = IMM8();
+    alu_adc(REG, val);
+    NEXT;
+}
+
+// SUI
+OP(0xd6) {
+    uint8_t val = IMM8();
+    alu_sub(REG, val);
+    NEXT;
+}
+
+// SBI
+OP(0xde) {
+    uint8_t val = IMM8();
+    alu_sbb(REG, val);
+    NEXT;
+}
+
+// ANI
+OP(0xe6) {
+    uint8_t val = IMM8();
+    alu_ana(REG, val);
+    NEXT;
+}
+
+// XRI
+OP(0xee) {
+    uint8_t val = IMM8();
+    alu_xra(REG, val);
+    NEXT;
+}
+
+// ORI
+OP(0xf6) {
+    uint8_t val = IMM8();
+    alu_ora(REG, val);
+    NEXT;
+}
+
+// CPI
+OP(0xfe) {
+    uint8_t val = IMM8();
+    alu_cmp(REG, val);
+    NEXT;
+}
+
+// STA
+OP(0x32) {
+    uint16_t addr = IMM16();
+    mem_write(MEM, addr, REG->a);
+    NEXT;
+}
+
+// LDA
+OP(0x3a) {
+    uint16_t addr = IMM16();
+    uint8_t val = mem_read(MEM, addr);
+    REG->a = val;
+    NEXT;
+}
+
+// SHLD
+OP(0x22) {
+    uint16_t addr = IMM16();
+    mem_write_word(MEM, addr, REG->hl);
+    NEXT;
+}
+
+// LHLD
+OP(0x2a) {
+    uint16_t addr = IMM16();
+    uint16_t val = mem_read_word(MEM, addr);
+    REG->hl = val;
+    NEXT;
+}
+
+
+// PCHL
+OP(0xe9)
+    REG->pc = REG->hl;
+    JUMP;
+
+// JUMP
+OP(0xc3)
+ALIAS(0xcb)
+    REG->pc = IMM16();
+    JUMP;
+
+OP(0xc2) // JNZ
+OP(0xca) // JZ
+OP(0xd2) // JNC
+OP(0xda) // JC
+OP(0xe2) // JPO
+OP(0xea) // JPE
+OP(0xf2) // JP
+OP(0xfa) // JM
+{
+    uint16_t addr = IMM16();
+
+    if (cond(REG, opcode)) {
+        REG->pc = addr;
+    }
+
+    JUMP;
+}
+
+// CALL
+OP(0xcd)
+ALIAS(0xdd)
+ALIAS(0xed)
+ALIAS(0xfd)
+{
+    uint16_t addr = IMM16();
+
+    stack_add(REG, MEM, REG->pc);
+    REG->pc = addr;
+
+    JUMP;
+}
+
+OP(0xc4) // CNZ
+OP(0xcc) // CZ
+OP(0xd4) // CNC
+OP(0xdc) // CC
+OP(0xe4) // CPO
+OP(0xec) // CPE
+OP(0xf4) // CP
+OP(0xfc) // CM
+{
+    uint16_t addr = IMM16();
+
+    if (cond(REG, opcode)) {
+        cycles += 6;
+        stack_add(REG, MEM, REG->pc);
+        REG->pc = addr;
+    }
+
+    JUMP;
+}
+
+// RET
+OP(0xc9)
+ALIAS(0xd9)
+    REG->pc = stack_pop(REG, MEM);
+    JUMP;
+
+OP(0xc0) // RNZ
+OP(0xc8) // RZ
+OP(0xd0) // RNC
+OP(0xd8) // RC
+OP(0xe0) // RPO
+OP(0xe8) // RPE
+OP(0xf0) // RP
+OP(0xf8) // RM
+    if (cond(REG, opcode)) {
+        cycles += 6;
+        REG->pc = stack_pop(REG, MEM);
+    }
+
+    JUMP;
+
+// RST
+OP(0xc7)
+OP(0xcf)
+OP(0xd7)
+OP(0xdf)
+OP(0xe7)
+OP(0xef)
+OP(0xf7)
+OP(0xff)
+    stack_add(REG, MEM, REG->pc);
+    REG->pc = (uint16_t)(opcode & 0x38);
+    JUMP;
+
+// Interrupts
+OP(0xfb)
+    cpu->interrupt = true;
+    NEXT;
+OP(0xf3)
+    cpu->interrupt = false;
+    NEXT;
+
+// I/O, through the port handlers or else trapped to the host
+OP(0xdb)
+    cpu->io_port = IMM8();
+    cpu->io_out = false;
+    if (cpu->io != NULL && cpu->io->port[cpu->io_port].in != NULL) {
+        const io_port_t* port = &cpu->io->port[cpu->io_port];
+        uint8_t val;
+
+        SAVE();
+        val = port->in(port->ctx, cpu->io_port);
+        LOAD();
+        REG->a = val;
+        // The handler scheduled an event that is due within the batch.
+        if (cpu->events != NULL && cpu->cycles + budget > cpu->next_event) {
+            EXIT;
+        }
+        NEXT;
+    }
+    cpu->stop = STOP_IO;
+    EXIT;
+OP(0xd3)
+    cpu->io_port = IMM8();
+    cpu->io_out = true;
+    if (cpu->io != NULL && cpu->io->port[cpu->io_port].out != NULL) {
+        const io_port_t* port = &cpu->io->port[cpu->io_port];
+
+        SAVE();
+        port->out(port->ctx, cpu->io_port, REG->a);
+        LOAD();
+        // The handler scheduled an event that is due within the batch.
+        if (cpu->events != NULL && cpu->cycles + budget > cpu->next_event) {
+            EXIT;
+        }
+        NEXT;
+    }
+    cpu->stop = STOP_IO;
+    EXIT;
+
+// HLT
+OP(0x76)
+    cpu->halted = true;
+    cpu->stop = STOP_HALT;
+    EXIT;
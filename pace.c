@@ -0,0 +1,116 @@
+#include "pace.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+    struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+
+    // Interrupted by a signal: go back to sleep.
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+void init_pace(pace_t* pace, uint64_t tick_ns, uint32_t skip)
+{
+    if (pace == NULL) {
+        return;
+    }
+
+    pace->tick_ns = tick_ns;
+    pace->skip = skip > 0 ? skip : 1;
+    pace->turbo = false;
+    pace->deadline = now_ns();
+    pace->ticks = 0;
+    pace->spin_ns = PACE_SPIN_MIN_NS;
+    pace->waits = 0;
+    pace->jitter_sum_ns = 0;
+    pace->jitter_max_ns = 0;
+    pace->dropped_ns = 0;
+
+#ifdef __linux__
+    // Sleeps otherwise wake up to 50us late, so that they can be batched.
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+#endif
+}
+
+void pace_tick(pace_t* pace)
+{
+    if (pace == NULL || pace->turbo || ++pace->ticks < pace->skip) {
+        return;
+    }
+
+    pace->deadline += pace->tick_ns * pace->ticks;
+    pace->ticks = 0;
+
+    uint64_t now = now_ns();
+
+    // Behind: catch up by not waiting, or give up on the lost time.
+    if (now >= pace->deadline) {
+        if (now - pace->deadline > pace->tick_ns * PACE_MAX_LAG) {
+            pace->dropped_ns += now - pace->deadline;
+            pace->deadline = now;
+        }
+
+        return;
+    }
+
+    if (pace->deadline - now > pace->spin_ns) {
+        uint64_t wake = pace->deadline - pace->spin_ns;
+
+        sleep_until(wake);
+        now = now_ns();
+
+        uint64_t late = now > wake ? now - wake : 0;
+
+        if (late > pace->spin_ns) {
+            pace->spin_ns += (late - pace->spin_ns) / 2;
+        } else {
+            pace->spin_ns -= pace->spin_ns / 64;
+        }
+
+        pace->spin_ns = pace->spin_ns < PACE_SPIN_MIN_NS ? PACE_SPIN_MIN_NS : pace->spin_ns;
+        pace->spin_ns = pace->spin_ns > PACE_SPIN_MAX_NS ? PACE_SPIN_MAX_NS : pace->spin_ns;
+    }
+
+    // Yielding, so that a spinning instance gives way to any other that
+    // has work on a crowded host.
+    while (now < pace->deadline) {
+        sched_yield();
+        now = now_ns();
+    }
+
+    uint64_t jitter = now - pace->deadline;
+
+    pace->waits++;
+    pace->jitter_sum_ns += jitter;
+    pace->jitter_max_ns = jitter > pace->jitter_max_ns ? jitter : pace->jitter_max_ns;
+}
+
+void pace_turbo(pace_t* pace, bool turbo)
+{
+    if (pace == NULL) {
+        return;
+    }
+
+    if (pace->turbo && !turbo) {
+        pace->deadline = now_ns();
+        pace->ticks = 0;
+    }
+
+    pace->turbo = turbo;
+}
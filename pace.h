@@ -0,0 +1,55 @@
+#ifndef __PACE_H__
+#define __PACE_H__
+
+#include "common.h"
+
+#define PACE_MAX_LAG 8 // Ticks the host may fall behind before the time is dropped.
+#define PACE_SPIN_MIN_NS 10000
+#define PACE_SPIN_MAX_NS 200000
+
+// Keeps emulated time in step with wall-clock time. The host runs one tick
+// of emulated time (TICK_CYCLES) and calls pace_tick(), which waits until
+// the tick is due.
+//
+// Waits sleep until shortly before the deadline and spin for the rest, so
+// that the wake-up lands within a few microseconds of it without a core
+// busy-waiting the whole time. The spin margin follows how late the sleeps
+// have been waking up: it grows quickly after a late wake-up and shrinks
+// slowly, within PACE_SPIN_MAX_NS so that spinning stays around 1% of a
+// tick even on a crowded host, where wake-ups are late because every core
+// is busy and spinning longer would only make that worse. init_pace()
+// lowers the timer slack of the calling thread on Linux, which keeps most
+// sleeps within tens of microseconds to begin with.
+//
+// A host that falls behind runs the missing ticks back to back until it has
+// caught up; past PACE_MAX_LAG ticks the missed time is dropped instead.
+typedef struct {
+    uint64_t tick_ns; // Wall-clock time of one tick.
+    uint32_t skip; // Ticks run back to back between waits (frame skip).
+    bool turbo; // Unthrottled: pace_tick() returns at once.
+
+    uint64_t deadline; // When the ticks run so far are due, CLOCK_MONOTONIC.
+    uint32_t ticks; // Ticks since the last wait.
+    uint64_t spin_ns; // Spin margin before the deadline.
+
+    // Statistics, since init_pace().
+    uint64_t waits;
+    uint64_t jitter_sum_ns; // Of the time each wait returned past its deadline.
+    uint64_t jitter_max_ns;
+    uint64_t dropped_ns;
+} pace_t;
+
+// Starts the clock. `skip` ticks are run per wait, 1 to wait after every
+// one; waiting less often costs fewer wake-ups at the price of coarser
+// pacing.
+void init_pace(pace_t* pace, uint64_t tick_ns, uint32_t skip);
+
+// Called after every tick; waits when the next batch of ticks is not due
+// yet.
+void pace_tick(pace_t* pace);
+
+// Turns turbo on or off. Turning it off restarts the clock from now, so
+// the time run ahead is not paid back.
+void pace_turbo(pace_t* pace, bool turbo);
+
+#endif
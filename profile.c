@@ -0,0 +1,498 @@
+#include "profile.h"
+
+#include <stdlib.h>
+
+#include "cpu.h"
+
+#define PROFILE_ROOT 0 // Node of the code outside any call.
+#define PROFILE_NODES 1024 // Initial call tree size, grown as needed.
+#define PROFILE_TOP 0x10000 // Caller of the calls made outside any call.
+
+// A position in the call tree: one call target reached through a given
+// chain of callers. Children are always created after their parent.
+typedef struct {
+    uint16_t addr;
+    uint32_t parent;
+    uint32_t child; // First child, 0 if none (the root is nobody's child).
+    uint32_t sibling;
+    uint64_t calls;
+    uint64_t self; // Cycles spent while this was the innermost frame.
+} node_t;
+
+typedef struct {
+    uint32_t node;
+    uint16_t sp; // Where the return address is.
+} frame_t;
+
+// One line of a report.
+typedef struct {
+    uint64_t key;
+    uint64_t count;
+    uint64_t cycles;
+    uint64_t self;
+} row_t;
+
+struct profile {
+    profile_mode_t mode;
+    uint32_t period;
+    uint64_t next_sample; // Cycle of the next sample.
+    bool started;
+
+    // The instruction fetched last, charged when the next one is fetched.
+    bool pending;
+    uint16_t last_pc;
+    uint16_t last_sp;
+    uint8_t last_opcode;
+    uint64_t last_cycle;
+
+    uint64_t count; // Instructions (samples) charged.
+    uint64_t cycles;
+    uint64_t irq_count;
+    uint64_t irq_cycles;
+    uint64_t op_count[256];
+    uint64_t op_cycles[256];
+    uint64_t pc_count[65536];
+    uint64_t pc_cycles[65536];
+    uint64_t fetched; // Instructions recorded, counted exactly in both modes.
+    uint64_t pair_count[256][256]; // [opcode][opcode that follows it in memory]
+
+    node_t* nodes;
+    uint32_t node_count;
+    uint32_t node_cap;
+    frame_t frames[PROFILE_MAX_DEPTH];
+    unsigned depth;
+};
+
+// clang-format off
+// 1 for instructions that push a return address, 2 for returns.
+static const uint8_t CALL_KIND[256] = {
+    [0xc4] = 1, [0xcc] = 1, [0xcd] = 1, [0xd4] = 1, [0xdc] = 1, [0xdd] = 1, [0xe4] = 1, [0xec] = 1,
+    [0xed] = 1, [0xf4] = 1, [0xfc] = 1, [0xfd] = 1,
+    [0xc7] = 1, [0xcf] = 1, [0xd7] = 1, [0xdf] = 1, [0xe7] = 1, [0xef] = 1, [0xf7] = 1, [0xff] = 1,
+    [0xc0] = 2, [0xc8] = 2, [0xc9] = 2, [0xd0] = 2, [0xd8] = 2, [0xd9] = 2, [0xe0] = 2, [0xe8] = 2,
+    [0xf0] = 2, [0xf8] = 2,
+};
+// clang-format on
+
+profile_t* profile_create(profile_mode_t mode, uint32_t period)
+{
+    if (mode == PROFILE_SAMPLE && period == 0) {
+        return NULL;
+    }
+
+    profile_t* prof = calloc(1, sizeof(profile_t));
+
+    if (prof == NULL) {
+        return NULL;
+    }
+
+    prof->mode = mode;
+    prof->period = period;
+    prof->nodes = calloc(PROFILE_NODES, sizeof(node_t));
+    prof->node_count = 1;
+    prof->node_cap = PROFILE_NODES;
+
+    if (prof->nodes == NULL) {
+        free(prof);
+        return NULL;
+    }
+
+    return prof;
+}
+
+void profile_destroy(profile_t* prof)
+{
+    if (prof == NULL) {
+        return;
+    }
+
+    free(prof->nodes);
+    free(prof);
+}
+
+static uint32_t current(const profile_t* prof)
+{
+    return prof->depth > 0 ? prof->frames[prof->depth - 1].node : PROFILE_ROOT;
+}
+
+// Charges `cycles` spent at `pc` running `opcode` (or in an interrupt when
+// `irq` is set) to the counters, from cycle `from` on.
+static void charge(profile_t* prof, uint16_t pc, uint8_t opcode, bool irq, uint64_t from, uint64_t cycles)
+{
+    node_t* node = &prof->nodes[current(prof)];
+    uint64_t count = 1;
+
+    if (prof->mode == PROFILE_SAMPLE) {
+        if (!prof->started) {
+            prof->next_sample = from;
+            prof->started = true;
+        }
+
+        for (count = 0; prof->next_sample < from + cycles; count++) {
+            prof->next_sample += prof->period;
+        }
+
+        if (count == 0) {
+            return;
+        }
+
+        cycles = count * prof->period;
+    }
+
+    node->self += cycles;
+
+    if (irq) {
+        prof->irq_count += count;
+        prof->irq_cycles += cycles;
+        return;
+    }
+
+    prof->count += count;
+    prof->cycles += cycles;
+    prof->op_count[opcode] += count;
+    prof->op_cycles[opcode] += cycles;
+    prof->pc_count[pc] += count;
+    prof->pc_cycles[pc] += cycles;
+}
+
+// Enters a call to `addr` whose return address is at `sp`.
+static void push(profile_t* prof, uint16_t addr, uint16_t sp)
+{
+    if (prof->depth == PROFILE_MAX_DEPTH) {
+        return;
+    }
+
+    uint32_t parent = current(prof);
+    uint32_t child = prof->nodes[parent].child;
+
+    while (child != 0 && prof->nodes[child].addr != addr) {
+        child = prof->nodes[child].sibling;
+    }
+
+    if (child == 0) {
+        if (prof->node_count == prof->node_cap) {
+            node_t* nodes = realloc(prof->nodes, (size_t)prof->node_cap * 2 * sizeof(node_t));
+
+            if (nodes == NULL) {
+                return;
+            }
+
+            prof->nodes = nodes;
+            prof->node_cap *= 2;
+        }
+
+        child = prof->node_count++;
+        prof->nodes[child] = (node_t) { .addr = addr, .parent = parent, .sibling = prof->nodes[parent].child };
+        prof->nodes[parent].child = child;
+    }
+
+    prof->nodes[child].calls++;
+    prof->frames[prof->depth++] = (frame_t) { child, sp };
+}
+
+void profile_settle(profile_t* prof, uint16_t pc, uint16_t sp, uint64_t cycle)
+{
+    if (prof == NULL || !prof->pending) {
+        return;
+    }
+
+    prof->pending = false;
+    charge(prof, prof->last_pc, prof->last_opcode, false, prof->last_cycle, cycle - prof->last_cycle);
+
+    // Both only move SP when taken.
+    if (sp == prof->last_sp) {
+        return;
+    }
+
+    switch (CALL_KIND[prof->last_opcode]) {
+    case 1:
+        push(prof, pc, sp);
+        break;
+    case 2:
+        // Back to the caller of the frame whose return address was popped.
+        for (unsigned i = prof->depth; i > 0; i--) {
+            if (prof->frames[i - 1].sp == prof->last_sp) {
+                prof->depth = i - 1;
+                break;
+            }
+        }
+        break;
+    }
+}
+
+void profile_record(profile_t* prof, uint16_t pc, uint16_t sp, uint8_t opcode, uint64_t cycle)
+{
+    if (prof == NULL) {
+        return;
+    }
+
+    // A pair when the last instruction went on to the next one, which the
+    // block cache could run as one (see fuse.h).
+    if (prof->pending && pc == (uint16_t)(prof->last_pc + OPCODES_SIZE[prof->last_opcode])) {
+        prof->pair_count[prof->last_opcode][opcode]++;
+    }
+
+    profile_settle(prof, pc, sp, cycle);
+
+    prof->fetched++;
+    prof->pending = true;
+    prof->last_pc = pc;
+    prof->last_sp = sp;
+    prof->last_opcode = opcode;
+    prof->last_cycle = cycle;
+}
+
+void profile_interrupt(profile_t* prof, uint16_t addr, uint16_t sp, uint64_t cycle, uint32_t cycles)
+{
+    if (prof == NULL) {
+        return;
+    }
+
+    push(prof, addr, sp);
+    charge(prof, addr, 0, true, cycle, cycles);
+}
+
+// Call target of the node's parent, PROFILE_TOP for the root.
+static uint32_t caller_of(const profile_t* prof, const node_t* node)
+{
+    return node->parent == PROFILE_ROOT ? PROFILE_TOP : prof->nodes[node->parent].addr;
+}
+
+static int by_key(const void* a, const void* b)
+{
+    const row_t* x = a;
+    const row_t* y = b;
+
+    return (x->key > y->key) - (x->key < y->key);
+}
+
+// Most cycles first, then lowest key.
+static int by_cycles(const void* a, const void* b)
+{
+    const row_t* x = a;
+    const row_t* y = b;
+
+    if (x->cycles != y->cycles) {
+        return x->cycles < y->cycles ? 1 : -1;
+    }
+
+    return by_key(a, b);
+}
+
+// Most counted first, then lowest key.
+static int by_count(const void* a, const void* b)
+{
+    const row_t* x = a;
+    const row_t* y = b;
+
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+
+    return by_key(a, b);
+}
+
+static double percent(uint64_t part, uint64_t total)
+{
+    return total > 0 ? 100.0 * part / total : 0.0;
+}
+
+// Merges the call tree into one row per caller -> callee pair, keyed
+// caller << 16 | callee (see caller_of()), with the cycles spent in the
+// callee and below. A call nested in a call of the same pair only adds its
+// calls and self cycles, the outer one already covers its inclusive cycles.
+// Returns the number of rows, or -1 when out of memory.
+static long call_edges(const profile_t* prof, row_t* rows)
+{
+    uint64_t* inclusive = malloc((size_t)prof->node_count * sizeof(uint64_t));
+    long count = 0;
+
+    if (inclusive == NULL) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < prof->node_count; i++) {
+        inclusive[i] = prof->nodes[i].self;
+    }
+
+    for (uint32_t i = prof->node_count - 1; i > PROFILE_ROOT; i--) {
+        inclusive[prof->nodes[i].parent] += inclusive[i];
+    }
+
+    for (uint32_t i = PROFILE_ROOT + 1; i < prof->node_count; i++) {
+        const node_t* node = &prof->nodes[i];
+        uint32_t caller = caller_of(prof, node);
+        bool nested = false;
+
+        for (uint32_t up = node->parent; up != PROFILE_ROOT && !nested; up = prof->nodes[up].parent) {
+            const node_t* outer = &prof->nodes[up];
+
+            nested = outer->addr == node->addr && caller_of(prof, outer) == caller;
+        }
+
+        rows[count++] = (row_t) {
+            .key = (uint64_t)caller << 16 | node->addr,
+            .count = node->calls,
+            .cycles = nested ? 0 : inclusive[i],
+            .self = node->self,
+        };
+    }
+
+    free(inclusive);
+    qsort(rows, count, sizeof(row_t), by_key);
+
+    long merged = 0;
+
+    for (long i = 0; i < count; i++) {
+        if (merged > 0 && rows[merged - 1].key == rows[i].key) {
+            rows[merged - 1].count += rows[i].count;
+            rows[merged - 1].cycles += rows[i].cycles;
+            rows[merged - 1].self += rows[i].self;
+        } else {
+            rows[merged++] = rows[i];
+        }
+    }
+
+    return merged;
+}
+
+bool profile_dump(profile_t* prof, FILE* file)
+{
+    if (prof == NULL || file == NULL) {
+        return false;
+    }
+
+    row_t* rows = malloc((prof->node_count > 65536 ? prof->node_count : 65536) * sizeof(row_t));
+    uint64_t total = prof->cycles + prof->irq_cycles;
+    const char* unit = prof->mode == PROFILE_SAMPLE ? "samples" : "count";
+    long count = 0;
+
+    if (rows == NULL) {
+        return false;
+    }
+
+    if (prof->mode == PROFILE_SAMPLE) {
+        fprintf(file, "%llu samples every %u cycles, %llu in interrupts\n",
+            (unsigned long long)(prof->count + prof->irq_count),
+            prof->period,
+            (unsigned long long)prof->irq_count);
+    } else {
+        fprintf(file, "%llu instructions in %llu cycles, %llu interrupts in %llu cycles\n",
+            (unsigned long long)prof->count,
+            (unsigned long long)prof->cycles,
+            (unsigned long long)prof->irq_count,
+            (unsigned long long)prof->irq_cycles);
+    }
+
+    for (uint32_t pc = 0; pc < 65536; pc++) {
+        if (prof->pc_count[pc] > 0) {
+            rows[count++] = (row_t) { .key = pc, .count = prof->pc_count[pc], .cycles = prof->pc_cycles[pc] };
+        }
+    }
+
+    qsort(rows, count, sizeof(row_t), by_cycles);
+    fprintf(file, "\n%14s %7s %12s  PC\n", "cycles", "%", unit);
+
+    for (long i = 0; i < count; i++) {
+        fprintf(file, "%14llu %7.3f %12llu  %04X\n",
+            (unsigned long long)rows[i].cycles,
+            percent(rows[i].cycles, total),
+            (unsigned long long)rows[i].count,
+            (unsigned)rows[i].key);
+    }
+
+    count = 0;
+    for (uint32_t op = 0; op < 256; op++) {
+        if (prof->op_count[op] > 0) {
+            rows[count++] = (row_t) { .key = op, .count = prof->op_count[op], .cycles = prof->op_cycles[op] };
+        }
+    }
+
+    qsort(rows, count, sizeof(row_t), by_cycles);
+    fprintf(file, "\n%14s %7s %12s  opcode\n", "cycles", "%", unit);
+
+    for (long i = 0; i < count; i++) {
+        fprintf(file, "%14llu %7.3f %12llu  %02X\n",
+            (unsigned long long)rows[i].cycles,
+            percent(rows[i].cycles, total),
+            (unsigned long long)rows[i].count,
+            (unsigned)rows[i].key);
+    }
+
+    count = 0;
+    for (uint32_t pair = 0; pair < 65536; pair++) {
+        if (prof->pair_count[pair >> 8][pair & 0xff] > 0) {
+            rows[count++] = (row_t) { .key = pair, .count = prof->pair_count[pair >> 8][pair & 0xff] };
+        }
+    }
+
+    qsort(rows, count, sizeof(row_t), by_count);
+    fprintf(file, "\n%14s %7s  pair\n", "count", "%");
+
+    for (long i = 0; i < count; i++) {
+        fprintf(file, "%14llu %7.3f  %02X %02X\n",
+            (unsigned long long)rows[i].count,
+            percent(rows[i].count, prof->fetched),
+            (unsigned)(rows[i].key >> 8),
+            (unsigned)(rows[i].key & 0xff));
+    }
+
+    count = call_edges(prof, rows);
+
+    if (count < 0) {
+        free(rows);
+        return false;
+    }
+
+    qsort(rows, count, sizeof(row_t), by_cycles);
+    fprintf(file, "\n%14s %7s %14s %12s  caller -> callee\n", "inclusive", "%", "self", "calls");
+
+    for (long i = 0; i < count; i++) {
+        char caller[8] = "top";
+
+        if (rows[i].key >> 16 != PROFILE_TOP) {
+            snprintf(caller, sizeof(caller), "%04X", (unsigned)(rows[i].key >> 16));
+        }
+
+        fprintf(file, "%14llu %7.3f %14llu %12llu  %s -> %04X\n",
+            (unsigned long long)rows[i].cycles,
+            percent(rows[i].cycles, total),
+            (unsigned long long)rows[i].self,
+            (unsigned long long)rows[i].count,
+            caller,
+            (unsigned)(rows[i].key & 0xffff));
+    }
+
+    free(rows);
+    return !ferror(file);
+}
+
+bool profile_dump_folded(profile_t* prof, FILE* file)
+{
+    if (prof == NULL || file == NULL) {
+        return false;
+    }
+
+    uint32_t path[PROFILE_MAX_DEPTH + 1];
+
+    for (uint32_t i = 0; i < prof->node_count; i++) {
+        if (prof->nodes[i].self == 0) {
+            continue;
+        }
+
+        unsigned depth = 0;
+
+        for (uint32_t up = i; up != PROFILE_ROOT; up = prof->nodes[up].parent) {
+            path[depth++] = up;
+        }
+
+        fputs("top", file);
+        while (depth > 0) {
+            fprintf(file, ";%04X", prof->nodes[path[--depth]].addr);
+        }
+
+        fprintf(file, " %llu\n", (unsigned long long)prof->nodes[i].self);
+    }
+
+    return !ferror(file);
+}
@@ -0,0 +1,55 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include "common.h"
+
+#include <stdio.h>
+
+#define PROFILE_MAX_DEPTH 256 // Deeper calls are charged to the deepest frame.
+
+typedef enum {
+    PROFILE_EXACT = 0, // Every instruction is counted with its cycles.
+    PROFILE_SAMPLE, // One instruction is counted every `period` cycles.
+} profile_mode_t;
+
+// Where the guest spends its cycles. Profiling is on while cpu->profile
+// points at one; like tracing, batches then run through the interpreter.
+//
+// An instruction's cycles are only known once it has run (conditional CALLs
+// and RETs take 6 more when taken), so each one is charged when the next is
+// fetched. The call graph follows CALL, RST and interrupts: a call that
+// was taken pushes a frame for its target, and a RET that was taken returns
+// from the frame whose return address it popped, along with any frames
+// above it that code dropping its return address left behind. A RET to an
+// address pushed some other way, as in jump tables, is not a return.
+//
+// In sampling mode the counts are samples and the cycles are estimates,
+// `period` for each sample. Pairs of an instruction and the one that
+// follows it in memory are counted exactly either way, for fusegen.
+typedef struct profile profile_t;
+
+profile_t* profile_create(profile_mode_t mode, uint32_t period);
+void profile_destroy(profile_t* prof);
+
+// Called by the interpreter for every instruction it fetches, with PC
+// pointing at the opcode and SP and the cycle count as they are before it
+// runs.
+void profile_record(profile_t* prof, uint16_t pc, uint16_t sp, uint8_t opcode, uint64_t cycle);
+
+// Called by handle_interrupt() once it has settled the last instruction
+// and pushed PC, with the cycle count before the `cycles` of the interrupt.
+void profile_interrupt(profile_t* prof, uint16_t addr, uint16_t sp, uint64_t cycle, uint32_t cycles);
+
+// Charges the last instruction fetched, which has run by `cycle`. Call it
+// before dumping; the profile can go on afterwards.
+void profile_settle(profile_t* prof, uint16_t pc, uint16_t sp, uint64_t cycle);
+
+// Text report: totals, then PCs and opcodes by cycles, opcode pairs by
+// count as a share of the instructions run, and call graph edges by cycles.
+bool profile_dump(profile_t* prof, FILE* file);
+
+// One line per call stack, outermost frame first, with the cycles spent in
+// its innermost frame, as read by flamegraph.pl and speedscope.
+bool profile_dump_folded(profile_t* prof, FILE* file);
+
+#endif
@@ -1,5 +1,7 @@
 #include "regs.h"
 
+#include "flags.h"
+
 void init_reg(reg_t* reg)
 {
     if (reg == NULL) {
@@ -16,6 +18,9 @@ void init_reg(reg_t* reg)
     reg->l = 0;
     reg->sp = 0;
     reg->pc = 0;
+#ifdef LAZY_FLAGS
+    reg->lazy = LAZY_NONE;
+#endif
 }
 
 uint16_t get_reg_af(reg_t* reg)
@@ -24,7 +29,7 @@ uint16_t get_reg_af(reg_t* reg)
         return 0;
     }
 
-    return (reg->a << 8) | reg->f;
+    return (reg->a << 8) | flags_get(reg);
 }
 
 uint16_t get_reg_bc(reg_t* reg)
@@ -33,7 +38,7 @@ uint16_t get_reg_bc(reg_t* reg)
         return 0;
     }
 
-    return (reg->b << 8) | reg->c;
+    return reg->bc;
 }
 
 uint16_t get_reg_de(reg_t* reg)
@@ -42,7 +47,7 @@ uint16_t get_reg_de(reg_t* reg)
         return 0;
     }
 
-    return (reg->d << 8) | reg->e;
+    return reg->de;
 }
 
 uint16_t get_reg_hl(reg_t* reg)
@@ -51,7 +56,7 @@ uint16_t get_reg_hl(reg_t* reg)
         return 0;
     }
 
-    return (reg->h << 8) | reg->l;
+    return reg->hl;
 }
 
 void set_reg_af(reg_t* reg, uint16_t val)
@@ -61,7 +66,7 @@ void set_reg_af(reg_t* reg, uint16_t val)
     }
 
     reg->a = val >> 8;
-    reg->f = ((val & 0x00d5) | 0x0002);
+    flags_set(reg, (val & 0x00d5) | 0x0002);
 }
 
 void set_reg_bc(reg_t* reg, uint16_t val)
@@ -70,8 +75,7 @@ void set_reg_bc(reg_t* reg, uint16_t val)
         return;
     }
 
-    reg->b = val >> 8;
-    reg->c = ((val & 0x00d5) | 0x0002);
+    reg->bc = val;
 }
 
 void set_reg_de(reg_t* reg, uint16_t val)
@@ -80,8 +84,7 @@ void set_reg_de(reg_t* reg, uint16_t val)
         return;
     }
 
-    reg->d = val >> 8;
-    reg->e = ((val & 0x00d5) | 0x0002);
+    reg->de = val;
 }
 
 void set_reg_hl(reg_t* reg, uint16_t val)
@@ -90,8 +93,7 @@ void set_reg_hl(reg_t* reg, uint16_t val)
         return;
     }
 
-    reg->h = val >> 8;
-    reg->l = ((val & 0x00d5) | 0x0002);
+    reg->hl = val;
 }
 
 bool get_reg_flag(reg_t* reg, flag_t flag)
@@ -100,7 +102,7 @@ bool get_reg_flag(reg_t* reg, flag_t flag)
         return NULL;
     }
 
-    return GET_BIT(reg->f, flag) != 0;
+    return flags_test(reg, 1 << flag);
 }
 
 void set_reg_flag(reg_t* reg, flag_t flag, bool val)
@@ -109,9 +111,11 @@ void set_reg_flag(reg_t* reg, flag_t flag, bool val)
         return;
     }
 
+    uint8_t f = flags_get(reg);
+
     if (val == true) {
-        reg->f = SET_BIT(reg->f, flag);
+        flags_set(reg, SET_BIT(f, flag));
     } else {
-        reg->f = CLR_BIT(reg->f, flag);
+        flags_set(reg, CLR_BIT(f, flag));
     }
 }
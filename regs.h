@@ -3,6 +3,29 @@
 
 #include "common.h"
 
+// A register pair, readable as the 16-bit value (`bc`) or as its two
+// registers (`b`, the high byte, and `c`), whichever byte order the host
+// stores the value in.
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define REG_PAIR(hi, lo)   \
+    union {                \
+        uint16_t hi##lo;   \
+        struct {           \
+            uint8_t hi;    \
+            uint8_t lo;    \
+        };                 \
+    }
+#else
+#define REG_PAIR(hi, lo)   \
+    union {                \
+        uint16_t hi##lo;   \
+        struct {           \
+            uint8_t lo;    \
+            uint8_t hi;    \
+        };                 \
+    }
+#endif
+
 // -------------
 // | A   Flags |  ---> Program Status Word
 // | B       C |  ---> B
@@ -14,14 +37,16 @@
 typedef struct {
     uint8_t a;
     uint8_t f; // Not available to the programmer.
-    uint8_t b;
-    uint8_t c;
-    uint8_t d;
-    uint8_t e;
-    uint8_t h;
-    uint8_t l;
-    uint8_t sp;
-    uint8_t pc;
+    REG_PAIR(b, c);
+    REG_PAIR(d, e);
+    REG_PAIR(h, l);
+    uint16_t sp;
+    uint16_t pc;
+#ifdef LAZY_FLAGS
+    uint8_t lazy; // Last flag-producing operation, see flags.h.
+    uint8_t lazy_a;
+    uint8_t lazy_b;
+#endif
 } reg_t;
 
 typedef enum {
@@ -36,6 +61,7 @@ void init_reg(reg_t* reg);
 
 // 16bit registers by pairing:
 // af,bc,de,hl
+// Checked versions of reg->bc and the like; AF goes through the flags.
 uint16_t get_reg_af(reg_t* reg);
 uint16_t get_reg_bc(reg_t* reg);
 uint16_t get_reg_de(reg_t* reg);
@@ -0,0 +1,251 @@
+#include "spin.h"
+
+#include "cpu.h"
+
+// JMP (and its alias) and the conditional jumps.
+static bool is_jump(uint8_t op)
+{
+    return op == 0xc3 || op == 0xcb || (op & 0xc7) == 0xc2;
+}
+
+// INR or DCR of a register.
+static bool is_counter(uint8_t op)
+{
+    return (op & 0xc6) == 0x04 && ((op >> 3) & 7) != 6;
+}
+
+// Instructions that only read and write A-L and the flags.
+static bool is_register_only(uint8_t op)
+{
+    uint8_t dst = (op >> 3) & 7;
+    uint8_t src = op & 7;
+
+    if (op < 0x40) {
+        switch (op & 0xc7) {
+        case 0x00: // NOP
+        case 0x04: // INR
+        case 0x05: // DCR
+        case 0x06: // MVI
+            return dst != 6;
+        case 0x07: // RLC, RRC, RAL, RAR, DAA, CMA, STC, CMC
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    if (op < 0x80) { // MOV
+        return dst != 6 && src != 6;
+    }
+
+    if (op < 0xc0) { // ALU
+        return src != 6;
+    }
+
+    return (op & 0xc7) == 0xc6; // ALU immediate
+}
+
+static uint8_t* reg8(reg_t* reg, uint8_t r)
+{
+    switch (r) {
+    case 0:
+        return &reg->b;
+    case 1:
+        return &reg->c;
+    case 2:
+        return &reg->d;
+    case 3:
+        return &reg->e;
+    case 4:
+        return &reg->h;
+    case 5:
+        return &reg->l;
+    default:
+        return &reg->a;
+    }
+}
+
+void spin_detect(spin_t* spin, const mem_t* mem, uint16_t pc)
+{
+    if (spin == NULL || mem == NULL) {
+        return;
+    }
+
+    uint32_t limit = ((pc >> MEM_PAGE_SHIFT) + 1) << MEM_PAGE_SHIFT;
+    uint32_t addr = pc;
+    uint8_t counters = 0;
+    uint8_t others = 0; // Instructions besides NOPs and counters.
+    bool exits = false;
+    spin_t found = { 0 };
+
+    for (int i = 0; i < SPIN_MAX_INSNS; i++) {
+        uint8_t op = mem_peek(mem, addr);
+        uint8_t size = OPCODES_SIZE[op];
+
+        if (addr + size > limit) {
+            break;
+        }
+
+        uint16_t imm = 0;
+
+        if (size == 2) {
+            imm = mem_peek(mem, addr + 1);
+        } else if (size == 3) {
+            imm = mem_peek(mem, addr + 1) | (mem_peek(mem, addr + 2) << 8);
+        }
+
+        found.cycles += OPCODES_CYCLES[op];
+        addr += size;
+
+        if (is_jump(op)) {
+            if (imm == pc) {
+                found.kind = op == 0xc2 && !exits && counters == 1 && others == 0 ? SPIN_COUNT : SPIN_WAIT;
+                found.size = addr - pc;
+                *spin = found;
+                return;
+            }
+
+            // Conditional jumps elsewhere leave the loop.
+            if (op == 0xc3 || op == 0xcb) {
+                break;
+            }
+
+            exits = true;
+        } else if (op == 0xdb && !found.in) { // IN
+            found.in = true;
+            found.port = imm;
+            others++;
+        } else if (op == 0x3a && !found.load) { // LDA
+            found.load = true;
+            found.addr = imm;
+            others++;
+        } else if (is_counter(op)) {
+            found.op = op;
+            counters++;
+        } else if (is_register_only(op)) {
+            others += (op & 0xc7) != 0x00;
+        } else {
+            break;
+        }
+    }
+
+    spin->kind = SPIN_NONE;
+}
+
+// Delay loop: all but the last iteration, as far as the budget goes. The
+// last of them is run through the ALU for its flags.
+static uint32_t skip_count(cpu_t* cpu, const spin_t* spin, uint32_t budget)
+{
+    uint8_t* counter = reg8(cpu->reg, (spin->op >> 3) & 7);
+    bool down = spin->op & 1;
+    uint32_t left = down ? *counter : 256 - *counter; // Iterations, the last one leaves.
+
+    left = left == 0 ? 256 : left;
+
+    uint32_t count = budget / spin->cycles < left - 1 ? budget / spin->cycles : left - 1;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    if (down) {
+        *counter = alu_dcr(cpu->reg, *counter - (count - 1));
+    } else {
+        *counter = alu_inr(cpu->reg, *counter + (count - 1));
+    }
+
+    return count * spin->cycles;
+}
+
+static bool same_regs(reg_t* x, reg_t* y)
+{
+    return x->a == y->a && x->b == y->b && x->c == y->c && x->d == y->d && x->e == y->e && x->h == y->h
+        && x->l == y->l && x->sp == y->sp && x->pc == y->pc && flags_get(x) == flags_get(y);
+}
+
+// Runs one iteration on `sim` and adds up its cycles; false if it leaves
+// the loop.
+static bool iterate(cpu_t* sim, const spin_t* spin, uint32_t* cycles)
+{
+    uint16_t head = sim->reg->pc;
+
+    *cycles = 0;
+
+    for (int i = 0; i < SPIN_MAX_INSNS; i++) {
+        *cycles += exec(sim);
+
+        if (sim->reg->pc == head) {
+            return true;
+        }
+
+        if (sim->stop != STOP_BUDGET || sim->reg->pc < head || sim->reg->pc >= head + spin->size) {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+// Wait loop: runs two iterations on a copy, and if the second is a fixed
+// point, every iteration that fits in the budget. Those after the first
+// take what the second did, which differs from spin->cycles when a branch
+// inside the loop skips part of it. A loop that turns out not to be one is
+// not looked at again.
+static uint32_t skip_wait(cpu_t* cpu, spin_t* spin, uint32_t budget)
+{
+    if (budget / spin->cycles < 2) {
+        return 0;
+    }
+
+    if ((spin->in && (cpu->io == NULL || cpu->io->port[spin->port].in == NULL || !cpu->io->port[spin->port].stable))
+        || (spin->load && cpu->mem->read[spin->addr >> MEM_PAGE_SHIFT] == NULL)) {
+        return 0;
+    }
+
+    cpu_t sim = *cpu;
+    reg_t first = *cpu->reg;
+    reg_t second;
+    uint32_t first_cycles;
+    uint32_t cycles;
+
+    sim.trace = NULL;
+    sim.profile = NULL;
+    sim.events = NULL;
+    sim.traps = NULL;
+    sim.reg = &first;
+
+    if (!iterate(&sim, spin, &first_cycles)) {
+        return 0;
+    }
+
+    second = first;
+    sim.reg = &second;
+
+    if (!iterate(&sim, spin, &cycles) || !same_regs(&first, &second)) {
+        spin->kind = SPIN_NONE;
+        return 0;
+    }
+
+    if (first_cycles + cycles > budget) {
+        return 0;
+    }
+
+    *cpu->reg = first;
+    return first_cycles + (budget - first_cycles) / cycles * cycles;
+}
+
+uint32_t spin_skip(cpu_t* cpu, spin_t* spin, uint32_t budget)
+{
+    if (cpu == NULL || spin == NULL || budget < spin->cycles) {
+        return 0;
+    }
+
+    switch (spin->kind) {
+    case SPIN_COUNT:
+        return skip_count(cpu, spin, budget);
+    case SPIN_WAIT:
+        return skip_wait(cpu, spin, budget);
+    default:
+        return 0;
+    }
+}
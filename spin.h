@@ -0,0 +1,42 @@
+#ifndef __SPIN_H__
+#define __SPIN_H__
+
+#include "common.h"
+
+#include "mem.h"
+
+#define SPIN_MAX_INSNS 8 // Longest loop body recognized.
+
+typedef enum {
+    SPIN_NONE = 0,
+    SPIN_COUNT, // INR or DCR of a register and JNZ back, NOPs aside: a delay.
+    SPIN_WAIT, // Register-only code that comes back in the same state every time.
+} spin_kind_t;
+
+// A loop that burns cycles without doing anything the rest of the machine
+// can see, such as `DCR B / JNZ` or `IN 01 / ANI 01 / JZ`, found by
+// spin_detect() and skipped over by spin_skip() (see cpu.h).
+//
+// A delay loop is run in closed form. A wait loop may also read one port
+// and one absolute address; two of its iterations are run on a copy of the
+// registers, and when the second leaves them as the first did, every
+// further one would too until an interrupt or an event, so the iterations
+// that fit in the budget (which run_cycles() ends at the next event) pass
+// at once. It is only skipped while its port is marked stable with
+// io_stable() and its address is not MMIO.
+typedef struct {
+    uint8_t kind;
+    uint8_t op; // SPIN_COUNT: the INR or DCR.
+    uint8_t size; // Bytes from the head to the end of the backward jump.
+    bool in; // SPIN_WAIT: reads `port`.
+    bool load; // SPIN_WAIT: reads `addr` with LDA.
+    uint8_t port;
+    uint16_t addr;
+    uint16_t cycles; // Of its instructions, each once: a delay loop's iteration. Wait loops are timed as they run.
+} spin_t;
+
+// Classifies the code at `pc`: a loop if it runs straight through to a jump
+// back to `pc` within one memory page.
+void spin_detect(spin_t* spin, const mem_t* mem, uint16_t pc);
+
+#endif
@@ -0,0 +1,203 @@
+#include "state.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const uint8_t STATE_MAGIC[4] = { 'I', '8', '0', 'S' };
+
+// Everything before the pages: magic, version, kind, A F B C D E H L, SP,
+// PC, halted, interrupt, tick_cycles, cycles, ROM bitmap and page count.
+#define STATE_HEADER (4 + 2 + 1 + 8 + 2 + 2 + 1 + 1 + 8 + 8 + MEM_PAGES / 8 + 2)
+#define STATE_PAGE (1 + MEM_PAGE_SIZE) // Page number and contents.
+
+static uint8_t* put16(uint8_t* out, uint16_t val)
+{
+    out[0] = val;
+    out[1] = val >> 8;
+    return out + 2;
+}
+
+static uint8_t* put64(uint8_t* out, uint64_t val)
+{
+    for (int i = 0; i < 8; i++) {
+        out[i] = val >> (i * 8);
+    }
+
+    return out + 8;
+}
+
+static uint16_t get16(const uint8_t* in)
+{
+    return in[0] | (in[1] << 8);
+}
+
+static uint64_t get64(const uint8_t* in)
+{
+    uint64_t val = 0;
+
+    for (int i = 7; i >= 0; i--) {
+        val = (val << 8) | in[i];
+    }
+
+    return val;
+}
+
+// Device state is up to the device, so MMIO pages are never saved.
+static bool saved(const mem_t* mem, uint32_t page, state_kind_t kind)
+{
+    return mem->io[page] == NULL && (kind == STATE_FULL || mem_dirty(mem, page));
+}
+
+bool state_save(cpu_t* cpu, FILE* file, state_kind_t kind)
+{
+    if (cpu == NULL || file == NULL) {
+        return false;
+    }
+
+    reg_t* reg = cpu->reg;
+    mem_t* mem = cpu->mem;
+    uint32_t count = 0;
+
+    for (uint32_t page = 0; page < MEM_PAGES; page++) {
+        count += saved(mem, page, kind);
+    }
+
+    uint8_t* buf = malloc(STATE_HEADER + count * STATE_PAGE);
+    uint8_t* out = buf;
+
+    if (buf == NULL) {
+        return false;
+    }
+
+    memcpy(out, STATE_MAGIC, sizeof(STATE_MAGIC));
+    out = put16(out + sizeof(STATE_MAGIC), STATE_VERSION);
+    *out++ = kind;
+
+    *out++ = reg->a;
+    *out++ = flags_get(reg);
+    *out++ = reg->b;
+    *out++ = reg->c;
+    *out++ = reg->d;
+    *out++ = reg->e;
+    *out++ = reg->h;
+    *out++ = reg->l;
+    out = put16(out, reg->sp);
+    out = put16(out, reg->pc);
+    *out++ = cpu->halted;
+    *out++ = cpu->interrupt;
+    out = put64(out, cpu->tick_cycles);
+    out = put64(out, cpu->cycles);
+
+    memset(out, 0, MEM_PAGES / 8);
+    for (uint32_t page = 0; page < MEM_PAGES; page++) {
+        out[page / 8] |= mem->rom_page[page] << (page % 8);
+    }
+
+    out = put16(out + MEM_PAGES / 8, count);
+
+    for (uint32_t page = 0; page < MEM_PAGES; page++) {
+        if (saved(mem, page, kind)) {
+            *out++ = page;
+            memcpy(out, mem->read[page], MEM_PAGE_SIZE);
+            out += MEM_PAGE_SIZE;
+        }
+    }
+
+    bool ok = fwrite(buf, out - buf, 1, file) == 1;
+
+    free(buf);
+
+    if (ok) {
+        mem_checkpoint(mem);
+    }
+
+    return ok;
+}
+
+bool state_load(cpu_t* cpu, FILE* file)
+{
+    if (cpu == NULL || file == NULL) {
+        return false;
+    }
+
+    uint8_t head[STATE_HEADER];
+
+    if (fread(head, sizeof(head), 1, file) != 1) {
+        return false;
+    }
+
+    const uint8_t* in = head;
+    uint8_t kind = in[6];
+    uint32_t count = get16(&head[STATE_HEADER - 2]);
+
+    if (memcmp(in, STATE_MAGIC, sizeof(STATE_MAGIC)) != 0 || get16(in + 4) != STATE_VERSION) {
+        return false;
+    }
+
+    if (kind > STATE_DELTA || count > MEM_PAGES) {
+        return false;
+    }
+
+    // The whole record is read and checked before any of it is applied.
+    uint8_t* pages = malloc(count * STATE_PAGE + 1);
+    bool seen[MEM_PAGES] = { false };
+
+    if (pages == NULL) {
+        return false;
+    }
+
+    bool ok = fread(pages, STATE_PAGE, count, file) == count;
+    reg_t* reg = cpu->reg;
+    mem_t* mem = cpu->mem;
+
+    // A page MMIO here would be dropped by mem_load(): the record is from a
+    // machine set up differently.
+    for (uint32_t i = 0; i < count && ok; i++) {
+        uint8_t page = pages[i * STATE_PAGE];
+
+        ok = !seen[page] && mem->io[page] == NULL;
+        seen[page] = true;
+    }
+
+    // Getting every page its own bytes is the only step that can fail, for
+    // want of host memory, and changes nothing the guest can see.
+    for (uint32_t page = 0; page < MEM_PAGES && ok; page++) {
+        ok = !seen[page] || mem_unshare(mem, page) != NULL;
+    }
+
+    if (!ok) {
+        free(pages);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* rec = &pages[i * STATE_PAGE];
+
+        memcpy(mem->read[rec[0]], rec + 1, MEM_PAGE_SIZE);
+    }
+
+    in += 7;
+    reg->a = *in++;
+    flags_set(reg, *in++);
+    reg->b = *in++;
+    reg->c = *in++;
+    reg->d = *in++;
+    reg->e = *in++;
+    reg->h = *in++;
+    reg->l = *in++;
+    reg->sp = get16(in);
+    reg->pc = get16(in + 2);
+    cpu->halted = in[4];
+    cpu->interrupt = in[5];
+    cpu->tick_cycles = get64(in + 6);
+    cpu->cycles = get64(in + 14);
+    in += 22;
+
+    for (uint32_t page = 0; page < MEM_PAGES; page++) {
+        mem->rom_page[page] = (in[page / 8] >> (page % 8)) & 1;
+    }
+
+    free(pages);
+    mem_checkpoint(mem);
+    return true;
+}
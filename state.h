@@ -0,0 +1,44 @@
+#ifndef __STATE_H__
+#define __STATE_H__
+
+#include "common.h"
+
+#include <stdio.h>
+
+#include "cpu.h"
+
+#define STATE_VERSION 2
+
+typedef enum {
+    STATE_FULL = 0, // Every RAM and ROM page; restores a machine on its own.
+    STATE_DELTA, // Pages written since the previous record only.
+} state_kind_t;
+
+// Save states are streams of records: a full record, optionally followed by
+// deltas, each applying on top of the state the records before it restore.
+// A record holds the registers, halted/interrupt/tick_cycles/cycles, the
+// ROM pages and then the pages it carries. Multi-byte fields are
+// little-endian.
+//
+// The memory map itself, mirrors and MMIO, is part of the machine rather
+// than of its state: a state is restored into a machine set up like the one
+// it was saved from. MMIO pages are not saved.
+//
+// Both functions end with mem_checkpoint(), so the next delta holds what
+// is written after this record. Blocks decoded from restored pages are
+// invalidated like on any other write.
+//
+// Events are not saved: they are callbacks of the host. Loading a record
+// moves cpu->cycles, on which they are scheduled, so the host cancels and
+// schedules its events again, or sets next_event if it keeps that itself,
+// before running the machine on.
+
+// Appends one record to `file`.
+bool state_save(cpu_t* cpu, FILE* file, state_kind_t kind);
+
+// Reads and applies the next record from `file`. Returns false at the end
+// of the stream or on a bad record, which leaves the machine as it was; a
+// record carrying a page that is MMIO in this machine is a bad one.
+bool state_load(cpu_t* cpu, FILE* file);
+
+#endif
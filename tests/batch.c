@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "check.h"
+
+#define BATCHTEST_JOBS 41 // Not a multiple of the workers, so ranges differ in length.
+#define BATCHTEST_THREADS 4
+
+// clang-format off
+// Counts BC down from the word at 0001 and halts.
+static const uint8_t COUNTDOWN[] = {
+    0x01, 0x00, 0x00, // 0000 LXI B,0000
+    0x0b,             // 0003 DCX B
+    0x78,             // 0004 MOV A,B
+    0xb1,             // 0005 ORA C
+    0xc2, 0x03, 0x00, // 0006 JNZ 0003
+    0x76,             // 0009 HLT
+};
+// clang-format on
+
+static uint8_t images[BATCHTEST_JOBS][MEM_SIZE];
+
+// Even jobs count down from a random start and run until they halt, odd
+// ones run random code for a random budget: runs from a few cycles to a
+// few hundred thousand, so that workers finish their ranges at different
+// times and steal from each other.
+static uint64_t generate(int job)
+{
+    uint8_t* image = images[job];
+
+    for (uint32_t i = 0; i < MEM_SIZE; i++) {
+        image[i] = rand();
+    }
+
+    if (job % 2 == 0) {
+        uint16_t count = 1 + rand() % 20000;
+
+        memcpy(image, COUNTDOWN, sizeof(COUNTDOWN));
+        image[1] = count & 0xff;
+        image[2] = count >> 8;
+        return 0;
+    }
+
+    return 1 + rand() % (job % 4 == 1 ? 100 : 200000);
+}
+
+// What batch_run() has to come up with for one job: the same machine run
+// on this thread, with IN reading an open bus.
+static bool serial(int job, uint64_t budget, batch_job_t* out)
+{
+    machine_t* machine = machine_create();
+    cpu_t* cpu = &machine->cpu;
+
+    EXPECT(machine != NULL);
+
+    mem_load(cpu->mem, 0, images[job], MEM_SIZE);
+
+    while (!cpu->halted && (budget == 0 || cpu->cycles < budget)) {
+        uint64_t left = budget == 0 ? TICK_CYCLES : budget - cpu->cycles;
+
+        if (run_cycles(cpu, left < TICK_CYCLES ? left : TICK_CYCLES) == STOP_IO && !cpu->io_out) {
+            cpu->reg->a = 0xff;
+        }
+    }
+
+    out->stop = cpu->halted ? STOP_HALT : STOP_BUDGET;
+    out->cycles = cpu->cycles;
+    out->reg = *cpu->reg;
+    out->reg.f = flags_get(cpu->reg);
+    out->digest = mem_digest(cpu->mem);
+
+    machine_destroy(machine);
+    return true;
+}
+
+static bool same_job(const batch_job_t* job, const batch_job_t* ref)
+{
+    const reg_t* x = &job->reg;
+    const reg_t* y = &ref->reg;
+
+    EXPECT(job->stop == ref->stop && job->cycles == ref->cycles);
+    EXPECT(x->a == y->a && x->f == y->f && x->bc == y->bc && x->de == y->de && x->hl == y->hl);
+    EXPECT(x->sp == y->sp && x->pc == y->pc);
+    EXPECT(job->digest == ref->digest);
+    return true;
+}
+
+// More jobs than workers, of mixed lengths, run on the pool and one by one.
+static bool run_pool(void)
+{
+    static batch_job_t jobs[BATCHTEST_JOBS];
+    machine_t* machines[BATCHTEST_JOBS];
+    batch_job_t ref;
+
+    for (int i = 0; i < BATCHTEST_JOBS; i++) {
+        machines[i] = machine_create();
+        EXPECT(machines[i] != NULL);
+
+        jobs[i].budget = generate(i);
+        jobs[i].cpu = &machines[i]->cpu;
+        mem_load(jobs[i].cpu->mem, 0, images[i], MEM_SIZE);
+    }
+
+    unsigned workers = batch_run(jobs, BATCHTEST_JOBS, BATCHTEST_THREADS);
+
+    EXPECT(workers >= 1 && workers <= BATCHTEST_THREADS);
+
+    for (int i = 0; i < BATCHTEST_JOBS; i++) {
+        EXPECT(serial(i, jobs[i].budget, &ref));
+
+        if (!same_job(&jobs[i], &ref)) {
+            fprintf(stderr, "[ERROR:%s:%d] Job %d differs from its serial run.\n", __FILE__, __LINE__, i);
+            return false;
+        }
+
+        EXPECT(jobs[i].budget != 0 || jobs[i].stop == STOP_HALT);
+        EXPECT(jobs[i].budget == 0 || jobs[i].stop == STOP_HALT || jobs[i].cycles >= jobs[i].budget);
+        machine_destroy(machines[i]);
+    }
+
+    return true;
+}
+
+// The batch runner: work stealing between workers leaves every job with the
+// cycles, registers and memory a serial run ends with.
+int main(void)
+{
+    srand(1);
+
+    if (!run_pool()) {
+        return 1;
+    }
+
+    printf("batch: %d jobs on %d workers match serial runs\n", BATCHTEST_JOBS, BATCHTEST_THREADS);
+    return 0;
+}
@@ -0,0 +1,316 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bdos.h"
+#include "check.h"
+#include "cpu.h"
+
+#define FCB 0x005c // The default FCB.
+
+// clang-format off
+// Prints a string through CALL 0005 and returns to the CCP.
+static const uint8_t HELLO[] = {
+    0x11, 0x09, 0x01, // 0100 LXI D,0109
+    0x0e, 0x09,       // 0103 MVI C,09
+    0xcd, 0x05, 0x00, // 0105 CALL 0005
+    0xc9,             // 0108 RET
+    'H', 'i', ',', ' ', 'C', 'P', '/', 'M', '\r', '\n', '$',
+};
+// clang-format on
+
+// A machine with the BDOS installed on files in `dir`, its console output
+// going to `out`.
+typedef struct {
+    machine_t* machine;
+    traps_t traps;
+    bdos_t bdos;
+} cpm_t;
+
+static bool boot(cpm_t* cpm, const char* dir, FILE* out)
+{
+    cpm->machine = machine_create();
+    EXPECT(cpm->machine != NULL);
+
+    init_traps(&cpm->traps);
+    init_bdos(&cpm->bdos, NULL, out, dir);
+    EXPECT(bdos_install(&cpm->bdos, &cpm->traps, cpm->machine->cpu.reg, cpm->machine->cpu.mem));
+    cpm->machine->cpu.traps = &cpm->traps;
+    cpm->machine->reg.pc = 0x0100;
+    return true;
+}
+
+static void shut_down(cpm_t* cpm)
+{
+    bdos_close(&cpm->bdos);
+    machine_destroy(cpm->machine);
+}
+
+// BDOS function `func` with `de`, as a CALL 0005 makes it. Returns A.
+static uint8_t call(cpm_t* cpm, uint8_t func, uint16_t de)
+{
+    const trap_t* trap = traps_find(&cpm->traps, 0x0005);
+    reg_t* reg = &cpm->machine->reg;
+
+    reg->c = func;
+    reg->de = de;
+    trap->fire(trap->ctx, reg, &cpm->machine->mem);
+    return reg->a;
+}
+
+// Writes `name`, 8 characters and 3 of type, into the FCB at `fcb` and
+// clears the rest of its first half.
+static void set_fcb(cpm_t* cpm, uint16_t fcb, const char* name)
+{
+    mem_t* mem = &cpm->machine->mem;
+
+    mem_write(mem, fcb, 0);
+
+    for (int i = 0; i < 11; i++) {
+        mem_write(mem, fcb + 1 + i, name[i]);
+    }
+
+    for (int i = 12; i < 16; i++) {
+        mem_write(mem, fcb + i, 0);
+    }
+}
+
+// Entries of `dir` besides . and ..
+static int count_files(const char* dir)
+{
+    DIR* d = opendir(dir);
+    struct dirent* entry;
+    int count = 0;
+
+    if (d == NULL) {
+        return -1;
+    }
+
+    while ((entry = readdir(d)) != NULL) {
+        count += strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0;
+    }
+
+    closedir(d);
+    return count;
+}
+
+// Function 9, from a program.
+static bool print_string(const char* dir)
+{
+    cpm_t cpm;
+    FILE* out = tmpfile();
+    char text[64] = { 0 };
+
+    EXPECT(out != NULL);
+    EXPECT(boot(&cpm, dir, out));
+    mem_load(&cpm.machine->mem, 0x0100, HELLO, sizeof(HELLO));
+
+    while (!cpm.machine->cpu.halted) {
+        run_cycles(&cpm.machine->cpu, TICK_CYCLES);
+    }
+
+    EXPECT(cpm.machine->reg.pc == 0x0000);
+    rewind(out);
+    EXPECT(fread(text, 1, sizeof(text) - 1, out) == 10);
+    EXPECT(strcmp(text, "Hi, CP/M\r\n") == 0);
+
+    fclose(out);
+    shut_down(&cpm);
+    return true;
+}
+
+// Fills the DMA buffer at 0080 with `seed`, `seed` + 1 and so on.
+static void fill_dma(cpm_t* cpm, uint8_t seed)
+{
+    for (int i = 0; i < 128; i++) {
+        mem_write(&cpm->machine->mem, 0x0080 + i, seed + i);
+    }
+}
+
+static bool dma_holds(cpm_t* cpm, uint8_t seed)
+{
+    for (int i = 0; i < 128; i++) {
+        EXPECT(mem_read(&cpm->machine->mem, 0x0080 + i) == (uint8_t)(seed + i));
+    }
+
+    return true;
+}
+
+// Make, write, close, open, read, size, random read, rename and delete.
+static bool files(const char* dir)
+{
+    mem_t* mem;
+    cpm_t cpm;
+
+    EXPECT(boot(&cpm, dir, NULL));
+    mem = &cpm.machine->mem;
+
+    set_fcb(&cpm, FCB, "TEST    DAT");
+    EXPECT(call(&cpm, 22, FCB) == 0);
+
+    for (int i = 0; i < 3; i++) {
+        fill_dma(&cpm, i * 16);
+        EXPECT(call(&cpm, 21, FCB) == 0);
+    }
+
+    EXPECT(call(&cpm, 16, FCB) == 0);
+
+    set_fcb(&cpm, FCB, "TEST    DAT");
+    EXPECT(call(&cpm, 15, FCB) == 0);
+    EXPECT(mem_read(mem, FCB + 15) == 3); // Records in the extent
+    mem_write(mem, FCB + 32, 0);
+
+    for (int i = 0; i < 3; i++) {
+        EXPECT(call(&cpm, 20, FCB) == 0);
+        EXPECT(dma_holds(&cpm, i * 16));
+    }
+
+    EXPECT(call(&cpm, 20, FCB) == 1); // End of file
+
+    EXPECT(call(&cpm, 35, FCB) == 0);
+    EXPECT(mem_read(mem, FCB + 33) == 3 && mem_read(mem, FCB + 34) == 0 && mem_read(mem, FCB + 35) == 0);
+    mem_write(mem, FCB + 33, 1);
+    EXPECT(call(&cpm, 33, FCB) == 0);
+    EXPECT(dma_holds(&cpm, 16));
+    EXPECT(call(&cpm, 16, FCB) == 0);
+
+    set_fcb(&cpm, FCB, "TEST    DAT");
+    set_fcb(&cpm, FCB + 16, "NEW     DAT");
+    EXPECT(call(&cpm, 23, FCB) == 0);
+    set_fcb(&cpm, FCB, "TEST    DAT");
+    EXPECT(call(&cpm, 15, FCB) == 0xff);
+    set_fcb(&cpm, FCB, "NEW     DAT");
+    mem_write(mem, FCB + 32, 0);
+    EXPECT(call(&cpm, 15, FCB) == 0 && call(&cpm, 20, FCB) == 0);
+    EXPECT(dma_holds(&cpm, 0));
+    EXPECT(call(&cpm, 16, FCB) == 0);
+
+    EXPECT(call(&cpm, 19, FCB) == 0 && count_files(dir) == 0);
+
+    shut_down(&cpm);
+    return true;
+}
+
+// A file is only reached through the FCB it was opened with, and opening
+// an FCB again reuses its file rather than taking another.
+static bool owners(const char* dir)
+{
+    mem_t* mem;
+    cpm_t cpm;
+
+    EXPECT(boot(&cpm, dir, NULL));
+    mem = &cpm.machine->mem;
+
+    set_fcb(&cpm, FCB, "OWNED   DAT");
+    EXPECT(call(&cpm, 22, FCB) == 0);
+    fill_dma(&cpm, 0x40);
+    EXPECT(call(&cpm, 21, FCB) == 0);
+
+    // A copy of the FCB elsewhere, map byte and all.
+    for (int i = 0; i < 36; i++) {
+        mem_write(mem, 0x0200 + i, mem_read(mem, FCB + i));
+    }
+
+    mem_write(mem, 0x0200 + 32, 0);
+    EXPECT(call(&cpm, 20, 0x0200) == 0xff);
+    EXPECT(call(&cpm, 21, 0x0200) == 0xff);
+    EXPECT(call(&cpm, 16, 0x0200) == 0);
+    mem_write(mem, FCB + 32, 0);
+    EXPECT(call(&cpm, 20, FCB) == 0);
+    EXPECT(dma_holds(&cpm, 0x40));
+
+    // Opened again and again from one FCB, then from as many others as
+    // there are slots left.
+    for (int i = 0; i < 2 * BDOS_FILES; i++) {
+        EXPECT(call(&cpm, 15, FCB) == 0);
+    }
+
+    for (int i = 1; i < BDOS_FILES; i++) {
+        set_fcb(&cpm, 0x0200 + i * 36, "OWNED   DAT");
+        EXPECT(call(&cpm, 15, 0x0200 + i * 36) == 0);
+    }
+
+    set_fcb(&cpm, 0x0200, "OWNED   DAT");
+    EXPECT(call(&cpm, 15, 0x0200) == 0xff);
+
+    for (int i = 1; i < BDOS_FILES; i++) {
+        EXPECT(call(&cpm, 16, 0x0200 + i * 36) == 0);
+    }
+
+    EXPECT(call(&cpm, 16, FCB) == 0);
+    EXPECT(call(&cpm, 15, 0x0200) == 0 && call(&cpm, 16, 0x0200) == 0);
+    EXPECT(call(&cpm, 19, 0x0200) == 0 && count_files(dir) == 0);
+
+    shut_down(&cpm);
+    return true;
+}
+
+// Names CP/M cannot have are turned down by every function that takes one,
+// and nothing is made, opened or removed on the host for them.
+static bool bad_names(const char* dir)
+{
+    static const char* const NAMES[] = {
+        "../ETC  PAS", "A/B     TXT", "A\\B     TXT", "A.B     TXT", "*       TXT", "A?      TXT",
+        "A:      TXT", "A<      TXT", "A>      TXT", "A,      TXT", "A;      TXT", "A=      TXT",
+        "A[      TXT", "A]      TXT", "A|      TXT", "A\"      TXT", "A B     TXT", "AB      T X",
+        "        TXT", "           ", "A\x01      TXT", "A\x7f      TXT",
+    };
+    cpm_t cpm;
+
+    EXPECT(boot(&cpm, dir, NULL));
+    set_fcb(&cpm, FCB, "GOOD    TXT");
+    EXPECT(call(&cpm, 22, FCB) == 0 && call(&cpm, 16, FCB) == 0);
+
+    for (size_t i = 0; i < sizeof(NAMES) / sizeof(NAMES[0]); i++) {
+        set_fcb(&cpm, FCB, NAMES[i]);
+        EXPECT(call(&cpm, 22, FCB) == 0xff); // Make
+        EXPECT(call(&cpm, 15, FCB) == 0xff); // Open
+        EXPECT(call(&cpm, 19, FCB) == 0xff); // Delete
+        EXPECT(call(&cpm, 35, FCB) == 0xff); // Size
+
+        // Renamed from a good name to the bad one and back.
+        set_fcb(&cpm, FCB, "GOOD    TXT");
+        set_fcb(&cpm, FCB + 16, NAMES[i]);
+        EXPECT(call(&cpm, 23, FCB) == 0xff);
+        set_fcb(&cpm, FCB, NAMES[i]);
+        set_fcb(&cpm, FCB + 16, "GOOD    TXT");
+        EXPECT(call(&cpm, 23, FCB) == 0xff);
+
+        if (count_files(dir) != 1) {
+            fprintf(stderr, "[ERROR:%s:%d] \"%s\" reached the host.\n", __FILE__, __LINE__, NAMES[i]);
+            return false;
+        }
+    }
+
+    set_fcb(&cpm, FCB, "GOOD    TXT");
+    EXPECT(call(&cpm, 19, FCB) == 0 && count_files(dir) == 0);
+
+    shut_down(&cpm);
+    return true;
+}
+
+// The CP/M BDOS on host files: console output from a program, file
+// functions, which FCB a file belongs to, and file names that must not
+// reach the host.
+int main(void)
+{
+    char dir[] = "/tmp/bdos-XXXXXX";
+
+    if (mkdtemp(dir) == NULL) {
+        fprintf(stderr, "[ERROR:%s:%d] Cannot create a temporary directory.\n", __FILE__, __LINE__);
+        return 1;
+    }
+
+    bool ok = print_string(dir) && files(dir) && owners(dir) && bad_names(dir);
+
+    rmdir(dir);
+
+    if (!ok) {
+        return 1;
+    }
+
+    printf("bdos: console, files, owners and bad names\n");
+    return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef __CHECK_H__
+#define __CHECK_H__
+
+#include <stdio.h>
+
+// Ends the enclosing test, a function returning bool, when `cond` does not
+// hold.
+#define EXPECT(cond)                                                                      \
+    do {                                                                                  \
+        if (!(cond)) {                                                                    \
+            fprintf(stderr, "[ERROR:%s:%d] Expected %s.\n", __FILE__, __LINE__, #cond); \
+            return false;                                                                 \
+        }                                                                                 \
+    } while (0)
+
+#endif
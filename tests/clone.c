@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "check.h"
+#include "cpu.h"
+
+// clang-format off
+// Stores to 1200 and halts, run on one side of a fork.
+static const uint8_t STORE[] = {
+    0x21, 0x00, 0x12, // 0000 LXI H,1200
+    0x36, 0x77,       // 0003 MVI M,77
+    0x76,             // 0005 HLT
+};
+// clang-format on
+
+// Every page in the tables of `mems` is referenced once per table entry
+// that points at it, across all of them: what free_mem() relies on to free
+// each page exactly once, when the last machine using it lets go.
+static bool refs_match(mem_t** mems, int count)
+{
+    for (int m = 0; m < count; m++) {
+        for (uint32_t page = 0; page < MEM_PAGES; page++) {
+            mem_page_t* shared = mems[m]->page[page];
+            uint32_t users = 0;
+
+            if (shared == NULL) {
+                continue;
+            }
+
+            for (int n = 0; n < count; n++) {
+                for (uint32_t at = 0; at < MEM_PAGES; at++) {
+                    users += mems[n]->page[at] == shared;
+                }
+            }
+
+            EXPECT(atomic_load(&shared->refs) == users);
+        }
+    }
+
+    return true;
+}
+
+// A machine with RAM at 1000-31FF holding the number of each page, ROM at
+// 2000, 3000-31FF mirrored at 4000-41FF, and STORE at 0000.
+static machine_t* create_source(void)
+{
+    machine_t* machine = machine_create();
+    uint8_t page[MEM_PAGE_SIZE];
+
+    if (machine == NULL) {
+        return NULL;
+    }
+
+    for (uint32_t i = 0x10; i < 0x32; i++) {
+        memset(page, i, sizeof(page));
+        mem_load(&machine->mem, i << MEM_PAGE_SHIFT, page, sizeof(page));
+    }
+
+    memset(page, 0xee, sizeof(page));
+    mem_load(&machine->mem, 0x2000, page, sizeof(page));
+    mem_protect(&machine->mem, 0x2000, MEM_PAGE_SIZE);
+
+    // Written once mirrored, so that each ring has a page of its own.
+    mem_mirror(&machine->mem, 0x4000, 2 * MEM_PAGE_SIZE, 0x3000);
+    set_mem(&machine->mem, 0x3000, 0x30);
+    set_mem(&machine->mem, 0x4100, 0x31);
+
+    mem_load(&machine->mem, 0x0000, STORE, sizeof(STORE));
+    machine->reg.sp = 0x1800;
+    return machine;
+}
+
+static bool fork_and_write(void)
+{
+    machine_t* a = create_source();
+    machine_t* b = machine_create();
+    machine_t* c = machine_create();
+
+    EXPECT(a != NULL && b != NULL && c != NULL);
+
+    free_mem(&b->mem);
+    EXPECT(cpu_clone(&b->cpu, &b->reg, &b->mem, &a->cpu));
+    EXPECT(b->cpu.reg == &b->reg && b->cpu.mem == &b->mem);
+    EXPECT(b->reg.sp == 0x1800 && b->reg.pc == 0x0000);
+    EXPECT(b->mem.page[0x10] == a->mem.page[0x10] && b->mem.page[0x30] == a->mem.page[0x30]);
+    EXPECT(mem_digest(&a->mem) == mem_digest(&b->mem));
+    EXPECT(refs_match((mem_t*[]) { &a->mem, &b->mem }, 2));
+
+    // RAM: each side gets its own copy of the page it writes.
+    set_mem(&a->mem, 0x1005, 0xaa);
+    set_mem(&b->mem, 0x1105, 0xbb);
+    EXPECT(get_mem(&a->mem, 0x1005) == 0xaa && get_mem(&b->mem, 0x1005) == 0x10);
+    EXPECT(get_mem(&b->mem, 0x1105) == 0xbb && get_mem(&a->mem, 0x1105) == 0x11);
+    EXPECT(a->mem.page[0x12] == b->mem.page[0x12]);
+
+    // Once a page is its own, writes go in place.
+    const uint8_t* own = a->mem.read[0x10];
+
+    set_mem(&a->mem, 0x1006, 0xab);
+    EXPECT(a->mem.read[0x10] == own && a->mem.write[0x10] == own);
+
+    // ROM stays as it was on both sides.
+    set_mem(&a->mem, 0x2000, 0x00);
+    set_mem(&b->mem, 0x2001, 0x00);
+    EXPECT(get_mem(&a->mem, 0x2000) == 0xee && get_mem(&b->mem, 0x2001) == 0xee);
+    EXPECT(get_mem(&b->mem, 0x2000) == 0xee && get_mem(&a->mem, 0x2001) == 0xee);
+
+    // Mirrors: a write shows through the other page of the ring on its own
+    // side only.
+    set_mem(&a->mem, 0x3003, 0xcc);
+    set_mem(&b->mem, 0x4104, 0xdd);
+    EXPECT(get_mem(&a->mem, 0x4003) == 0xcc && get_mem(&b->mem, 0x3003) == 0x30 && get_mem(&b->mem, 0x4003) == 0x30);
+    EXPECT(get_mem(&b->mem, 0x3104) == 0xdd && get_mem(&a->mem, 0x3104) == 0x31 && get_mem(&a->mem, 0x4104) == 0x31);
+    EXPECT(a->mem.read[0x30] == a->mem.read[0x40] && b->mem.read[0x31] == b->mem.read[0x41]);
+
+    // The zero page.
+    set_mem(&b->mem, 0x5000, 0x50);
+    EXPECT(get_mem(&b->mem, 0x5000) == 0x50 && get_mem(&a->mem, 0x5000) == 0x00);
+
+    // Guest stores.
+    while (!b->cpu.halted) {
+        step(&b->cpu);
+    }
+
+    EXPECT(get_mem(&b->mem, 0x1200) == 0x77 && get_mem(&a->mem, 0x1200) == 0x12);
+    EXPECT(a->reg.pc == 0x0000 && !a->cpu.halted);
+    EXPECT(refs_match((mem_t*[]) { &a->mem, &b->mem }, 2));
+
+    // A clone outlives the machine it was cloned from.
+    free_mem(&c->mem);
+    EXPECT(cpu_clone(&c->cpu, &c->reg, &c->mem, &b->cpu));
+    EXPECT(refs_match((mem_t*[]) { &a->mem, &b->mem, &c->mem }, 3));
+
+    machine_destroy(b);
+    EXPECT(refs_match((mem_t*[]) { &a->mem, &c->mem }, 2));
+    EXPECT(get_mem(&c->mem, 0x1105) == 0xbb && get_mem(&c->mem, 0x1200) == 0x77);
+    EXPECT(get_mem(&c->mem, 0x3104) == 0xdd && get_mem(&c->mem, 0x4104) == 0xdd);
+
+    set_mem(&c->mem, 0x3105, 0xcd);
+    EXPECT(get_mem(&c->mem, 0x4105) == 0xcd && get_mem(&a->mem, 0x4105) == 0x31);
+
+    machine_destroy(a);
+    EXPECT(refs_match((mem_t*[]) { &c->mem }, 1));
+
+    machine_destroy(c);
+    return true;
+}
+
+// Copy-on-write forks: cpu_clone() and mem_clone() with RAM, ROM, mirrored
+// and never written pages, written from either side and freed in any order.
+int main(void)
+{
+    if (!fork_and_write()) {
+        return 1;
+    }
+
+    printf("clone: forks keep their memory apart\n");
+    return 0;
+}
@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "fuse.h"
+
+#define JITTEST_PROGRAMS 200 // Random programs run unless an argument says otherwise.
+#define JITTEST_BATCHES 2000 // Batches per program at most.
+
+typedef enum {
+    ENGINE_INTERP = 0,
+    ENGINE_BCACHE,
+    ENGINE_JIT,
+    ENGINE_COUNT,
+} engine_t;
+
+static const char* const ENGINE_NAMES[] = { "interp", "bcache", "jit" };
+
+// clang-format off
+// Opcodes that make the random programs go somewhere: loads and stores,
+// rotations, jumps and calls of every kind, ALU immediates and the stack.
+static const uint8_t BIASED[] = {
+    0x02, 0x0a, 0x12, 0x1a, 0x22, 0x2a, 0x32, 0x3a, 0x07, 0x0f, 0x17, 0x1f,
+    0x27, 0x2f, 0x37, 0x3f, 0xc2, 0xc3, 0xca, 0xd2, 0xda, 0xe2, 0xea, 0xf2,
+    0xfa, 0xc4, 0xcc, 0xcd, 0xd4, 0xdc, 0xc0, 0xc8, 0xc9, 0xd0, 0xd8, 0xc7,
+    0xcf, 0xc6, 0xce, 0xd6, 0xde, 0xe6, 0xee, 0xf6, 0xfe, 0xc5, 0xd5, 0xe5,
+    0xf5, 0xc1, 0xd1, 0xe1, 0xf1, 0xe3, 0xe9, 0xeb, 0xf9, 0xfb, 0xf3, 0xdb,
+    0xd3,
+};
+// clang-format on
+
+static uint8_t image[MEM_SIZE];
+
+// Fills `image` from `seed`: random bytes, with the first pages biased
+// towards instructions that branch, call and touch memory so that the run
+// does not halt or fall into the zero page at once, and towards the pairs
+// the block cache fuses.
+static void generate(unsigned seed)
+{
+    srand(seed);
+
+    for (uint32_t i = 0; i < MEM_SIZE; i++) {
+        image[i] = rand();
+    }
+
+    for (uint32_t i = 0; i < 4 * MEM_PAGE_SIZE; i++) {
+        int pick = rand() % 10;
+
+        if (pick < 4) {
+            image[i] = 0x40 + rand() % 0x80; // MOV and ALU
+        } else if (pick < 7) {
+            image[i] = BIASED[rand() % sizeof(BIASED)];
+        } else if (pick < 9) {
+            image[i] = (rand() % 8) << 3 | (4 + rand() % 3); // INR, DCR and MVI
+        } else if (rand() % 2 == 0) {
+            // A pair the block cache fuses, with the operands of the first.
+            const uint8_t* pair = FUSE_PAIRS[rand() % FUSE_COUNT];
+            uint32_t next = i + OPCODES_SIZE[pair[0]];
+
+            if (next < 4 * MEM_PAGE_SIZE) {
+                image[i] = pair[0];
+                image[next] = pair[1];
+                i = next;
+                continue;
+            }
+        }
+
+        if (image[i] == 0x76 && rand() % 8 != 0) {
+            image[i] = 0x00; // Fewer HLTs.
+        }
+    }
+}
+
+static bool same_regs(reg_t* x, reg_t* y)
+{
+    return x->a == y->a && flags_get(x) == flags_get(y) && x->bc == y->bc && x->de == y->de && x->hl == y->hl
+        && x->sp == y->sp && x->pc == y->pc;
+}
+
+static bool same_mem(const mem_t* x, const mem_t* y)
+{
+    for (uint32_t page = 0; page < MEM_PAGES; page++) {
+        if (memcmp(x->read[page], y->read[page], MEM_PAGE_SIZE) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Runs program `seed` on every engine in `machines`, in batches of random
+// size, and compares each of them with the interpreter after every batch.
+// IN reads the port number, and now and then an interrupt comes in between
+// batches. False on the first difference, which is printed.
+static bool run(unsigned seed, machine_t** machines, int engines)
+{
+    generate(seed);
+
+    for (int e = 0; e < engines; e++) {
+        cpu_t* cpu = &machines[e]->cpu;
+
+        init_reg(cpu->reg);
+        mem_load(cpu->mem, 0, image, MEM_SIZE);
+        cpu->halted = false;
+        cpu->interrupt = false;
+        cpu->cycles = 0;
+        cpu->tick_cycles = 0;
+        bcache_flush(cpu->bcache);
+        jit_flush(cpu->jit);
+    }
+
+    for (int batch = 0; batch < JITTEST_BATCHES; batch++) {
+        uint32_t budget = 1 + rand() % 300;
+        bool interrupt = rand() % 16 == 0;
+        uint16_t vector = (rand() % 8) << 3;
+        stop_t stops[ENGINE_COUNT];
+
+        for (int e = 0; e < engines; e++) {
+            cpu_t* cpu = &machines[e]->cpu;
+
+            if (interrupt) {
+                handle_interrupt(cpu, vector);
+            }
+
+            stops[e] = run_cycles(cpu, budget);
+
+            if (stops[e] == STOP_IO && !cpu->io_out) {
+                cpu->reg->a = cpu->io_port;
+            }
+        }
+
+        cpu_t* ref = &machines[ENGINE_INTERP]->cpu;
+
+        for (int e = 1; e < engines; e++) {
+            cpu_t* cpu = &machines[e]->cpu;
+
+            if (stops[e] != stops[ENGINE_INTERP] || cpu->cycles != ref->cycles || cpu->halted != ref->halted
+                || cpu->interrupt != ref->interrupt || !same_regs(cpu->reg, ref->reg) || !same_mem(cpu->mem, ref->mem)) {
+                fprintf(stderr,
+                    "[ERROR:%s:%d] Program %u, batch %d: %s stopped %d at PC %04x after %llu cycles, interp %d at "
+                    "%04x after %llu.\n",
+                    __FILE__, __LINE__, seed, batch, ENGINE_NAMES[e], stops[e], cpu->reg->pc,
+                    (unsigned long long)cpu->cycles, stops[ENGINE_INTERP], ref->reg->pc, (unsigned long long)ref->cycles);
+                return false;
+            }
+        }
+
+        if (ref->halted && !ref->interrupt) {
+            break;
+        }
+    }
+
+    return true;
+}
+
+// Differential test of the engines: random programs run on the interpreter,
+// the block cache and, where it is available, the JIT, which must agree on
+// the registers, memory, cycles and stop reason after every batch. Built
+// with the DISPATCH and FLAG_EVAL settings of the emulator.
+int main(int argc, char** argv)
+{
+    unsigned programs = argc > 1 ? strtoul(argv[1], NULL, 0) : JITTEST_PROGRAMS;
+    machine_t* machines[ENGINE_COUNT];
+    int engines = ENGINE_COUNT;
+
+    for (int e = 0; e < ENGINE_COUNT; e++) {
+        machines[e] = machine_create();
+
+        if (machines[e] == NULL) {
+            fprintf(stderr, "[ERROR:%s:%d] Out of memory.\n", __FILE__, __LINE__);
+            return 1;
+        }
+    }
+
+    machines[ENGINE_BCACHE]->cpu.bcache = bcache_create();
+    machines[ENGINE_JIT]->cpu.jit = jit_create();
+
+    if (machines[ENGINE_JIT]->cpu.jit == NULL) {
+        printf("jit: not available on this host, comparing the block cache only\n");
+        engines = ENGINE_JIT;
+    }
+
+    for (unsigned seed = 1; seed <= programs; seed++) {
+        if (!run(seed, machines, engines)) {
+            return 1;
+        }
+    }
+
+    printf("jit: %u programs, engines agree\n", programs);
+
+    bcache_destroy(machines[ENGINE_BCACHE]->cpu.bcache);
+    jit_destroy(machines[ENGINE_JIT]->cpu.jit);
+
+    for (int e = 0; e < ENGINE_COUNT; e++) {
+        machine_destroy(machines[e]);
+    }
+
+    return 0;
+}
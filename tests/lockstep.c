@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "lockstep.h"
+
+#define LOCKSTEPTEST_PROGRAMS 40
+#define LOCKSTEPTEST_BUDGET 20000 // Cycles per lane and run.
+
+#ifdef LOCKSTEP_SCALAR
+#define LOCKSTEPTEST_NAME "lockstep (scalar)"
+#else
+#define LOCKSTEPTEST_NAME "lockstep"
+#endif
+
+// clang-format off
+// Opcodes that make the random programs go somewhere, as in tests/jit.c.
+static const uint8_t BIASED[] = {
+    0x02, 0x0a, 0x12, 0x1a, 0x22, 0x2a, 0x32, 0x3a, 0x07, 0x0f, 0x17, 0x1f,
+    0x27, 0x2f, 0x37, 0x3f, 0xc2, 0xc3, 0xca, 0xd2, 0xda, 0xe2, 0xea, 0xf2,
+    0xfa, 0xc4, 0xcc, 0xcd, 0xd4, 0xdc, 0xc0, 0xc8, 0xc9, 0xd0, 0xd8, 0xc7,
+    0xcf, 0xc6, 0xce, 0xd6, 0xde, 0xe6, 0xee, 0xf6, 0xfe, 0xc5, 0xd5, 0xe5,
+    0xf5, 0xc1, 0xd1, 0xe1, 0xf1, 0xe3, 0xe9, 0xeb, 0xf9, 0xdb, 0xd3,
+};
+// clang-format on
+
+static uint8_t image[MEM_SIZE];
+
+// Random bytes, with the first pages biased towards instructions that
+// branch, call and touch memory.
+static void generate(void)
+{
+    for (uint32_t i = 0; i < MEM_SIZE; i++) {
+        image[i] = rand();
+    }
+
+    for (uint32_t i = 0; i < 4 * MEM_PAGE_SIZE; i++) {
+        int pick = rand() % 10;
+
+        if (pick < 4) {
+            image[i] = 0x40 + rand() % 0x80; // MOV and ALU
+        } else if (pick < 7) {
+            image[i] = BIASED[rand() % sizeof(BIASED)];
+        } else if (pick < 9) {
+            image[i] = (rand() % 8) << 3 | (4 + rand() % 3); // INR, DCR and MVI
+        }
+
+        if (image[i] == 0x76 && rand() % 8 != 0) {
+            image[i] = 0x00; // Fewer HLTs.
+        }
+    }
+}
+
+// Random registers; the PC stays in the first pages for most lanes, and
+// some lanes share one so that they start in step.
+static void randomize(reg_t* reg, unsigned lane)
+{
+    init_reg(reg);
+    reg->a = rand();
+    flags_set(reg, (rand() & 0xd5) | FLAG_ALWAYS);
+    reg->bc = rand();
+    reg->de = rand();
+    reg->hl = rand();
+    reg->sp = rand();
+    reg->pc = lane % 4 == 0 ? 0x0000 : rand() % (rand() % 8 == 0 ? MEM_SIZE : 4 * MEM_PAGE_SIZE);
+}
+
+// What a lane has to come up with: the same machine run with exec() until
+// it halts or has used the budget, with IN reading an open bus.
+static void run_ref(cpu_t* cpu)
+{
+    uint64_t start = cpu->cycles;
+
+    while (!cpu->halted && cpu->cycles - start < LOCKSTEPTEST_BUDGET) {
+        cpu->cycles += exec(cpu);
+
+        if (cpu->stop == STOP_IO && !cpu->io_out) {
+            cpu->reg->a = 0xff;
+        }
+    }
+}
+
+static bool same_lane(lockstep_t* ls, unsigned lane, machine_t* ref)
+{
+    reg_t reg;
+    reg_t* x = &reg;
+    reg_t* y = &ref->reg;
+
+    lockstep_get_reg(ls, lane, &reg);
+    EXPECT(x->a == y->a && flags_get(x) == flags_get(y) && x->bc == y->bc && x->de == y->de && x->hl == y->hl);
+    EXPECT(x->sp == y->sp && x->pc == y->pc);
+    EXPECT(ls->cycles[lane] == (uint32_t)ref->cpu.cycles);
+    EXPECT((ls->halted[lane] != 0) == ref->cpu.halted);
+    EXPECT(mem_digest(&ls->mem[lane]) == mem_digest(&ref->mem));
+    return true;
+}
+
+// Runs one random program on every lane, from different registers, twice:
+// the second run starts after lockstep_reset() with new registers and the
+// memory the first one left. Every lane is compared with its own machine.
+static bool run(unsigned program, lockstep_t* ls, machine_t** refs)
+{
+    generate();
+    lockstep_reset(ls);
+
+    for (unsigned i = 0; i < LOCKSTEP_LANES; i++) {
+        machine_t* ref = refs[i];
+
+        mem_load(&ls->mem[i], 0, image, MEM_SIZE);
+        mem_load(&ref->mem, 0, image, MEM_SIZE);
+        randomize(&ref->reg, i);
+        lockstep_set_reg(ls, i, &ref->reg);
+        ref->cpu.halted = false;
+        ref->cpu.interrupt = false;
+        ref->cpu.cycles = 0;
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            lockstep_reset(ls);
+
+            for (unsigned i = 0; i < LOCKSTEP_LANES; i++) {
+                machine_t* ref = refs[i];
+
+                randomize(&ref->reg, i);
+                lockstep_set_reg(ls, i, &ref->reg);
+                ref->cpu.halted = false;
+                ref->cpu.interrupt = false;
+                ref->cpu.cycles = 0;
+            }
+        }
+
+        lockstep_run(ls, LOCKSTEPTEST_BUDGET);
+
+        for (unsigned i = 0; i < LOCKSTEP_LANES; i++) {
+            run_ref(&refs[i]->cpu);
+
+            if (!same_lane(ls, i, refs[i])) {
+                fprintf(stderr, "[ERROR:%s:%d] Program %u, run %d: lane %u differs from exec().\n", __FILE__, __LINE__,
+                    program, pass, i);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// The lockstep interpreter, lane by lane against exec() on random programs
+// that fall in and out of step. The Makefile also builds it with
+// LOCKSTEP_SCALAR, which takes the vector kernels out.
+int main(void)
+{
+    lockstep_t* ls = lockstep_create();
+    machine_t* refs[LOCKSTEP_LANES];
+
+    if (ls == NULL) {
+        fprintf(stderr, "[ERROR:%s:%d] Could not create the lanes.\n", __FILE__, __LINE__);
+        return 1;
+    }
+
+    for (unsigned i = 0; i < LOCKSTEP_LANES; i++) {
+        refs[i] = machine_create();
+
+        if (refs[i] == NULL) {
+            fprintf(stderr, "[ERROR:%s:%d] Could not create lane %u's machine.\n", __FILE__, __LINE__, i);
+            return 1;
+        }
+    }
+
+    srand(1);
+
+    for (unsigned p = 0; p < LOCKSTEPTEST_PROGRAMS; p++) {
+        if (!run(p, ls, refs)) {
+            return 1;
+        }
+    }
+
+    for (unsigned i = 0; i < LOCKSTEP_LANES; i++) {
+        machine_destroy(refs[i]);
+    }
+
+    lockstep_destroy(ls);
+    printf("%s: %d programs on %d lanes agree with exec()\n", LOCKSTEPTEST_NAME, LOCKSTEPTEST_PROGRAMS, LOCKSTEP_LANES);
+    return 0;
+}
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "check.h"
+#include "cpu.h"
+
+#define SPIN_PERIOD 1013 // Cycles between interrupts, not a multiple of any loop.
+#define SPIN_CYCLES 200000 // Run per program and engine.
+#define SPIN_LOG 256 // Interrupts logged at most.
+
+typedef enum {
+    ENGINE_INTERP = 0,
+    ENGINE_BCACHE,
+    ENGINE_JIT,
+    ENGINE_COUNT,
+} engine_t;
+
+static const char* const ENGINE_NAMES[] = { "interp", "bcache", "jit" };
+
+typedef struct {
+    const char* name;
+    const uint8_t* code;
+    size_t size;
+} program_t;
+
+// clang-format off
+// Polls a status bit with a branch that skips part of the loop.
+static const uint8_t SKIPPING[] = {
+    0xfb,             // 0000 EI
+    0xdb, 0x01,       // 0001 IN 01
+    0xe6, 0x01,       // 0003 ANI 01
+    0xca, 0x0a, 0x00, // 0005 JZ 000A
+    0x00,             // 0008 NOP
+    0x00,             // 0009 NOP
+    0xc3, 0x01, 0x00, // 000A JMP 0001
+};
+
+static const uint8_t POLLING[] = {
+    0xfb,             // 0000 EI
+    0xdb, 0x01,       // 0001 IN 01
+    0xe6, 0x01,       // 0003 ANI 01
+    0xca, 0x01, 0x00, // 0005 JZ 0001
+    0x76,             // 0008 HLT
+};
+
+static const uint8_t DELAY[] = {
+    0xfb,             // 0000 EI
+    0x06, 0x00,       // 0001 MVI B,00
+    0x05,             // 0003 DCR B
+    0xc2, 0x03, 0x00, // 0004 JNZ 0003
+    0x0c,             // 0007 INR C
+    0xc3, 0x01, 0x00, // 0008 JMP 0001
+};
+
+// RST 7: counts in D and returns with interrupts enabled.
+static const uint8_t RST7[] = {
+    0x14,             // 0038 INR D
+    0xfb,             // 0039 EI
+    0xc9,             // 003A RET
+};
+// clang-format on
+
+static const program_t PROGRAMS[] = {
+    { "skipping", SKIPPING, sizeof(SKIPPING) },
+    { "polling", POLLING, sizeof(POLLING) },
+    { "delay", DELAY, sizeof(DELAY) },
+};
+
+// The cycle and interrupted PC of every interrupt of one run.
+typedef struct {
+    cpu_t* cpu;
+    uint32_t count;
+    uint64_t cycle[SPIN_LOG];
+    uint16_t pc[SPIN_LOG];
+} ticker_t;
+
+static void tick(void* ctx, uint64_t cycle)
+{
+    ticker_t* ticker = ctx;
+
+    if (ticker->count < SPIN_LOG) {
+        ticker->cycle[ticker->count] = ticker->cpu->cycles;
+        ticker->pc[ticker->count] = ticker->cpu->reg->pc;
+        ticker->count++;
+    }
+
+    handle_interrupt(ticker->cpu, 0x0038);
+    schedule_event(ticker->cpu, cycle + SPIN_PERIOD, tick, ticker);
+}
+
+static uint8_t status(void* ctx, uint8_t port)
+{
+    (void)ctx;
+    (void)port;
+    return 0x00;
+}
+
+static bool never(cpu_t* cpu, void* arg)
+{
+    (void)cpu;
+    (void)arg;
+    return false;
+}
+
+// Runs `program` with a ticker interrupt on `engine`: the interpreter goes
+// through exec() one instruction at a time, the others in frames.
+static bool run(const program_t* program, engine_t engine, ticker_t* ticker, reg_t* out)
+{
+    machine_t* machine = machine_create();
+    cpu_t* cpu = &machine->cpu;
+    events_t events;
+    io_t io;
+
+    EXPECT(machine != NULL);
+
+    init_events(&events);
+    init_io(&io);
+    io_map(&io, 0x01, status, NULL, NULL);
+    io_stable(&io, 0x01, true);
+    mem_load(cpu->mem, 0x0000, program->code, program->size);
+    mem_load(cpu->mem, 0x0038, RST7, sizeof(RST7));
+    cpu->reg->sp = 0x1000;
+    cpu->events = &events;
+    cpu->io = &io;
+
+    if (engine == ENGINE_BCACHE) {
+        cpu->bcache = bcache_create();
+    } else if (engine == ENGINE_JIT) {
+        cpu->jit = jit_create();
+    }
+
+    memset(ticker, 0, sizeof(ticker_t));
+    ticker->cpu = cpu;
+    schedule_event(cpu, SPIN_PERIOD, tick, ticker);
+
+    while (cpu->cycles < SPIN_CYCLES) {
+        if (engine == ENGINE_INTERP) {
+            run_until(cpu, TICK_CYCLES, never, NULL);
+        } else {
+            run_cycles(cpu, TICK_CYCLES);
+        }
+
+        cpu->tick_cycles = 0;
+    }
+
+    *out = *cpu->reg;
+    bcache_destroy(cpu->bcache);
+    jit_destroy(cpu->jit);
+    machine_destroy(machine);
+    return true;
+}
+
+// The loops the block cache and the JIT skip must take them as many cycles
+// as running them does: interrupts then come at the same cycles and PCs on
+// every engine.
+static bool compare(const program_t* program, int engines)
+{
+    static ticker_t tickers[ENGINE_COUNT];
+    reg_t regs[ENGINE_COUNT];
+
+    for (int e = 0; e < engines; e++) {
+        EXPECT(run(program, e, &tickers[e], &regs[e]));
+    }
+
+    ticker_t* ref = &tickers[ENGINE_INTERP];
+
+    EXPECT(ref->count > 100);
+
+    for (int e = 1; e < engines; e++) {
+        ticker_t* ticker = &tickers[e];
+
+        for (uint32_t i = 0; i < ref->count; i++) {
+            if (ticker->cycle[i] != ref->cycle[i] || ticker->pc[i] != ref->pc[i]) {
+                fprintf(stderr, "[ERROR:%s:%d] %s: interrupt %u taken by %s at %04x after %llu cycles, interp at %04x after %llu.\n",
+                    __FILE__, __LINE__, program->name, i, ENGINE_NAMES[e], ticker->pc[i], (unsigned long long)ticker->cycle[i],
+                    ref->pc[i], (unsigned long long)ref->cycle[i]);
+                return false;
+            }
+        }
+
+        EXPECT(ticker->count == ref->count);
+        EXPECT(regs[e].pc == regs[ENGINE_INTERP].pc && regs[e].bc == regs[ENGINE_INTERP].bc);
+        EXPECT(regs[e].d == regs[ENGINE_INTERP].d);
+    }
+
+    return true;
+}
+
+// Skipped delay and polling loops, against running them, under a ticker
+// interrupt.
+int main(void)
+{
+    int engines = ENGINE_COUNT;
+    jit_t* jit = jit_create();
+
+    if (jit == NULL) {
+        printf("spin: no jit on this host, comparing the block cache only\n");
+        engines = ENGINE_JIT;
+    }
+
+    jit_destroy(jit);
+
+    for (size_t i = 0; i < sizeof(PROGRAMS) / sizeof(PROGRAMS[0]); i++) {
+        if (!compare(&PROGRAMS[i], engines)) {
+            return 1;
+        }
+    }
+
+    printf("spin: skipped loops keep interrupt timing\n");
+    return 0;
+}
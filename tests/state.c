@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "state.h"
+
+#define STATE_RECORDS 6 // A full record and the deltas after it.
+
+// What a record has to bring back.
+typedef struct {
+    reg_t reg;
+    bool halted;
+    bool interrupt;
+    uint32_t tick_cycles;
+    uint64_t cycles;
+    bool rom_page[MEM_PAGES];
+    uint64_t digest;
+} snapshot_t;
+
+static void take(snapshot_t* snap, cpu_t* cpu)
+{
+    snap->reg = *cpu->reg;
+    snap->halted = cpu->halted;
+    snap->interrupt = cpu->interrupt;
+    snap->tick_cycles = cpu->tick_cycles;
+    snap->cycles = cpu->cycles;
+    memcpy(snap->rom_page, cpu->mem->rom_page, sizeof(snap->rom_page));
+    snap->digest = mem_digest(cpu->mem);
+}
+
+static bool same(snapshot_t* snap, cpu_t* cpu)
+{
+    reg_t* reg = cpu->reg;
+
+    EXPECT(reg->a == snap->reg.a && flags_get(reg) == flags_get(&snap->reg));
+    EXPECT(reg->bc == snap->reg.bc && reg->de == snap->reg.de && reg->hl == snap->reg.hl);
+    EXPECT(reg->sp == snap->reg.sp && reg->pc == snap->reg.pc);
+    EXPECT(cpu->halted == snap->halted && cpu->interrupt == snap->interrupt);
+    EXPECT(cpu->tick_cycles == snap->tick_cycles && cpu->cycles == snap->cycles);
+    EXPECT(memcmp(cpu->mem->rom_page, snap->rom_page, sizeof(snap->rom_page)) == 0);
+    EXPECT(mem_digest(cpu->mem) == snap->digest);
+    return true;
+}
+
+// Runs random code for a while and writes a few pages from the host, so
+// that every delta has something in it.
+static void advance(cpu_t* cpu)
+{
+    cpu->halted = false;
+    run_cycles(cpu, 1000 + rand() % 1000);
+
+    for (int i = 0; i < 4; i++) {
+        set_mem(cpu->mem, rand(), rand());
+    }
+}
+
+// Saves a full record and deltas from one machine and loads them one by one
+// into another, which must match the first as it was at each save.
+static bool round_trip(FILE* file, snapshot_t* snaps)
+{
+    machine_t* src = machine_create();
+    machine_t* dst = machine_create();
+    uint8_t image[MEM_SIZE];
+
+    EXPECT(src != NULL && dst != NULL);
+
+    for (uint32_t i = 0; i < MEM_SIZE; i++) {
+        image[i] = rand();
+    }
+
+    mem_load(&src->mem, 0, image, MEM_SIZE);
+    mem_protect(&src->mem, 0xf000, 0x1000);
+
+    for (int i = 0; i < STATE_RECORDS; i++) {
+        advance(&src->cpu);
+        EXPECT(state_save(&src->cpu, file, i == 0 ? STATE_FULL : STATE_DELTA));
+        take(&snaps[i], &src->cpu);
+    }
+
+    rewind(file);
+
+    for (int i = 0; i < STATE_RECORDS; i++) {
+        EXPECT(state_load(&dst->cpu, file));
+        EXPECT(same(&snaps[i], &dst->cpu));
+    }
+
+    EXPECT(!state_load(&dst->cpu, file));
+    EXPECT(same(&snaps[STATE_RECORDS - 1], &dst->cpu));
+
+    machine_destroy(src);
+    machine_destroy(dst);
+    return true;
+}
+
+// A record that cannot be applied, cut short or carrying a page that is
+// MMIO in the machine it is loaded into, changes nothing.
+static bool bad_records(FILE* file, snapshot_t* snaps)
+{
+    static const mem_io_t device = { NULL, NULL, NULL };
+    machine_t* machine = machine_create();
+    snapshot_t before;
+    long size;
+
+    EXPECT(machine != NULL);
+
+    // Restored to the record before the last, which the full record would
+    // take back.
+    rewind(file);
+
+    for (int i = 0; i < STATE_RECORDS - 1; i++) {
+        EXPECT(state_load(&machine->cpu, file));
+    }
+
+    long last = ftell(file);
+
+    EXPECT(fseek(file, 0, SEEK_END) == 0);
+    size = ftell(file);
+    take(&before, &machine->cpu);
+    EXPECT(same(&snaps[STATE_RECORDS - 2], &machine->cpu));
+
+    // The full record, cut short.
+    FILE* cut = tmpfile();
+    uint8_t* buf = malloc(size);
+
+    EXPECT(cut != NULL && buf != NULL);
+    rewind(file);
+    EXPECT(fread(buf, size, 1, file) == 1);
+    EXPECT(fwrite(buf, 1, last / 2, cut) == (size_t)(last / 2));
+    rewind(cut);
+    EXPECT(!state_load(&machine->cpu, cut));
+    EXPECT(same(&before, &machine->cpu));
+
+    // The full record, onto a machine with a device at 8000.
+    mem_map_io(&machine->mem, 0x8000, MEM_PAGE_SIZE, &device);
+    take(&before, &machine->cpu);
+    rewind(file);
+    EXPECT(!state_load(&machine->cpu, file));
+    EXPECT(same(&before, &machine->cpu));
+
+    fclose(cut);
+    free(buf);
+    machine_destroy(machine);
+    return true;
+}
+
+// Save states: a full record and deltas written while a machine runs, read
+// back in order, and records that must be turned down whole.
+int main(void)
+{
+    FILE* file = tmpfile();
+    snapshot_t snaps[STATE_RECORDS];
+
+    if (file == NULL) {
+        fprintf(stderr, "[ERROR:%s:%d] Cannot create a temporary file.\n", __FILE__, __LINE__);
+        return 1;
+    }
+
+    srand(1);
+
+    if (!round_trip(file, snaps) || !bad_records(file, snaps)) {
+        return 1;
+    }
+
+    fclose(file);
+    printf("state: %d records round-trip, bad ones change nothing\n", STATE_RECORDS);
+    return 0;
+}
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "cpu.h"
+#include "tracefile.h"
+
+#define TRACEFILE_RING 64 // Records per chunk of the streamed trace.
+#define TRACEFILE_BATCHES 200
+
+// clang-format off
+// Counts B up in a loop that calls a subroutine on odd counts, which
+// returns with a taken RNZ, and halts every 16 counts to wait for RST 7.
+static const uint8_t LOOP[] = {
+    0x31, 0x00, 0x20, // 0000 LXI SP,2000
+    0xfb,             // 0003 EI
+    0x06, 0x00,       // 0004 MVI B,00
+    0x04,             // 0006 INR B
+    0x78,             // 0007 MOV A,B
+    0xe6, 0x01,       // 0008 ANI 01
+    0xc4, 0x20, 0x00, // 000A CNZ 0020
+    0x78,             // 000D MOV A,B
+    0xe6, 0x0f,       // 000E ANI 0F
+    0xc2, 0x06, 0x00, // 0010 JNZ 0006
+    0x76,             // 0013 HLT
+    0xc3, 0x06, 0x00, // 0014 JMP 0006
+};
+
+static const uint8_t SUB[] = {
+    0x4f,             // 0020 MOV C,A
+    0xb7,             // 0021 ORA A
+    0xc0,             // 0022 RNZ
+    0xc9,             // 0023 RET
+};
+
+static const uint8_t RST7[] = {
+    0x14,             // 0038 INR D
+    0xfb,             // 0039 EI
+    0xc9,             // 003A RET
+};
+// clang-format on
+
+// Runs LOOP with `trace` attached. A halted CPU idles for a few thousand
+// cycles before it is interrupted, and a running one is interrupted every
+// few batches as well, so the trace has taken conditional calls and
+// returns, interrupts and long cycle steps in it.
+static bool run(trace_t* trace)
+{
+    machine_t* machine = machine_create();
+    cpu_t* cpu = &machine->cpu;
+
+    EXPECT(machine != NULL);
+
+    mem_load(cpu->mem, 0x0000, LOOP, sizeof(LOOP));
+    mem_load(cpu->mem, 0x0020, SUB, sizeof(SUB));
+    mem_load(cpu->mem, 0x0038, RST7, sizeof(RST7));
+    cpu->trace = trace;
+
+    for (int batch = 0; batch < TRACEFILE_BATCHES; batch++) {
+        if (cpu->halted) {
+            cpu->next_event = cpu->cycles + 3000 + batch;
+            run_cycles(cpu, 5000);
+            cpu->next_event = UINT64_MAX;
+            handle_interrupt(cpu, 0x0038);
+        } else if (batch % 7 == 0) {
+            handle_interrupt(cpu, 0x0038);
+        }
+
+        run_cycles(cpu, 50 + batch % 50);
+    }
+
+    machine_destroy(machine);
+    return true;
+}
+
+static bool same_rec(const trace_rec_t* x, const trace_rec_t* y)
+{
+    return x->cycle == y->cycle && x->pc == y->pc && x->sp == y->sp && x->opcode == y->opcode && x->a == y->a
+        && x->f == y->f && x->b == y->b && x->c == y->c && x->d == y->d && x->e == y->e && x->h == y->h
+        && x->l == y->l;
+}
+
+// The records of `ref` whose cycle step from the one before differs from
+// OPCODES_CYCLES, so stored with CTL_CYCLE.
+static uint32_t odd_steps(const trace_t* ref)
+{
+    uint32_t odd = 0;
+
+    for (uint64_t i = 1; i < ref->count; i++) {
+        const trace_rec_t* prev = &ref->recs[i - 1];
+
+        odd += ref->recs[i].cycle - prev->cycle != OPCODES_CYCLES[prev->opcode];
+    }
+
+    return odd;
+}
+
+// Streams the trace of a run to a file with a small ring, so that it takes
+// many chunks, and reads it back, all through and by seeking, against the
+// same run recorded whole into a ring large enough to hold it. The ring
+// itself ends up with the last records.
+static bool round_trip(const char* path)
+{
+    trace_t* ref = trace_create(1 << 16);
+    trace_t* trace = trace_create(TRACEFILE_RING);
+    tracefile_t tf;
+    trace_rec_t rec;
+
+    EXPECT(ref != NULL && trace != NULL);
+    EXPECT(run(ref));
+    EXPECT(ref->count > 16 * TRACEFILE_RING && ref->count < ref->size);
+    EXPECT(odd_steps(ref) > 100);
+
+    EXPECT(trace_stream_open(trace, path));
+    EXPECT(run(trace));
+    EXPECT(trace->count == ref->count);
+    EXPECT(trace_stream_close(trace));
+
+    // The ring is left with the last records, across the last chunk.
+    EXPECT(trace->count == ref->count && ref->count % TRACEFILE_RING != 0);
+
+    for (uint64_t i = ref->count - TRACEFILE_RING; i < ref->count; i++) {
+        EXPECT(same_rec(&trace->recs[i % TRACEFILE_RING], &ref->recs[i]));
+    }
+
+    EXPECT(tracefile_open(&tf, path));
+
+    for (uint64_t i = 0; i < ref->count; i++) {
+        EXPECT(tracefile_next(&tf, &rec));
+        EXPECT(same_rec(&rec, &ref->recs[i]));
+    }
+
+    EXPECT(!tracefile_next(&tf, &rec));
+
+    // Records by their own cycle and by one cycle before it, which falls
+    // inside the instruction before; a few records are read on from there,
+    // across the end of the chunk for the last ones of it.
+    for (uint64_t i = 0; i < ref->count; i += 7) {
+        EXPECT(tracefile_seek(&tf, ref->recs[i].cycle - (i % 2)));
+
+        for (uint64_t j = i; j < i + 3 && j < ref->count; j++) {
+            EXPECT(tracefile_next(&tf, &rec));
+            EXPECT(same_rec(&rec, &ref->recs[j]));
+        }
+    }
+
+    EXPECT(!tracefile_seek(&tf, ref->recs[ref->count - 1].cycle + 1));
+
+    tracefile_close(&tf);
+    trace_destroy(trace);
+    trace_destroy(ref);
+    return true;
+}
+
+// Trace files: the delta encoding with its PC, SP and cycle flags, chunk
+// boundaries and seeking, against the records as they were taken.
+int main(void)
+{
+    char path[] = "/tmp/tracefile-XXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd < 0) {
+        fprintf(stderr, "[ERROR:%s:%d] Cannot create a temporary file.\n", __FILE__, __LINE__);
+        return 1;
+    }
+
+    close(fd);
+
+    bool ok = round_trip(path);
+
+    unlink(path);
+
+    if (!ok) {
+        return 1;
+    }
+
+    printf("tracefile: streamed records read back as taken\n");
+    return 0;
+}
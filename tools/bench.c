@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cpu.h"
+#include "lockstep.h"
+
+#define BENCH_SECONDS 0.5 // Minimum time measured per workload and engine.
+
+typedef struct {
+    const char* name;
+    const uint8_t* code;
+    size_t size;
+} workload_t;
+
+typedef enum {
+    ENGINE_INTERP = 0,
+    ENGINE_BCACHE,
+    ENGINE_JIT,
+} engine_t;
+
+static const char* const ENGINE_NAMES[] = { "interp", "bcache", "jit" };
+
+// Synthetic workloads, loaded at 0000. Each one runs a fixed amount of work
+// and halts, and sets up every register and memory location it depends on,
+// so that it can be rerun by resetting the registers only. All of them run
+// the same instructions every time; the counts come from one stepped run.
+
+// clang-format off
+// Mixed ALU operations on A, B and C, 4 * 65536 times.
+static const uint8_t ALU[] = {
+    0x31, 0x00, 0x00,       // 0000 LXI SP,0000
+    0x2e, 0x04,             // 0003 MVI L,04
+    0x1e, 0x00,             // 0005 MVI E,00
+    0x16, 0x00,             // 0007 MVI D,00
+    0x80,                   // 0009 ADD B
+    0xa9,                   // 000A XRA C
+    0x2f,                   // 000B CMA
+    0x87,                   // 000C ADD A
+    0x89,                   // 000D ADC C
+    0x90,                   // 000E SUB B
+    0xb1,                   // 000F ORA C
+    0xa0,                   // 0010 ANA B
+    0x3c,                   // 0011 INR A
+    0x04,                   // 0012 INR B
+    0x0d,                   // 0013 DCR C
+    0x15,                   // 0014 DCR D
+    0xc2, 0x09, 0x00,       // 0015 JNZ 0009
+    0x1d,                   // 0018 DCR E
+    0xc2, 0x07, 0x00,       // 0019 JNZ 0007
+    0x2d,                   // 001C DCR L
+    0xc2, 0x05, 0x00,       // 001D JNZ 0005
+    0x76,                   // 0020 HLT
+};
+
+// Copies 1000-1FFF to 3000-3FFF 128 times.
+static const uint8_t MEMCPY[] = {
+    0x31, 0x00, 0x00,       // 0000 LXI SP,0000
+    0x0e, 0x80,             // 0003 MVI C,80
+    0x26, 0x10,             // 0005 MVI H,10
+    0x16, 0x30,             // 0007 MVI D,30
+    0x2e, 0x00,             // 0009 MVI L,00
+    0x1e, 0x00,             // 000B MVI E,00
+    0x7e,                   // 000D MOV A,M
+    0x12,                   // 000E STAX D
+    0x2c,                   // 000F INR L
+    0x1c,                   // 0010 INR E
+    0xc2, 0x0d, 0x00,       // 0011 JNZ 000D
+    0x24,                   // 0014 INR H
+    0x14,                   // 0015 INR D
+    0x7c,                   // 0016 MOV A,H
+    0xfe, 0x20,             // 0017 CPI 20
+    0xc2, 0x0d, 0x00,       // 0019 JNZ 000D
+    0x0d,                   // 001C DCR C
+    0xc2, 0x05, 0x00,       // 001D JNZ 0005
+    0x76,                   // 0020 HLT
+};
+
+// Adds fib(18) to L by naive recursion, 40 times.
+static const uint8_t CALLS[] = {
+    0x31, 0x00, 0x00,       // 0000 LXI SP,0000
+    0x06, 0x28,             // 0003 MVI B,28
+    0x2e, 0x00,             // 0005 MVI L,00
+    0x0e, 0x12,             // 0007 MVI C,12
+    0xcd, 0x20, 0x00,       // 0009 CALL 0020
+    0x05,                   // 000C DCR B
+    0xc2, 0x05, 0x00,       // 000D JNZ 0005
+    0x76,                   // 0010 HLT
+    0x00, 0x00, 0x00, 0x00, // 0011
+    0x00, 0x00, 0x00, 0x00, // 0015
+    0x00, 0x00, 0x00, 0x00, // 0019
+    0x00, 0x00, 0x00,       // 001D
+    0x79,                   // 0020 MOV A,C
+    0xfe, 0x02,             // 0021 CPI 02
+    0xda, 0x33, 0x00,       // 0023 JC 0033
+    0x0d,                   // 0026 DCR C
+    0xcd, 0x20, 0x00,       // 0027 CALL 0020
+    0x0d,                   // 002A DCR C
+    0xcd, 0x20, 0x00,       // 002B CALL 0020
+    0x0c,                   // 002E INR C
+    0x0c,                   // 002F INR C
+    0xc9,                   // 0030 RET
+    0x00, 0x00,             // 0031
+    0x7d,                   // 0033 MOV A,L
+    0x81,                   // 0034 ADD C
+    0x6f,                   // 0035 MOV L,A
+    0xc9,                   // 0036 RET
+};
+
+// Adds 37373737 plus one to the packed BCD number at 1000-1003, 65536
+// times.
+static const uint8_t BCD[] = {
+    0x31, 0x00, 0x00,       // 0000 LXI SP,0000
+    0x1e, 0x00,             // 0003 MVI E,00
+    0x16, 0x00,             // 0005 MVI D,00
+    0x26, 0x10,             // 0007 MVI H,10
+    0x2e, 0x00,             // 0009 MVI L,00
+    0x0e, 0x04,             // 000B MVI C,04
+    0x37,                   // 000D STC
+    0x7e,                   // 000E MOV A,M
+    0xce, 0x37,             // 000F ACI 37
+    0x27,                   // 0011 DAA
+    0x77,                   // 0012 MOV M,A
+    0x2c,                   // 0013 INR L
+    0x0d,                   // 0014 DCR C
+    0xc2, 0x0e, 0x00,       // 0015 JNZ 000E
+    0x15,                   // 0018 DCR D
+    0xc2, 0x09, 0x00,       // 0019 JNZ 0009
+    0x1d,                   // 001C DCR E
+    0xc2, 0x05, 0x00,       // 001D JNZ 0005
+    0x76,                   // 0020 HLT
+};
+
+// Four-way branches on an 8-bit Galois LFSR, 4 * 65536 times.
+static const uint8_t BRANCH[] = {
+    0x31, 0x00, 0x00,       // 0000 LXI SP,0000
+    0x0e, 0x04,             // 0003 MVI C,04
+    0x1e, 0x00,             // 0005 MVI E,00
+    0x16, 0x00,             // 0007 MVI D,00
+    0x06, 0xa5,             // 0009 MVI B,A5
+    0x78,                   // 000B MOV A,B
+    0xb7,                   // 000C ORA A
+    0x1f,                   // 000D RAR
+    0xd2, 0x13, 0x00,       // 000E JNC 0013
+    0xee, 0xb8,             // 0011 XRI B8
+    0x47,                   // 0013 MOV B,A
+    0xe6, 0x03,             // 0014 ANI 03
+    0xca, 0x27, 0x00,       // 0016 JZ 0027
+    0xfe, 0x02,             // 0019 CPI 02
+    0xda, 0x2b, 0x00,       // 001B JC 002B
+    0xca, 0x2f, 0x00,       // 001E JZ 002F
+    0x24,                   // 0021 INR H
+    0xc3, 0x33, 0x00,       // 0022 JMP 0033
+    0x00, 0x00,             // 0025
+    0x2c,                   // 0027 INR L
+    0xc3, 0x33, 0x00,       // 0028 JMP 0033
+    0x25,                   // 002B DCR H
+    0xc3, 0x33, 0x00,       // 002C JMP 0033
+    0x2d,                   // 002F DCR L
+    0xc3, 0x33, 0x00,       // 0030 JMP 0033
+    0x15,                   // 0033 DCR D
+    0xc2, 0x0b, 0x00,       // 0034 JNZ 000B
+    0x1d,                   // 0037 DCR E
+    0xc2, 0x07, 0x00,       // 0038 JNZ 0007
+    0x0d,                   // 003B DCR C
+    0xc2, 0x05, 0x00,       // 003C JNZ 0005
+    0x76,                   // 003F HLT
+};
+// clang-format on
+
+static const workload_t WORKLOADS[] = {
+    { "alu", ALU, sizeof(ALU) },
+    { "memcpy", MEMCPY, sizeof(MEMCPY) },
+    { "calls", CALLS, sizeof(CALLS) },
+    { "bcd", BCD, sizeof(BCD) },
+    { "branch", BRANCH, sizeof(BRANCH) },
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void reset(cpu_t* cpu)
+{
+    init_reg(cpu->reg);
+    cpu->halted = false;
+    cpu->interrupt = false;
+    cpu->tick_cycles = 0;
+}
+
+// Runs the loaded workload to HLT in frames, as the host loop does.
+static void run(cpu_t* cpu)
+{
+    while (run_cycles(cpu, TICK_CYCLES) != STOP_HALT) {
+        cpu->tick_cycles = 0;
+    }
+}
+
+// Loads `w` into a new machine for `engine`. NULL if the engine is not
+// available on this host.
+static machine_t* setup(const workload_t* w, engine_t engine)
+{
+    machine_t* machine = machine_create();
+
+    if (machine == NULL) {
+        return NULL;
+    }
+
+    cpu_t* cpu = &machine->cpu;
+
+    mem_load(cpu->mem, 0, w->code, w->size);
+
+    if (engine == ENGINE_BCACHE) {
+        cpu->bcache = bcache_create();
+    } else if (engine == ENGINE_JIT) {
+        cpu->jit = jit_create();
+    }
+
+    if ((engine == ENGINE_BCACHE && cpu->bcache == NULL) || (engine == ENGINE_JIT && cpu->jit == NULL)) {
+        machine_destroy(machine);
+        return NULL;
+    }
+
+    return machine;
+}
+
+static void teardown(machine_t* machine)
+{
+    bcache_destroy(machine->cpu.bcache);
+    jit_destroy(machine->cpu.jit);
+    machine_destroy(machine);
+}
+
+// Runs `w` on every lane of the lockstep interpreter at once, for at least
+// `seconds`. All lanes start alike and stay in step, so the instructions
+// and cycles are `insns` and `cycles` per lane and run. Prints a row like
+// main() does, totalled over the lanes; false if a lane went astray.
+static bool bench_lockstep(const workload_t* w, uint64_t insns, uint64_t cycles, double seconds)
+{
+    lockstep_t* ls = lockstep_create();
+
+    if (ls == NULL) {
+        return false;
+    }
+
+    for (unsigned i = 0; i < LOCKSTEP_LANES; i++) {
+        mem_load(&ls->mem[i], 0, w->code, w->size);
+    }
+
+    uint64_t runs = 0;
+    uint64_t total = 0;
+    double start = now();
+    double elapsed;
+
+    do {
+        reg_t reg;
+
+        init_reg(&reg);
+        lockstep_reset(ls);
+
+        for (unsigned i = 0; i < LOCKSTEP_LANES; i++) {
+            lockstep_set_reg(ls, i, &reg);
+        }
+
+        total += lockstep_run(ls, UINT32_MAX);
+        runs++;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+
+    bool ok = total == runs * insns * LOCKSTEP_LANES;
+
+    for (unsigned i = 0; i < LOCKSTEP_LANES; i++) {
+        ok &= ls->halted[i] && ls->cycles[i] == cycles;
+    }
+
+    if (!ok) {
+        fprintf(stderr, "[ERROR:%s:%d] %s ran %llu instructions on lockstep instead of %llu.\n", __FILE__, __LINE__,
+            w->name, (unsigned long long)total, (unsigned long long)(runs * insns * LOCKSTEP_LANES));
+        lockstep_destroy(ls);
+        return false;
+    }
+
+    printf("%s\t%s\t%llu\t%llu\t%.3f\t%.3f\t%.1f\t%.1f\n",
+        w->name,
+        "lockstep",
+        (unsigned long long)total,
+        (unsigned long long)(runs * cycles * LOCKSTEP_LANES),
+        elapsed,
+        elapsed * 1e9 / total,
+        total / elapsed / 1e6,
+        runs * cycles * LOCKSTEP_LANES / elapsed / CLOCK_FREQUENCY);
+    fflush(stdout);
+
+    lockstep_destroy(ls);
+    return true;
+}
+
+// Runs every workload on every engine for at least `seconds` each and
+// prints one line per pair:
+//   workload engine insns cycles seconds ns_per_insn mips clock_x
+// where insns and cycles are totals over all runs and clock_x is the
+// emulated clock rate over CLOCK_FREQUENCY. The lockstep rows total every
+// lane.
+int main(int argc, char** argv)
+{
+    double seconds = argc > 1 ? strtod(argv[1], NULL) : BENCH_SECONDS;
+
+    if (argc > 2 || seconds <= 0) {
+        fprintf(stderr, "usage: %s [SECONDS]\n", argv[0]);
+        return 1;
+    }
+
+    printf("# workload\tengine\tinsns\tcycles\tseconds\tns_per_insn\tmips\tclock_x\n");
+
+    for (size_t i = 0; i < sizeof(WORKLOADS) / sizeof(WORKLOADS[0]); i++) {
+        const workload_t* w = &WORKLOADS[i];
+        machine_t* machine = setup(w, ENGINE_INTERP);
+        uint64_t insns = 0;
+
+        if (machine == NULL) {
+            fprintf(stderr, "[ERROR:%s:%d] Could not set up %s.\n", __FILE__, __LINE__, w->name);
+            return 1;
+        }
+
+        while (!machine->cpu.halted) {
+            step(&machine->cpu);
+            insns++;
+        }
+
+        uint64_t cycles = machine->cpu.cycles;
+
+        teardown(machine);
+
+        for (engine_t engine = ENGINE_INTERP; engine <= ENGINE_JIT; engine++) {
+            machine = setup(w, engine);
+
+            if (machine == NULL) {
+                continue;
+            }
+
+            cpu_t* cpu = &machine->cpu;
+
+            uint64_t runs = 0;
+            double start = now();
+            double elapsed;
+
+            do {
+                reset(cpu);
+                run(cpu);
+                runs++;
+                elapsed = now() - start;
+            } while (elapsed < seconds);
+
+            if (cpu->cycles != runs * cycles) {
+                fprintf(stderr, "[ERROR:%s:%d] %s ran %llu cycles on %s instead of %llu.\n", __FILE__, __LINE__, w->name,
+                    (unsigned long long)cpu->cycles, ENGINE_NAMES[engine], (unsigned long long)(runs * cycles));
+                return 1;
+            }
+
+            printf("%s\t%s\t%llu\t%llu\t%.3f\t%.3f\t%.1f\t%.1f\n",
+                w->name,
+                ENGINE_NAMES[engine],
+                (unsigned long long)(runs * insns),
+                (unsigned long long)cpu->cycles,
+                elapsed,
+                elapsed * 1e9 / (runs * insns),
+                runs * insns / elapsed / 1e6,
+                cpu->cycles / elapsed / CLOCK_FREQUENCY);
+            fflush(stdout);
+
+            teardown(machine);
+        }
+
+        if (!bench_lockstep(w, insns, cycles, seconds)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bcache.h"
+
+#define FUSE_MAX 32 // Pairs written unless -n says otherwise.
+#define FUSE_MIN_SHARE 0.1 // Percent of the instructions run, on average, that a pair must start.
+
+typedef struct {
+    uint16_t key; // First opcode << 8 | second opcode.
+    double share;
+    char note[64]; // What a seed pair is, from the seed list.
+} pair_t;
+
+static double shares[65536];
+static pair_t pairs[65536];
+static bool seeded[65536];
+
+// Reads the seed list at `path` into `pairs`, in its order: one pair per
+// line as two hex opcodes and what they are, with blank lines and lines
+// starting with # left out. Returns the number of pairs, -1 if the file
+// cannot be read or has a pair that cannot be fused or is listed twice.
+static int read_seeds(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    char line[256];
+    int count = 0;
+
+    if (file == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        unsigned first;
+        unsigned second;
+        int end = 0;
+
+        if (line[0] == '#' || line[strspn(line, " \t\n")] == '\0') {
+            continue;
+        }
+
+        if (sscanf(line, "%x %x %n", &first, &second, &end) != 2 || first > 0xff || second > 0xff
+            || bcache_ends_block(first) || seeded[first << 8 | second]) {
+            fprintf(stderr, "[ERROR:%s:%d] Bad seed pair in %s: %s", __FILE__, __LINE__, path, line);
+            fclose(file);
+            return -1;
+        }
+
+        pair_t* pair = &pairs[count++];
+
+        pair->key = first << 8 | second;
+        snprintf(pair->note, sizeof(pair->note), "%.*s", (int)strcspn(line + end, "\n"), line + end);
+        seeded[pair->key] = true;
+    }
+
+    fclose(file);
+    return count;
+}
+
+// Adds the share of every pair in the profile report at `path` to
+// `shares`. False if it cannot be read or has no pairs.
+static bool read_profile(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    char line[256];
+    bool in_pairs = false;
+
+    if (file == NULL) {
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        unsigned long long count;
+        double share;
+        unsigned first;
+        unsigned second;
+
+        if (!in_pairs) {
+            size_t len = strlen(line);
+
+            in_pairs = len >= 6 && strcmp(line + len - 6, " pair\n") == 0;
+            continue;
+        }
+
+        if (sscanf(line, "%llu %lf %x %x", &count, &share, &first, &second) != 4) {
+            break;
+        }
+
+        shares[(first & 0xff) << 8 | (second & 0xff)] += share;
+    }
+
+    fclose(file);
+    return in_pairs;
+}
+
+// Largest share first, then lowest key.
+static int by_share(const void* a, const void* b)
+{
+    const pair_t* x = a;
+    const pair_t* y = b;
+
+    if (x->share != y->share) {
+        return x->share < y->share ? 1 : -1;
+    }
+
+    return (x->key > y->key) - (x->key < y->key);
+}
+
+// Writes fuse.h: the pairs of the seed list given with -s first, then the
+// opcode pairs that start the most instructions on average over the profile
+// reports written with emu -p, leaving out those the block cache cannot
+// fuse.
+int main(int argc, char** argv)
+{
+    const char* name = argv[0];
+    unsigned max = FUSE_MAX;
+    int count = 0;
+
+    while (argc > 2 && argv[1][0] == '-' && strchr("ns", argv[1][1]) != NULL && argv[1][2] == '\0') {
+        if (argv[1][1] == 'n') {
+            max = strtoul(argv[2], NULL, 0);
+        } else if ((count = read_seeds(argv[2])) < 0) {
+            return 1;
+        }
+
+        argc -= 2;
+        argv += 2;
+    }
+
+    if ((argc < 2 && count == 0) || max == 0) {
+        fprintf(stderr, "usage: %s [-n MAX] [-s SEEDS] [PROFILE...] > fuse.h\n", name);
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (!read_profile(argv[i])) {
+            fprintf(stderr, "[ERROR:%s:%d] No opcode pairs in %s.\n", __FILE__, __LINE__, argv[i]);
+            return 1;
+        }
+    }
+
+    int seeds = count;
+
+    for (uint32_t key = 0; key < 65536 && argc > 1; key++) {
+        double share = shares[key] / (argc - 1);
+
+        // A pair whose first instruction ends a block never gets decoded.
+        if (share >= FUSE_MIN_SHARE && !seeded[key] && !bcache_ends_block(key >> 8)) {
+            pairs[count++] = (pair_t) { key, share, "" };
+        }
+    }
+
+    if (count == 0) {
+        fprintf(stderr, "[ERROR:%s:%d] No pair starts %.1f%% of the instructions run.\n", __FILE__, __LINE__, FUSE_MIN_SHARE);
+        return 1;
+    }
+
+    qsort(pairs + seeds, count - seeds, sizeof(pair_t), by_share);
+    count = (unsigned)count < max ? count : (int)max;
+
+    printf("// Opcode pairs that the block cache runs as one handler (see fused.h):\n");
+    printf("// those of the seed list, then the most frequent in the profiles. Generated\n");
+    printf("// by fusegen from the seed list and profiles written with emu -p; do not\n");
+    printf("// edit.\n");
+    printf("\n#ifndef __FUSE_H__\n#define __FUSE_H__\n\n#include \"common.h\"\n");
+    printf("\n#define FUSE_COUNT %d\n", count);
+    printf("\n// clang-format off\n");
+    printf("// [pair] -> first and second opcode, with what a seed pair is or the\n");
+    printf("// average share of the instructions run that start the pair.\n");
+    printf("static const uint8_t FUSE_PAIRS[FUSE_COUNT][2] = {\n");
+
+    for (int i = 0; i < count; i++) {
+        if (i < seeds) {
+            printf("    { 0x%02x, 0x%02x }, // %s\n", pairs[i].key >> 8, pairs[i].key & 0xff, pairs[i].note);
+        } else {
+            printf("    { 0x%02x, 0x%02x }, // %6.3f%%\n", pairs[i].key >> 8, pairs[i].key & 0xff, pairs[i].share);
+        }
+    }
+
+    printf("};\n");
+    printf("\n// Entry points of the handlers, in the same order.\n");
+    printf("#define FUSE_HANDLERS");
+
+    for (int i = 0; i < count; i++) {
+        printf("%s&&fused_%d%s", i % 8 == 0 ? " \\\n    " : " ", i, i + 1 < count ? "," : "\n");
+    }
+
+    printf("// clang-format on\n\n#endif\n");
+    printf("\n// The handlers, in dispatch_blocks().\n#ifdef FUSE_INSTANCES\n");
+
+    for (int i = 0; i < count; i++) {
+        printf("#define FUSE_INDEX %d\n#include \"fused.h\"\n", i);
+    }
+
+    printf("#endif\n");
+    return 0;
+}
@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tracefile.h"
+
+// Prints the records of a trace file written with emu -T, optionally from
+// a given cycle on and only so many of them.
+int main(int argc, char** argv)
+{
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "usage: %s TRACE [CYCLE [COUNT]]\n", argv[0]);
+        return 1;
+    }
+
+    tracefile_t tf;
+    uint64_t cycle = argc > 2 ? strtoull(argv[2], NULL, 0) : 0;
+    uint64_t count = argc > 3 ? strtoull(argv[3], NULL, 0) : UINT64_MAX;
+    trace_rec_t rec;
+
+    if (!tracefile_open(&tf, argv[1])) {
+        fprintf(stderr, "[ERROR:%s:%d] Could not open trace %s.\n", __FILE__, __LINE__, argv[1]);
+        return 1;
+    }
+
+    if (cycle > 0 && !tracefile_seek(&tf, cycle)) {
+        fprintf(stderr, "[ERROR:%s:%d] No instruction at or after cycle %llu.\n", __FILE__, __LINE__, (unsigned long long)cycle);
+        tracefile_close(&tf);
+        return 1;
+    }
+
+    for (uint64_t i = 0; i < count && tracefile_next(&tf, &rec); i++) {
+        if (!trace_format(&rec, stdout)) {
+            break;
+        }
+    }
+
+    tracefile_close(&tf);
+    return 0;
+}
@@ -0,0 +1,337 @@
+#include "trace.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tracefile.h"
+
+#define TRACE_STREAM_BUFFERS 4 // Rings in flight, the one being recorded included.
+
+// Rings are passed between the recording thread and the writer through two
+// stacks under one lock: full rings waiting to be written and free ones.
+struct trace_stream {
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stop;
+    bool failed;
+
+    trace_rec_t* rings[TRACE_STREAM_BUFFERS];
+    trace_rec_t* full[TRACE_STREAM_BUFFERS]; // Oldest first.
+    uint32_t full_count[TRACE_STREAM_BUFFERS]; // Records in each full ring.
+    unsigned fulls;
+    trace_rec_t* free[TRACE_STREAM_BUFFERS];
+    unsigned frees;
+    trace_rec_t* last; // Ring most recently handed over full, NULL before the first.
+
+    uint8_t* out; // Encoded chunk.
+};
+
+trace_t* trace_create(uint32_t size)
+{
+    if (size == 0 || size > (UINT32_MAX >> 1) + 1) {
+        return NULL;
+    }
+
+    trace_t* trace = malloc(sizeof(trace_t));
+    uint32_t pow = 1;
+
+    while (pow < size) {
+        pow <<= 1;
+    }
+
+    if (trace == NULL) {
+        return NULL;
+    }
+
+    trace->recs = malloc((size_t)pow * sizeof(trace_rec_t));
+    trace->size = pow;
+    trace->count = 0;
+    trace->stream = NULL;
+
+    if (trace->recs == NULL) {
+        free(trace);
+        return NULL;
+    }
+
+    return trace;
+}
+
+void trace_destroy(trace_t* trace)
+{
+    if (trace == NULL) {
+        return;
+    }
+
+    trace_stream_close(trace);
+    free(trace->recs);
+    free(trace);
+}
+
+static bool write_all(int fd, const uint8_t* data, size_t size)
+{
+    while (size > 0) {
+        ssize_t done = write(fd, data, size);
+
+        if (done < 0) {
+            return false;
+        }
+
+        data += done;
+        size -= done;
+    }
+
+    return true;
+}
+
+static void* write_rings(void* arg)
+{
+    struct trace_stream* stream = arg;
+
+    pthread_mutex_lock(&stream->lock);
+
+    for (;;) {
+        while (stream->fulls == 0 && !stream->stop) {
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        }
+
+        if (stream->fulls == 0) {
+            break;
+        }
+
+        trace_rec_t* ring = stream->full[0];
+        uint32_t count = stream->full_count[0];
+
+        pthread_mutex_unlock(&stream->lock);
+
+        size_t size = tracefile_encode(stream->out, ring, count);
+        bool ok = write_all(stream->fd, stream->out, size);
+
+        pthread_mutex_lock(&stream->lock);
+
+        stream->failed |= !ok;
+        stream->fulls--;
+        for (unsigned i = 0; i < stream->fulls; i++) {
+            stream->full[i] = stream->full[i + 1];
+            stream->full_count[i] = stream->full_count[i + 1];
+        }
+
+        stream->free[stream->frees++] = ring;
+        pthread_cond_broadcast(&stream->cond);
+    }
+
+    pthread_mutex_unlock(&stream->lock);
+    return NULL;
+}
+
+bool trace_stream_open(trace_t* trace, const char* path)
+{
+    if (trace == NULL || path == NULL || trace->stream != NULL) {
+        return false;
+    }
+
+    struct trace_stream* stream = calloc(1, sizeof(struct trace_stream));
+
+    if (stream == NULL) {
+        return false;
+    }
+
+    stream->rings[0] = trace->recs;
+    stream->out = malloc(tracefile_chunk_max(trace->size));
+    bool ok = stream->out != NULL;
+
+    for (unsigned i = 1; i < TRACE_STREAM_BUFFERS && ok; i++) {
+        stream->rings[i] = malloc((size_t)trace->size * sizeof(trace_rec_t));
+        stream->free[stream->frees++] = stream->rings[i];
+        ok = stream->rings[i] != NULL;
+    }
+
+    stream->fd = ok ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+
+    if (stream->fd >= 0) {
+        uint8_t header[TRACEFILE_ALIGN];
+
+        tracefile_header(header);
+        ok = write_all(stream->fd, header, sizeof(header));
+        pthread_mutex_init(&stream->lock, NULL);
+        pthread_cond_init(&stream->cond, NULL);
+        ok = ok && pthread_create(&stream->thread, NULL, write_rings, stream) == 0;
+
+        if (!ok) {
+            pthread_mutex_destroy(&stream->lock);
+            pthread_cond_destroy(&stream->cond);
+        }
+    }
+
+    if (stream->fd < 0 || !ok) {
+        if (stream->fd >= 0) {
+            close(stream->fd);
+        }
+
+        for (unsigned i = 1; i < TRACE_STREAM_BUFFERS; i++) {
+            free(stream->rings[i]);
+        }
+
+        free(stream->out);
+        free(stream);
+        return false;
+    }
+
+    // Chunks line up with the ring from here on.
+    trace->count = 0;
+    trace->stream = stream;
+    return true;
+}
+
+// Queues the first `count` records of the ring and takes a free one.
+static void hand_over(trace_t* trace, uint32_t count)
+{
+    struct trace_stream* stream = trace->stream;
+
+    pthread_mutex_lock(&stream->lock);
+
+    stream->full[stream->fulls] = trace->recs;
+    stream->full_count[stream->fulls] = count;
+    stream->fulls++;
+    pthread_cond_broadcast(&stream->cond);
+
+    while (stream->frees == 0) {
+        pthread_cond_wait(&stream->cond, &stream->lock);
+    }
+
+    trace->recs = stream->free[--stream->frees];
+    pthread_mutex_unlock(&stream->lock);
+}
+
+void trace_stream_chunk(trace_t* trace)
+{
+    if (trace == NULL || trace->stream == NULL) {
+        return;
+    }
+
+    trace->stream->last = trace->recs;
+    hand_over(trace, trace->size);
+}
+
+bool trace_stream_close(trace_t* trace)
+{
+    if (trace == NULL || trace->stream == NULL) {
+        return false;
+    }
+
+    struct trace_stream* stream = trace->stream;
+    uint32_t left = trace->count & (trace->size - 1);
+    trace_rec_t* current = trace->recs;
+
+    if (left > 0) {
+        hand_over(trace, left);
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    stream->stop = true;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+    pthread_join(stream->thread, NULL);
+
+    bool closed = close(stream->fd) == 0;
+    bool ok = closed && !stream->failed;
+
+    // Written rings keep their records, so the ring the trace ends up with
+    // can be filled with the last `size` of them: the records since the
+    // last full hand-over and, in the slots after them, the end of the ring
+    // before.
+    if (trace->recs != current) {
+        memcpy(trace->recs, current, left * sizeof(trace_rec_t));
+    }
+
+    if (stream->last != NULL && trace->recs != stream->last) {
+        memcpy(&trace->recs[left], &stream->last[left], (trace->size - left) * sizeof(trace_rec_t));
+    }
+
+    // The ring the trace ends up with stays with it.
+    for (unsigned i = 0; i < TRACE_STREAM_BUFFERS; i++) {
+        if (stream->rings[i] != trace->recs) {
+            free(stream->rings[i]);
+        }
+    }
+
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->cond);
+    free(stream->out);
+    free(stream);
+
+    trace->stream = NULL;
+    return ok;
+}
+
+// Index of the oldest record still in the ring, and how many there are.
+static uint64_t oldest(const trace_t* trace, uint64_t* count)
+{
+    if (trace->stream != NULL) {
+        *count = trace->count & (trace->size - 1);
+    } else {
+        *count = trace->count < trace->size ? trace->count : trace->size;
+    }
+
+    return trace->count - *count;
+}
+
+bool trace_format(const trace_rec_t* rec, FILE* file)
+{
+    if (rec == NULL || file == NULL) {
+        return false;
+    }
+
+    return fprintf(file, "%12llu %02X PC=%04X SP=%04X A=%02X F=%02X B=%02X C=%02X D=%02X E=%02X H=%02X L=%02X\n",
+               (unsigned long long)rec->cycle,
+               rec->opcode,
+               rec->pc,
+               rec->sp,
+               rec->a,
+               rec->f,
+               rec->b,
+               rec->c,
+               rec->d,
+               rec->e,
+               rec->h,
+               rec->l)
+        >= 0;
+}
+
+bool trace_dump(trace_t* trace, FILE* file)
+{
+    if (trace == NULL || file == NULL) {
+        return false;
+    }
+
+    uint64_t count;
+    uint64_t first = oldest(trace, &count);
+
+    for (uint64_t i = first; i < first + count; i++) {
+        if (!trace_format(&trace->recs[i & (trace->size - 1)], file)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool trace_save(trace_t* trace, FILE* file)
+{
+    if (trace == NULL || file == NULL) {
+        return false;
+    }
+
+    uint64_t count;
+    uint64_t first = oldest(trace, &count);
+    uint32_t start = first & (trace->size - 1);
+    uint32_t head = trace->size - start < count ? trace->size - start : count;
+
+    // The ring wraps at most once.
+    return fwrite(&trace->recs[start], sizeof(trace_rec_t), head, file) == head
+        && fwrite(trace->recs, sizeof(trace_rec_t), count - head, file) == count - head;
+}
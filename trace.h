@@ -0,0 +1,91 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "common.h"
+
+#include <stdio.h>
+
+#include "flags.h"
+#include "regs.h"
+
+// One executed instruction, with the registers as they were before it ran.
+typedef struct {
+    uint64_t cycle; // cpu->cycles when the instruction started.
+    uint16_t pc;
+    uint16_t sp;
+    uint8_t opcode;
+    uint8_t a;
+    uint8_t f;
+    uint8_t b;
+    uint8_t c;
+    uint8_t d;
+    uint8_t e;
+    uint8_t h;
+    uint8_t l;
+} trace_rec_t;
+
+// Ring of the last `size` instructions a cpu ran. Tracing is on while
+// cpu->trace points at one; batches then run through the interpreter,
+// bypassing the block cache and the JIT, so that every instruction gets a
+// record. Nothing is formatted until the ring is dumped.
+//
+// A ring can also stream every record to a file, see trace_stream_open().
+typedef struct {
+    trace_rec_t* recs;
+    uint32_t size; // A power of two.
+    uint64_t count; // Records written so far; the newest is recs[(count - 1) % size].
+    struct trace_stream* stream;
+} trace_t;
+
+// Rounds `size` up to a power of two. Returns NULL when out of memory.
+trace_t* trace_create(uint32_t size);
+
+// Also closes the stream, if any.
+void trace_destroy(trace_t* trace);
+
+// Streams every record from now on to a new trace file at `path`, see
+// tracefile.h. Each time the ring fills up it is handed to a background
+// thread, which encodes and writes it while recording goes on into another
+// buffer; recording only waits if the writer falls a few rings behind. The
+// ring then only holds the records since the last hand-over.
+bool trace_stream_open(trace_t* trace, const char* path);
+
+// Writes what is left and closes the file. False if any write failed. The
+// ring is left holding the last `size` records streamed, as if it had
+// recorded them without a stream, and `count` is the number streamed.
+bool trace_stream_close(trace_t* trace);
+
+// Hands the full ring to the writer; called by trace_record().
+void trace_stream_chunk(trace_t* trace);
+
+static inline void trace_record(trace_t* trace, reg_t* reg, uint16_t pc, uint8_t opcode, uint64_t cycle)
+{
+    trace_rec_t* rec = &trace->recs[trace->count++ & (trace->size - 1)];
+
+    rec->cycle = cycle;
+    rec->pc = pc;
+    rec->sp = reg->sp;
+    rec->opcode = opcode;
+    rec->a = reg->a;
+    rec->f = flags_get(reg);
+    rec->b = reg->b;
+    rec->c = reg->c;
+    rec->d = reg->d;
+    rec->e = reg->e;
+    rec->h = reg->h;
+    rec->l = reg->l;
+
+    if (trace->stream != NULL && (trace->count & (trace->size - 1)) == 0) {
+        trace_stream_chunk(trace);
+    }
+}
+
+// One record as a text line: cycle, opcode, PC, SP and the registers.
+bool trace_format(const trace_rec_t* rec, FILE* file);
+
+// Records still in the ring, oldest first, as text (trace_dump()) or as
+// raw trace_rec_t for offline tools (trace_save()).
+bool trace_dump(trace_t* trace, FILE* file);
+bool trace_save(trace_t* trace, FILE* file);
+
+#endif
@@ -0,0 +1,389 @@
+#include "tracefile.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+static const uint8_t FILE_MAGIC[4] = { 'I', '8', 'T', 'R' };
+static const uint8_t CHUNK_MAGIC[4] = { 'T', 'C', 'H', 'K' };
+
+#define KEY_SIZE 21 // Cycle, PC, SP, opcode and the eight registers.
+#define DELTA_MAX (3 + 8 + 2 + 2 + 10)
+
+#define CTL_PC 0x01
+#define CTL_SP 0x02
+#define CTL_CYCLE 0x04
+
+static size_t align_up(size_t size)
+{
+    return (size + TRACEFILE_ALIGN - 1) & ~(size_t)(TRACEFILE_ALIGN - 1);
+}
+
+static uint8_t* put16(uint8_t* out, uint16_t val)
+{
+    out[0] = val;
+    out[1] = val >> 8;
+    return out + 2;
+}
+
+static uint8_t* put32(uint8_t* out, uint32_t val)
+{
+    for (int i = 0; i < 4; i++) {
+        out[i] = val >> (i * 8);
+    }
+
+    return out + 4;
+}
+
+static uint8_t* put64(uint8_t* out, uint64_t val)
+{
+    for (int i = 0; i < 8; i++) {
+        out[i] = val >> (i * 8);
+    }
+
+    return out + 8;
+}
+
+static uint64_t get(const uint8_t* in, int bytes)
+{
+    uint64_t val = 0;
+
+    for (int i = bytes - 1; i >= 0; i--) {
+        val = (val << 8) | in[i];
+    }
+
+    return val;
+}
+
+// Registers in the order of the change mask.
+static void regs_of(const trace_rec_t* rec, uint8_t* regs)
+{
+    regs[0] = rec->a;
+    regs[1] = rec->f;
+    regs[2] = rec->b;
+    regs[3] = rec->c;
+    regs[4] = rec->d;
+    regs[5] = rec->e;
+    regs[6] = rec->h;
+    regs[7] = rec->l;
+}
+
+static void set_regs(trace_rec_t* rec, const uint8_t* regs)
+{
+    rec->a = regs[0];
+    rec->f = regs[1];
+    rec->b = regs[2];
+    rec->c = regs[3];
+    rec->d = regs[4];
+    rec->e = regs[5];
+    rec->h = regs[6];
+    rec->l = regs[7];
+}
+
+size_t tracefile_chunk_max(uint32_t count)
+{
+    return align_up(TRACEFILE_CHUNK_HEADER + KEY_SIZE + (size_t)count * DELTA_MAX);
+}
+
+void tracefile_header(uint8_t* out)
+{
+    if (out == NULL) {
+        return;
+    }
+
+    memset(out, 0, TRACEFILE_ALIGN);
+    memcpy(out, FILE_MAGIC, sizeof(FILE_MAGIC));
+    put16(out + sizeof(FILE_MAGIC), TRACEFILE_VERSION);
+}
+
+size_t tracefile_encode(uint8_t* out, const trace_rec_t* recs, uint32_t count)
+{
+    if (out == NULL || recs == NULL || count == 0) {
+        return 0;
+    }
+
+    uint8_t* p = out + TRACEFILE_CHUNK_HEADER;
+    const trace_rec_t* key = &recs[0];
+    uint8_t regs[8];
+
+    p = put64(p, key->cycle);
+    p = put16(p, key->pc);
+    p = put16(p, key->sp);
+    *p++ = key->opcode;
+    regs_of(key, p);
+    p += 8;
+
+    for (uint32_t i = 1; i < count; i++) {
+        const trace_rec_t* prev = &recs[i - 1];
+        const trace_rec_t* rec = &recs[i];
+        uint8_t old[8];
+        uint8_t mask = 0;
+        uint8_t ctl = 0;
+        uint64_t step = rec->cycle - prev->cycle;
+
+        regs_of(prev, old);
+        regs_of(rec, regs);
+        for (int r = 0; r < 8; r++) {
+            mask |= (regs[r] != old[r]) << r;
+        }
+
+        ctl |= rec->pc != (uint16_t)(prev->pc + OPCODES_SIZE[prev->opcode]) ? CTL_PC : 0;
+        ctl |= rec->sp != prev->sp ? CTL_SP : 0;
+        ctl |= step != OPCODES_CYCLES[prev->opcode] ? CTL_CYCLE : 0;
+
+        *p++ = mask;
+        *p++ = ctl;
+        *p++ = rec->opcode;
+
+        for (int r = 0; r < 8; r++) {
+            if (mask & (1 << r)) {
+                *p++ = regs[r];
+            }
+        }
+
+        if (ctl & CTL_PC) {
+            p = put16(p, rec->pc);
+        }
+
+        if (ctl & CTL_SP) {
+            p = put16(p, rec->sp);
+        }
+
+        if (ctl & CTL_CYCLE) {
+            do {
+                *p++ = (step & 0x7f) | (step > 0x7f ? 0x80 : 0);
+                step >>= 7;
+            } while (step != 0);
+        }
+    }
+
+    size_t bytes = p - out - TRACEFILE_CHUNK_HEADER;
+    size_t total = align_up(p - out);
+    uint8_t* h = out;
+
+    memcpy(h, CHUNK_MAGIC, sizeof(CHUNK_MAGIC));
+    h = put32(h + sizeof(CHUNK_MAGIC), count);
+    h = put32(h, bytes);
+    h = put32(h, 0);
+    h = put64(h, recs[0].cycle);
+    put64(h, recs[count - 1].cycle);
+
+    memset(p, 0, total - (p - out));
+    return total;
+}
+
+bool tracefile_open(tracefile_t* tf, const char* path)
+{
+    if (tf == NULL || path == NULL) {
+        return false;
+    }
+
+    uint8_t head[sizeof(FILE_MAGIC) + 2];
+
+    memset(tf, 0, sizeof(tracefile_t));
+    tf->file = fopen(path, "rb");
+
+    if (tf->file == NULL) {
+        return false;
+    }
+
+    if (fread(head, sizeof(head), 1, tf->file) != 1 || memcmp(head, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0
+        || get(head + sizeof(FILE_MAGIC), 2) != TRACEFILE_VERSION) {
+        fclose(tf->file);
+        tf->file = NULL;
+        return false;
+    }
+
+    tf->next = TRACEFILE_ALIGN;
+    return true;
+}
+
+void tracefile_close(tracefile_t* tf)
+{
+    if (tf == NULL) {
+        return;
+    }
+
+    if (tf->file != NULL) {
+        fclose(tf->file);
+    }
+
+    free(tf->payload);
+    memset(tf, 0, sizeof(tracefile_t));
+}
+
+// Reads the header of the chunk at `offset`.
+static bool read_header(tracefile_t* tf, long offset, uint32_t* count, uint32_t* bytes, uint64_t* last)
+{
+    uint8_t h[TRACEFILE_CHUNK_HEADER];
+
+    if (fseek(tf->file, offset, SEEK_SET) != 0 || fread(h, sizeof(h), 1, tf->file) != 1) {
+        return false;
+    }
+
+    *count = get(h + 4, 4);
+    *bytes = get(h + 8, 4);
+    *last = get(h + 24, 8);
+
+    return memcmp(h, CHUNK_MAGIC, sizeof(CHUNK_MAGIC)) == 0 && *count > 0 && *bytes >= KEY_SIZE;
+}
+
+// Loads the chunk at `offset` and decodes its first record into prev.
+static bool load_chunk(tracefile_t* tf, long offset)
+{
+    uint32_t count;
+    uint32_t bytes;
+    uint64_t last;
+
+    if (!read_header(tf, offset, &count, &bytes, &last)) {
+        return false;
+    }
+
+    if (bytes > tf->cap) {
+        uint8_t* payload = realloc(tf->payload, bytes);
+
+        if (payload == NULL) {
+            return false;
+        }
+
+        tf->payload = payload;
+        tf->cap = bytes;
+    }
+
+    if (fread(tf->payload, bytes, 1, tf->file) != 1) {
+        return false;
+    }
+
+    const uint8_t* p = tf->payload;
+
+    tf->prev.cycle = get(p, 8);
+    tf->prev.pc = get(p + 8, 2);
+    tf->prev.sp = get(p + 10, 2);
+    tf->prev.opcode = p[12];
+    set_regs(&tf->prev, p + 13);
+
+    tf->pos = p + KEY_SIZE;
+    tf->end = p + bytes;
+    tf->left = count - 1;
+    tf->next = offset + align_up(TRACEFILE_CHUNK_HEADER + bytes);
+    return true;
+}
+
+// Decodes the record after prev into prev.
+static bool decode(tracefile_t* tf)
+{
+    const uint8_t* p = tf->pos;
+    trace_rec_t* rec = &tf->prev;
+    uint8_t regs[8];
+
+    if (tf->end - p < 3) {
+        return false;
+    }
+
+    uint8_t mask = p[0];
+    uint8_t ctl = p[1];
+    uint64_t step = OPCODES_CYCLES[rec->opcode];
+    uint16_t pc = rec->pc + OPCODES_SIZE[rec->opcode];
+    uint8_t opcode = p[2];
+    size_t need = __builtin_popcount(mask) + (ctl & CTL_PC ? 2 : 0) + (ctl & CTL_SP ? 2 : 0);
+
+    p += 3;
+    if ((size_t)(tf->end - p) < need) {
+        return false;
+    }
+
+    regs_of(rec, regs);
+    for (int r = 0; r < 8; r++) {
+        if (mask & (1 << r)) {
+            regs[r] = *p++;
+        }
+    }
+
+    if (ctl & CTL_PC) {
+        pc = get(p, 2);
+        p += 2;
+    }
+
+    if (ctl & CTL_SP) {
+        rec->sp = get(p, 2);
+        p += 2;
+    }
+
+    if (ctl & CTL_CYCLE) {
+        step = 0;
+
+        for (int shift = 0;; shift += 7) {
+            if (p == tf->end || shift > 63) {
+                return false;
+            }
+
+            step |= (uint64_t)(*p & 0x7f) << shift;
+            if (!(*p++ & 0x80)) {
+                break;
+            }
+        }
+    }
+
+    set_regs(rec, regs);
+    rec->cycle += step;
+    rec->pc = pc;
+    rec->opcode = opcode;
+    tf->pos = p;
+    tf->left--;
+    return true;
+}
+
+bool tracefile_next(tracefile_t* tf, trace_rec_t* rec)
+{
+    if (tf == NULL || tf->file == NULL || rec == NULL) {
+        return false;
+    }
+
+    if (tf->pending) {
+        tf->pending = false;
+    } else if (tf->left > 0) {
+        if (!decode(tf)) {
+            return false;
+        }
+    } else if (!load_chunk(tf, tf->next)) {
+        return false;
+    }
+
+    *rec = tf->prev;
+    return true;
+}
+
+bool tracefile_seek(tracefile_t* tf, uint64_t cycle)
+{
+    if (tf == NULL || tf->file == NULL) {
+        return false;
+    }
+
+    long offset = TRACEFILE_ALIGN;
+    uint32_t count;
+    uint32_t bytes;
+    uint64_t last;
+
+    while (read_header(tf, offset, &count, &bytes, &last)) {
+        if (last < cycle) {
+            offset += align_up(TRACEFILE_CHUNK_HEADER + bytes);
+            continue;
+        }
+
+        if (!load_chunk(tf, offset)) {
+            return false;
+        }
+
+        while (tf->prev.cycle < cycle) {
+            if (tf->left == 0 || !decode(tf)) {
+                return false;
+            }
+        }
+
+        tf->pending = true;
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,64 @@
+#ifndef __TRACEFILE_H__
+#define __TRACEFILE_H__
+
+#include "common.h"
+
+#include <stdio.h>
+
+#include "trace.h"
+
+#define TRACEFILE_VERSION 1
+#define TRACEFILE_ALIGN 4096 // Chunks start and end on this boundary.
+#define TRACEFILE_CHUNK_HEADER 32
+
+// On-disk trace, written by trace_stream_open(). Multi-byte fields are
+// little-endian.
+//
+// The file starts with a TRACEFILE_ALIGN block holding the magic and the
+// version, followed by chunks of consecutive records. A chunk is a header
+// (magic, record count, payload size, cycles of its first and last record)
+// and a payload padded to TRACEFILE_ALIGN. The first record of a payload is
+// stored whole, so decoding can start at any chunk; every other record is
+// stored as its difference from the one before:
+//   u8 mask of A F B C D E H L that changed (bit 0 is A)
+//   u8 bit 0: PC did not follow on from the previous instruction
+//      bit 1: SP changed
+//      bit 2: cycles spent by the previous instruction differ from its
+//             OPCODES_CYCLES entry
+//   u8 opcode
+//   then the changed registers, PC and SP (u16) and the cycle step
+//   (LEB128) in that order, each only if flagged.
+
+// Largest encoded chunk of `count` records, padding included.
+size_t tracefile_chunk_max(uint32_t count);
+
+// Fills the file header block.
+void tracefile_header(uint8_t* out);
+
+// Encodes `count` records (at least one) as a chunk. Returns its size.
+size_t tracefile_encode(uint8_t* out, const trace_rec_t* recs, uint32_t count);
+
+// Sequential reader with seeking by cycle.
+typedef struct {
+    FILE* file;
+    uint8_t* payload; // Current chunk.
+    size_t cap;
+    const uint8_t* pos;
+    const uint8_t* end;
+    uint32_t left; // Records of the current chunk not decoded yet.
+    long next; // File offset of the next chunk.
+    trace_rec_t prev;
+    bool pending; // prev was found by tracefile_seek() and not returned yet.
+} tracefile_t;
+
+bool tracefile_open(tracefile_t* tf, const char* path);
+void tracefile_close(tracefile_t* tf);
+
+// Next record; false at the end of the file or on a damaged chunk.
+bool tracefile_next(tracefile_t* tf, trace_rec_t* rec);
+
+// Makes the first record that started at or after `cycle` the next one.
+// Only chunk headers are read on the way there.
+bool tracefile_seek(tracefile_t* tf, uint64_t cycle);
+
+#endif
@@ -0,0 +1,49 @@
+#include "trap.h"
+
+#include <string.h>
+
+void init_traps(traps_t* traps)
+{
+    if (traps == NULL) {
+        return;
+    }
+
+    memset(traps, 0, sizeof(traps_t));
+}
+
+bool traps_add(traps_t* traps, uint16_t addr, bool (*fire)(void* ctx, reg_t* reg, mem_t* mem), void* ctx)
+{
+    if (traps == NULL || fire == NULL) {
+        return false;
+    }
+
+    uint32_t i = 0;
+
+    while (i < traps->count && traps->traps[i].addr != addr) {
+        i++;
+    }
+
+    if (i == TRAPS_MAX) {
+        return false;
+    }
+
+    traps->traps[i] = (trap_t) { addr, fire, ctx };
+    traps->count += i == traps->count;
+    traps->mask[addr >> 6] |= (uint64_t)1 << (addr & 63);
+    return true;
+}
+
+const trap_t* traps_find(const traps_t* traps, uint16_t addr)
+{
+    if (traps == NULL || !traps_at(traps, addr)) {
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < traps->count; i++) {
+        if (traps->traps[i].addr == addr) {
+            return &traps->traps[i];
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef __TRAP_H__
+#define __TRAP_H__
+
+#include "common.h"
+
+#include "mem.h"
+#include "regs.h"
+
+#define TRAPS_MAX 16 // Trap addresses per table.
+
+// A native handler that runs in place of the guest code at `addr`, such as
+// a CP/M BDOS entry point (see bdos.h). It gets the registers and memory of
+// the machine and returns true to have the CPU RET to its caller, or false
+// to halt it at `addr`.
+typedef struct {
+    uint16_t addr;
+    bool (*fire)(void* ctx, reg_t* reg, mem_t* mem);
+    void* ctx;
+} trap_t;
+
+// Trap table. Attach one to cpu->traps; the engines look for a trap when
+// control moves somewhere else, on a jump, call, return or restart and at
+// the start of each block or batch, never per instruction, so code that
+// runs into a trap address from the instruction before it does not trap.
+// Add every trap before the machine runs: JIT blocks linked to each other
+// earlier do not look again.
+typedef struct {
+    uint64_t mask[MEM_SIZE / 64]; // One bit per address that has a trap.
+    trap_t traps[TRAPS_MAX];
+    uint32_t count;
+} traps_t;
+
+void init_traps(traps_t* traps);
+
+// Replaces the trap at `addr`, if any. False if TRAPS_MAX traps are already
+// set.
+bool traps_add(traps_t* traps, uint16_t addr, bool (*fire)(void* ctx, reg_t* reg, mem_t* mem), void* ctx);
+
+static inline bool traps_at(const traps_t* traps, uint16_t addr)
+{
+    return (traps->mask[addr >> 6] >> (addr & 63)) & 1;
+}
+
+// The trap at `addr`, NULL if there is none.
+const trap_t* traps_find(const traps_t* traps, uint16_t addr);
+
+#endif